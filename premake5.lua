@@ -81,7 +81,8 @@ project "ckd"
 project "test"
 
     kind "ConsoleApp"
-    files {"tests/**.cpp", "tests/**.h"}
+    files {"tests/**.cpp", "tests/**.h", "src/client/wallet.cpp", "src/client/wallet.h"}
+    includedirs {"src/client"}
     links {"ck", "cppunit"}
     links(cklibs)
     postbuildcommands{"%{cfg.linktarget.abspath}"}
@@ -1,99 +1,112 @@
 Json = (loadfile("./json.lua"))()
 local json = Json.new()
-thisTransaction = json:decode(txJson)
-thisInput = json:decode(thisInputJson)
 
+-- Before the gas rules activate, blockchain lookups return JSON text that is
+-- decoded here, inside the script, so decoding costs instructions as it always
+-- has. Once they activate, Blockchain's lookups return tables, or nil if
+-- nothing was found, and are charged as host calls instead.
 function jsonStrToObj(str)
     if str == "" then return nil end
     return json:decode(str)
 end
 
 function getBlock(id)
-    local res = Blockchain.getBlock(id)
+    local res = BlockchainJson.getBlock(id)
     return jsonStrToObj(res)
 end
 
 function getTransaction(id)
-    local res = Blockchain.getTransaction(id)
+    local res = BlockchainJson.getTransaction(id)
     return jsonStrToObj(res)
 end
 
 function getOutput(id)
-    local res = Blockchain.getOutput(id)
+    local res = BlockchainJson.getOutput(id)
     return jsonStrToObj(res)
 end
 
 function getInput(id)
-    local res = Blockchain.getInput(id)
+    local res = BlockchainJson.getInput(id)
     return jsonStrToObj(res)
 end
 
-sandbox_env = {Crypto = {new = Crypto.new, getPublicKey = Crypto.getPublicKey, getPrivateKey = Crypto.getPrivateKey,
-                        setPublicKey = Crypto.setPublicKey, setPrivateKey = Crypto.setPrivateKey,
-                        getStatus = Crypto.getStatus, sign = Crypto.sign, verify = Crypto.verify,},
-               Json = {new = Json.new, decode = Json.decode,},
-               sha256 = sha256,
-               thisTransaction = thisTransaction,
-               thisInput = thisInput,
-               outputSetId = outputSetId,
-               Blockchain = {getBlock = getBlock, getTransaction = getTransaction,
-                             getOutput = getOutput, getInput = getInput,},
-               assert = assert,
-               error = error,
-               ipairs = ipairs,
-               next = next,
-               pairs = pairs,
-               pcall = pcall,
-               select = select,
-               tonumber = tonumber,
-               tostring = tostring,
-               type = type,
-               xpcall = xpcall,
-               string = {len = string.len,
-                         pack = string.pack,
-                         packsize = string.packsize,
-                         reverse = string.reverse,
-                         sub = string.sub,
-                         unpack = string.unpack,},
-               utf8 = {char = utf8.char,
-                       charpattern = utf8.charpattern,
-                       codes = utf8.codes,
-                       codepoint = utf8.codepoint,
-                       len = utf8.len,
-                       offset = utf8.offset,},
-               table = {concat = table.concat,
-                        insert = table.insert,
-                        move = table.move,
-                        pack = table.pack,
-                        remove = table.remove,
-                        sort = table.sort,
-                        unpack = table.unpack,},
-               math = {abs = math.abs,
-                       acos = math.acos,
-                       asin = math.asin,
-                       atan = math.atan,
-                       ceil = math.ceil,
-                       cos = math.cos,
-                       deg = math.deg,
-                       exp = math.exp,
-                       floor = math.floor,
-                       fmod = math.fmod,
-                       huge = math.huge,
-                       log = math.log,
-                       max = math.max,
-                       maxinteger = math.maxinteger,
-                       min = math.min,
-                       mininteger = math.mininteger,
-                       modf = math.modf,
-                       pi = math.pi,
-                       rad = math.rad,
-                       sin = math.sin,
-                       sqrt = math.sqrt,
-                       tan = math.tan,
-                       tointeger = math.tointeger,
-                       type = math.type,
-                       ult = math.ult,},
-              }
+-- The sandbox is loaded once per Lua state and reused, so everything a
+-- script can see or change is rebuilt before each run. thisTransaction and
+-- thisInput are set as fresh tables by the runner.
+function resetEnvironment()
+    pc = 0
+
+    sandbox_env = {Crypto = {new = Crypto.new, getPublicKey = Crypto.getPublicKey, getPrivateKey = Crypto.getPrivateKey,
+                            setPublicKey = Crypto.setPublicKey, setPrivateKey = Crypto.setPrivateKey,
+                            getStatus = Crypto.getStatus, sign = Crypto.sign, verify = Crypto.verify,},
+                   Json = {new = Json.new, decode = Json.decode,},
+                   sha256 = sha256,
+                   thisTransaction = thisTransaction,
+                   thisInput = thisInput,
+                   outputSetId = outputSetId,
+                   Blockchain = gasRules and {getBlock = Blockchain.getBlock,
+                                              getTransaction = Blockchain.getTransaction,
+                                              getOutput = Blockchain.getOutput,
+                                              getInput = Blockchain.getInput,}
+                                          or {getBlock = getBlock, getTransaction = getTransaction,
+                                              getOutput = getOutput, getInput = getInput,},
+                   assert = assert,
+                   error = error,
+                   ipairs = ipairs,
+                   next = next,
+                   pairs = pairs,
+                   pcall = pcall,
+                   select = select,
+                   tonumber = tonumber,
+                   tostring = tostring,
+                   type = type,
+                   xpcall = xpcall,
+                   string = {len = string.len,
+                             pack = string.pack,
+                             packsize = string.packsize,
+                             reverse = string.reverse,
+                             sub = string.sub,
+                             unpack = string.unpack,},
+                   utf8 = {char = utf8.char,
+                           charpattern = utf8.charpattern,
+                           codes = utf8.codes,
+                           codepoint = utf8.codepoint,
+                           len = utf8.len,
+                           offset = utf8.offset,},
+                   table = {concat = table.concat,
+                            insert = table.insert,
+                            move = table.move,
+                            pack = table.pack,
+                            remove = table.remove,
+                            sort = table.sort,
+                            unpack = table.unpack,},
+                   math = {abs = math.abs,
+                           acos = math.acos,
+                           asin = math.asin,
+                           atan = math.atan,
+                           ceil = math.ceil,
+                           cos = math.cos,
+                           deg = math.deg,
+                           exp = math.exp,
+                           floor = math.floor,
+                           fmod = math.fmod,
+                           huge = math.huge,
+                           log = math.log,
+                           max = math.max,
+                           maxinteger = math.maxinteger,
+                           min = math.min,
+                           mininteger = math.mininteger,
+                           modf = math.modf,
+                           pi = math.pi,
+                           rad = math.rad,
+                           sin = math.sin,
+                           sqrt = math.sqrt,
+                           tan = math.tan,
+                           tointeger = math.tointeger,
+                           type = math.type,
+                           ult = math.ult,},
+                  }
+end
 
 local function setfenv(fn, env)
   local i = 1
@@ -114,12 +127,14 @@ local function setfenv(fn, env)
   return fn
 end
 
+-- pc is the gas a script has used: one per instruction, counted every 50,
+-- plus whatever the runner charges for calls into the host
 pc = 0
 
 function programCounterHook()
     pc = pc + 50
     if pc > pcLimit then
-        error("Instruction limit reached")
+        error("Gas limit reached")
     end
 end
 
@@ -134,19 +149,31 @@ function run_sandbox(sb_env, sb_func, ...)
   return _ENV.table.unpack(sb_ret)
 end
 
-function verifyTransaction(bytecode)
+function decompressContract(bytecode)
     local status, lz4 = pcall(require, "lz4")
     if(status) then
-        f = load(lz4.decompress(bytecode))
-        pcall_rc, result_or_err_msg = run_sandbox(sandbox_env, f)
-        if type(result_or_err_msg) ~= "boolean" then
-            print(result_or_err_msg)
-            return false, ""
-        else
-            return result_or_err_msg, ""
-        end
+        return lz4.decompress(bytecode), ""
+    else
+        return "", "Failed to load lz4"
+    end
+end
+
+function runContract(code)
+    resetEnvironment()
+    f = load(code)
+    pcall_rc, result_or_err_msg = run_sandbox(sandbox_env, f)
+    if type(result_or_err_msg) ~= "boolean" then
+        print(result_or_err_msg)
+        return false, ""
     else
-        return false, "Failed to load lz4"
+        return result_or_err_msg, ""
     end
 end
 
+function verifyTransaction(bytecode)
+    local code, err = decompressContract(bytecode)
+    if err ~= "" then
+        return false, err
+    end
+    return runContract(code)
+end
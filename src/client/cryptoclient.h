@@ -69,6 +69,17 @@ public:
         else
         { throw jsonrpc::JsonRpcException(jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE, result.toStyledString()); }
     }
+    std::string sendmany(const Json::Value& recipients,
+                         const std::string& password) throw (jsonrpc::JsonRpcException) {
+        Json::Value p;
+        p["recipients"] = recipients;
+        p["password"] = password;
+        Json::Value result = this->CallMethod("sendmany",p);
+        if (result.isString())
+        { return result.asString(); }
+        else
+        { throw jsonrpc::JsonRpcException(jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE, result.toStyledString()); }
+    }
     bool sendrawtransaction(const Json::Value tx) throw (jsonrpc::JsonRpcException) {
         Json::Value p;
         p["transaction"] = tx;
@@ -117,9 +128,14 @@ public:
         else
         { throw jsonrpc::JsonRpcException(jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE, result.toStyledString()); }
     }
-    Json::Value listtransactions() throw (jsonrpc::JsonRpcException) {
+    Json::Value listtransactions(const uint64_t limit = 0,
+                                 const std::string& after = "") throw (jsonrpc::JsonRpcException) {
         Json::Value p;
         p = Json::nullValue;
+        if(limit > 0) {
+            p["limit"] = static_cast<Json::UInt64>(limit);
+            p["after"] = after;
+        }
         Json::Value result = this->CallMethod("listtransactions",p);
         if (result.isObject())
         { return result; }
@@ -137,6 +153,38 @@ public:
                                             result.toStyledString());
         }
     }
+    Json::Value getblocks(const uint64_t start, const uint64_t count,
+                          const unsigned int verbosity = 1) throw (jsonrpc::JsonRpcException) {
+        Json::Value p;
+        p["start"] = static_cast<Json::UInt64>(start);
+        p["count"] = static_cast<Json::UInt64>(count);
+        p["verbosity"] = verbosity;
+        const Json::Value result = this->CallMethod("getblocks", p);
+        if (result.isArray()) {
+            return result;
+        } else {
+            throw jsonrpc::JsonRpcException(jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE,
+                                            result.toStyledString());
+        }
+    }
+    Json::Value walletpassphrase(const std::string& password,
+                                 const uint64_t timeout) throw (jsonrpc::JsonRpcException) {
+        Json::Value p;
+        p["password"] = password;
+        p["timeout"] = static_cast<Json::UInt64>(timeout);
+        Json::Value result = this->CallMethod("walletpassphrase",p);
+        if (result.isObject())
+        { return result; }
+        else
+        { throw jsonrpc::JsonRpcException(jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE, result.toStyledString()); }
+    }
+    bool walletlock() throw (jsonrpc::JsonRpcException) {
+        Json::Value result = this->CallMethod("walletlock", Json::nullValue);
+        if (result.isBool())
+        { return result.asBool(); }
+        else
+        { throw jsonrpc::JsonRpcException(jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE, result.toStyledString()); }
+    }
     Json::Value stop() throw (jsonrpc::JsonRpcException) {
         const Json::Value result = this->CallMethod("stop", Json::nullValue);
         if (result.isBool()) {
@@ -157,6 +205,81 @@ public:
                                             result.toStyledString());
         }
     }
+    Json::Value getblockfilter(const std::string& id) throw (jsonrpc::JsonRpcException) {
+        Json::Value p;
+        p["id"] = id;
+        const Json::Value result = this->CallMethod("getblockfilter", p);
+        if (result.isObject()) {
+            return result;
+        } else {
+            throw jsonrpc::JsonRpcException(jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE,
+                                            result.toStyledString());
+        }
+    }
+    Json::Value getaddresssummary(const std::string& publickey) throw (jsonrpc::JsonRpcException) {
+        Json::Value p;
+        p["publickey"] = publickey;
+        const Json::Value result = this->CallMethod("getaddresssummary", p);
+        if (result.isObject()) {
+            return result;
+        } else {
+            throw jsonrpc::JsonRpcException(jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE,
+                                            result.toStyledString());
+        }
+    }
+    Json::Value getspendingtx(const std::string& outputid) throw (jsonrpc::JsonRpcException) {
+        Json::Value p;
+        p["outputid"] = outputid;
+        const Json::Value result = this->CallMethod("getspendingtx", p);
+        if (result.isObject()) {
+            return result;
+        } else {
+            throw jsonrpc::JsonRpcException(jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE,
+                                            result.toStyledString());
+        }
+    }
+    Json::Value getaddresstransactions(const std::string& publickey, const uint64_t limit = 0,
+                                       const std::string& after = "") throw (jsonrpc::JsonRpcException) {
+        Json::Value p;
+        p["publickey"] = publickey;
+        if(limit > 0) {
+            p["limit"] = static_cast<Json::UInt64>(limit);
+        }
+        if(!after.empty()) {
+            p["after"] = after;
+        }
+        const Json::Value result = this->CallMethod("getaddresstransactions", p);
+        if (result.isObject()) {
+            return result;
+        } else {
+            throw jsonrpc::JsonRpcException(jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE,
+                                            result.toStyledString());
+        }
+    }
+    Json::Value profilecontract(const Json::Value tx) throw (jsonrpc::JsonRpcException) {
+        Json::Value p;
+        p["transaction"] = tx;
+        const Json::Value result = this->CallMethod("profilecontract", p);
+        if (result.isObject()) {
+            return result;
+        } else {
+            throw jsonrpc::JsonRpcException(jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE,
+                                            result.toStyledString());
+        }
+    }
+    Json::Value getcontractprofiles(const uint64_t limit = 0) throw (jsonrpc::JsonRpcException) {
+        Json::Value p;
+        if(limit > 0) {
+            p["limit"] = static_cast<Json::UInt64>(limit);
+        }
+        const Json::Value result = this->CallMethod("getcontractprofiles", p);
+        if (result.isObject()) {
+            return result;
+        } else {
+            throw jsonrpc::JsonRpcException(jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE,
+                                            result.toStyledString());
+        }
+    }
     Json::Value gettransaction(const std::string& id) throw (jsonrpc::JsonRpcException) {
         Json::Value p;
         p["id"] = id;
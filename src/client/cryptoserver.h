@@ -18,8 +18,13 @@
 #ifndef JSONRPC_CPP_STUB_CRYPTOSERVER_H_
 #define JSONRPC_CPP_STUB_CRYPTOSERVER_H_
 
+#include <atomic>
+#include <memory>
+#include <set>
+
 #include <jsonrpccpp/server.h>
 
+#include "httpserver.h"
 #include "wallet.h"
 
 class CryptoRPCServer : public jsonrpc::AbstractServer<CryptoRPCServer> {
@@ -36,6 +41,10 @@ public:
                                jsonrpc::JSON_STRING, "address",jsonrpc::JSON_STRING,"amount",
                                jsonrpc::JSON_REAL, "password", jsonrpc::JSON_STRING, NULL),
                                &CryptoRPCServer::sendtoaddressI);
+        this->bindAndAddMethod(jsonrpc::Procedure("sendmany", jsonrpc::PARAMS_BY_NAME,
+                               jsonrpc::JSON_STRING, "recipients", jsonrpc::JSON_OBJECT,
+                               "password", jsonrpc::JSON_STRING, NULL),
+                               &CryptoRPCServer::sendmanyI);
         this->bindAndAddMethod(jsonrpc::Procedure("sendrawtransaction", jsonrpc::PARAMS_BY_NAME,
                                jsonrpc::JSON_BOOLEAN, "transaction",jsonrpc::JSON_OBJECT, NULL),
                                &CryptoRPCServer::sendrawtransactionI);
@@ -47,9 +56,23 @@ public:
         this->bindAndAddMethod(jsonrpc::Procedure("getpubkeyoutputs", jsonrpc::PARAMS_BY_NAME,
                                jsonrpc::JSON_OBJECT, "publickey",jsonrpc::JSON_STRING, NULL),
                                &CryptoRPCServer::getpubkeyoutputsI);
+        this->bindAndAddMethod(jsonrpc::Procedure("getaddresssummary", jsonrpc::PARAMS_BY_NAME,
+                               jsonrpc::JSON_OBJECT, "publickey",jsonrpc::JSON_STRING, NULL),
+                               &CryptoRPCServer::getaddresssummaryI);
+        this->bindAndAddMethod(jsonrpc::Procedure("getspendingtx", jsonrpc::PARAMS_BY_NAME,
+                               jsonrpc::JSON_OBJECT, "outputid",jsonrpc::JSON_STRING, NULL),
+                               &CryptoRPCServer::getspendingtxI);
+        this->bindAndAddMethod(jsonrpc::Procedure("getaddresstransactions", jsonrpc::PARAMS_BY_NAME,
+                               jsonrpc::JSON_OBJECT, "publickey",jsonrpc::JSON_STRING, NULL),
+                               &CryptoRPCServer::getaddresstransactionsI);
         this->bindAndAddMethod(jsonrpc::Procedure("compilecontract", jsonrpc::PARAMS_BY_NAME,
                                jsonrpc::JSON_STRING, "code",jsonrpc::JSON_STRING, NULL),
                                &CryptoRPCServer::compilecontractI);
+        this->bindAndAddMethod(jsonrpc::Procedure("profilecontract", jsonrpc::PARAMS_BY_NAME,
+                               jsonrpc::JSON_OBJECT, "transaction",jsonrpc::JSON_OBJECT, NULL),
+                               &CryptoRPCServer::profilecontractI);
+        this->bindAndAddMethod(jsonrpc::Procedure("getcontractprofiles", jsonrpc::PARAMS_BY_NAME,
+                               jsonrpc::JSON_OBJECT, NULL), &CryptoRPCServer::getcontractprofilesI);
         this->bindAndAddMethod(jsonrpc::Procedure("calculateoutputid", jsonrpc::PARAMS_BY_NAME,
                                jsonrpc::JSON_STRING, "output",jsonrpc::JSON_OBJECT, NULL),
                                &CryptoRPCServer::calculateoutputidI);
@@ -62,10 +85,17 @@ public:
         this->bindAndAddMethod(jsonrpc::Procedure("getblockbyheight", jsonrpc::PARAMS_BY_NAME,
                                jsonrpc::JSON_OBJECT, "height", jsonrpc::JSON_INTEGER, NULL),
                                &CryptoRPCServer::getblockbyheightI);
+        this->bindAndAddMethod(jsonrpc::Procedure("getblocks", jsonrpc::PARAMS_BY_NAME,
+                               jsonrpc::JSON_ARRAY, "start", jsonrpc::JSON_INTEGER,
+                               "count", jsonrpc::JSON_INTEGER, NULL),
+                               &CryptoRPCServer::getblocksI);
         this->bindAndAddMethod(jsonrpc::Procedure("stop", jsonrpc::PARAMS_BY_NAME,
                                jsonrpc::JSON_BOOLEAN, NULL), &CryptoRPCServer::stopI);
         this->bindAndAddMethod(jsonrpc::Procedure("getblock", jsonrpc::PARAMS_BY_NAME,
                                jsonrpc::JSON_OBJECT, "id", jsonrpc::JSON_STRING, NULL), &CryptoRPCServer::getblockI);
+        this->bindAndAddMethod(jsonrpc::Procedure("getblockfilter", jsonrpc::PARAMS_BY_NAME,
+                               jsonrpc::JSON_OBJECT, "id", jsonrpc::JSON_STRING, NULL),
+                               &CryptoRPCServer::getblockfilterI);
         this->bindAndAddMethod(jsonrpc::Procedure("gettransaction", jsonrpc::PARAMS_BY_NAME,
                                jsonrpc::JSON_OBJECT, "id", jsonrpc::JSON_STRING, NULL),
                                &CryptoRPCServer::gettransactionI);
@@ -86,6 +116,12 @@ public:
                                jsonrpc::JSON_STRING, "message",jsonrpc::JSON_STRING, 
                                "password", jsonrpc::JSON_STRING, "publickey", jsonrpc::JSON_STRING, NULL),
                                                   &CryptoRPCServer::signmessageI);
+        this->bindAndAddMethod(jsonrpc::Procedure("walletpassphrase", jsonrpc::PARAMS_BY_NAME,
+                               jsonrpc::JSON_OBJECT, "password", jsonrpc::JSON_STRING,
+                               "timeout", jsonrpc::JSON_INTEGER, NULL),
+                               &CryptoRPCServer::walletpassphraseI);
+        this->bindAndAddMethod(jsonrpc::Procedure("walletlock", jsonrpc::PARAMS_BY_NAME,
+                               jsonrpc::JSON_BOOLEAN, NULL), &CryptoRPCServer::walletlockI);
     }
 
     inline virtual void getinfoI(const Json::Value &request, Json::Value &response) {
@@ -99,6 +135,9 @@ public:
                                        request["amount"].asDouble(),
                                        request["password"].asString());
     }
+    inline virtual void sendmanyI(const Json::Value &request, Json::Value &response) {
+        response = this->sendmany(request["recipients"], request["password"].asString());
+    }
     inline virtual void sendrawtransactionI(const Json::Value &request,
                                             Json::Value &response) {
         response = this->sendrawtransaction(request["transaction"]);
@@ -112,11 +151,36 @@ public:
     }
     inline virtual void getpubkeyoutputsI(const Json::Value &request,
                                             Json::Value &response) {
-        response = this->getpubkeyoutputs(request["publickey"].asString());
+        // limit and after are optional, without a limit every output is returned
+        response = this->getpubkeyoutputs(request["publickey"].asString(),
+                                          request["limit"].asUInt64(),
+                                          request["after"].asString());
+    }
+    inline virtual void getaddresssummaryI(const Json::Value &request,
+                                           Json::Value &response) {
+        response = this->getaddresssummary(request["publickey"].asString());
+    }
+    inline virtual void getspendingtxI(const Json::Value &request, Json::Value &response) {
+        response = this->getspendingtx(request["outputid"].asString());
+    }
+    inline virtual void getaddresstransactionsI(const Json::Value &request,
+                                                Json::Value &response) {
+        // limit and after are optional
+        response = this->getaddresstransactions(request["publickey"].asString(),
+                                                request["limit"].asUInt64(),
+                                                request["after"].asString());
     }
     inline virtual void compilecontractI(const Json::Value &request, Json::Value &response) {
         response = this->compilecontract(request["code"].asString());
     }
+    inline virtual void profilecontractI(const Json::Value &request, Json::Value &response) {
+        response = this->profilecontract(request["transaction"]);
+    }
+    inline virtual void getcontractprofilesI(const Json::Value &request,
+                                             Json::Value &response) {
+        // limit is optional
+        response = this->getcontractprofiles(request["limit"].asUInt64());
+    }
     inline virtual void calculateoutputidI(const Json::Value &request,
                                            Json::Value &response) {
         response = this->calculateoutputid(request["output"]);
@@ -126,17 +190,28 @@ public:
                                          request["password"].asString());
     }
     inline virtual void listtransactionsI(const Json::Value &request, Json::Value &response) {
-        response = this->listtransactions();
+        // limit and after are optional, without a limit the whole history is returned
+        response = this->listtransactions(request["limit"].asUInt64(),
+                                          request["after"].asString());
     }
     inline virtual void getblockbyheightI(const Json::Value &request, Json::Value &response) {
         response = this->getblockbyheight(request["height"].asUInt64());
     }
+    inline virtual void getblocksI(const Json::Value &request, Json::Value &response) {
+        // verbosity is optional, without it full blocks are returned
+        response = this->getblocks(request["start"].asUInt64(), request["count"].asUInt64(),
+                                   request.isMember("verbosity") ?
+                                   request["verbosity"].asUInt() : 1);
+    }
     inline virtual void stopI(const Json::Value &request, Json::Value &response) {
         response = this->stop();
     }
     inline virtual void getblockI(const Json::Value &request, Json::Value &response) {
         response = this->getblock(request["id"].asString());
     }
+    inline virtual void getblockfilterI(const Json::Value &request, Json::Value &response) {
+        response = this->getblockfilter(request["id"].asString());
+    }
     inline virtual void gettransactionI(const Json::Value &request, Json::Value &response) {
         response = this->gettransaction(request["id"].asString());
     }
@@ -157,22 +232,41 @@ public:
         response = this->signmessage(request["message"].asString(), request["publickey"].asString(),  
                                          request["password"].asString());
     }
+    inline virtual void walletpassphraseI(const Json::Value &request, Json::Value &response) {
+        response = this->walletpassphrase(request["password"].asString(),
+                                          request["timeout"].asUInt64());
+    }
+    inline virtual void walletlockI(const Json::Value &request, Json::Value &response) {
+        response = this->walletlock();
+    }
     virtual Json::Value getinfo() = 0;
     virtual Json::Value account(const std::string& account, const std::string& password) = 0;
     virtual std::string sendtoaddress(const std::string& address, double amount,
                                       const std::string& password) = 0;
+    virtual std::string sendmany(const Json::Value& recipients,
+                                 const std::string& password) = 0;
     virtual bool sendrawtransaction(const Json::Value tx) = 0;
     virtual Json::Value listaccounts() = 0;
     virtual Json::Value listunspentoutputs(const std::string& account) = 0;
-    virtual Json::Value getpubkeyoutputs(const std::string& publickey) = 0;
+    virtual Json::Value getpubkeyoutputs(const std::string& publickey, const uint64_t limit,
+                                         const std::string& after) = 0;
+    virtual Json::Value getaddresssummary(const std::string& publickey) = 0;
+    virtual Json::Value getspendingtx(const std::string& outputid) = 0;
+    virtual Json::Value getaddresstransactions(const std::string& publickey, const uint64_t limit,
+                                               const std::string& after) = 0;
     virtual std::string compilecontract(const std::string& code) = 0;
+    virtual Json::Value profilecontract(const Json::Value tx) = 0;
+    virtual Json::Value getcontractprofiles(const uint64_t limit) = 0;
     virtual std::string calculateoutputid(const Json::Value output) = 0;
     virtual Json::Value signtransaction(const Json::Value& tx, 
                                         const std::string& password) = 0;
-    virtual Json::Value listtransactions() = 0;
+    virtual Json::Value listtransactions(const uint64_t limit, const std::string& after) = 0;
     virtual Json::Value getblockbyheight(const uint64_t height) = 0;
+    virtual Json::Value getblocks(const uint64_t start, const uint64_t count,
+                                  const unsigned int verbosity) = 0;
     virtual bool stop() = 0;
     virtual Json::Value getblock(const std::string& id) = 0;
+    virtual Json::Value getblockfilter(const std::string& id) = 0;
     virtual Json::Value gettransaction(const std::string& id) = 0;
     virtual Json::Value importprivkey(const std::string& name, const std::string& key,
                                       const std::string& password) = 0;
@@ -180,30 +274,73 @@ public:
     virtual Json::Value dumpprivkeys(const std::string& account, const std::string& password) = 0;
     virtual std::string getoutputsetid(const Json::Value& outputs) = 0;
     virtual std::string signmessage(const std::string& message, const std::string& publickey, const std::string& password) = 0;
+    virtual Json::Value walletpassphrase(const std::string& password, const uint64_t timeout) = 0;
+    virtual bool walletlock() = 0;
 };
 
-class CryptoServer : public CryptoRPCServer {
+class CryptoServer : public CryptoRPCServer, public jsonrpc::IStreamRequestHandler {
 public:
-    CryptoServer(jsonrpc::AbstractServerConnector &connector);
+    /**
+    * @param connector the connector requests arrive on
+    * @param walletThreads the most wallet methods that may run at once, further wallet
+    *        calls are refused until one finishes
+    */
+    CryptoServer(jsonrpc::AbstractServerConnector &connector,
+                 const unsigned int walletThreads = 1);
+
+    virtual void HandleMethodCall(jsonrpc::Procedure& proc, const Json::Value& input,
+                                  Json::Value& output);
+
+    /**
+    * Answers getblock, getblocks and unpaged getpubkeyoutputs calls with a stream that
+    * writes the result as it reads it, a few transactions, blocks or outputs at a time.
+    * Streamed getpubkeyoutputs results list outputs in address index order.
+    * Other requests, batches and notifications return nullptr.
+    */
+    virtual std::unique_ptr<jsonrpc::ResponseStream> HandleStreamRequest(
+        const std::string& request);
 
     virtual Json::Value getinfo();
     virtual Json::Value account(const std::string& account, const std::string& password);
     virtual std::string sendtoaddress(const std::string& address, double amount,
                                       const std::string& password);
+    virtual std::string sendmany(const Json::Value& recipients,
+                                 const std::string& password);
     virtual bool sendrawtransaction(const Json::Value tx);
     void setWallet(CryptoKernel::Wallet* Wallet, CryptoKernel::Blockchain* Blockchain,
                    CryptoKernel::Network* Network, bool* running);
     virtual Json::Value listaccounts();
     virtual Json::Value listunspentoutputs(const std::string& account);
-    virtual Json::Value getpubkeyoutputs(const std::string& publickey);
+    virtual Json::Value getpubkeyoutputs(const std::string& publickey, const uint64_t limit,
+                                         const std::string& after);
+    virtual Json::Value getaddresssummary(const std::string& publickey);
+    virtual Json::Value getspendingtx(const std::string& outputid);
+    virtual Json::Value getaddresstransactions(const std::string& publickey, const uint64_t limit,
+                                               const std::string& after);
     virtual std::string compilecontract(const std::string& code);
+    virtual Json::Value profilecontract(const Json::Value tx);
+    virtual Json::Value getcontractprofiles(const uint64_t limit);
     virtual std::string calculateoutputid(const Json::Value output);
     virtual Json::Value signtransaction(const Json::Value& tx, 
                                         const std::string& password);
-    virtual Json::Value listtransactions();
+    virtual Json::Value listtransactions(const uint64_t limit, const std::string& after);
     virtual Json::Value getblockbyheight(const uint64_t height);
+
+    /**
+    * Returns a contiguous range of main chain blocks read on one snapshot, stopping
+    * early at the tip
+    *
+    * @param start the height of the first block
+    * @param count the number of blocks, at most 1000 are returned
+    * @param verbosity 0 for the stored blocks with their transactions as ids, 1 for
+    *        full blocks as getblockbyheight returns them
+    * @return an array of the blocks, each with its id
+    */
+    virtual Json::Value getblocks(const uint64_t start, const uint64_t count,
+                                  const unsigned int verbosity);
     virtual bool stop();
     virtual Json::Value getblock(const std::string& id);
+    virtual Json::Value getblockfilter(const std::string& id);
     virtual Json::Value gettransaction(const std::string& id);
     virtual Json::Value importprivkey(const std::string& name, const std::string& key,
                                       const std::string& password);
@@ -211,12 +348,52 @@ public:
     virtual Json::Value dumpprivkeys(const std::string& account, const std::string& password);
     virtual std::string getoutputsetid(const Json::Value& outputs);
     virtual std::string signmessage(const std::string& message, const std::string& publickey, const std::string& password);
+    virtual Json::Value walletpassphrase(const std::string& password, const uint64_t timeout);
+    virtual bool walletlock();
 
 private:
     CryptoKernel::Wallet* wallet;
     CryptoKernel::Blockchain* blockchain;
     CryptoKernel::Network* network;
     bool* running;
+
+    // Wallet methods wait on the wallet's lock, so only some of the RPC
+    // threads may be spent on them and the rest are left for reads
+    static const std::set<std::string> walletMethods;
+    std::atomic<unsigned int> walletCalls;
+    unsigned int maxWalletCalls;
+
+    /**
+    * Sits between the connector and the JSON-RPC protocol handler. Batches are split so
+    * that each run of read-only calls is handled concurrently on one chain snapshot, and
+    * their responses are joined back together in request order. Everything else passes
+    * straight through.
+    */
+    class BatchHandler : public jsonrpc::IClientConnectionHandler {
+    public:
+        BatchHandler(CryptoServer* server, jsonrpc::IClientConnectionHandler* protocolHandler);
+
+        virtual void HandleRequest(const std::string& request, std::string& retValue);
+
+    private:
+        CryptoServer* server;
+        jsonrpc::IClientConnectionHandler* protocolHandler;
+    };
+
+    // Methods that only read, so batched calls to them can run concurrently
+    static const std::set<std::string> readOnlyMethods;
+    std::unique_ptr<BatchHandler> batchHandler;
+    std::unique_ptr<CryptoKernel::ThreadPool> batchPool;
+
+    // The snapshot of the batch being handled on this thread, if any
+    static thread_local CryptoKernel::Storage::Transaction* batchSnapshot;
+
+    /**
+    * Returns the batch's snapshot when handling part of a batch, otherwise a new one
+    * owned by the caller through owned
+    */
+    CryptoKernel::Storage::Transaction* readSnapshot(
+        std::unique_ptr<CryptoKernel::Storage::Transaction>& owned);
 };
 
 
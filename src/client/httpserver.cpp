@@ -9,6 +9,7 @@
  ************************************************************************/
 
 #include "httpserver.h"
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
 #include <sstream>
@@ -27,6 +28,29 @@ using namespace std;
 
 #define BUFFERSIZE 65536
 
+struct mhd_streaminfo {
+        std::unique_ptr<ResponseStream> stream;
+        string pending;
+        size_t offset;
+        bool finished;
+};
+
+// The body of a response that has already been built, handed over without a copy
+class StringResponseStream : public ResponseStream
+{
+    public:
+        StringResponseStream(string&& body) : body(std::move(body)) {}
+
+        virtual bool Next(string& chunk)
+        {
+            chunk.swap(body);
+            return false;
+        }
+
+    private:
+        string body;
+};
+
 struct mhd_coninfo {
         struct MHD_PostProcessor *postprocessor;
         MHD_Connection* connection;
@@ -37,16 +61,20 @@ struct mhd_coninfo {
 
 HttpServerLocal::HttpServerLocal(int port, const std::string& username, const std::string& password,
 								 const std::string &sslcert, const std::string &sslkey,
-								 int threads) :
+								 int threads, unsigned int connectionLimit,
+								 unsigned int connectionTimeout) :
     AbstractServerConnector(),
     port(port),
     threads(threads),
+    connectionLimit(connectionLimit),
+    connectionTimeout(connectionTimeout),
     running(false),
     path_sslcert(sslcert),
     path_sslkey(sslkey),
 	username(username),
 	password(password),
-    daemon(NULL)
+    daemon(NULL),
+    streamhandler(NULL)
 {
 }
 
@@ -73,13 +101,18 @@ bool HttpServerLocal::StartListening()
             mhd_flags = MHD_USE_POLL_INTERNALLY;
         else
             mhd_flags = MHD_USE_SELECT_INTERNALLY;
+
+        // libmicrohttpd's own default applies unless a limit was given
+        const unsigned int connectionLimitOption = this->connectionLimit > 0
+                                                   ? MHD_OPTION_CONNECTION_LIMIT
+                                                   : MHD_OPTION_END;
         if (this->path_sslcert != "" && this->path_sslkey != "")
         {
             try {
                 SpecificationParser::GetFileContent(this->path_sslcert, this->sslcert);
                 SpecificationParser::GetFileContent(this->path_sslkey, this->sslkey);
 
-                this->daemon = MHD_start_daemon(MHD_USE_SSL | mhd_flags, this->port, HttpServerLocal::accessCallback, NULL, HttpServerLocal::callback, this, MHD_OPTION_HTTPS_MEM_KEY, this->sslkey.c_str(), MHD_OPTION_HTTPS_MEM_CERT, this->sslcert.c_str(), MHD_OPTION_THREAD_POOL_SIZE, this->threads, MHD_OPTION_END);
+                this->daemon = MHD_start_daemon(MHD_USE_SSL | mhd_flags, this->port, HttpServerLocal::accessCallback, NULL, HttpServerLocal::callback, this, MHD_OPTION_HTTPS_MEM_KEY, this->sslkey.c_str(), MHD_OPTION_HTTPS_MEM_CERT, this->sslcert.c_str(), MHD_OPTION_THREAD_POOL_SIZE, this->threads, MHD_OPTION_CONNECTION_TIMEOUT, this->connectionTimeout, connectionLimitOption, this->connectionLimit, MHD_OPTION_END);
             }
             catch (JsonRpcException& ex)
             {
@@ -88,7 +121,7 @@ bool HttpServerLocal::StartListening()
         }
         else
         {
-            this->daemon = MHD_start_daemon(mhd_flags, this->port, HttpServerLocal::accessCallback, NULL, HttpServerLocal::callback, this,   MHD_OPTION_THREAD_POOL_SIZE, this->threads, MHD_OPTION_END);
+            this->daemon = MHD_start_daemon(mhd_flags, this->port, HttpServerLocal::accessCallback, NULL, HttpServerLocal::callback, this,   MHD_OPTION_THREAD_POOL_SIZE, this->threads, MHD_OPTION_CONNECTION_TIMEOUT, this->connectionTimeout, connectionLimitOption, this->connectionLimit, MHD_OPTION_END);
         }
         if (this->daemon != NULL)
             this->running = true;
@@ -141,6 +174,71 @@ void HttpServerLocal::SetUrlHandler(const string &url, IClientConnectionHandler
     this->SetHandler(NULL);
 }
 
+void HttpServerLocal::SetStreamHandler(IStreamRequestHandler *handler)
+{
+    this->streamhandler = handler;
+}
+
+bool HttpServerLocal::SendStream(std::unique_ptr<ResponseStream> stream, uint64_t size, void* addInfo)
+{
+    struct mhd_coninfo* client_connection = static_cast<struct mhd_coninfo*>(addInfo);
+
+    struct mhd_streaminfo* info = new mhd_streaminfo;
+    info->stream = std::move(stream);
+    info->offset = 0;
+    info->finished = false;
+
+    // Without a size libmicrohttpd sends the body chunked
+    struct MHD_Response *result = MHD_create_response_from_callback(size, BUFFERSIZE, HttpServerLocal::streamReader, info, HttpServerLocal::streamFree);
+    if (result == NULL)
+    {
+        delete info;
+        return false;
+    }
+
+    MHD_add_response_header(result, "Content-Type", "application/json");
+    MHD_add_response_header(result, "Access-Control-Allow-Origin", "*");
+
+    int ret = MHD_queue_response(client_connection->connection, client_connection->code, result);
+    MHD_destroy_response(result);
+    return ret == MHD_YES;
+}
+
+ssize_t HttpServerLocal::streamReader(void *cls, uint64_t pos, char *buf, size_t max)
+{
+    (void)pos;
+    struct mhd_streaminfo* info = static_cast<struct mhd_streaminfo*>(cls);
+
+    while (info->offset >= info->pending.size())
+    {
+        if (info->finished)
+            return MHD_CONTENT_READER_END_OF_STREAM;
+
+        info->pending.clear();
+        info->offset = 0;
+        try
+        {
+            info->finished = !info->stream->Next(info->pending);
+        }
+        catch (const std::exception& e)
+        {
+            // The status has already been sent, all that's left is to cut
+            // the body short
+            return MHD_CONTENT_READER_END_WITH_ERROR;
+        }
+    }
+
+    const size_t length = std::min(max, info->pending.size() - info->offset);
+    memcpy(buf, info->pending.data() + info->offset, length);
+    info->offset += length;
+    return length;
+}
+
+void HttpServerLocal::streamFree(void *cls)
+{
+    delete static_cast<struct mhd_streaminfo*>(cls);
+}
+
 int HttpServerLocal::callback(void *cls, MHD_Connection *connection, const char *url, const char *method, const char *version, const char *upload_data, size_t *upload_data_size, void **con_cls)
 {
     (void)version;
@@ -181,8 +279,22 @@ int HttpServerLocal::callback(void *cls, MHD_Connection *connection, const char
               else
               {
                 client_connection->code = MHD_HTTP_OK;
-                handler->HandleRequest(client_connection->request.str(), response);
-                client_connection->server->SendResponse(response, client_connection);
+                const string request = client_connection->request.str();
+
+                std::unique_ptr<ResponseStream> stream;
+                if (client_connection->server->streamhandler != NULL)
+                  stream = client_connection->server->streamhandler->HandleStreamRequest(request);
+
+                if (stream)
+                {
+                  client_connection->server->SendStream(std::move(stream), MHD_SIZE_UNKNOWN, client_connection);
+                }
+                else
+                {
+                  handler->HandleRequest(request, response);
+                  const uint64_t size = response.size();
+                  client_connection->server->SendStream(std::unique_ptr<ResponseStream>(new StringResponseStream(std::move(response))), size, client_connection);
+                }
               }
             }
         } else {
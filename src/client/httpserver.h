@@ -27,11 +27,44 @@ typedef intptr_t ssize_t;
 #endif
 
 #include <map>
+#include <memory>
 #include <microhttpd.h>
 #include <jsonrpccpp/server/abstractserverconnector.h>
 
 namespace jsonrpc
 {
+    /**
+     * A response body produced a piece at a time while it is being sent, so it never has
+     * to be held in memory whole.
+     */
+    class ResponseStream
+    {
+        public:
+            virtual ~ResponseStream() {}
+
+            /**
+             * @brief Next, appends the next part of the body to chunk
+             * @return false once chunk holds the last part of the body
+             */
+            virtual bool Next(std::string& chunk) = 0;
+    };
+
+    /**
+     * Chooses which requests are answered with a ResponseStream rather than going
+     * through the connection handler.
+     */
+    class IStreamRequestHandler
+    {
+        public:
+            virtual ~IStreamRequestHandler() {}
+
+            /**
+             * @brief HandleStreamRequest, returns a stream answering the request, or
+             * nullptr to have it handled the usual way
+             */
+            virtual std::unique_ptr<ResponseStream> HandleStreamRequest(const std::string& request) = 0;
+    };
+
     /**
      * This class provides an embedded HTTP Server, based on libmicrohttpd, to handle incoming Requests and send HTTP 1.1
      * valid responses.
@@ -50,10 +83,14 @@ namespace jsonrpc
              * @param port on which the server is listening
              * @param enableSpecification - defines if the specification is returned in case of a GET request
              * @param sslcert - defines the path to a SSL certificate, if this path is != "", then SSL/HTTPS is used with the given certificate.
+             * @param threads - number of threads handling requests
+             * @param connectionLimit - most connections open at once, 0 for libmicrohttpd's default
+             * @param connectionTimeout - seconds an idle connection is kept open, 0 for no timeout
              */
             HttpServerLocal(int port, const std::string& username, const std::string& password, 
 							const std::string& sslcert = "", const std::string& sslkey = "", 
-							int threads = 1);
+							int threads = 1, unsigned int connectionLimit = 0,
+							unsigned int connectionTimeout = 0);
 
             virtual bool StartListening();
             virtual bool StopListening();
@@ -64,9 +101,16 @@ namespace jsonrpc
 
             void SetUrlHandler(const std::string &url, IClientConnectionHandler *handler);
 
+            /**
+             * @brief SetStreamHandler, gives handler the first look at each authenticated request
+             */
+            void SetStreamHandler(IStreamRequestHandler *handler);
+
         private:
             int port;
             int threads;
+            unsigned int connectionLimit;
+            unsigned int connectionTimeout;
             bool running;
             std::string path_sslcert;
             std::string path_sslkey;
@@ -78,6 +122,16 @@ namespace jsonrpc
             struct MHD_Daemon *daemon;
 
             std::map<std::string, IClientConnectionHandler*> urlhandler;
+            IStreamRequestHandler* streamhandler;
+
+            /**
+             * @brief SendStream, queues a response whose body is read from stream as the
+             * connection can take it. size is the length of the body if it's known.
+             */
+            bool SendStream(std::unique_ptr<ResponseStream> stream, uint64_t size, void* addInfo);
+
+            static ssize_t streamReader(void *cls, uint64_t pos, char *buf, size_t max);
+            static void streamFree(void *cls);
 
             static int callback(void *cls, struct MHD_Connection *connection, const char *url, const char *method, const char *version, const char *upload_data, size_t *upload_data_size, void **con_cls);
 
@@ -136,6 +136,17 @@ int main(int argc, char* argv[]) {
                 } else {
                     std::cout << "Usage: sendtoaddress [address] [amount]" << std::endl;
                 }
+            } else if(command == "sendmany") {
+                if(argc >= 4 + offset && (argc - offset) % 2 == 0) {
+                    Json::Value recipients;
+                    for(int i = 2 + offset; i < argc; i += 2) {
+                        recipients[std::string(argv[i])] = std::strtod(argv[i + 1], NULL);
+                    }
+                    const std::string password = getPass("Please enter your wallet passphrase: ");
+                    std::cout << client.sendmany(recipients, password) << std::endl;
+                } else {
+                    std::cout << "Usage: sendmany [address] [amount] ([address] [amount] ...)" << std::endl;
+                }
             } else if(command == "listaccounts") {
                 std::cout << client.listaccounts().toStyledString() << std::endl;
             } else if(command == "listunspentoutputs") {
@@ -152,14 +163,53 @@ int main(int argc, char* argv[]) {
                 } else {
                     std::cout << "Usage: compilecontract [code]" << std::endl;
                 }
+            } else if(command == "profilecontract") {
+                if(argc == 3 + offset) {
+                    const Json::Value tx = CryptoKernel::Storage::toJson(std::string(argv[2 + offset]));
+                    std::cout << client.profilecontract(tx).toStyledString() << std::endl;
+                } else {
+                    std::cout << "Usage: profilecontract [transaction]" << std::endl;
+                }
+            } else if(command == "getcontractprofiles") {
+                const uint64_t limit = argc >= 3 + offset ? std::strtoull(argv[2 + offset], NULL, 10) : 0;
+                std::cout << client.getcontractprofiles(limit).toStyledString() << std::endl;
             } else if(command == "listtransactions") {
-                std::cout << client.listtransactions().toStyledString() << std::endl;
+                const uint64_t limit = argc >= 3 + offset ? std::strtoull(argv[2 + offset], NULL, 10) : 0;
+                const std::string after = argc >= 4 + offset ? argv[3 + offset] : "";
+                std::cout << client.listtransactions(limit, after).toStyledString() << std::endl;
             } else if(command == "getblock") {
                 if(argc == 3 + offset) {
                     std::cout << client.getblock(std::string(argv[2 + offset])) << std::endl;
                 } else {
                     std::cout << "Usage: getblock [id]" << std::endl;
                 }
+            } else if(command == "getblockfilter") {
+                if(argc == 3 + offset) {
+                    std::cout << client.getblockfilter(std::string(argv[2 + offset])).toStyledString() << std::endl;
+                } else {
+                    std::cout << "Usage: getblockfilter [id]" << std::endl;
+                }
+            } else if(command == "getaddresssummary") {
+                if(argc == 3 + offset) {
+                    std::cout << client.getaddresssummary(std::string(argv[2 + offset])).toStyledString() << std::endl;
+                } else {
+                    std::cout << "Usage: getaddresssummary [publickey]" << std::endl;
+                }
+            } else if(command == "getspendingtx") {
+                if(argc == 3 + offset) {
+                    std::cout << client.getspendingtx(std::string(argv[2 + offset])).toStyledString() << std::endl;
+                } else {
+                    std::cout << "Usage: getspendingtx [outputid]" << std::endl;
+                }
+            } else if(command == "getaddresstransactions") {
+                if(argc >= 3 + offset && argc <= 5 + offset) {
+                    const uint64_t limit = argc > 3 + offset ? std::strtoull(argv[3 + offset], NULL, 10) : 0;
+                    const std::string after = argc > 4 + offset ? argv[4 + offset] : "";
+                    std::cout << client.getaddresstransactions(std::string(argv[2 + offset]), limit,
+                                                               after).toStyledString() << std::endl;
+                } else {
+                    std::cout << "Usage: getaddresstransactions [publickey] ([limit] [after])" << std::endl;
+                }
             } else if(command == "getblockbyheight") {
                 if(argc == 3 + offset) {
                     std::cout << client.getblockbyheight(std::strtoull(argv[2 + offset], nullptr,
@@ -167,6 +217,30 @@ int main(int argc, char* argv[]) {
                 } else {
                     std::cout << "Usage: getblockbyheight [height]" << std::endl;
                 }
+            } else if(command == "getblocks") {
+                if(argc >= 4 + offset) {
+                    const uint64_t start = std::strtoull(argv[2 + offset], NULL, 10);
+                    const uint64_t count = std::strtoull(argv[3 + offset], NULL, 10);
+                    const unsigned int verbosity = argc >= 5 + offset ?
+                                                   std::strtoul(argv[4 + offset], NULL, 10) : 1;
+
+                    // One block per line, so the output can be piped into an indexer
+                    for(const Json::Value& block : client.getblocks(start, count, verbosity)) {
+                        std::cout << CryptoKernel::Storage::toString(block);
+                    }
+                } else {
+                    std::cout << "Usage: getblocks [start] [count] ([verbosity])" << std::endl;
+                }
+            } else if(command == "walletpassphrase") {
+                if(argc >= 3 + offset) {
+                    const uint64_t timeout = std::strtoull(argv[2 + offset], NULL, 10);
+                    const std::string password = getPass("Please enter your wallet passphrase: ");
+                    std::cout << client.walletpassphrase(password, timeout).toStyledString() << std::endl;
+                } else {
+                    std::cout << "Usage: walletpassphrase [seconds]" << std::endl;
+                }
+            } else if(command == "walletlock") {
+                std::cout << client.walletlock() << std::endl;
             } else if(command == "stop") {
                 std::cout << client.stop().toStyledString() << std::endl;
             } else if(command == "importprivkey") {
@@ -199,17 +273,27 @@ int main(int argc, char* argv[]) {
                           << "account [accountname]\n"
                           << "compilecontract [code]\n"
                           << "dumpprivkeys [accountname]\n"
+                          << "getaddresssummary [publickey]\n"
+                          << "getaddresstransactions [publickey] ([limit] [after])\n"
                           << "getblock [id]\n"
                           << "getblockbyheight [height]\n"
+                          << "getblocks [start] [count] ([verbosity])\n"
+                          << "getblockfilter [id]\n"
+                          << "getcontractprofiles ([limit])\n"
                           << "getinfo\n"
                           << "getpeerinfo\n"
+                          << "getspendingtx [outputid]\n"
                           << "gettransaction [id]\n"
                           << "importprivkey [accountname] [privkey]\n"
                           << "listaccounts\n"
-                          << "listtransactions\n"
+                          << "listtransactions ([limit] [after])\n"
                           << "listunspentoutputs [accountname]\n"
+                          << "profilecontract [transaction]\n"
+                          << "sendmany [address] [amount] ([address] [amount] ...)\n"
                           << "sendtoaddress [address] [amount]\n"
-                          << "stop\n";
+                          << "stop\n"
+                          << "walletlock\n"
+                          << "walletpassphrase [seconds]\n";
             }
         } catch(jsonrpc::JsonRpcException e) {
             std::cout << e.what() << std::endl;
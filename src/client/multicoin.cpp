@@ -1,6 +1,9 @@
+#include <algorithm>
+
 #include "multicoin.h"
 
 #include "consensus/PoW.h"
+#include "contract.h"
 
 CryptoKernel::MulticoinLoader::MulticoinLoader(const std::string& configFile,
                                                Log* log,
@@ -17,6 +20,20 @@ CryptoKernel::MulticoinLoader::MulticoinLoader(const std::string& configFile,
 
     t.close();
 
+    // Contracts run in the same process for every coin
+    if(config["contractprofiling"].asBool()) {
+        ContractRunner::setProfiling(true);
+    }
+
+    const unsigned int rpcThreads = std::max(config.get("rpcthreads", 4).asUInt(), 1u);
+
+    // Leave at least one thread for reads unless there's only the one
+    unsigned int rpcWalletThreads = config.get("rpcwalletthreads",
+                                               std::max(rpcThreads / 2, 1u)).asUInt();
+    if(rpcThreads > 1) {
+        rpcWalletThreads = std::min(rpcWalletThreads, rpcThreads - 1);
+    }
+
     for(const auto& coin : config["coins"]) {
         Coin* newCoin = new Coin;
         newCoin->name = coin["name"].asString();
@@ -36,6 +53,14 @@ CryptoKernel::MulticoinLoader::MulticoinLoader(const std::string& configFile,
                                                   config,
                                                   newCoin->blockchain.get());
 
+        if(coin["txindex"].asBool()) {
+            newCoin->blockchain->enableTxIndex();
+        }
+
+        if(coin.isMember("gasheight")) {
+            newCoin->blockchain->setGasActivationHeight(coin["gasheight"].asUInt64());
+        }
+
         newCoin->blockchain->loadChain(newCoin->consensusAlgo.get(),
                                       coin["genesisblock"].asString());
 
@@ -56,10 +81,14 @@ CryptoKernel::MulticoinLoader::MulticoinLoader(const std::string& configFile,
                                   config["rpcuser"].asString(),
                                   config["rpcpassword"].asString(),
                                   config["sslcert"].asString(),
-                                  config["sslkey"].asString()));
-        newCoin->rpcserver.reset(new CryptoServer(*newCoin->httpserver));
+                                  config["sslkey"].asString(),
+                                  rpcThreads,
+                                  config["rpcconnections"].asUInt(),
+                                  config.get("rpctimeout", 30).asUInt()));
+        newCoin->rpcserver.reset(new CryptoServer(*newCoin->httpserver, rpcWalletThreads));
         newCoin->rpcserver->setWallet(newCoin->wallet.get(), newCoin->blockchain.get(),
                                       newCoin->network.get(), running);
+        newCoin->httpserver->SetStreamHandler(newCoin->rpcserver.get());
         newCoin->rpcserver->StartListening();
 
         coins.push_back(std::unique_ptr<Coin>(newCoin));
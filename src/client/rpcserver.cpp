@@ -15,6 +15,7 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
 #include <sstream>
 #include <iomanip>
 
@@ -24,10 +25,453 @@
 #include "merkletree.h"
 
 const std::string noWalletError = "No wallet attached to this RPC server";
+const std::string noTxIndexError = "Transaction index is disabled, set txindex in the config";
+const std::string noProfilingError =
+    "Contract profiling is disabled, set contractprofiling in the config";
+const uint64_t maxBlocksPerCall = 1000;
+
+namespace {
+// Wraps a result written a piece at a time in the JSON-RPC response around it
+class ResultStream : public jsonrpc::ResponseStream {
+public:
+    ResultStream(const Json::Value& id) {
+        this->id = id;
+        started = false;
+
+        Json::StreamWriterBuilder builder;
+        builder["commentStyle"] = "None";
+        builder["indentation"] = "";
+        writer.reset(builder.newStreamWriter());
+    }
+
+    virtual bool Next(std::string& chunk) {
+        if(!started) {
+            chunk += "{\"id\":" + write(id) + ",\"jsonrpc\":\"2.0\",\"result\":";
+            started = true;
+        }
+
+        if(nextResult(chunk)) {
+            return true;
+        }
+
+        chunk += "}";
+        return false;
+    }
+
+protected:
+    /**
+    * Appends the next part of the result to chunk, returning false once the
+    * result is complete
+    */
+    virtual bool nextResult(std::string& chunk) = 0;
+
+    std::string write(const Json::Value& value) {
+        std::ostringstream buffer;
+        writer->write(value, &buffer);
+        return buffer.str();
+    }
+
+private:
+    Json::Value id;
+    bool started;
+    std::unique_ptr<Json::StreamWriter> writer;
+};
+
+// Every output of a key, unspent then spent, read from one snapshot. Each
+// half is in address index order, i.e. by id string, which matches the
+// paged getpubkeyoutputs result rather than the numeric id order the
+// unstreamed call returns.
+class PubKeyOutputsStream : public ResultStream {
+public:
+    PubKeyOutputsStream(const Json::Value& id, CryptoKernel::Blockchain* blockchain,
+                        const std::string& publicKey) : ResultStream(id) {
+        this->blockchain = blockchain;
+        this->publicKey = publicKey;
+        snapshot.reset(blockchain->getTxHandle());
+        spent = false;
+        written = 0;
+    }
+
+protected:
+    virtual bool nextResult(std::string& chunk) {
+        const auto outputs = blockchain->getAddressOutputs(snapshot.get(), publicKey, spent,
+                                                           outputsPerChunk, cursor);
+        for(const auto& out : outputs) {
+            cursor = out.id;
+
+            Json::Value outJson = blockchain->getOutputDB(snapshot.get(), out.id).toJson();
+            outJson["spent"] = spent;
+            outJson["id"] = out.id;
+
+            chunk += written == 0 ? "[" : ",";
+            chunk += write(outJson);
+            written++;
+        }
+
+        if(outputs.size() == outputsPerChunk) {
+            return true;
+        }
+
+        if(!spent) {
+            spent = true;
+            cursor = "";
+            return true;
+        }
+
+        // A key with no outputs gets null, as an empty Json::Value array would
+        chunk += written > 0 ? "]" : "null";
+        return false;
+    }
+
+private:
+    static const uint64_t outputsPerChunk = 500;
+
+    CryptoKernel::Blockchain* blockchain;
+    std::string publicKey;
+    std::unique_ptr<CryptoKernel::Storage::Transaction> snapshot;
+    bool spent;
+    std::string cursor;
+    uint64_t written;
+};
+
+// A block with its transactions written a few at a time, the same as
+// block::toJson
+class BlockStream : public ResultStream {
+public:
+    BlockStream(const Json::Value& id, CryptoKernel::Blockchain* blockchain,
+                std::unique_ptr<CryptoKernel::Storage::Transaction> snapshot,
+                const CryptoKernel::Blockchain::dbBlock& block) : ResultStream(id), block(block) {
+        this->blockchain = blockchain;
+        this->snapshot = std::move(snapshot);
+        txIds = block.getTransactions();
+        nextTx = txIds.begin();
+        started = false;
+    }
+
+protected:
+    virtual bool nextResult(std::string& chunk) {
+        if(!started) {
+            started = true;
+
+            Json::Value header;
+            header["coinbaseTx"] = blockchain->getTransaction(snapshot.get(),
+                                   block.getCoinbaseTx().toString()).toJson();
+            header["previousBlockId"] = block.getPreviousBlockId().toString();
+            header["timestamp"] = static_cast<Json::UInt64>(block.getTimestamp());
+            header["consensusData"] = block.getConsensusData();
+            header["height"] = static_cast<Json::UInt64>(block.getHeight());
+            header["data"] = block.getData();
+
+            if(txIds.empty()) {
+                chunk += write(header);
+                return false;
+            }
+
+            header["transactionMerkleRoot"] = block.getTransactionMerkleRoot().toString();
 
-CryptoServer::CryptoServer(jsonrpc::AbstractServerConnector &connector) : CryptoRPCServer(
+            // Leave the object open for the transactions
+            std::string headerJson = write(header);
+            headerJson.pop_back();
+            chunk += headerJson + ",\"transactions\":[";
+        }
+
+        for(unsigned int i = 0; i < txsPerChunk && nextTx != txIds.end(); i++, nextTx++) {
+            if(nextTx != txIds.begin()) {
+                chunk += ",";
+            }
+            chunk += write(blockchain->getTransaction(snapshot.get(),
+                                                      nextTx->toString()).toJson());
+        }
+
+        if(nextTx != txIds.end()) {
+            return true;
+        }
+
+        chunk += "]}";
+        return false;
+    }
+
+private:
+    static const unsigned int txsPerChunk = 100;
+
+    CryptoKernel::Blockchain* blockchain;
+    std::unique_ptr<CryptoKernel::Storage::Transaction> snapshot;
+    CryptoKernel::Blockchain::dbBlock block;
+    std::set<CryptoKernel::BigNum> txIds;
+    std::set<CryptoKernel::BigNum>::const_iterator nextTx;
+    bool started;
+};
+
+// A range of main chain blocks, one per line, read a few at a time
+class BlocksStream : public ResultStream {
+public:
+    BlocksStream(const Json::Value& id, CryptoKernel::Blockchain* blockchain,
+                 const uint64_t start, const uint64_t count,
+                 const unsigned int verbosity) : ResultStream(id) {
+        this->blockchain = blockchain;
+        snapshot.reset(blockchain->getTxHandle());
+        height = start;
+        end = start + std::min(count, maxBlocksPerCall);
+        full = verbosity > 0;
+        started = false;
+        written = 0;
+    }
+
+protected:
+    virtual bool nextResult(std::string& chunk) {
+        if(!started) {
+            chunk += "[";
+            started = true;
+        }
+
+        const uint64_t chunkEnd = std::min(end, height + blocksPerChunk);
+        for(; height < chunkEnd; height++) {
+            Json::Value block;
+            try {
+                block = blockchain->getBlockJsonByHeight(snapshot.get(), height, full);
+            } catch(const CryptoKernel::Blockchain::NotFoundException& e) {
+                // Past the tip
+                end = height;
+                break;
+            }
+
+            chunk += written == 0 ? "\n" : ",\n";
+            chunk += write(block);
+            written++;
+        }
+
+        if(height < end) {
+            return true;
+        }
+
+        chunk += "\n]";
+        return false;
+    }
+
+private:
+    static const uint64_t blocksPerChunk = 10;
+
+    CryptoKernel::Blockchain* blockchain;
+    std::unique_ptr<CryptoKernel::Storage::Transaction> snapshot;
+    uint64_t height;
+    uint64_t end;
+    bool full;
+    bool started;
+    uint64_t written;
+};
+}
+
+static Json::Value profileToJson(const CryptoKernel::ContractRunner::scriptProfile& profile) {
+    Json::Value returning;
+    returning["script"] = profile.scriptHash;
+    returning["runs"] = static_cast<Json::UInt64>(profile.runs);
+    returning["failures"] = static_cast<Json::UInt64>(profile.failures);
+    returning["gas"] = static_cast<Json::UInt64>(profile.gas);
+    returning["instructions"] = static_cast<Json::UInt64>(profile.instructions);
+    returning["peakmemory"] = static_cast<Json::UInt64>(profile.peakMemory);
+    returning["microseconds"] = static_cast<Json::UInt64>(profile.microseconds);
+    returning["hostcalls"] = Json::Value(Json::objectValue);
+    for(const auto& call : profile.hostCalls) {
+        Json::Value callJson;
+        callJson["calls"] = static_cast<Json::UInt64>(call.second.calls);
+        callJson["gas"] = static_cast<Json::UInt64>(call.second.gas);
+        callJson["microseconds"] = static_cast<Json::UInt64>(call.second.microseconds);
+        returning["hostcalls"][call.first] = callJson;
+    }
+
+    return returning;
+}
+
+const std::set<std::string> CryptoServer::walletMethods = {
+    "account", "sendtoaddress", "sendmany", "listaccounts", "listunspentoutputs",
+    "signtransaction", "listtransactions", "importprivkey", "dumpprivkeys", "signmessage",
+    "walletpassphrase", "walletlock"
+};
+
+const std::set<std::string> CryptoServer::readOnlyMethods = {
+    "getinfo", "getpubkeyoutputs", "getaddresssummary", "getspendingtx",
+    "getaddresstransactions", "profilecontract", "calculateoutputid", "getblockbyheight",
+    "getblocks", "getblock", "getblockfilter", "gettransaction", "getpeerinfo", "getoutputsetid"
+};
+
+thread_local CryptoKernel::Storage::Transaction* CryptoServer::batchSnapshot = nullptr;
+
+CryptoServer::CryptoServer(jsonrpc::AbstractServerConnector &connector,
+                           const unsigned int walletThreads) : CryptoRPCServer(
         connector) {
+    walletCalls = 0;
+    maxWalletCalls = std::max(walletThreads, 1u);
+
+    batchPool.reset(new CryptoKernel::ThreadPool());
+    batchHandler.reset(new BatchHandler(this, connector.GetHandler()));
+    connector.SetHandler(batchHandler.get());
+}
+
+CryptoServer::BatchHandler::BatchHandler(CryptoServer* server,
+        jsonrpc::IClientConnectionHandler* protocolHandler) {
+    this->server = server;
+    this->protocolHandler = protocolHandler;
+}
+
+void CryptoServer::BatchHandler::HandleRequest(const std::string& request,
+                                               std::string& retValue) {
+    const size_t start = request.find_first_not_of(" \t\r\n");
+    if(start == std::string::npos || request[start] != '[') {
+        protocolHandler->HandleRequest(request, retValue);
+        return;
+    }
+
+    // Anything malformed gets the protocol handler's error
+    Json::Value calls;
+    Json::CharReaderBuilder builder;
+    std::string errors;
+    std::istringstream input(request);
+    if(!Json::parseFromStream(builder, input, &calls, &errors) || !calls.isArray() ||
+       calls.empty()) {
+        protocolHandler->HandleRequest(request, retValue);
+        return;
+    }
+
+    const auto readOnly = [](const Json::Value& call) {
+        return call.isObject() && call["method"].isString() &&
+               readOnlyMethods.count(call["method"].asString()) > 0;
+    };
+
+    std::vector<std::string> responses(calls.size());
+
+    Json::ArrayIndex i = 0;
+    while(i < calls.size()) {
+        if(!readOnly(calls[i])) {
+            // Writes run alone and in order so the reads after them see them
+            protocolHandler->HandleRequest(CryptoKernel::Storage::toString(calls[i]),
+                                           responses[i]);
+            i++;
+            continue;
+        }
+
+        std::unique_ptr<CryptoKernel::Storage::Transaction> snapshot(
+            server->blockchain->getTxHandle());
+
+        std::vector<std::future<void>> results;
+        for(; i < calls.size() && readOnly(calls[i]); i++) {
+            results.push_back(server->batchPool->enqueue([&, i]() {
+                batchSnapshot = snapshot.get();
+                protocolHandler->HandleRequest(CryptoKernel::Storage::toString(calls[i]),
+                                               responses[i]);
+                batchSnapshot = nullptr;
+            }));
+        }
+
+        // The snapshot has to outlive every call using it
+        for(auto& result : results) {
+            result.wait();
+        }
+    }
+
+    // Notifications have no response, if there are only notifications
+    // nothing is sent back
+    std::string joined;
+    for(const std::string& response : responses) {
+        const size_t end = response.find_last_not_of(" \t\r\n");
+        if(end == std::string::npos) {
+            continue;
+        }
+
+        joined += joined.empty() ? "[" : ",";
+        joined.append(response, 0, end + 1);
+    }
+
+    retValue = joined.empty() ? "" : joined + "]";
+}
+
+std::unique_ptr<jsonrpc::ResponseStream> CryptoServer::HandleStreamRequest(
+    const std::string& request) {
+    const size_t start = request.find_first_not_of(" \t\r\n");
+    if(start == std::string::npos || request[start] != '{') {
+        return nullptr;
+    }
 
+    // Anything that isn't a well formed call gets the usual handling and
+    // its errors
+    Json::Value call;
+    Json::CharReaderBuilder builder;
+    std::string errors;
+    std::istringstream input(request);
+    if(!Json::parseFromStream(builder, input, &call, &errors) || !call.isObject() ||
+       call["jsonrpc"] != "2.0" || !call.isMember("id") || !call["method"].isString() ||
+       !call["params"].isObject()) {
+        return nullptr;
+    }
+
+    const std::string method = call["method"].asString();
+    const Json::Value& params = call["params"];
+
+    if(method == "getpubkeyoutputs" && params["publickey"].isString() &&
+       (params["limit"].isNull() || (params["limit"].isUInt64() && params["limit"].asUInt64() == 0))) {
+        return std::unique_ptr<jsonrpc::ResponseStream>(new PubKeyOutputsStream(call["id"],
+                blockchain, params["publickey"].asString()));
+    }
+
+    if(method == "getblocks" && params["start"].isUInt64() && params["count"].isUInt64() &&
+       (params["verbosity"].isNull() || params["verbosity"].isUInt())) {
+        return std::unique_ptr<jsonrpc::ResponseStream>(new BlocksStream(call["id"], blockchain,
+                params["start"].asUInt64(), params["count"].asUInt64(),
+                params["verbosity"].isNull() ? 1 : params["verbosity"].asUInt()));
+    }
+
+    if(method == "getblock" && params["id"].isString()) {
+        std::unique_ptr<CryptoKernel::Storage::Transaction> snapshot(blockchain->getTxHandle());
+        try {
+            const CryptoKernel::Blockchain::dbBlock block = blockchain->getBlockDB(snapshot.get(),
+                    params["id"].asString());
+
+            // Blocks off the main chain are only stored whole, leave those
+            // to getBlock
+            blockchain->getTransaction(snapshot.get(), block.getCoinbaseTx().toString());
+
+            return std::unique_ptr<jsonrpc::ResponseStream>(new BlockStream(call["id"], blockchain,
+                    std::move(snapshot), block));
+        } catch(const CryptoKernel::Blockchain::NotFoundException& e) {
+            return nullptr;
+        }
+    }
+
+    return nullptr;
+}
+
+CryptoKernel::Storage::Transaction* CryptoServer::readSnapshot(
+    std::unique_ptr<CryptoKernel::Storage::Transaction>& owned) {
+    if(batchSnapshot != nullptr) {
+        return batchSnapshot;
+    }
+
+    owned.reset(blockchain->getTxHandle());
+    return owned.get();
+}
+
+void CryptoServer::HandleMethodCall(jsonrpc::Procedure& proc, const Json::Value& input,
+                                    Json::Value& output) {
+    if(walletMethods.find(proc.GetProcedureName()) == walletMethods.end()) {
+        CryptoRPCServer::HandleMethodCall(proc, input, output);
+        return;
+    }
+
+    // Refusing rather than queueing keeps waiting wallet calls from tying up
+    // the threads reads need
+    if(walletCalls.fetch_add(1) >= maxWalletCalls) {
+        walletCalls--;
+        throw jsonrpc::JsonRpcException(jsonrpc::Errors::ERROR_RPC_INTERNAL_ERROR,
+                                        "Too many wallet calls in progress, try again");
+    }
+
+    try {
+        CryptoRPCServer::HandleMethodCall(proc, input, output);
+    } catch(...) {
+        walletCalls--;
+        throw;
+    }
+
+    walletCalls--;
 }
 
 void CryptoServer::setWallet(CryptoKernel::Wallet* Wallet,
@@ -51,6 +495,16 @@ Json::Value CryptoServer::getinfo() {
         const long double balance = wallet->getTotalBalance() / 100000000.0;
         buffer << std::setprecision(8) << std::fixed << balance;
         returning["balance"] = buffer.str();
+
+        buffer.str("");
+        buffer << (wallet->getUnconfirmedBalance() / 100000000.0L);
+        returning["unconfirmedbalance"] = buffer.str();
+
+        buffer.str("");
+        buffer << (wallet->getLockedBalance() / 100000000.0L);
+        returning["lockedbalance"] = buffer.str();
+
+        returning["unlockeduntil"] = static_cast<Json::UInt64>(wallet->getUnlockedUntil());
     }
     returning["height"] = blockchain->getBlockDB("tip").getHeight();
     returning["connections"] = network->getConnections();
@@ -63,6 +517,14 @@ Json::Value CryptoServer::getinfo() {
 
     returning["mempool"]["size"] = buffer.str();
 
+    const auto cacheStats = CryptoKernel::ContractRunner::getCacheStats();
+    const uint64_t lookups = cacheStats.hits + cacheStats.misses;
+    returning["contractcache"]["entries"] = static_cast<Json::UInt64>(cacheStats.entries);
+    returning["contractcache"]["bytes"] = static_cast<Json::UInt64>(cacheStats.bytes);
+    returning["contractcache"]["hits"] = static_cast<Json::UInt64>(cacheStats.hits);
+    returning["contractcache"]["misses"] = static_cast<Json::UInt64>(cacheStats.misses);
+    returning["contractcache"]["hitrate"] = lookups > 0 ? double(cacheStats.hits) / lookups : 0.0;
+
     return returning;
 }
 
@@ -113,6 +575,24 @@ std::string CryptoServer::sendtoaddress(const std::string& address, double amoun
     }
 }
 
+std::string CryptoServer::sendmany(const Json::Value& recipients,
+                                   const std::string& password) {
+    if(wallet != nullptr) {
+        std::map<std::string, uint64_t> payments;
+        for(const std::string& address : recipients.getMemberNames()) {
+            if(!recipients[address].isNumeric()) {
+                return "Invalid amount for " + address;
+            }
+
+            payments[address] = recipients[address].asDouble() * 100000000;
+        }
+
+        return wallet->sendMany(payments, password);
+    } else {
+        return noWalletError;
+    }
+}
+
 bool CryptoServer::sendrawtransaction(const Json::Value tx) {
     try {
         const CryptoKernel::Blockchain::transaction transaction =
@@ -146,6 +626,10 @@ Json::Value CryptoServer::listaccounts() {
             buffer << std::setprecision(8) << balance;
             account["balance"] = buffer.str();
 
+            buffer.str("");
+            buffer << (acc.getUnconfirmedBalance() / 100000000.0);
+            account["unconfirmedbalance"] = buffer.str();
+
             for(const auto& addr : acc.getKeys()) {
                 Json::Value keyPair;
                 keyPair["pubKey"] = addr.pubKey;
@@ -191,7 +675,44 @@ Json::Value CryptoServer::listunspentoutputs(const std::string& account) {
     return returning;
 }
 
-Json::Value CryptoServer::getpubkeyoutputs(const std::string& publickey) {
+Json::Value CryptoServer::getpubkeyoutputs(const std::string& publickey, const uint64_t limit,
+                                           const std::string& after) {
+    if(limit > 0) {
+        // Pages run through the unspent outputs then the spent ones. The
+        // cursor is the last output returned, prefixed with u/ or s/.
+        Json::Value returning;
+        returning["outputs"] = Json::Value(Json::arrayValue);
+
+        bool spent = after.compare(0, 2, "s/") == 0;
+        std::string cursor = after.size() > 2 ? after.substr(2) : "";
+
+        uint64_t remaining = limit;
+        while(remaining > 0) {
+            const auto outputs = blockchain->getAddressOutputs(publickey, spent, remaining, cursor);
+            for(const auto& out : outputs) {
+                Json::Value outJson;
+                outJson["id"] = out.id;
+                outJson["value"] = static_cast<Json::UInt64>(out.value);
+                outJson["height"] = static_cast<Json::UInt64>(out.height);
+                outJson["tx"] = out.txId;
+                outJson["spent"] = out.spent;
+
+                returning["outputs"].append(outJson);
+                returning["next"] = (spent ? "s/" : "u/") + out.id;
+            }
+
+            remaining -= outputs.size();
+            if(remaining == 0 || spent) {
+                break;
+            }
+
+            spent = true;
+            cursor = "";
+        }
+
+        return returning;
+    }
+
     const auto unspent = blockchain->getUnspentOutputs(publickey);
 
     Json::Value returning;
@@ -215,10 +736,120 @@ Json::Value CryptoServer::getpubkeyoutputs(const std::string& publickey) {
     return returning;
 }
 
+Json::Value CryptoServer::getaddresssummary(const std::string& publickey) {
+    const auto summary = blockchain->getAddressSummary(publickey);
+
+    std::stringstream buffer;
+    buffer << std::setprecision(8) << std::fixed;
+
+    Json::Value returning;
+    buffer << (summary.balance / 100000000.0);
+    returning["balance"] = buffer.str();
+    buffer.str("");
+    buffer << (summary.received / 100000000.0);
+    returning["received"] = buffer.str();
+    returning["outputs"] = static_cast<Json::UInt64>(summary.outputs);
+    returning["spent"] = static_cast<Json::UInt64>(summary.spent);
+    returning["txs"] = static_cast<Json::UInt64>(summary.txs);
+
+    return returning;
+}
+
+Json::Value CryptoServer::getspendingtx(const std::string& outputid) {
+    Json::Value returning;
+
+    if(!blockchain->txIndexEnabled()) {
+        returning["error"] = noTxIndexError;
+        return returning;
+    }
+
+    try {
+        const auto spending = blockchain->getSpendingTx(outputid);
+        returning["tx"] = spending.txId;
+        returning["height"] = static_cast<Json::UInt64>(spending.height);
+        return returning;
+    } catch(const CryptoKernel::Blockchain::NotFoundException& e) {
+        return Json::Value();
+    }
+}
+
+Json::Value CryptoServer::getaddresstransactions(const std::string& publickey,
+                                                 const uint64_t limit,
+                                                 const std::string& after) {
+    Json::Value returning;
+
+    if(!blockchain->txIndexEnabled()) {
+        returning["error"] = noTxIndexError;
+        return returning;
+    }
+
+    // Results only cover the chain up to here while the index is being built
+    returning["indexheight"] = static_cast<Json::UInt64>(blockchain->getTxIndexHeight());
+    returning["transactions"] = Json::Value(Json::arrayValue);
+
+    const auto txs = blockchain->getAddressTransactions(publickey, limit > 0 ? limit : 100,
+                                                        after);
+    for(const auto& tx : txs) {
+        Json::Value txJson;
+        txJson["tx"] = tx.txId;
+        txJson["height"] = static_cast<Json::UInt64>(tx.height);
+        returning["transactions"].append(txJson);
+        returning["next"] = tx.cursor;
+    }
+
+    return returning;
+}
+
 std::string CryptoServer::compilecontract(const std::string& code) {
     return CryptoKernel::ContractRunner::compile(code);
 }
 
+Json::Value CryptoServer::profilecontract(const Json::Value tx) {
+    try {
+        const CryptoKernel::Blockchain::transaction transaction =
+            CryptoKernel::Blockchain::transaction(tx);
+
+        Json::Value returning;
+
+        std::unique_ptr<CryptoKernel::Storage::Transaction> ownedSnapshot;
+        CryptoKernel::Storage::Transaction* dbTx = readSnapshot(ownedSnapshot);
+        CryptoKernel::ContractRunner lvm(blockchain);
+        lvm.enableProfiling();
+        try {
+            returning["valid"] = lvm.evaluateValid(dbTx, transaction);
+        } catch(const std::exception& e) {
+            returning["valid"] = false;
+            returning["error"] = e.what();
+        }
+
+        returning["gas"] = static_cast<Json::UInt64>(lvm.getGasUsed());
+        returning["scripts"] = Json::Value(Json::arrayValue);
+        for(const auto& profile : lvm.getProfiles()) {
+            returning["scripts"].append(profileToJson(profile));
+        }
+
+        return returning;
+    } catch(const CryptoKernel::Blockchain::InvalidElementException& e) {
+        return Json::Value();
+    }
+}
+
+Json::Value CryptoServer::getcontractprofiles(const uint64_t limit) {
+    Json::Value returning;
+
+    if(!CryptoKernel::ContractRunner::getProfiling()) {
+        returning["error"] = noProfilingError;
+        return returning;
+    }
+
+    returning["scripts"] = Json::Value(Json::arrayValue);
+    for(const auto& profile : CryptoKernel::ContractRunner::getProfileTotals(limit)) {
+        returning["scripts"].append(profileToJson(profile));
+    }
+
+    return returning;
+}
+
 std::string CryptoServer::calculateoutputid(const Json::Value output) {
     try {
         const CryptoKernel::Blockchain::output out = CryptoKernel::Blockchain::output(output);
@@ -248,10 +879,30 @@ Json::Value CryptoServer::signtransaction(const Json::Value& tx,
     }
 }
 
-Json::Value CryptoServer::listtransactions() {
+Json::Value CryptoServer::listtransactions(const uint64_t limit, const std::string& after) {
     Json::Value returning;
 
-    if(wallet != nullptr) {
+    if(wallet != nullptr && limit > 0) {
+        returning["transactions"] = Json::Value(Json::arrayValue);
+
+        for(Json::Value summary : wallet->listHistory(limit, after)) {
+            std::stringstream buffer;
+            buffer << std::setprecision(8) << std::fixed
+                   << (summary["received"].asUInt64() / 100000000.0);
+            summary["received"] = buffer.str();
+
+            buffer.str("");
+            buffer << (summary["spent"].asUInt64() / 100000000.0);
+            summary["spent"] = buffer.str();
+
+            returning["next"] = summary["cursor"];
+            returning["transactions"].append(summary);
+        }
+
+        if(returning["transactions"].size() < limit) {
+            returning["next"] = Json::nullValue;
+        }
+    } else if(wallet != nullptr) {
         returning["transactions"] = Json::Value();
 
         const auto transactions =
@@ -289,7 +940,9 @@ Json::Value CryptoServer::listtransactions() {
 
 Json::Value CryptoServer::getblockbyheight(const uint64_t height) {
     try {
-        const CryptoKernel::Blockchain::block block = blockchain->getBlockByHeight(height);
+        std::unique_ptr<CryptoKernel::Storage::Transaction> ownedSnapshot;
+        const CryptoKernel::Blockchain::block block = blockchain->getBlockByHeight(
+                    readSnapshot(ownedSnapshot), height);
         Json::Value returning = block.toJson();
         returning["id"] = block.getId().toString();
         return returning;
@@ -298,6 +951,24 @@ Json::Value CryptoServer::getblockbyheight(const uint64_t height) {
     }
 }
 
+Json::Value CryptoServer::getblocks(const uint64_t start, const uint64_t count,
+                                    const unsigned int verbosity) {
+    std::unique_ptr<CryptoKernel::Storage::Transaction> ownedSnapshot;
+    CryptoKernel::Storage::Transaction* snapshot = readSnapshot(ownedSnapshot);
+
+    Json::Value returning = Json::Value(Json::arrayValue);
+    const uint64_t end = start + std::min(count, maxBlocksPerCall);
+    for(uint64_t height = start; height < end; height++) {
+        try {
+            returning.append(blockchain->getBlockJsonByHeight(snapshot, height, verbosity > 0));
+        } catch(const CryptoKernel::Blockchain::NotFoundException& e) {
+            break;
+        }
+    }
+
+    return returning;
+}
+
 bool CryptoServer::stop() {
     *running = false;
     return true;
@@ -305,7 +976,20 @@ bool CryptoServer::stop() {
 
 Json::Value CryptoServer::getblock(const std::string& id) {
     try {
-        return blockchain->getBlock(id).toJson();
+        std::unique_ptr<CryptoKernel::Storage::Transaction> ownedSnapshot;
+        return blockchain->getBlock(readSnapshot(ownedSnapshot), id).toJson();
+    } catch(const CryptoKernel::Blockchain::NotFoundException& e) {
+        return Json::Value();
+    }
+}
+
+Json::Value CryptoServer::getblockfilter(const std::string& id) {
+    try {
+        std::unique_ptr<CryptoKernel::Storage::Transaction> ownedSnapshot;
+        Json::Value returning = blockchain->getBlockFilter(readSnapshot(ownedSnapshot),
+                                                          id).toJson();
+        returning["id"] = id;
+        return returning;
     } catch(const CryptoKernel::Blockchain::NotFoundException& e) {
         return Json::Value();
     }
@@ -313,7 +997,8 @@ Json::Value CryptoServer::getblock(const std::string& id) {
 
 Json::Value CryptoServer::gettransaction(const std::string& id) {
     try {
-        return blockchain->getTransaction(id).toJson();
+        std::unique_ptr<CryptoKernel::Storage::Transaction> ownedSnapshot;
+        return blockchain->getTransaction(readSnapshot(ownedSnapshot), id).toJson();
     } catch(const CryptoKernel::Blockchain::NotFoundException& e) {
         return Json::Value();
     }
@@ -398,3 +1083,29 @@ std::string CryptoServer::signmessage(const std::string& message,
         return noWalletError;
     }
 }
+
+Json::Value CryptoServer::walletpassphrase(const std::string& password, const uint64_t timeout) {
+    Json::Value returning;
+
+    if(wallet != nullptr) {
+        try {
+            wallet->unlockWallet(password, timeout);
+            returning["unlockeduntil"] = static_cast<Json::UInt64>(wallet->getUnlockedUntil());
+        } catch(const CryptoKernel::Wallet::WalletException& e) {
+            returning["error"] = e.what();
+        }
+    } else {
+        returning["error"] = noWalletError;
+    }
+
+    return returning;
+}
+
+bool CryptoServer::walletlock() {
+    if(wallet != nullptr) {
+        wallet->lockWallet();
+        return true;
+    }
+
+    return false;
+}
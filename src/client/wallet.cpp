@@ -17,10 +17,42 @@
 
 #include <sstream>
 #include <iostream>
+#include <algorithm>
+#include <iterator>
+#include <iomanip>
 
 #include "wallet.h"
 #include "crypto.h"
 
+namespace {
+// Copies a secret into locked memory, with enough room reserved that it
+// isn't stored inline
+template<typename String> CryptoKernel::SecureString secureCopy(const String& secret) {
+    CryptoKernel::SecureString returning;
+    returning.reserve(std::max<size_t>(secret.size(), 64));
+    returning.assign(secret.begin(), secret.end());
+    return returning;
+}
+}
+
+// Blocks the wallet can fall behind before it switches to a parallel rescan
+static const uint64_t rescanThreshold = 100;
+// Blocks read by each rescan task
+static const uint64_t rescanChunkSize = 50;
+// Blocks applied between commits during a rescan
+static const uint64_t rescanBatchSize = 2000;
+// Fee paid for every transaction, on top of the per input fee
+static const uint64_t baseFee = 15000;
+// Fee per byte of the data of each output spent
+static const uint64_t inputFeeRate = 60;
+// Excess over the amount and fee that may go to the miner rather than
+// paying for a change output
+static const uint64_t changeWindow = 10000;
+// Largest transaction the wallet will build, leaving room in a block for others
+static const uint64_t maxSendSize = 1024 * 1024;
+// Branch and bound steps to try before falling back to a greedy selection
+static const uint64_t coinSelectionTries = 100000;
+
 CryptoKernel::Wallet::Wallet(CryptoKernel::Blockchain* blockchain,
                              CryptoKernel::Network* network,
                              CryptoKernel::Log* log,
@@ -34,6 +66,7 @@ CryptoKernel::Wallet::Wallet(CryptoKernel::Blockchain* blockchain,
     utxos.reset(new CryptoKernel::Storage::Table("utxos"));
     transactions.reset(new CryptoKernel::Storage::Table("transactions"));
     params.reset(new CryptoKernel::Storage::Table("params"));
+    history.reset(new CryptoKernel::Storage::Table("history"));
 
     std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(walletdb->begin());
     const Json::Value height = params->get(dbTx.get(), "height");
@@ -42,6 +75,9 @@ CryptoKernel::Wallet::Wallet(CryptoKernel::Blockchain* blockchain,
     if(height.isNull()) {
         params->put(dbTx.get(), "height", Json::Value(0));
         params->put(dbTx.get(), "tipId", Json::Value(""));
+        params->put(dbTx.get(), "balance", Json::Value(0));
+        params->put(dbTx.get(), "lockedBalance", Json::Value(0));
+        params->put(dbTx.get(), "unconfirmedBalance", Json::Value(0));
         params->put(dbTx.get(), "schemaVersion", Json::Value(LATEST_WALLET_SCHEMA));
         dbTx->commit();
         upgradeWallet();
@@ -56,12 +92,21 @@ CryptoKernel::Wallet::Wallet(CryptoKernel::Blockchain* blockchain,
     const time_t t = std::time(0);
     generator.seed(static_cast<uint64_t> (t));
 
+    coinIndexLoaded = false;
+    unlockChanged = false;
+
     running = true;
+    blockchain->addListener(this);
     watchThread.reset(new std::thread(&CryptoKernel::Wallet::watchFunc, this));
 }
 
 CryptoKernel::Wallet::~Wallet() {
-    running = false;
+    blockchain->removeListener(this);
+    {
+        std::lock_guard<std::mutex> lock(eventMutex);
+        running = false;
+    }
+    eventReady.notify_all();
     watchThread->join();
 }
 
@@ -146,6 +191,106 @@ void CryptoKernel::Wallet::upgradeWallet() {
         schemaVersion = 2;
     }
 
+    if(schemaVersion == 2) {
+        // Seed the running totals from the outputs. Unconfirmed balances
+        // start at zero and are rebuilt from the mempool on startup.
+        uint64_t balance = 0;
+        uint64_t locked = 0;
+
+        std::unique_ptr<CryptoKernel::Storage::Table::Iterator> it(new
+            CryptoKernel::Storage::Table::Iterator(utxos.get(), walletdb.get()));
+        for(it->SeekToFirst(); it->Valid(); it->Next()) {
+            const Txo txo = Txo(it->value());
+            balance += txo.getValue();
+            if(txo.isSpent()) {
+                locked += txo.getValue();
+            }
+        }
+        it.reset();
+
+        std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(walletdb->begin());
+
+        params->put(dbTx.get(), "balance", Json::Value(balance));
+        params->put(dbTx.get(), "lockedBalance", Json::Value(locked));
+        params->put(dbTx.get(), "unconfirmedBalance", Json::Value(0));
+        params->put(dbTx.get(), "schemaVersion", Json::Value(3));
+
+        dbTx->commit();
+
+        schemaVersion = 3;
+
+        if(!checkBalances()) {
+            log->printf(LOG_LEVEL_WARN, "Wallet(): Account balances don't match the wallet's outputs, "
+                                        "import a key or delete the wallet's utxos to rescan");
+        }
+    }
+
+    if(schemaVersion == 3) {
+        // File a history summary for every confirmed transaction from the
+        // chain. Unconfirmed ones are dropped and re-read from the mempool
+        // on startup, so they're left as they are.
+        std::set<std::string> txIds;
+
+        std::unique_ptr<CryptoKernel::Storage::Table::Iterator> it(new
+            CryptoKernel::Storage::Table::Iterator(transactions.get(), walletdb.get()));
+        for(it->SeekToFirst(); it->Valid(); it->Next()) {
+            if(!it->value()["unconfirmed"].asBool()) {
+                txIds.insert(it->key());
+            }
+        }
+        it.reset();
+
+        std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(walletdb->begin());
+        std::unique_ptr<CryptoKernel::Storage::Transaction> bchainTx(blockchain->getTxHandle());
+
+        try {
+            for(const auto& txId : txIds) {
+                const auto txDB = blockchain->getTransactionDB(bchainTx.get(), txId);
+                const uint64_t height = blockchain->getBlockDB(bchainTx.get(),
+                                        txDB.getConfirmingBlock().toString()).getHeight();
+                const CryptoKernel::Blockchain::transaction tx = blockchain->getTransaction(bchainTx.get(),
+                                                                  txId);
+
+                uint64_t received = 0;
+                for(const auto& payment : getReceived(dbTx.get(), tx)) {
+                    received += payment.second;
+                }
+
+                // Our spent outputs are gone from utxos, look them up in the chain
+                uint64_t spent = 0;
+                for(const CryptoKernel::Blockchain::input& inp : tx.getInputs()) {
+                    const CryptoKernel::Blockchain::output out = blockchain->getOutput(bchainTx.get(),
+                                                                 inp.getOutputId().toString());
+                    const Json::Value data = out.getData();
+                    if(data["publicKey"].isString()
+                       && accounts->get(dbTx.get(), data["publicKey"].asString(), 0).isString()) {
+                        spent += out.getValue();
+                    }
+                }
+
+                recordTx(dbTx.get(), txId, false, height, tx.getTimestamp(), received, spent);
+            }
+
+            params->put(dbTx.get(), "schemaVersion", Json::Value(4));
+            dbTx->commit();
+        } catch(const CryptoKernel::Blockchain::NotFoundException& e) {
+            // The wallet knows a transaction the chain doesn't, only a rescan
+            // can make sense of that
+            dbTx->abort();
+
+            log->printf(LOG_LEVEL_WARN, "Wallet(): Transaction missing from the chain, rescanning "
+                                        "to build the transaction history");
+
+            clearDB();
+
+            dbTx.reset(walletdb->begin());
+            params->put(dbTx.get(), "schemaVersion", Json::Value(4));
+            dbTx->commit();
+        }
+
+        schemaVersion = 4;
+    }
+
     schemaVersion = LATEST_WALLET_SCHEMA;
 
     log->printf(LOG_LEVEL_INFO, "Wallet(): Wallet upgrade complete");
@@ -166,70 +311,506 @@ bool CryptoKernel::Wallet::checkPassword(const std::string& password) {
     return false;
 }
 
+CryptoKernel::SecureString CryptoKernel::Wallet::authorize(const std::string& password) {
+    std::lock_guard<std::recursive_mutex> lock(walletLock);
+
+    if(isUnlocked()) {
+        if(password.empty()) {
+            return secureCopy(cachedPassword);
+        }
+
+        if(password.size() == cachedPassword.size()
+                && CRYPTO_memcmp(password.data(), cachedPassword.data(), password.size()) == 0) {
+            return secureCopy(password);
+        }
+    }
+
+    if(!password.empty() && checkPassword(password)) {
+        return secureCopy(password);
+    }
+
+    return SecureString();
+}
+
+void CryptoKernel::Wallet::unlockWallet(const std::string& password, const uint64_t timeout) {
+    std::lock_guard<std::recursive_mutex> lock(walletLock);
+
+    if(password.empty() || !checkPassword(password)) {
+        throw WalletException("Incorrect wallet password");
+    }
+
+    if(timeout == 0) {
+        lockWallet();
+        return;
+    }
+
+    SecureString newPassword = secureCopy(password);
+    cachedPassword.swap(newPassword);
+
+    {
+        std::lock_guard<std::mutex> eventLock(eventMutex);
+        unlockedUntil = std::chrono::system_clock::now() + std::chrono::seconds(timeout);
+        unlockChanged = true;
+    }
+    // Wake the watch thread so it relocks at the new time
+    eventReady.notify_one();
+}
+
+void CryptoKernel::Wallet::lockWallet() {
+    std::lock_guard<std::recursive_mutex> lock(walletLock);
+
+    {
+        std::lock_guard<std::mutex> eventLock(eventMutex);
+        unlockedUntil = std::chrono::system_clock::time_point();
+        unlockChanged = true;
+    }
+    eventReady.notify_one();
+
+    // Freeing locked memory wipes it
+    SecureString().swap(cachedPassword);
+    keyCache.clear();
+}
+
+uint64_t CryptoKernel::Wallet::getUnlockedUntil() {
+    std::lock_guard<std::mutex> lock(eventMutex);
+    if(unlockedUntil <= std::chrono::system_clock::now()) {
+        return 0;
+    }
+
+    return std::chrono::duration_cast<std::chrono::seconds>(
+               unlockedUntil.time_since_epoch()).count();
+}
+
+bool CryptoKernel::Wallet::isUnlocked() {
+    return getUnlockedUntil() > 0;
+}
+
+std::string CryptoKernel::Wallet::getPrivKey(const Account::keyPair& key,
+                                             const SecureString& passphrase) {
+    std::lock_guard<std::recursive_mutex> lock(walletLock);
+
+    const bool unlocked = isUnlocked();
+    if(unlocked) {
+        const auto it = keyCache.find(key.pubKey);
+        if(it != keyCache.end()) {
+            return std::string(it->second.begin(), it->second.end());
+        }
+    }
+
+    const std::string privKey = key.privKey->decrypt(passphrase);
+    if(unlocked) {
+        cacheKey(key.pubKey, privKey);
+    }
+
+    return privKey;
+}
+
+void CryptoKernel::Wallet::cacheKey(const std::string& pubKey, const std::string& privKey) {
+    SecureString secret = secureCopy(privKey);
+    keyCache[pubKey].swap(secret);
+}
+
+void CryptoKernel::Wallet::pushEvent(const walletEvent& event) {
+    {
+        std::lock_guard<std::mutex> lock(eventMutex);
+        events.push_back(event);
+    }
+    eventReady.notify_one();
+}
+
+void CryptoKernel::Wallet::blockConnected(const CryptoKernel::Blockchain::block& block) {
+    pushEvent({CHAIN_CHANGED, nullptr});
+}
+
+void CryptoKernel::Wallet::blockDisconnected(const CryptoKernel::Blockchain::block& block) {
+    pushEvent({CHAIN_CHANGED, nullptr});
+}
+
+void CryptoKernel::Wallet::transactionAdded(const CryptoKernel::Blockchain::transaction& tx) {
+    pushEvent({TX_ADDED, std::make_shared<CryptoKernel::Blockchain::transaction>(tx)});
+}
+
+void CryptoKernel::Wallet::transactionRemoved(const CryptoKernel::Blockchain::transaction& tx) {
+    pushEvent({TX_REMOVED, std::make_shared<CryptoKernel::Blockchain::transaction>(tx)});
+}
+
 void CryptoKernel::Wallet::watchFunc() {
-    while(running) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(1000));
-        /*
-            Steps:
-                - Compare sync height and block hash to check for forks
-                - If tip is higher, sync up to tip
-                - Otherwise, if there is a mismatch, rewind to fork block
-        */
+    // Catch up with whatever happened while the wallet was closed, including
+    // the current mempool. From then on only apply what the chain tells us.
+    {
         std::lock_guard<std::recursive_mutex> lock(walletLock);
+        clearUnconfirmed();
+
         std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(walletdb->begin());
         std::unique_ptr<CryptoKernel::Storage::Transaction> bchainTx(blockchain->getTxHandle());
 
-        bool rewind = false;
-        do {
-            rewind = false;
-            const uint64_t height = params->get(dbTx.get(), "height").asUInt64();
-            const std::string tipId = params->get(dbTx.get(), "tipId").asString();
-            if(height > 0) {
+        syncChain(dbTx, bchainTx.get());
+
+        const std::set<CryptoKernel::Blockchain::transaction> unconfirmedTxs = blockchain->getUnconfirmedTransactions();
+        for(const CryptoKernel::Blockchain::transaction& tx : unconfirmedTxs) {
+            digestTx(tx, dbTx.get(), bchainTx.get(), true);
+        }
+
+        bchainTx->abort();
+        dbTx->commit();
+        applyCoinChanges();
+    }
+
+    while(true) {
+        std::deque<walletEvent> pending;
+        bool relock = false;
+        {
+            std::unique_lock<std::mutex> lock(eventMutex);
+            const auto ready = [&]{ return !running || !events.empty() || unlockChanged; };
+
+            // While unlocked, also wake up when the unlock expires
+            if(unlockedUntil != std::chrono::system_clock::time_point()) {
+                eventReady.wait_until(lock, unlockedUntil, ready);
+                relock = unlockedUntil != std::chrono::system_clock::time_point()
+                         && unlockedUntil <= std::chrono::system_clock::now();
+            } else {
+                eventReady.wait(lock, ready);
+            }
+            unlockChanged = false;
+
+            if(!running) {
+                break;
+            }
+            pending.swap(events);
+        }
+
+        std::lock_guard<std::recursive_mutex> lock(walletLock);
+
+        if(relock) {
+            lockWallet();
+            log->printf(LOG_LEVEL_INFO, "Wallet::watchFunc(): Wallet locked");
+        }
+
+        if(pending.empty()) {
+            continue;
+        }
+        std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(walletdb->begin());
+        std::unique_ptr<CryptoKernel::Storage::Transaction> bchainTx(blockchain->getTxHandle());
+
+        // Consecutive block notifications collapse into a single sync
+        bool chainChanged = false;
+        for(const walletEvent& event : pending) {
+            if(event.type == CHAIN_CHANGED) {
+                chainChanged = true;
+                continue;
+            }
+
+            if(chainChanged) {
+                syncChain(dbTx, bchainTx.get());
+                chainChanged = false;
+            }
+
+            const std::string txId = event.tx->getId().toString();
+            const Json::Value txJson = transactions->get(dbTx.get(), txId);
+
+            if(event.type == TX_ADDED) {
+                // The sync may have already seen it confirmed in a later block
+                if(!txJson.isObject() || txJson["unconfirmed"].asBool()) {
+                    digestTx(*event.tx, dbTx.get(), bchainTx.get(), true);
+                }
+            } else if(txJson.isObject() && txJson["unconfirmed"].asBool()) {
+                removeUnconfirmedTx(*event.tx, dbTx.get());
+            }
+        }
+
+        if(chainChanged) {
+            syncChain(dbTx, bchainTx.get());
+        }
+
+        bchainTx->abort();
+        dbTx->commit();
+        applyCoinChanges();
+    }
+}
+
+void CryptoKernel::Wallet::syncChain(std::unique_ptr<CryptoKernel::Storage::Transaction>& dbTx,
+                                     CryptoKernel::Storage::Transaction* bchainTx) {
+    /*
+        Steps:
+            - Compare sync height and block hash to check for forks
+            - If tip is higher, sync up to tip
+            - Otherwise, if there is a mismatch, rewind to fork block
+    */
+    std::lock_guard<std::recursive_mutex> lock(walletLock);
+
+    bool rewind = false;
+    do {
+        rewind = false;
+        const uint64_t height = params->get(dbTx.get(), "height").asUInt64();
+        const std::string tipId = params->get(dbTx.get(), "tipId").asString();
+        if(height > 0) {
+            try {
+                const CryptoKernel::Blockchain::dbBlock syncBlock = blockchain->getBlockByHeightDB(
+                            bchainTx, height);
+                if(syncBlock.getId().toString() != tipId) {
+                    // There was a fork, rewind to fork block
+                    rewind = true;
+                }
+            } catch(const CryptoKernel::Blockchain::NotFoundException& e) {
+                rewind = true;
+            }
+
+            if(rewind) {
                 try {
-                    const CryptoKernel::Blockchain::dbBlock syncBlock = blockchain->getBlockByHeightDB(
-                                bchainTx.get(), height);
-                    if(syncBlock.getId().toString() != tipId) {
-                        // There was a fork, rewind to fork block
-                        rewind = true;
-                    }
+                    rewindBlock(dbTx.get(), bchainTx);
                 } catch(const CryptoKernel::Blockchain::NotFoundException& e) {
-                    rewind = true;
+                    dbTx->abort();
+                    clearDB();
+                    dbTx.reset(walletdb->begin());
                 }
+            }
+        }
+    } while(rewind);
+
+    // Forks resolved, sync to current tip
+    const CryptoKernel::Blockchain::dbBlock tipBlock = blockchain->getBlockDB(bchainTx,
+            "tip");
+    uint64_t height = params->get(dbTx.get(), "height").asUInt64();
+    if(tipBlock.getHeight() > height + rescanThreshold) {
+        rescan(dbTx, bchainTx, tipBlock.getHeight());
+        height = params->get(dbTx.get(), "height").asUInt64();
+    }
+
+    while(height < tipBlock.getHeight()) {
+        const CryptoKernel::Blockchain::block currentBlock = blockchain->getBlockByHeight(
+                    bchainTx, height + 1);
+        digestBlock(dbTx.get(), bchainTx, currentBlock);
+        height = params->get(dbTx.get(), "height").asUInt64();
+    }
+}
+
+std::vector<CryptoKernel::Wallet::scannedBlock> CryptoKernel::Wallet::scanBlocks(
+    CryptoKernel::Storage::Transaction* bchainTx,
+    const std::unordered_map<std::string, std::string>& keyOwners,
+    const uint64_t start, const uint64_t end) {
+    std::vector<scannedBlock> returning;
+
+    for(uint64_t height = start; height < end; height++) {
+        const CryptoKernel::Blockchain::block block = blockchain->getBlockByHeight(bchainTx,
+                height);
+
+        scannedBlock scanned;
+        scanned.id = block.getId().toString();
+        scanned.height = height;
+
+        std::set<CryptoKernel::Blockchain::transaction> txs = block.getTransactions();
+        txs.insert(block.getCoinbaseTx());
 
-                if(rewind) {
-                    try {
-                        rewindBlock(dbTx.get(), bchainTx.get());
-                    } catch(const CryptoKernel::Blockchain::NotFoundException& e) {
-                        dbTx->abort();
-                        clearDB();
-                        dbTx.reset(walletdb->begin());
+        for(const CryptoKernel::Blockchain::transaction& tx : txs) {
+            scannedTx scannedTransaction;
+            scannedTransaction.id = tx.getId().toString();
+            scannedTransaction.timestamp = tx.getTimestamp();
+
+            for(const CryptoKernel::Blockchain::input& inp : tx.getInputs()) {
+                scannedTransaction.spends.push_back(inp.getOutputId().toString());
+            }
+
+            for(const CryptoKernel::Blockchain::output& out : tx.getOutputs()) {
+                const Json::Value data = out.getData();
+                if(data["publicKey"].isString()) {
+                    const auto it = keyOwners.find(data["publicKey"].asString());
+                    if(it != keyOwners.end()) {
+                        scannedTransaction.outputs.push_back({out.getId().toString(),
+                                                              out.getValue(), it->second});
                     }
                 }
             }
-        } while(rewind);
 
-        // Forks resolved, sync to current tip
-        const CryptoKernel::Blockchain::dbBlock tipBlock = blockchain->getBlockDB(bchainTx.get(),
-                "tip");
-        uint64_t height = params->get(dbTx.get(), "height").asUInt64();
-        while(height < tipBlock.getHeight()) {
-            const CryptoKernel::Blockchain::block currentBlock = blockchain->getBlockByHeight(
-                        bchainTx.get(), height + 1);
-            digestBlock(dbTx.get(), bchainTx.get(), currentBlock);
-            height = params->get(dbTx.get(), "height").asUInt64();
+            scanned.txs.push_back(std::move(scannedTransaction));
         }
 
-        // get the unconfirmed transactions
-        const std::set<CryptoKernel::Blockchain::transaction> unconfirmedTxs = blockchain->getUnconfirmedTransactions();
+        returning.push_back(std::move(scanned));
+    }
 
-        // check to see if they are relevant
-        for(const CryptoKernel::Blockchain::transaction& tx : unconfirmedTxs) {
-            digestTx(tx, dbTx.get(), bchainTx.get(), true);
+    return returning;
+}
+
+void CryptoKernel::Wallet::rescan(std::unique_ptr<CryptoKernel::Storage::Transaction>& dbTx,
+                                  CryptoKernel::Storage::Transaction* bchainTx,
+                                  const uint64_t toHeight) {
+    std::lock_guard<std::recursive_mutex> lock(walletLock);
+
+    // Table iterators can't run inside a write transaction so commit what
+    // syncChain has done so far and read the wallet from a snapshot
+    dbTx->commit();
+    applyCoinChanges();
+
+    std::unordered_map<std::string, std::string> keyOwners;
+    std::unordered_map<std::string, scannedOutput> owned;
+    std::unordered_set<std::string> lockedOutputs;
+    {
+        std::unique_ptr<CryptoKernel::Storage::Transaction> snapshotTx(walletdb->beginReadOnly());
+
+        std::unique_ptr<CryptoKernel::Storage::Table::Iterator> it(new
+            CryptoKernel::Storage::Table::Iterator(accounts.get(), walletdb.get(), snapshotTx->snapshot));
+        for(it->SeekToFirst(); it->Valid(); it->Next()) {
+            const Account acc = Account(it->value());
+            for(const auto& key : acc.getKeys()) {
+                keyOwners[key.pubKey] = acc.getName();
+            }
         }
 
-        bchainTx->abort();
+        // The owner of outputs found before the rescan is looked up if they're spent
+        it.reset(new CryptoKernel::Storage::Table::Iterator(utxos.get(), walletdb.get(),
+                 snapshotTx->snapshot));
+        for(it->SeekToFirst(); it->Valid(); it->Next()) {
+            const Txo txo = Txo(it->value());
+            owned[it->key()] = {it->key(), txo.getValue(), ""};
+            if(txo.isSpent()) {
+                lockedOutputs.insert(it->key());
+            }
+        }
+    }
+
+    dbTx.reset(walletdb->begin());
+
+    const uint64_t startHeight = params->get(dbTx.get(), "height").asUInt64() + 1;
+
+    log->printf(LOG_LEVEL_INFO, "Wallet::rescan(): Scanning blocks " + std::to_string(startHeight)
+                + " to " + std::to_string(toHeight) + " for " + std::to_string(keyOwners.size())
+                + " keys");
+
+    CryptoKernel::ThreadPool pool;
+    std::deque<std::future<std::vector<scannedBlock>>> pending;
+    uint64_t nextChunk = startHeight;
+
+    auto queueChunks = [&]() {
+        // Keep every worker busy without reading the whole chain into memory
+        while(pending.size() < pool.size() * 2 && nextChunk <= toHeight) {
+            const uint64_t chunkStart = nextChunk;
+            const uint64_t chunkEnd = std::min(toHeight + 1, chunkStart + rescanChunkSize);
+            pending.push_back(pool.enqueue([this, bchainTx, &keyOwners, chunkStart, chunkEnd]() {
+                return scanBlocks(bchainTx, keyOwners, chunkStart, chunkEnd);
+            }));
+            nextChunk = chunkEnd;
+        }
+    };
+
+    std::map<std::string, int64_t> balanceChanges;
+    std::map<std::string, int64_t> unconfirmedChanges;
+    int64_t totalChange = 0;
+    int64_t lockedChange = 0;
+    int64_t unconfirmedChange = 0;
+    uint64_t sinceCommit = 0;
+
+    auto commitBatch = [&](const scannedBlock& lastBlock) {
+        for(const auto& change : balanceChanges) {
+            Account acc = Account(accounts->get(dbTx.get(), change.first));
+            acc.setBalance(acc.getBalance() + change.second);
+            accounts->put(dbTx.get(), acc.getName(), acc.toJson());
+        }
+        balanceChanges.clear();
+
+        for(const auto& change : unconfirmedChanges) {
+            Account acc = Account(accounts->get(dbTx.get(), change.first));
+            acc.setUnconfirmedBalance(acc.getUnconfirmedBalance() + change.second);
+            accounts->put(dbTx.get(), acc.getName(), acc.toJson());
+        }
+        unconfirmedChanges.clear();
+
+        adjustBalance(dbTx.get(), "balance", totalChange);
+        adjustBalance(dbTx.get(), "lockedBalance", lockedChange);
+        adjustBalance(dbTx.get(), "unconfirmedBalance", unconfirmedChange);
+        totalChange = 0;
+        lockedChange = 0;
+        unconfirmedChange = 0;
+
+        params->put(dbTx.get(), "height", Json::Value(lastBlock.height));
+        params->put(dbTx.get(), "tipId", Json::Value(lastBlock.id));
         dbTx->commit();
+        dbTx.reset(walletdb->begin());
+        sinceCommit = 0;
+
+        const uint64_t total = toHeight - startHeight + 1;
+        const uint64_t done = lastBlock.height - startHeight + 1;
+        log->printf(LOG_LEVEL_INFO, "Wallet::rescan(): Scanned to block "
+                    + std::to_string(lastBlock.height) + " ("
+                    + std::to_string(done * 100 / total) + "%)");
+    };
+
+    queueChunks();
+    while(!pending.empty()) {
+        const std::vector<scannedBlock> blocks = pending.front().get();
+        pending.pop_front();
+        queueChunks();
+
+        // Apply in height order so spends always find the outputs they consume
+        for(const scannedBlock& block : blocks) {
+            for(const scannedTx& tx : block.txs) {
+                bool trackTx = !tx.outputs.empty();
+                uint64_t spent = 0;
+                uint64_t received = 0;
+
+                for(const std::string& spend : tx.spends) {
+                    const auto it = owned.find(spend);
+                    if(it == owned.end()) {
+                        continue;
+                    }
+
+                    trackTx = true;
+                    spent += it->second.value;
+
+                    std::string account = it->second.account;
+                    if(account.empty()) {
+                        const CryptoKernel::Blockchain::output out = blockchain->getOutput(bchainTx,
+                                spend);
+                        const auto owner = keyOwners.find(out.getData()["publicKey"].asString());
+                        if(owner != keyOwners.end()) {
+                            account = owner->second;
+                        }
+                    }
+
+                    if(!account.empty()) {
+                        balanceChanges[account] -= it->second.value;
+                    }
+
+                    totalChange -= it->second.value;
+                    if(lockedOutputs.erase(spend) > 0) {
+                        lockedChange -= it->second.value;
+                    }
+
+                    utxos->erase(dbTx.get(), spend);
+                    owned.erase(it);
+                }
+
+                for(const scannedOutput& out : tx.outputs) {
+                    received += out.value;
+                    balanceChanges[out.account] += out.value;
+                    totalChange += out.value;
+                    utxos->put(dbTx.get(), out.id, Txo(out.id, out.value).toJson());
+                    owned[out.id] = out;
+                }
+
+                if(trackTx) {
+                    // Seen in the mempool first, move its payments to confirmed
+                    const Json::Value existing = transactions->get(dbTx.get(), tx.id);
+                    if(existing.isObject() && existing["unconfirmed"].asBool()) {
+                        for(const scannedOutput& out : tx.outputs) {
+                            unconfirmedChanges[out.account] -= out.value;
+                            unconfirmedChange -= out.value;
+                        }
+                    }
+
+                    recordTx(dbTx.get(), tx.id, false, block.height, tx.timestamp, received,
+                             spent);
+                }
+            }
+
+            sinceCommit++;
+            if(sinceCommit >= rescanBatchSize || block.height == toHeight) {
+                commitBatch(block);
+            }
+        }
     }
+
+    resetCoinIndex();
+
+    log->printf(LOG_LEVEL_INFO, "Wallet::rescan(): Rescan complete");
 }
 
 void CryptoKernel::Wallet::rewindTx(const CryptoKernel::Blockchain::transaction& tx,
@@ -237,16 +818,22 @@ void CryptoKernel::Wallet::rewindTx(const CryptoKernel::Blockchain::transaction&
                      CryptoKernel::Storage::Transaction* bchainTx) {
     const Json::Value txJson = transactions->get(walletTx, tx.getId().toString());
     if(!txJson.isNull()) {
-        transactions->erase(walletTx, tx.getId().toString());
+        forgetTx(walletTx, tx.getId().toString());
 
         for(const CryptoKernel::Blockchain::output& out : tx.getOutputs()) {
             const Json::Value outJson = utxos->get(walletTx, out.getId().toString());
             if(outJson.isObject()) {
                 utxos->erase(walletTx, out.getId().toString());
+                stageUnindexCoin(out.getId().toString());
 
                 Account acc = getAccountByKey(walletTx, out.getData()["publicKey"].asString());
                 acc.setBalance(acc.getBalance() - out.getValue());
                 accounts->put(walletTx, acc.getName(), acc.toJson());
+
+                adjustBalance(walletTx, "balance", -static_cast<int64_t>(out.getValue()));
+                if(Txo(outJson).isSpent()) {
+                    adjustBalance(walletTx, "lockedBalance", -static_cast<int64_t>(out.getValue()));
+                }
             }
         }
 
@@ -264,6 +851,8 @@ void CryptoKernel::Wallet::rewindTx(const CryptoKernel::Blockchain::transaction&
 
                 const Txo newTxo = Txo(out.getId().toString(), out.getValue());
                 utxos->put(walletTx, out.getId().toString(), newTxo.toJson());
+                adjustBalance(walletTx, "balance", out.getValue());
+                stageIndexCoin(out);
             }
         }
     }
@@ -303,7 +892,10 @@ void CryptoKernel::Wallet::rewindBlock(CryptoKernel::Storage::Transaction* walle
 void CryptoKernel::Wallet::clearDB() {
     std::lock_guard<std::recursive_mutex> lock(walletLock);
 
+    resetCoinIndex();
+
     std::set<std::string> transactionIds;
+    std::set<std::string> historyKeys;
     std::set<std::string> utxoIds;
     std::set<std::string> accountNames;
 
@@ -314,90 +906,351 @@ void CryptoKernel::Wallet::clearDB() {
     }
     delete it;
 
-    it = new CryptoKernel::Storage::Table::Iterator(utxos.get(), walletdb.get());
+    it = new CryptoKernel::Storage::Table::Iterator(history.get(), walletdb.get());
+    for(it->SeekToFirst(); it->Valid(); it->Next()) {
+        historyKeys.insert(it->key());
+    }
+    delete it;
+
+    it = new CryptoKernel::Storage::Table::Iterator(utxos.get(), walletdb.get());
+    for(it->SeekToFirst(); it->Valid(); it->Next()) {
+        utxoIds.insert(it->key());
+    }
+    delete it;
+
+    it = new CryptoKernel::Storage::Table::Iterator(accounts.get(), walletdb.get());
+    for(it->SeekToFirst(); it->Valid(); it->Next()) {
+        accountNames.insert(it->key());
+    }
+    delete it;
+
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(walletdb->begin());
+
+    for(const auto& tx : transactionIds) {
+        transactions->erase(dbTx.get(), tx);
+    }
+
+    for(const auto& key : historyKeys) {
+        history->erase(dbTx.get(), key);
+    }
+
+    for(const auto& utxo : utxoIds) {
+        utxos->erase(dbTx.get(), utxo);
+    }
+
+    for(const auto& acc : accountNames) {
+        Account account = Account(accounts->get(dbTx.get(), acc));
+        account.setBalance(0);
+        account.setUnconfirmedBalance(0);
+        accounts->put(dbTx.get(), acc, account.toJson());
+    }
+
+    params->put(dbTx.get(), "height", Json::Value(0));
+    params->put(dbTx.get(), "tipId", Json::Value(""));
+    params->put(dbTx.get(), "balance", Json::Value(0));
+    params->put(dbTx.get(), "lockedBalance", Json::Value(0));
+    params->put(dbTx.get(), "unconfirmedBalance", Json::Value(0));
+
+    dbTx->commit();
+}
+
+
+void CryptoKernel::Wallet::digestTx(const CryptoKernel::Blockchain::transaction& tx,
+                 CryptoKernel::Storage::Transaction* walletTx,
+                 CryptoKernel::Storage::Transaction* bchainTx,
+                 const bool unconfirmed,
+                 const uint64_t height) {
+    const std::string txId = tx.getId().toString();
+    const Json::Value existing = transactions->get(walletTx, txId);
+
+    if(unconfirmed) {
+        // Already counted, or already confirmed
+        if(existing.isObject()) {
+            return;
+        }
+
+        const std::map<std::string, uint64_t> received = getReceived(walletTx, tx);
+
+        bool trackTx = !received.empty();
+        uint64_t receivedTotal = 0;
+        for(const auto& payment : received) {
+            Account acc = Account(accounts->get(walletTx, payment.first));
+            acc.setUnconfirmedBalance(acc.getUnconfirmedBalance() + payment.second);
+            accounts->put(walletTx, acc.getName(), acc.toJson());
+            adjustBalance(walletTx, "unconfirmedBalance", payment.second);
+            receivedTotal += payment.second;
+        }
+
+        uint64_t spent = 0;
+        for(const CryptoKernel::Blockchain::input& inp : tx.getInputs()) {
+            const std::string outputId = inp.getOutputId().toString();
+            const Json::Value txoJson = utxos->get(walletTx, outputId);
+            if(txoJson.isObject()) {
+                trackTx = true;
+                Txo txo = Txo(txoJson);
+                spent += txo.getValue();
+
+                // Not one of our sends, or one from before a restart, keep
+                // its inputs locked until it confirms or leaves the mempool
+                if(!txo.isSpent()) {
+                    txo.spend();
+                    utxos->put(walletTx, outputId, txo.toJson());
+                    adjustBalance(walletTx, "lockedBalance", txo.getValue());
+                    stageUnindexCoin(outputId);
+                }
+            }
+        }
+
+        if(trackTx) {
+            recordTx(walletTx, txId, true, 0, tx.getTimestamp(), receivedTotal, spent);
+        }
+
+        return;
+    }
+
+    // Move anything we counted while it was in the mempool over to confirmed
+    if(existing.isObject() && existing["unconfirmed"].asBool()) {
+        for(const auto& payment : getReceived(walletTx, tx)) {
+            Account acc = Account(accounts->get(walletTx, payment.first));
+            acc.setUnconfirmedBalance(acc.getUnconfirmedBalance() - payment.second);
+            accounts->put(walletTx, acc.getName(), acc.toJson());
+            adjustBalance(walletTx, "unconfirmedBalance", -static_cast<int64_t>(payment.second));
+        }
+    }
+
+    bool trackTx = false;
+    uint64_t spent = 0;
+    uint64_t received = 0;
+
+    for(const CryptoKernel::Blockchain::input& inp : tx.getInputs()) {
+        const Json::Value txo = utxos->get(walletTx, inp.getOutputId().toString());
+        if(txo.isObject()) {
+            trackTx = true;
+            spent += Txo(txo).getValue();
+            utxos->erase(walletTx, inp.getOutputId().toString());
+            stageUnindexCoin(inp.getOutputId().toString());
+
+            const CryptoKernel::Blockchain::output out = blockchain->getOutput(bchainTx,
+                    inp.getOutputId().toString());
+            Account acc = getAccountByKey(walletTx, out.getData()["publicKey"].asString());
+            acc.setBalance(acc.getBalance() - out.getValue());
+            accounts->put(walletTx, acc.getName(), acc.toJson());
+
+            adjustBalance(walletTx, "balance", -static_cast<int64_t>(out.getValue()));
+            if(Txo(txo).isSpent()) {
+                adjustBalance(walletTx, "lockedBalance", -static_cast<int64_t>(out.getValue()));
+            }
+        }
+    }
+
+    for(const CryptoKernel::Blockchain::output& out : tx.getOutputs()) {
+        // Check if there is a publicKey that belongs to you
+        if(out.getData()["publicKey"].isString()) {
+            try {
+                Account acc = getAccountByKey(walletTx, out.getData()["publicKey"].asString());
+                acc.setBalance(acc.getBalance() + out.getValue());
+                accounts->put(walletTx, acc.getName(), acc.toJson());
+            } catch(const WalletException& e) {
+                continue;
+            }
+
+            trackTx = true;
+            received += out.getValue();
+
+            const Txo newTxo = Txo(out.getId().toString(), out.getValue());
+            utxos->put(walletTx, out.getId().toString(), newTxo.toJson());
+            adjustBalance(walletTx, "balance", out.getValue());
+            stageIndexCoin(out);
+        }
+    }
+
+    if(trackTx) {
+        recordTx(walletTx, txId, false, height, tx.getTimestamp(), received, spent);
+    }
+}
+
+void CryptoKernel::Wallet::removeUnconfirmedTx(const CryptoKernel::Blockchain::transaction& tx,
+                                               CryptoKernel::Storage::Transaction* walletTx) {
+    for(const auto& payment : getReceived(walletTx, tx)) {
+        Account acc = Account(accounts->get(walletTx, payment.first));
+        acc.setUnconfirmedBalance(acc.getUnconfirmedBalance() - payment.second);
+        accounts->put(walletTx, acc.getName(), acc.toJson());
+        adjustBalance(walletTx, "unconfirmedBalance", -static_cast<int64_t>(payment.second));
+    }
+
+    // If it was one of our sends, its inputs are spendable again
+    for(const CryptoKernel::Blockchain::input& inp : tx.getInputs()) {
+        const std::string outputId = inp.getOutputId().toString();
+        const Json::Value txoJson = utxos->get(walletTx, outputId);
+        if(txoJson.isObject()) {
+            const Txo txo = Txo(txoJson);
+            if(txo.isSpent()) {
+                utxos->put(walletTx, outputId, Txo(outputId, txo.getValue()).toJson());
+                adjustBalance(walletTx, "lockedBalance", -static_cast<int64_t>(txo.getValue()));
+                // Rare, so reload rather than fetch the output here
+                resetCoinIndex();
+            }
+        }
+    }
+
+    forgetTx(walletTx, tx.getId().toString());
+}
+
+void CryptoKernel::Wallet::clearUnconfirmed() {
+    std::lock_guard<std::recursive_mutex> lock(walletLock);
+
+    std::set<std::string> unconfirmedIds;
+    std::set<std::string> accountNames;
+    std::map<std::string, uint64_t> lockedTxos;
+
+    std::unique_ptr<CryptoKernel::Storage::Table::Iterator> it(new
+        CryptoKernel::Storage::Table::Iterator(transactions.get(), walletdb.get()));
+    for(it->SeekToFirst(); it->Valid(); it->Next()) {
+        if(it->value()["unconfirmed"].asBool()) {
+            unconfirmedIds.insert(it->key());
+        }
+    }
+
+    it.reset(new CryptoKernel::Storage::Table::Iterator(accounts.get(), walletdb.get()));
     for(it->SeekToFirst(); it->Valid(); it->Next()) {
-        utxoIds.insert(it->key());
+        accountNames.insert(it->key());
     }
-    delete it;
 
-    it = new CryptoKernel::Storage::Table::Iterator(accounts.get(), walletdb.get());
+    // Confirmed spends remove our outputs, so every output still marked spent
+    // was locked by one of the transactions being dropped
+    it.reset(new CryptoKernel::Storage::Table::Iterator(utxos.get(), walletdb.get()));
     for(it->SeekToFirst(); it->Valid(); it->Next()) {
-        accountNames.insert(it->key());
+        const Txo txo = Txo(it->value());
+        if(txo.isSpent()) {
+            lockedTxos[it->key()] = txo.getValue();
+        }
     }
-    delete it;
+    it.reset();
 
     std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(walletdb->begin());
 
-    for(const auto& tx : transactionIds) {
-        transactions->erase(dbTx.get(), tx);
+    for(const auto& txId : unconfirmedIds) {
+        forgetTx(dbTx.get(), txId);
     }
 
-    for(const auto& utxo : utxoIds) {
-        utxos->erase(dbTx.get(), utxo);
+    for(const auto& name : accountNames) {
+        Account acc = Account(accounts->get(dbTx.get(), name));
+        if(acc.getUnconfirmedBalance() > 0) {
+            acc.setUnconfirmedBalance(0);
+            accounts->put(dbTx.get(), name, acc.toJson());
+        }
     }
 
-    for(const auto& acc : accountNames) {
-        Account account = Account(accounts->get(dbTx.get(), acc));
-        account.setBalance(0);
-        accounts->put(dbTx.get(), acc, account.toJson());
+    params->put(dbTx.get(), "unconfirmedBalance", Json::Value(0));
+
+    for(const auto& txo : lockedTxos) {
+        utxos->put(dbTx.get(), txo.first, Txo(txo.first, txo.second).toJson());
     }
 
-    params->put(dbTx.get(), "height", Json::Value(0));
-    params->put(dbTx.get(), "tipId", Json::Value(""));
+    params->put(dbTx.get(), "lockedBalance", Json::Value(0));
 
     dbTx->commit();
+
+    if(!lockedTxos.empty()) {
+        resetCoinIndex();
+    }
 }
 
+std::string CryptoKernel::Wallet::historyKey(const bool unconfirmed, const uint64_t height,
+                                             const std::string& txId) {
+    // Newest first: unconfirmed, then by descending height
+    const uint64_t order = unconfirmed ? 0 : std::numeric_limits<uint64_t>::max() - height;
 
-void CryptoKernel::Wallet::digestTx(const CryptoKernel::Blockchain::transaction& tx,
-                 CryptoKernel::Storage::Transaction* walletTx,
-                 CryptoKernel::Storage::Transaction* bchainTx,
-                 const bool unconfirmed) {
-    bool trackTx = false;
+    std::stringstream buffer;
+    buffer << std::setw(20) << std::setfill('0') << order << "_" << txId;
+    return buffer.str();
+}
 
-    for(const CryptoKernel::Blockchain::input& inp : tx.getInputs()) {
-        const Json::Value txo = utxos->get(walletTx, inp.getOutputId().toString());
-        if(txo.isObject()) {
-            trackTx = true;
-            if(!unconfirmed) {
-                utxos->erase(walletTx, inp.getOutputId().toString());
+void CryptoKernel::Wallet::recordTx(CryptoKernel::Storage::Transaction* walletTx,
+                                    const std::string& txId, const bool unconfirmed,
+                                    const uint64_t height, const uint64_t timestamp,
+                                    const uint64_t received, const uint64_t spent) {
+    const Json::Value existing = transactions->get(walletTx, txId);
+    if(existing["history"].isString()) {
+        history->erase(walletTx, existing["history"].asString());
+    }
 
-                const CryptoKernel::Blockchain::output out = blockchain->getOutput(bchainTx,
-                        inp.getOutputId().toString());
-                Account acc = getAccountByKey(walletTx, out.getData()["publicKey"].asString());
-                acc.setBalance(acc.getBalance() - out.getValue());
-                accounts->put(walletTx, acc.getName(), acc.toJson());
-            }
+    const std::string key = historyKey(unconfirmed, height, txId);
+
+    Json::Value summary;
+    summary["id"] = txId;
+    summary["unconfirmed"] = unconfirmed;
+    if(!unconfirmed) {
+        summary["height"] = static_cast<Json::UInt64>(height);
+    }
+    summary["timestamp"] = static_cast<Json::UInt64>(timestamp);
+    summary["received"] = static_cast<Json::UInt64>(received);
+    summary["spent"] = static_cast<Json::UInt64>(spent);
+    history->put(walletTx, key, summary);
+
+    Json::Value txJson;
+    txJson["unconfirmed"] = unconfirmed;
+    txJson["history"] = key;
+    transactions->put(walletTx, txId, txJson);
+}
+
+void CryptoKernel::Wallet::forgetTx(CryptoKernel::Storage::Transaction* walletTx,
+                                    const std::string& txId) {
+    const Json::Value existing = transactions->get(walletTx, txId);
+    if(existing["history"].isString()) {
+        history->erase(walletTx, existing["history"].asString());
+    }
+
+    transactions->erase(walletTx, txId);
+}
+
+Json::Value CryptoKernel::Wallet::listHistory(const uint64_t limit, const std::string& after) {
+    Json::Value returning = Json::Value(Json::arrayValue);
+
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(walletdb->beginReadOnly());
+    std::unique_ptr<CryptoKernel::Storage::Table::Iterator> it(new
+        CryptoKernel::Storage::Table::Iterator(history.get(), walletdb.get(), dbTx->snapshot));
+
+    if(after.empty()) {
+        it->SeekToFirst();
+    } else {
+        it->Seek(after);
+        if(it->Valid() && it->key() == after) {
+            it->Next();
         }
     }
 
-    for(const CryptoKernel::Blockchain::output& out : tx.getOutputs()) {
-        // Check if there is a publicKey that belongs to you
-        if(out.getData()["publicKey"].isString()) {
-            try {
-                Account acc = getAccountByKey(walletTx, out.getData()["publicKey"].asString());
-                if(!unconfirmed) {
-                    acc.setBalance(acc.getBalance() + out.getValue());
-                    accounts->put(walletTx, acc.getName(), acc.toJson());
-                }
-            } catch(const WalletException& e) {
-                continue;
-            }
+    for(; it->Valid() && returning.size() < limit; it->Next()) {
+        Json::Value summary = it->value();
+        summary["cursor"] = it->key();
+        returning.append(summary);
+    }
 
-            trackTx = true;
-        
-            if(!unconfirmed) {
-                const Txo newTxo = Txo(out.getId().toString(), out.getValue());
-                utxos->put(walletTx, out.getId().toString(), newTxo.toJson());
+    return returning;
+}
+
+std::map<std::string, uint64_t> CryptoKernel::Wallet::getReceived(
+    CryptoKernel::Storage::Transaction* walletTx,
+    const CryptoKernel::Blockchain::transaction& tx) {
+    std::map<std::string, uint64_t> returning;
+
+    for(const CryptoKernel::Blockchain::output& out : tx.getOutputs()) {
+        const Json::Value data = out.getData();
+        if(data["publicKey"].isString()) {
+            const Json::Value accName = accounts->get(walletTx, data["publicKey"].asString(), 0);
+            if(accName.isString()) {
+                returning[accName.asString()] += out.getValue();
             }
         }
     }
 
-    if(trackTx) {
-        Json::Value txJson;
-        txJson["unconfirmed"] = unconfirmed;
-        transactions->put(walletTx, tx.getId().toString(), txJson);
-    }
+    return returning;
+}
+
+void CryptoKernel::Wallet::adjustBalance(CryptoKernel::Storage::Transaction* walletTx,
+                                         const std::string& name, const int64_t delta) {
+    const uint64_t current = params->get(walletTx, name).asUInt64();
+    params->put(walletTx, name, Json::Value(static_cast<Json::UInt64>(current + delta)));
 }
 
 void CryptoKernel::Wallet::digestBlock(CryptoKernel::Storage::Transaction* walletTx,
@@ -417,7 +1270,7 @@ void CryptoKernel::Wallet::digestBlock(CryptoKernel::Storage::Transaction* walle
     txs.insert(block.getCoinbaseTx());
 
     for(const CryptoKernel::Blockchain::transaction& tx : txs) {
-        digestTx(tx, walletTx, bchainTx);
+        digestTx(tx, walletTx, bchainTx, false, block.getHeight());
     }
 
     params->put(walletTx, "height",
@@ -425,9 +1278,10 @@ void CryptoKernel::Wallet::digestBlock(CryptoKernel::Storage::Transaction* walle
     params->put(walletTx, "tipId", Json::Value(block.getId().toString()));
 }
 
-CryptoKernel::Wallet::Account::Account(const std::string& name, const std::string& password) {
+CryptoKernel::Wallet::Account::Account(const std::string& name, const SecureString& password) {
     this->name = name;
     balance = 0;
+    unconfirmedBalance = 0;
 
     const keyPair newKey = newAddress(password);
     keys.insert(newKey);
@@ -438,6 +1292,7 @@ Json::Value CryptoKernel::Wallet::Account::toJson() const {
 
     returning["name"] = name;
     returning["balance"] = balance;
+    returning["unconfirmedBalance"] = unconfirmedBalance;
 
     for(const keyPair& key : keys) {
         Json::Value jsonKeyPair;
@@ -452,6 +1307,7 @@ Json::Value CryptoKernel::Wallet::Account::toJson() const {
 CryptoKernel::Wallet::Account::Account(const Json::Value& accountJson) {
     name = accountJson["name"].asString();
     balance = accountJson["balance"].asUInt64();
+    unconfirmedBalance = accountJson["unconfirmedBalance"].asUInt64();
 
     for(const Json::Value& key : accountJson["keys"]) {
         keyPair newKeys;
@@ -469,6 +1325,14 @@ void CryptoKernel::Wallet::Account::setBalance(const uint64_t newBalance) {
     balance = newBalance;
 }
 
+uint64_t CryptoKernel::Wallet::Account::getUnconfirmedBalance() const {
+    return unconfirmedBalance;
+}
+
+void CryptoKernel::Wallet::Account::setUnconfirmedBalance(const uint64_t newBalance) {
+    unconfirmedBalance = newBalance;
+}
+
 void CryptoKernel::Wallet::Account::addKeyPair(const keyPair& kp) {
     keys.insert(kp);
 }
@@ -483,7 +1347,7 @@ const {
 }
 
 CryptoKernel::Wallet::Account::keyPair
-CryptoKernel::Wallet::Account::newAddress(const std::string& password) {
+CryptoKernel::Wallet::Account::newAddress(const SecureString& password) {
     CryptoKernel::Crypto crypto(true);
 
     keyPair newKey;
@@ -572,11 +1436,24 @@ CryptoKernel::Wallet::Account CryptoKernel::Wallet::newAccount(const std::string
     try {
         getAccountByName(name);
     } catch(const WalletException& e) {
-        if(!checkPassword(password)) {
+        const SecureString passphrase = authorize(password);
+        if(passphrase.empty()) {
             throw WalletException("Incorrect wallet password");
         }
 
-        const Account acc = Account(name, password);
+        return createAccount(name, passphrase);
+    }
+
+    throw WalletException("Account already exists");
+}
+
+CryptoKernel::Wallet::Account CryptoKernel::Wallet::createAccount(const std::string& name,
+        const SecureString& passphrase) {
+    std::lock_guard<std::recursive_mutex> lock(walletLock);
+    try {
+        getAccountByName(name);
+    } catch(const WalletException& e) {
+        const Account acc = Account(name, passphrase);
         std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(walletdb->begin());
         accounts->put(dbTx.get(), name, acc.toJson());
         accounts->put(dbTx.get(), (*acc.getKeys().begin()).pubKey, name, 0);
@@ -587,112 +1464,406 @@ CryptoKernel::Wallet::Account CryptoKernel::Wallet::newAccount(const std::string
     throw WalletException("Account already exists");
 }
 
-std::string CryptoKernel::Wallet::sendToAddress(const std::string& pubKey,
-        const uint64_t amount, const std::string& password) {
+namespace {
+uint64_t inputFee(const CryptoKernel::Blockchain::output& out) {
+    return CryptoKernel::Storage::toString(out.getData()).size() * inputFeeRate;
+}
+}
+
+void CryptoKernel::Wallet::loadCoinIndex() {
     std::lock_guard<std::recursive_mutex> lock(walletLock);
+
+    resetCoinIndex();
+    coinIndexLoaded = true;
+
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(walletdb->beginReadOnly());
     std::unique_ptr<CryptoKernel::Storage::Transaction> bchainTx(blockchain->getTxHandle());
 
-    if(!checkPassword(password)) {
-        return "Incorrect wallet password";
+    std::unique_ptr<CryptoKernel::Storage::Table::Iterator> it(new
+        CryptoKernel::Storage::Table::Iterator(utxos.get(), walletdb.get(), dbTx->snapshot));
+    for(it->SeekToFirst(); it->Valid(); it->Next()) {
+        if(Txo(it->value()).isSpent()) {
+            continue;
+        }
+
+        try {
+            const CryptoKernel::Blockchain::output out = blockchain->getOutput(bchainTx.get(),
+                    it->key());
+            indexCoin(out);
+        } catch(const CryptoKernel::Blockchain::NotFoundException& e) {
+            continue;
+        }
     }
+    it.reset();
 
-    if(getTotalBalance() * 100000000 < amount) {
-        return "Insufficient funds";
+    bchainTx->abort();
+}
+
+void CryptoKernel::Wallet::resetCoinIndex() {
+    std::lock_guard<std::recursive_mutex> lock(walletLock);
+    coinIndex.clear();
+    coinsByValue.clear();
+    coinChanges.clear();
+    coinIndexLoaded = false;
+}
+
+void CryptoKernel::Wallet::indexCoin(const CryptoKernel::Blockchain::output& out) {
+    if(!coinIndexLoaded || !out.getData()["contract"].isNull()) {
+        return;
     }
 
-    CryptoKernel::Crypto crypto;
-    if(!crypto.setPublicKey(pubKey)) {
-        return "Invalid address";
+    // Outputs worth less than the fee to spend them are never selected
+    const uint64_t fee = inputFee(out);
+    if(out.getValue() <= fee) {
+        return;
     }
 
-    std::set<CryptoKernel::Blockchain::output> toSpend;
-    uint64_t accumulator = 0;
-    uint64_t fee = 15000;
+    const std::string id = out.getId().toString();
+    if(coinIndex.emplace(id, out).second) {
+        coinsByValue.insert(std::make_pair(out.getValue() - fee, id));
+    }
+}
 
-    CryptoKernel::Storage::Table::Iterator* it = new CryptoKernel::Storage::Table::Iterator(
-        utxos.get(), walletdb.get());
-    for(it->SeekToFirst(); it->Valid(); it->Next()) {
-        const Txo out = Txo(it->value());
-        if(accumulator < amount + fee) {
-            if(!out.isSpent()) {
-                try {
-                    const CryptoKernel::Blockchain::output fullOut = blockchain->getOutput(bchainTx.get(),
-                            it->key());
-                    if(fullOut.getData()["contract"].isNull()) {
-                        fee += CryptoKernel::Storage::toString(fullOut.getData()).size() * 60;
-                        toSpend.insert(fullOut);
-                        accumulator += fullOut.getValue();
-                    }
-                } catch(const CryptoKernel::Blockchain::NotFoundException& e) {
-                    continue;
+void CryptoKernel::Wallet::unindexCoin(const std::string& id) {
+    const auto it = coinIndex.find(id);
+    if(it == coinIndex.end()) {
+        return;
+    }
+
+    coinsByValue.erase(std::make_pair(it->second.getValue() - inputFee(it->second), id));
+    coinIndex.erase(it);
+}
+
+void CryptoKernel::Wallet::stageIndexCoin(const CryptoKernel::Blockchain::output& out) {
+    // Nothing to keep up to date, the next load reads the committed utxos
+    if(!coinIndexLoaded) {
+        return;
+    }
+
+    coinChanges.push_back({out.getId().toString(),
+                           std::make_shared<CryptoKernel::Blockchain::output>(out)});
+}
+
+void CryptoKernel::Wallet::stageUnindexCoin(const std::string& id) {
+    if(!coinIndexLoaded) {
+        return;
+    }
+
+    coinChanges.push_back({id, nullptr});
+}
+
+void CryptoKernel::Wallet::applyCoinChanges() {
+    for(const coinChange& change : coinChanges) {
+        if(change.out) {
+            indexCoin(*change.out);
+        } else {
+            unindexCoin(change.id);
+        }
+    }
+    coinChanges.clear();
+}
+
+bool CryptoKernel::Wallet::selectCoins(const uint64_t amount, const uint64_t outputFee,
+                                       coinSelection& selection) {
+    std::lock_guard<std::recursive_mutex> lock(walletLock);
+
+    if(!coinIndexLoaded) {
+        loadCoinIndex();
+    }
+
+    // Work in values net of each input's own fee so that any set whose
+    // total reaches the target pays for itself
+    const uint64_t target = amount + baseFee + outputFee;
+
+    std::vector<std::pair<uint64_t, std::string>> coins(coinsByValue.rbegin(),
+            coinsByValue.rend());
+
+    std::vector<uint64_t> fees;
+    uint64_t available = 0;
+    selection.fee = baseFee + outputFee;
+    for(const auto& coin : coins) {
+        fees.push_back(inputFee(coinIndex.at(coin.second)));
+        available += coin.first;
+        selection.fee += fees.back();
+    }
+
+    // Report the fee of spending everything
+    if(available < target) {
+        return false;
+    }
+
+    auto finish = [&](const std::vector<size_t>& chosen, const uint64_t total) {
+        selection.inputs.clear();
+        selection.fee = baseFee + outputFee;
+        for(const size_t i : chosen) {
+            selection.inputs.push_back(coinIndex.at(coins[i].second));
+            selection.fee += fees[i];
+        }
+
+        const uint64_t excess = total - target;
+        selection.change = excess > changeWindow;
+        if(!selection.change) {
+            selection.fee += excess;
+        }
+    };
+
+    /* Branch and bound over the coins, largest first, looking for a set
+       that lands within changeWindow of the target so no change output is
+       needed. Of those, keep the one that costs the least in fees. */
+    {
+        std::vector<uint64_t> remaining(coins.size() + 1, 0);
+        for(size_t i = coins.size(); i > 0; i--) {
+            remaining[i - 1] = remaining[i] + coins[i - 1].first;
+        }
+
+        std::vector<size_t> current;
+        std::vector<size_t> best;
+        uint64_t currentValue = 0;
+        uint64_t bestCost = std::numeric_limits<uint64_t>::max();
+        uint64_t bestValue = 0;
+        size_t next = 0;
+
+        for(uint64_t tries = 0; tries < coinSelectionTries; tries++) {
+            bool backtrack = false;
+
+            if(currentValue > target + changeWindow
+                    || currentValue + remaining[next] < target) {
+                backtrack = true;
+            } else if(currentValue >= target) {
+                uint64_t cost = currentValue - target;
+                for(const size_t i : current) {
+                    cost += fees[i];
+                }
+
+                if(cost < bestCost || (cost == bestCost && current.size() < best.size())) {
+                    bestCost = cost;
+                    best = current;
+                    bestValue = currentValue;
                 }
+
+                backtrack = true;
+            } else if(next >= coins.size()) {
+                backtrack = true;
             }
-        } else {
-            break;
+
+            if(backtrack) {
+                if(current.empty()) {
+                    break;
+                }
+
+                // Drop the last coin taken and try the branch without it
+                const size_t last = current.back();
+                current.pop_back();
+                currentValue -= coins[last].first;
+                next = last + 1;
+            } else {
+                current.push_back(next);
+                currentValue += coins[next].first;
+                next++;
+            }
+        }
+
+        if(!best.empty()) {
+            finish(best, bestValue);
+            return true;
         }
     }
-    delete it;
 
-    if(accumulator < amount + fee) {
-        return "Insufficient funds when " + std::to_string(fee / 100000000.0) +
-               " fee is included";
+    /* No exact match, so pay for change. Take the smallest coin that covers
+       what is still owed if there is one, otherwise the largest, which
+       gives the fewest inputs without spending bigger coins than needed. */
+    std::set<std::pair<uint64_t, size_t>> unused;
+    for(size_t i = 0; i < coins.size(); i++) {
+        unused.insert(std::make_pair(coins[i].first, i));
+    }
+
+    std::vector<size_t> chosen;
+    uint64_t total = 0;
+    while(total < target && !unused.empty()) {
+        auto it = unused.lower_bound(std::make_pair(target - total, size_t(0)));
+        if(it == unused.end()) {
+            it = std::prev(unused.end());
+        }
+
+        chosen.push_back(it->second);
+        total += it->first;
+        unused.erase(it);
+    }
+
+    finish(chosen, total);
+    return true;
+}
+
+std::string CryptoKernel::Wallet::sendToAddress(const std::string& pubKey,
+        const uint64_t amount, const std::string& password) {
+    std::map<std::string, uint64_t> recipients;
+    recipients[pubKey] = amount;
+    return sendMany(recipients, password);
+}
+
+std::string CryptoKernel::Wallet::sendMany(const std::map<std::string, uint64_t>& recipients,
+        const std::string& password) {
+    std::lock_guard<std::recursive_mutex> lock(walletLock);
+
+    const SecureString passphrase = authorize(password);
+    if(passphrase.empty()) {
+        return "Incorrect wallet password";
+    }
+
+    if(recipients.empty()) {
+        return "No recipients";
+    }
+
+    uint64_t amount = 0;
+    for(const auto& recipient : recipients) {
+        if(recipient.second == 0
+                || amount > std::numeric_limits<uint64_t>::max() - recipient.second) {
+            return "Invalid amount";
+        }
+        amount += recipient.second;
+    }
+
+    if(getTotalBalance() < amount) {
+        return "Insufficient funds";
     }
 
     std::uniform_int_distribution<uint64_t> distribution(0,
             std::numeric_limits<uint64_t>::max());
-    Json::Value data;
-    data["publicKey"] = pubKey;
 
-    const CryptoKernel::Blockchain::output toThem = CryptoKernel::Blockchain::output(amount,
-            distribution(generator), data);
+    std::set<CryptoKernel::Blockchain::output> outputs;
+    uint64_t outputFee = 0;
+    uint64_t outputBytes = 0;
 
-    std::stringstream buffer;
-    buffer << distribution(generator) << "_change";
-    const Account account = newAccount(buffer.str(), password);
+    CryptoKernel::Crypto crypto;
+    for(const auto& recipient : recipients) {
+        if(!crypto.setPublicKey(recipient.first)) {
+            return "Invalid address " + recipient.first;
+        }
 
-    data.clear();
-    data["publicKey"] = (*(account.getKeys().begin())).pubKey;
+        Json::Value data;
+        data["publicKey"] = recipient.first;
 
-    const CryptoKernel::Blockchain::output change = CryptoKernel::Blockchain::output(
-                accumulator - amount - fee, distribution(generator), data);
+        const CryptoKernel::Blockchain::output toThem = CryptoKernel::Blockchain::output(
+                    recipient.second, distribution(generator), data);
 
-    std::set<CryptoKernel::Blockchain::output> outputs;
-    outputs.insert(change);
-    outputs.insert(toThem);
+        const uint64_t dataSize = CryptoKernel::Storage::toString(data).size();
+        outputBytes += dataSize;
+
+        // The base fee covers a single payment and its change
+        if(!outputs.empty()) {
+            outputFee += dataSize * inputFeeRate;
+        }
+
+        outputs.insert(toThem);
+    }
+
+    if(outputBytes > maxSendSize) {
+        return "Transaction too large, split the payment into smaller batches";
+    }
+
+    coinSelection selection;
+    if(!selectCoins(amount, outputFee, selection)) {
+        return "Insufficient funds when " + std::to_string(selection.fee / 100000000.0) +
+               " fee is included";
+    }
+
+    if(selection.change) {
+        uint64_t accumulator = 0;
+        for(const CryptoKernel::Blockchain::output& out : selection.inputs) {
+            accumulator += out.getValue();
+        }
+
+        std::stringstream buffer;
+        buffer << distribution(generator) << "_change";
+        const Account account = createAccount(buffer.str(), passphrase);
+
+        Json::Value data;
+        data["publicKey"] = (*(account.getKeys().begin())).pubKey;
+
+        const CryptoKernel::Blockchain::output change = CryptoKernel::Blockchain::output(
+                    accumulator - amount - selection.fee, distribution(generator), data);
+        outputs.insert(change);
+    }
 
     const std::string outputHash = CryptoKernel::Blockchain::transaction::getOutputSetId(
                                        outputs).toString();
 
-    std::set<CryptoKernel::Blockchain::input> spends;
-
     std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(walletdb->begin());
 
-    for(const CryptoKernel::Blockchain::output& out : toSpend) {
+    // Find the key for each input up front, then decrypt the keys and sign
+    // in parallel as key derivation dominates the cost of a send. Keys
+    // cached by an unlock skip the derivation entirely.
+    const bool unlocked = isUnlocked();
+    std::map<std::string, std::string> privKeys;
+    std::map<std::string, std::shared_ptr<AES256>> encryptedKeys;
+    for(const CryptoKernel::Blockchain::output& out : selection.inputs) {
         const std::string publicKey = out.getData()["publicKey"].asString();
-        Account acc = getAccountByKey(dbTx.get(), publicKey);
+        if(encryptedKeys.find(publicKey) != encryptedKeys.end()
+                || privKeys.find(publicKey) != privKeys.end()) {
+            continue;
+        }
 
-        std::string privKey = "";
+        if(unlocked) {
+            const auto cached = keyCache.find(publicKey);
+            if(cached != keyCache.end()) {
+                privKeys[publicKey] = std::string(cached->second.begin(), cached->second.end());
+                continue;
+            }
+        }
 
+        const Account acc = getAccountByKey(dbTx.get(), publicKey);
         for(const auto& key : acc.getKeys()) {
             if(key.pubKey == publicKey) {
-                privKey = key.privKey->decrypt(password);
+                encryptedKeys[publicKey] = key.privKey;
                 break;
             }
         }
+    }
+
+    std::set<CryptoKernel::Blockchain::input> spends;
+    {
+        CryptoKernel::ThreadPool pool(std::min<size_t>(std::thread::hardware_concurrency(),
+                                      selection.inputs.size()));
+
+        std::vector<std::pair<std::string, std::future<std::string>>> decrypting;
+        for(const auto& key : encryptedKeys) {
+            const std::shared_ptr<AES256> privKey = key.second;
+            decrypting.push_back(std::make_pair(key.first, pool.enqueue([privKey, &passphrase]() {
+                return privKey->decrypt(passphrase);
+            })));
+        }
+
+        for(auto& key : decrypting) {
+            privKeys[key.first] = key.second.get();
+            if(unlocked) {
+                cacheKey(key.first, privKeys[key.first]);
+            }
+        }
 
-        crypto.setPrivateKey(privKey);
+        std::vector<std::future<CryptoKernel::Blockchain::input>> signing;
+        for(const CryptoKernel::Blockchain::output& out : selection.inputs) {
+            const std::string& privKey = privKeys.at(out.getData()["publicKey"].asString());
+            signing.push_back(pool.enqueue([&out, &privKey, &outputHash]() {
+                CryptoKernel::Crypto signer;
+                signer.setPrivateKey(privKey);
 
-        const std::string signature = crypto.sign(out.getId().toString() + outputHash);
-        Json::Value spendData;
-        spendData["signature"] = signature;
+                Json::Value spendData;
+                spendData["signature"] = signer.sign(out.getId().toString() + outputHash);
 
-        const CryptoKernel::Blockchain::input inp = CryptoKernel::Blockchain::input(out.getId(),
-                spendData);
-        spends.insert(inp);
+                return CryptoKernel::Blockchain::input(out.getId(), spendData);
+            }));
+        }
+
+        for(auto& inp : signing) {
+            spends.insert(inp.get());
+        }
+    }
 
+    for(const CryptoKernel::Blockchain::output& out : selection.inputs) {
         Txo utxo = Txo(utxos->get(dbTx.get(), out.getId().toString()));
         utxo.spend();
         utxos->put(dbTx.get(), out.getId().toString(), utxo.toJson());
+        adjustBalance(dbTx.get(), "lockedBalance", utxo.getValue());
     }
 
     const time_t t = std::time(0);
@@ -701,7 +1872,9 @@ std::string CryptoKernel::Wallet::sendToAddress(const std::string& pubKey,
     const CryptoKernel::Blockchain::transaction tx = CryptoKernel::Blockchain::transaction(
                 spends, outputs, now);
 
-    bchainTx->abort();
+    if(tx.size() > maxSendSize) {
+        return "Transaction too large, split the payment into smaller batches";
+    }
 
     if(!std::get<0>(blockchain->submitTransaction(tx))) {
         return "Error submitting transaction";
@@ -709,28 +1882,89 @@ std::string CryptoKernel::Wallet::sendToAddress(const std::string& pubKey,
 
     dbTx->commit();
 
-    std::vector<CryptoKernel::Blockchain::transaction> txs;
-    txs.push_back(tx);
-    network->broadcastTransactions(txs);
+    for(const CryptoKernel::Blockchain::output& out : selection.inputs) {
+        unindexCoin(out.getId().toString());
+    }
+
+    if(network != nullptr) {
+        std::vector<CryptoKernel::Blockchain::transaction> txs;
+        txs.push_back(tx);
+        network->broadcastTransactions(txs);
+    }
 
     return tx.getId().toString();
 }
 
 uint64_t CryptoKernel::Wallet::getTotalBalance() {
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(walletdb->beginReadOnly());
+    return params->get(dbTx.get(), "balance").asUInt64() -
+           params->get(dbTx.get(), "lockedBalance").asUInt64();
+}
+
+uint64_t CryptoKernel::Wallet::getUnconfirmedBalance() {
+    return getParamBalance("unconfirmedBalance");
+}
+
+uint64_t CryptoKernel::Wallet::getLockedBalance() {
+    return getParamBalance("lockedBalance");
+}
+
+uint64_t CryptoKernel::Wallet::getParamBalance(const std::string& name) {
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(walletdb->beginReadOnly());
+    return params->get(dbTx.get(), name).asUInt64();
+}
+
+bool CryptoKernel::Wallet::checkBalances() {
     std::lock_guard<std::recursive_mutex> lock(walletLock);
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(walletdb->beginReadOnly());
+    std::unique_ptr<CryptoKernel::Storage::Transaction> bchainTx(blockchain->getTxHandle());
+
+    uint64_t balance = 0;
+    uint64_t locked = 0;
+    std::map<std::string, uint64_t> accountBalances;
+
     std::unique_ptr<CryptoKernel::Storage::Table::Iterator> it(new
-            CryptoKernel::Storage::Table::Iterator(utxos.get(), walletdb.get()));
+        CryptoKernel::Storage::Table::Iterator(utxos.get(), walletdb.get(), dbTx->snapshot));
+    for(it->SeekToFirst(); it->Valid(); it->Next()) {
+        const Txo txo = Txo(it->value());
+        balance += txo.getValue();
+        if(txo.isSpent()) {
+            locked += txo.getValue();
+        }
 
-    uint64_t total = 0;
+        try {
+            const CryptoKernel::Blockchain::output out = blockchain->getOutput(bchainTx.get(), it->key());
+            const Json::Value accName = accounts->get(dbTx.get(), out.getData()["publicKey"].asString(), 0);
+            accountBalances[accName.asString()] += txo.getValue();
+        } catch(const CryptoKernel::Blockchain::NotFoundException& e) {
+            log->printf(LOG_LEVEL_WARN, "Wallet::checkBalances(): Output " + it->key() + " is not in the chain");
+            return false;
+        }
+    }
+
+    uint64_t unconfirmed = 0;
+    bool consistent = true;
 
+    it.reset(new CryptoKernel::Storage::Table::Iterator(accounts.get(), walletdb.get(), dbTx->snapshot));
     for(it->SeekToFirst(); it->Valid(); it->Next()) {
-        const Txo utxo = Txo(it->value());
-        if(!utxo.isSpent()) {
-            total += utxo.getValue();
+        const Account acc = Account(it->value());
+        unconfirmed += acc.getUnconfirmedBalance();
+        if(acc.getBalance() != accountBalances[acc.getName()]) {
+            log->printf(LOG_LEVEL_WARN, "Wallet::checkBalances(): Account " + acc.getName()
+                        + " has balance " + std::to_string(acc.getBalance()) + " but owns "
+                        + std::to_string(accountBalances[acc.getName()]));
+            consistent = false;
         }
     }
 
-    return total;
+    if(params->get(dbTx.get(), "balance").asUInt64() != balance ||
+       params->get(dbTx.get(), "lockedBalance").asUInt64() != locked ||
+       params->get(dbTx.get(), "unconfirmedBalance").asUInt64() != unconfirmed) {
+        log->printf(LOG_LEVEL_WARN, "Wallet::checkBalances(): Wallet totals don't match its outputs");
+        consistent = false;
+    }
+
+    return consistent;
 }
 
 std::set<CryptoKernel::Wallet::Account> CryptoKernel::Wallet::listAccounts() {
@@ -757,15 +1991,16 @@ std::tuple<std::set<CryptoKernel::Blockchain::transaction>, std::set<CryptoKerne
 
     std::tuple<std::set<CryptoKernel::Blockchain::transaction>, std::set<CryptoKernel::Blockchain::transaction>> returning;
 
-    const auto& unconfirmedTxs = blockchain->getUnconfirmedTransactions();
+    std::map<std::string, CryptoKernel::Blockchain::transaction> unconfirmedTxs;
+    for(const CryptoKernel::Blockchain::transaction& tx : blockchain->getUnconfirmedTransactions()) {
+        unconfirmedTxs.emplace(tx.getId().toString(), tx);
+    }
 
     for(it->SeekToFirst(); it->Valid(); it->Next()) {
         if(it->value()["unconfirmed"].asBool()) {
-            for (const CryptoKernel::Blockchain::transaction& tx : unconfirmedTxs) {
-                if (tx.getId().toString() == it->key()) {
-                   std::get<1>(returning).insert(tx); 
-                   break;
-                }
+            const auto tx = unconfirmedTxs.find(it->key());
+            if(tx != unconfirmedTxs.end()) {
+                std::get<1>(returning).insert(tx->second);
             }
         }
         else {
@@ -781,7 +2016,8 @@ std::string CryptoKernel::Wallet::signMessage(const std::string& message,
                                               const std::string& password) {
     std::lock_guard<std::recursive_mutex> lock(walletLock);
 
-    if(!checkPassword(password)) {
+    const SecureString passphrase = authorize(password);
+    if(passphrase.empty()) {
         throw WalletException("Incorrect wallet password");
     }
 
@@ -791,7 +2027,7 @@ std::string CryptoKernel::Wallet::signMessage(const std::string& message,
 
     for(const auto& key : acc.getKeys()) {
         if(key.pubKey == publicKey) {
-            privKey = key.privKey->decrypt(password);
+            privKey = getPrivKey(key, passphrase);
             break;
         }
     }
@@ -807,7 +2043,8 @@ CryptoKernel::Wallet::signTransaction(const CryptoKernel::Blockchain::transactio
                                       const std::string& password) {
     std::lock_guard<std::recursive_mutex> lock(walletLock);
 
-    if(!checkPassword(password)) {
+    const SecureString passphrase = authorize(password);
+    if(passphrase.empty()) {
         throw WalletException("Incorrect wallet password");
     }
 
@@ -833,7 +2070,7 @@ CryptoKernel::Wallet::signTransaction(const CryptoKernel::Blockchain::transactio
 
         for(const auto& key : acc.getKeys()) {
             if(key.pubKey == outputData["publicKey"].asString()) {
-                privKey = key.privKey->decrypt(password);
+                privKey = getPrivKey(key, passphrase);
                 break;
             }
         }
@@ -856,7 +2093,8 @@ CryptoKernel::Wallet::importPrivKey(const std::string& name, const std::string&
                                     const std::string& password) {
     std::lock_guard<std::recursive_mutex> lock(walletLock);
 
-    if(!checkPassword(password)) {
+    const SecureString passphrase = authorize(password);
+    if(passphrase.empty()) {
         throw WalletException("Incorrect wallet password");
     }
 
@@ -876,11 +2114,11 @@ CryptoKernel::Wallet::importPrivKey(const std::string& name, const std::string&
         const Account acc = getAccountByKey(crypto.getPublicKey());
     } catch(const WalletException& e) {
         Account::keyPair kp;
-        kp.privKey.reset(new AES256(password, crypto.getPrivateKey()));
+        kp.privKey.reset(new AES256(passphrase, crypto.getPrivateKey()));
         kp.pubKey = crypto.getPublicKey();
 
         if(!accountExists) {
-            newAccount(name, password);
+            createAccount(name, passphrase);
         }
 
         Account acc = getAccountByName(name);
@@ -893,6 +2131,7 @@ CryptoKernel::Wallet::importPrivKey(const std::string& name, const std::string&
 
         // Rescan
         clearDB();
+        pushEvent({CHAIN_CHANGED, nullptr});
 
         return acc;
     }
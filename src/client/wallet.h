@@ -27,16 +27,23 @@
 
 #include <random>
 #include <iostream>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <unordered_set>
+#include <chrono>
 
 #include "storage.h"
 #include "blockchain.h"
 #include "network.h"
 #include "crypto.h"
+#include "threadpool.h"
 
-#define LATEST_WALLET_SCHEMA 2
+#define LATEST_WALLET_SCHEMA 4
 
 namespace CryptoKernel {
-class Wallet {
+class Wallet : private CryptoKernel::Blockchain::Listener {
 public:
     Wallet(CryptoKernel::Blockchain* blockchain,
            CryptoKernel::Network* network,
@@ -61,7 +68,7 @@ public:
 
     class Account {
     public:
-        Account(const std::string& name, const std::string& password);
+        Account(const std::string& name, const SecureString& password);
         Account(const Json::Value& accountJson);
 
         Json::Value toJson() const;
@@ -78,7 +85,7 @@ public:
 
         std::set<keyPair> getKeys() const;
 
-        keyPair newAddress(const std::string& password);
+        keyPair newAddress(const SecureString& password);
 
         bool operator<(const Account& rhs) const;
 
@@ -88,10 +95,19 @@ public:
 
         uint64_t getBalance() const;
 
+        /**
+        * Returns the value of the account's incoming outputs that are still
+        * in the mempool
+        */
+        uint64_t getUnconfirmedBalance() const;
+
+        void setUnconfirmedBalance(const uint64_t newBalance);
+
     private:
         std::set<keyPair> keys;
         std::string name;
         uint64_t balance;
+        uint64_t unconfirmedBalance;
     };
 
     class Txo {
@@ -123,12 +139,83 @@ public:
                               const uint64_t amount,
                               const std::string& password);
 
+    /**
+    * Pays several recipients in a single transaction, with one change output
+    * at most. Cheaper than repeated calls to sendToAddress as inputs are
+    * selected, signed, submitted and broadcast once for the whole batch.
+    *
+    * @param recipients map of public key to the amount to pay it
+    * @param password the wallet passphrase
+    * @return the id of the transaction, or a description of why it failed
+    */
+    std::string sendMany(const std::map<std::string, uint64_t>& recipients,
+                         const std::string& password);
+
+    /**
+    * Returns the confirmed value the wallet can spend, i.e. excluding outputs
+    * already spent by transactions waiting in the mempool
+    */
     uint64_t getTotalBalance();
 
+    /**
+    * Returns the value of incoming outputs still waiting in the mempool
+    */
+    uint64_t getUnconfirmedBalance();
+
+    /**
+    * Returns the value of confirmed outputs spent by our own transactions
+    * that are waiting in the mempool
+    */
+    uint64_t getLockedBalance();
+
+    /**
+    * Recomputes the running balances from the wallet's outputs and compares
+    * them with the cached ones. Expensive, meant for tests and diagnostics.
+    *
+    * @return true iff the cached balances are consistent
+    */
+    bool checkBalances();
+
+    /**
+    * Keeps the passphrase in locked memory for the given time. While the
+    * wallet is unlocked, calls taking a passphrase accept an empty one, and
+    * private keys are cached after their first use so signing with them
+    * again skips key derivation.
+    *
+    * @param password the wallet passphrase
+    * @param timeout seconds until the wallet locks itself again, 0 locks it now
+    * @throw WalletException if the passphrase is wrong
+    */
+    void unlockWallet(const std::string& password, const uint64_t timeout);
+
+    /**
+    * Wipes the cached passphrase and private keys
+    */
+    void lockWallet();
+
+    /**
+    * Returns when the wallet will lock itself as a unix timestamp, or 0 if
+    * it is locked
+    */
+    uint64_t getUnlockedUntil();
+
     std::set<Account> listAccounts();
 
     std::tuple<std::set<CryptoKernel::Blockchain::transaction>, std::set<CryptoKernel::Blockchain::transaction>> listTransactions();
 
+    /**
+    * Returns a page of summaries of the wallet's transactions, newest first:
+    * unconfirmed ones, then confirmed ones by descending height. Each
+    * summary has the transaction's id, height, timestamp, the value it paid
+    * us and the value of our outputs it spent, plus a cursor.
+    *
+    * @param limit the maximum number of transactions to return
+    * @param after the cursor of the last transaction of the previous page,
+    *        empty for the first page
+    * @return a JSON array of transaction summaries
+    */
+    Json::Value listHistory(const uint64_t limit, const std::string& after = "");
+
     CryptoKernel::Blockchain::transaction signTransaction(const
             CryptoKernel::Blockchain::transaction& tx, const std::string& password);
 
@@ -142,6 +229,7 @@ private:
     std::unique_ptr<CryptoKernel::Storage::Table> utxos;
     std::unique_ptr<CryptoKernel::Storage::Table> transactions;
     std::unique_ptr<CryptoKernel::Storage::Table> params;
+    std::unique_ptr<CryptoKernel::Storage::Table> history;
 
     CryptoKernel::Blockchain* blockchain;
     CryptoKernel::Network* network;
@@ -154,6 +242,105 @@ private:
     void watchFunc();
     bool running;
 
+    enum eventType {
+        CHAIN_CHANGED,
+        TX_ADDED,
+        TX_REMOVED
+    };
+
+    struct walletEvent {
+        eventType type;
+        std::shared_ptr<CryptoKernel::Blockchain::transaction> tx;
+    };
+
+    // Chain notifications waiting for the watch thread, guarded by eventMutex
+    std::deque<walletEvent> events;
+    std::mutex eventMutex;
+    std::condition_variable eventReady;
+
+    // When an unlock expires, the epoch if locked. Guarded by eventMutex so
+    // the watch thread can wait on it.
+    std::chrono::system_clock::time_point unlockedUntil;
+
+    // Set when unlockedUntil changes so the watch thread picks up the new
+    // time instead of waiting on the old one, guarded by eventMutex
+    bool unlockChanged;
+
+    // Secrets held while unlocked, guarded by walletLock
+    SecureString cachedPassword;
+    std::map<std::string, SecureString, std::less<std::string>,
+             LockedAllocator<std::pair<const std::string, SecureString>>> keyCache;
+
+    bool isUnlocked();
+
+    /**
+    * Checks a passphrase, substituting the cached one for an empty
+    * passphrase while the wallet is unlocked
+    *
+    * @return the passphrase to use, in locked memory, or an empty string if it is wrong
+    */
+    SecureString authorize(const std::string& password);
+
+    /**
+    * Decrypts one of our private keys, from the cache if the wallet is
+    * unlocked and it has been used before
+    */
+    std::string getPrivKey(const Account::keyPair& key, const SecureString& passphrase);
+
+    /**
+    * Creates and stores a new account with a passphrase authorize has accepted
+    */
+    Account createAccount(const std::string& name, const SecureString& passphrase);
+
+    void cacheKey(const std::string& pubKey, const std::string& privKey);
+
+    void pushEvent(const walletEvent& event);
+
+    void blockConnected(const CryptoKernel::Blockchain::block& block) override;
+    void blockDisconnected(const CryptoKernel::Blockchain::block& block) override;
+    void transactionAdded(const CryptoKernel::Blockchain::transaction& tx) override;
+    void transactionRemoved(const CryptoKernel::Blockchain::transaction& tx) override;
+
+    void syncChain(std::unique_ptr<CryptoKernel::Storage::Transaction>& walletTx,
+                   CryptoKernel::Storage::Transaction* bchainTx);
+
+    struct scannedOutput {
+        std::string id;
+        uint64_t value;
+        std::string account;
+    };
+
+    struct scannedTx {
+        std::string id;
+        uint64_t timestamp;
+        std::vector<std::string> spends;
+        std::vector<scannedOutput> outputs;
+    };
+
+    struct scannedBlock {
+        std::string id;
+        uint64_t height;
+        std::vector<scannedTx> txs;
+    };
+
+    /**
+    * Reads the main chain blocks in [start, end) and picks out, for every
+    * transaction, the outputs it spends and the outputs paying one of the
+    * given keys. Only reads from bchainTx so it is safe to run concurrently.
+    */
+    std::vector<scannedBlock> scanBlocks(CryptoKernel::Storage::Transaction* bchainTx,
+                                         const std::unordered_map<std::string, std::string>& keyOwners,
+                                         const uint64_t start, const uint64_t end);
+
+    /**
+    * Brings the wallet from its sync height up to toHeight by scanning
+    * block ranges in parallel and applying the results in height order.
+    * Commits walletTx every batch and leaves a fresh transaction in it.
+    */
+    void rescan(std::unique_ptr<CryptoKernel::Storage::Transaction>& walletTx,
+                CryptoKernel::Storage::Transaction* bchainTx,
+                const uint64_t toHeight);
+
     void rewindBlock(CryptoKernel::Storage::Transaction* walletTx,
                      CryptoKernel::Storage::Transaction* bchainTx);
 
@@ -168,7 +355,124 @@ private:
     void digestTx(const CryptoKernel::Blockchain::transaction& tx,
                      CryptoKernel::Storage::Transaction* walletTx,
                      CryptoKernel::Storage::Transaction* bchainTx,
-                     const bool unconfirmed = false);
+                     const bool unconfirmed = false,
+                     const uint64_t height = 0);
+
+    static std::string historyKey(const bool unconfirmed, const uint64_t height,
+                                  const std::string& txId);
+
+    /**
+    * Marks a transaction as ours and files its summary in the history
+    * index, replacing any previous entry for it
+    */
+    void recordTx(CryptoKernel::Storage::Transaction* walletTx, const std::string& txId,
+                  const bool unconfirmed, const uint64_t height, const uint64_t timestamp,
+                  const uint64_t received, const uint64_t spent);
+
+    /**
+    * Removes a transaction and its history entry
+    */
+    void forgetTx(CryptoKernel::Storage::Transaction* walletTx, const std::string& txId);
+
+    /**
+    * Forgets an unconfirmed transaction that left the mempool without being
+    * confirmed, releasing any of our outputs it had locked
+    */
+    void removeUnconfirmedTx(const CryptoKernel::Blockchain::transaction& tx,
+                             CryptoKernel::Storage::Transaction* walletTx);
+
+    /**
+    * Drops every unconfirmed transaction and releases the outputs they
+    * locked, used on startup as the mempool they were in is gone. Must be
+    * called without a wallet transaction open.
+    */
+    void clearUnconfirmed();
+
+    /**
+    * Adds delta to one of the wallet's running totals in params: "balance",
+    * "unconfirmedBalance" or "lockedBalance"
+    */
+    void adjustBalance(CryptoKernel::Storage::Transaction* walletTx,
+                       const std::string& name, const int64_t delta);
+
+    uint64_t getParamBalance(const std::string& name);
+
+    /**
+    * Returns the value paid to each of our accounts by a transaction
+    */
+    std::map<std::string, uint64_t> getReceived(CryptoKernel::Storage::Transaction* walletTx,
+                                                const CryptoKernel::Blockchain::transaction& tx);
+
+    /**
+    * In memory index of the confirmed outputs we can spend, loaded lazily by
+    * the first send and kept up to date as transactions are digested.
+    * Guarded by walletLock.
+    */
+    std::map<std::string, CryptoKernel::Blockchain::output> coinIndex;
+
+    /**
+    * The indexed outputs ordered by value net of the fee needed to spend them
+    */
+    std::set<std::pair<uint64_t, std::string>> coinsByValue;
+
+    bool coinIndexLoaded;
+
+    /**
+    * Fills the coin index from the utxos table. Reads from a snapshot so
+    * it is safe to call with a wallet transaction open, but only sees
+    * what has been committed.
+    */
+    void loadCoinIndex();
+
+    /**
+    * Drops the coin index so the next send reloads it from the database
+    */
+    void resetCoinIndex();
+
+    void indexCoin(const CryptoKernel::Blockchain::output& out);
+    void unindexCoin(const std::string& id);
+
+    struct coinChange {
+        std::string id;
+        // The output to index, or null to drop id from the index
+        std::shared_ptr<CryptoKernel::Blockchain::output> out;
+    };
+
+    /**
+    * Coin index changes made by the open wallet transaction. They are only
+    * applied once it commits so an aborted transaction can't leave the
+    * index out of step with the utxos table. Guarded by walletLock.
+    */
+    std::vector<coinChange> coinChanges;
+
+    void stageIndexCoin(const CryptoKernel::Blockchain::output& out);
+    void stageUnindexCoin(const std::string& id);
+
+    /**
+    * Applies the staged coin index changes, call after the wallet
+    * transaction that made them commits
+    */
+    void applyCoinChanges();
+
+    struct coinSelection {
+        std::vector<CryptoKernel::Blockchain::output> inputs;
+        uint64_t fee;
+        bool change;
+    };
+
+    /**
+    * Picks which indexed outputs to spend to pay amount. First searches for
+    * a set of inputs that pays the amount and fee without needing a change
+    * output, otherwise uses as few inputs as possible.
+    *
+    * @param amount the value to pay, excluding fees
+    * @param outputFee fee owed for the outputs on top of the base fee
+    * @param selection filled with the inputs, the fee and whether the
+    *        transaction needs a change output
+    * @return false if the indexed outputs can't cover the amount and fee
+    */
+    bool selectCoins(const uint64_t amount, const uint64_t outputFee,
+                     coinSelection& selection);
 
     std::recursive_mutex walletLock;
 
@@ -24,6 +24,7 @@
 #include <math.h>
 #include <random>
 #include <thread>
+#include <limits>
 
 #include "blockchain.h"
 #include "crypto.h"
@@ -31,6 +32,30 @@
 #include "contract.h"
 #include "schnorr.h"
 #include "merkletree.h"
+#include "blockfilter.h"
+#include "threadpool.h"
+
+// Bumped when the layout of the address index entries changes
+static const unsigned int addressIndexVersion = 1;
+static const unsigned int filtersVersion = 1;
+
+// Number of blocks each worker reads at a time while building the tx index
+static const uint64_t txIndexBlocksPerTask = 100;
+
+// Most gas the contracts in one block's transactions may use between them
+static const uint64_t maxBlockGas = 2000000000;
+
+// Gas a unit of fee pays for on top of the size based fee when relaying
+static const uint64_t gasPerFeeUnit = 100;
+
+namespace {
+// Keys sort by height within an address, so pages come out oldest first
+std::string addressTxKey(const uint64_t height, const std::string& txId) {
+    std::string heightStr = std::to_string(height);
+    heightStr.insert(0, 20 - heightStr.size(), '0');
+    return heightStr + txId;
+}
+}
 
 CryptoKernel::Blockchain::Blockchain(CryptoKernel::Log* GlobalLog,
                                      const std::string& dbDir) {
@@ -43,7 +68,16 @@ CryptoKernel::Blockchain::Blockchain(CryptoKernel::Log* GlobalLog,
     stxos.reset(new CryptoKernel::Storage::Table("stxos"));
     inputs.reset(new CryptoKernel::Storage::Table("inputs"));
     candidates.reset(new CryptoKernel::Storage::Table("candidates"));
+    filters.reset(new CryptoKernel::Storage::Table("filters"));
+    addresses.reset(new CryptoKernel::Storage::Table("addresses"));
+    spentBy.reset(new CryptoKernel::Storage::Table("spentBy"));
+    addressTxs.reset(new CryptoKernel::Storage::Table("addressTxs"));
     log = GlobalLog;
+    scriptPool.reset(new ThreadPool());
+    txPool.reset(new ThreadPool());
+    txIndex = false;
+    stopTxIndex = false;
+    gasActivationHeight = std::numeric_limits<uint64_t>::max();
 }
 
 bool CryptoKernel::Blockchain::loadChain(CryptoKernel::Consensus* consensus,
@@ -54,6 +88,20 @@ bool CryptoKernel::Blockchain::loadChain(CryptoKernel::Consensus* consensus,
     dbTransaction->abort();
     if(!tipExists) {
         emptyDB();
+
+        // A fresh chain builds its address index and filters as blocks are
+        // connected
+        dbTransaction.reset(blockdb->begin());
+        addresses->put(dbTransaction.get(), "version", addressIndexVersion, 0);
+        filters->put(dbTransaction.get(), "version", filtersVersion, 0);
+        if(txIndex) {
+            Json::Value progress;
+            progress["height"] = 0;
+            progress["complete"] = true;
+            spentBy->put(dbTransaction.get(), "progress", progress, 0);
+        }
+        dbTransaction->commit();
+
         bool newGenesisBlock = false;
         std::ifstream t(genesisBlockFile);
         if(!t.is_open()) {
@@ -93,13 +141,294 @@ bool CryptoKernel::Blockchain::loadChain(CryptoKernel::Consensus* consensus,
     const block genesisBlock = getBlockByHeight(1);
     genesisBlockId = genesisBlock.getId();
 
+    dbTransaction.reset(blockdb->beginReadOnly());
+    const bool addressesIndexed = addresses->get(dbTransaction.get(), "version", 0).isUInt();
+    const bool filtersBuilt = filters->get(dbTransaction.get(), "version", 0).isUInt();
+    dbTransaction->abort();
+    if(!addressesIndexed) {
+        reindexAddresses();
+    }
+
+    if(!filtersBuilt) {
+        backfillFilters();
+    }
+
+    dbTransaction.reset(blockdb->begin());
+    const Json::Value txIndexProgress = spentBy->get(dbTransaction.get(), "progress", 0);
+    if(txIndex) {
+        dbTransaction->abort();
+        if(!txIndexProgress["complete"].asBool()) {
+            txIndexThread.reset(new std::thread(&CryptoKernel::Blockchain::buildTxIndex, this));
+        }
+    } else if(!txIndexProgress.isNull()) {
+        // The index goes stale while it's off so rebuild it if it's turned back on
+        log->printf(LOG_LEVEL_WARN, "Blockchain::loadChain(): transaction index disabled, "
+                    "it will be rebuilt if enabled again");
+        spentBy->erase(dbTransaction.get(), "progress", 0);
+        dbTransaction->commit();
+    } else {
+        dbTransaction->abort();
+    }
+
     status = true;
 
     return true;
 }
 
 CryptoKernel::Blockchain::~Blockchain() {
+    if(txIndexThread) {
+        stopTxIndex = true;
+        txIndexThread->join();
+    }
+}
+
+void CryptoKernel::Blockchain::enableTxIndex() {
+    txIndex = true;
+}
+
+bool CryptoKernel::Blockchain::txIndexEnabled() const {
+    return txIndex;
+}
+
+void CryptoKernel::Blockchain::setGasActivationHeight(const uint64_t height) {
+    gasActivationHeight = height;
+}
+
+bool CryptoKernel::Blockchain::gasRulesActive(Storage::Transaction* dbTx) {
+    if(gasActivationHeight == std::numeric_limits<uint64_t>::max()) {
+        return false;
+    }
+
+    // Read the height straight from the stored tip, there's none yet while
+    // the genesis block is being connected
+    const Json::Value tip = blocks->get(dbTx, "tip");
+    const uint64_t height = tip.isObject() ? tip["height"].asUInt64() + 1 : 1;
+
+    return height >= gasActivationHeight;
+}
+
+uint64_t CryptoKernel::Blockchain::getTxIndexHeight() {
+    if(!txIndex) {
+        return 0;
+    }
+
+    std::unique_ptr<Storage::Transaction> dbTx(blockdb->beginReadOnly());
+    const Json::Value progress = spentBy->get(dbTx.get(), "progress", 0);
+    if(progress["complete"].asBool()) {
+        return getBlockDB(dbTx.get(), "tip").getHeight();
+    }
 
+    return progress["height"].asUInt64();
+}
+
+CryptoKernel::Blockchain::indexedTx CryptoKernel::Blockchain::getSpendingTx(
+    const std::string& outputId) {
+    if(!txIndex) {
+        throw NotFoundException("Transaction index");
+    }
+
+    std::unique_ptr<Storage::Transaction> dbTx(blockdb->beginReadOnly());
+
+    const Json::Value entry = spentBy->get(dbTx.get(), outputId);
+    if(!entry.isObject() || !transactions->get(dbTx.get(), entry["tx"].asString()).isObject()) {
+        throw NotFoundException("Spending transaction of output " + outputId);
+    }
+
+    indexedTx returning;
+    returning.txId = entry["tx"].asString();
+    returning.height = entry["height"].asUInt64();
+
+    return returning;
+}
+
+std::vector<CryptoKernel::Blockchain::indexedTx>
+CryptoKernel::Blockchain::getAddressTransactions(const std::string& publicKey,
+                                                 const uint64_t limit,
+                                                 const std::string& after) {
+    std::vector<indexedTx> returning;
+
+    if(!txIndex) {
+        return returning;
+    }
+
+    std::unique_ptr<Storage::Transaction> dbTx(blockdb->beginReadOnly());
+
+    std::unique_ptr<Storage::Table::Iterator> it(new Storage::Table::Iterator(addressTxs.get(), blockdb.get(), dbTx->snapshot, publicKey));
+
+    if(after.empty()) {
+        it->SeekToFirst();
+    } else {
+        it->Seek(after);
+        if(it->Valid() && it->key() == after) {
+            it->Next();
+        }
+    }
+
+    for(; it->Valid() && returning.size() < limit; it->Next()) {
+        const std::string key = it->key();
+        // Longer public keys sharing this one as a prefix land in the same
+        // range, their entries don't start with a zero padded height
+        if(key.size() <= 20 || !std::all_of(key.begin(), key.begin() + 20,
+                                            [](const char c) { return c >= '0' && c <= '9'; })) {
+            continue;
+        }
+
+        indexedTx tx;
+        tx.height = std::stoull(key.substr(0, 20));
+        tx.txId = key.substr(20);
+        tx.cursor = key;
+
+        // Entries left behind by reorgs while the index was off
+        const Json::Value txJson = transactions->get(dbTx.get(), tx.txId);
+        if(!txJson.isObject()
+           || getBlockDB(dbTx.get(), txJson["confirmingBlock"].asString()).getHeight() != tx.height) {
+            continue;
+        }
+
+        returning.push_back(tx);
+    }
+
+    return returning;
+}
+
+void CryptoKernel::Blockchain::indexAddressTxs(Storage::Transaction* dbTx,
+        const std::map<std::string, addressDelta>& touched, const uint64_t height,
+        const std::string& txId, const bool erase) {
+    for(const auto& address : touched) {
+        const std::string key = address.first + addressTxKey(height, txId);
+        if(erase) {
+            addressTxs->erase(dbTx, key);
+        } else {
+            addressTxs->put(dbTx, key, Json::nullValue);
+        }
+    }
+}
+
+void CryptoKernel::Blockchain::buildTxIndex() {
+    // The index entries for one block, read ahead of writing them
+    struct blockEntries {
+        std::string id;
+        uint64_t height;
+        std::vector<std::pair<std::string, Json::Value>> spent;
+        std::vector<std::string> addressKeys;
+    };
+
+    auto readBlocks = [&](const uint64_t start, const uint64_t end) {
+        std::unique_ptr<Storage::Transaction> dbTx(blockdb->beginReadOnly());
+        std::vector<blockEntries> returning;
+
+        for(uint64_t height = start; height <= end; height++) {
+            const dbBlock indexedBlock = getBlockByHeightDB(dbTx.get(), height);
+
+            blockEntries entries;
+            entries.id = indexedBlock.getId().toString();
+            entries.height = height;
+
+            std::set<BigNum> txIds = indexedBlock.getTransactions();
+            txIds.insert(indexedBlock.getCoinbaseTx());
+
+            for(const BigNum& txId : txIds) {
+                const dbTransaction tx = getTransactionDB(dbTx.get(), txId.toString());
+                std::set<std::string> touched;
+
+                for(const BigNum& inputId : tx.getInputs()) {
+                    const std::string outputId = getInput(dbTx.get(),
+                                                          inputId.toString()).getOutputId().toString();
+
+                    Json::Value entry;
+                    entry["tx"] = txId.toString();
+                    entry["height"] = static_cast<Json::UInt64>(height);
+                    entries.spent.push_back(std::make_pair(outputId, entry));
+
+                    const auto txoData = getOutputDB(dbTx.get(), outputId).getData();
+                    if(!txoData["publicKey"].isNull()) {
+                        touched.insert(txoData["publicKey"].asString());
+                    }
+                }
+
+                for(const BigNum& outputId : tx.getOutputs()) {
+                    const auto txoData = getOutputDB(dbTx.get(), outputId.toString()).getData();
+                    if(!txoData["publicKey"].isNull()) {
+                        touched.insert(txoData["publicKey"].asString());
+                    }
+                }
+
+                for(const std::string& publicKey : touched) {
+                    entries.addressKeys.push_back(publicKey + addressTxKey(height, txId.toString()));
+                }
+            }
+
+            returning.push_back(entries);
+        }
+
+        return returning;
+    };
+
+    try {
+        std::unique_ptr<Storage::Transaction> dbTx(blockdb->beginReadOnly());
+        // Blocks connected from here on are indexed as they arrive
+        const uint64_t targetHeight = getBlockDB(dbTx.get(), "tip").getHeight();
+        uint64_t height = spentBy->get(dbTx.get(), "progress", 0)["height"].asUInt64();
+        dbTx->abort();
+
+        log->printf(LOG_LEVEL_INFO, "Blockchain::buildTxIndex(): indexing blocks "
+                    + std::to_string(height + 1) + " to " + std::to_string(targetHeight));
+
+        ThreadPool pool;
+
+        while(height < targetHeight && !stopTxIndex) {
+            std::vector<std::future<std::vector<blockEntries>>> tasks;
+            for(size_t i = 0; i < pool.size() && height < targetHeight; i++) {
+                const uint64_t start = height + 1;
+                const uint64_t end = std::min(targetHeight, height + txIndexBlocksPerTask);
+                tasks.push_back(pool.enqueue([&, start, end]() {
+                    return readBlocks(start, end);
+                }));
+                height = end;
+            }
+
+            std::vector<std::vector<blockEntries>> results;
+            for(auto& task : tasks) {
+                results.push_back(task.get());
+            }
+
+            // Only take the write lock once the reads are done so blocks can
+            // still be connected in the meantime
+            dbTx.reset(blockdb->begin());
+            for(const auto& result : results) {
+                for(const blockEntries& entries : result) {
+                    // Skip blocks reorged out since they were read, the live
+                    // index has already dealt with their replacements
+                    if(blocks->get(dbTx.get(), std::to_string(entries.height), 0).asString()
+                       != entries.id) {
+                        continue;
+                    }
+
+                    for(const auto& spent : entries.spent) {
+                        spentBy->put(dbTx.get(), spent.first, spent.second);
+                    }
+
+                    for(const std::string& key : entries.addressKeys) {
+                        addressTxs->put(dbTx.get(), key, Json::nullValue);
+                    }
+                }
+            }
+
+            Json::Value progress;
+            progress["height"] = static_cast<Json::UInt64>(height);
+            progress["complete"] = height >= targetHeight;
+            spentBy->put(dbTx.get(), "progress", progress, 0);
+            dbTx->commit();
+        }
+
+        if(height >= targetHeight) {
+            log->printf(LOG_LEVEL_INFO, "Blockchain::buildTxIndex(): transaction index built");
+        }
+    } catch(const std::exception& e) {
+        // Runs on its own thread, nothing above it would catch this
+        log->printf(LOG_LEVEL_ERR, "Blockchain::buildTxIndex(): failed to build index: "
+                    + std::string(e.what()));
+    }
 }
 
 std::set<CryptoKernel::Blockchain::transaction>
@@ -163,6 +492,31 @@ CryptoKernel::Blockchain::block CryptoKernel::Blockchain::buildBlock(
     }
 }
 
+Json::Value CryptoKernel::Blockchain::getBlockJsonByHeight(Storage::Transaction* transaction,
+        const uint64_t height, const bool full) {
+    const Json::Value id = blocks->get(transaction, std::to_string(height), 0);
+    if(!id.isString()) {
+        throw NotFoundException("Block at height " + std::to_string(height));
+    }
+
+    Json::Value returning = blocks->get(transaction, id.asString());
+    if(!returning.isObject()) {
+        throw NotFoundException("Block " + id.asString());
+    }
+
+    if(full) {
+        returning["coinbaseTx"] = getTransactionJson(transaction,
+                                  returning["coinbaseTx"].asString());
+        for(Json::Value& tx : returning["transactions"]) {
+            tx = getTransactionJson(transaction, tx.asString());
+        }
+    }
+
+    returning["id"] = id;
+
+    return returning;
+}
+
 CryptoKernel::Blockchain::block CryptoKernel::Blockchain::getBlockByHeight(
     Storage::Transaction* transaction, const uint64_t height) {
     const std::string id = blocks->get(transaction, std::to_string(height), 0).asString();
@@ -193,6 +547,48 @@ CryptoKernel::Blockchain::block CryptoKernel::Blockchain::getBlockByHeight(
     return getBlockByHeight(tx.get(), height);
 }
 
+CryptoKernel::BlockFilter CryptoKernel::Blockchain::getBlockFilter(
+    Storage::Transaction* dbTx, const std::string& id) {
+    const dbBlock filteredBlock = getBlockDB(dbTx, id, true);
+    const std::string blockId = filteredBlock.getId().toString();
+
+    const Json::Value filterJson = filters->get(dbTx, blockId);
+    if(!filterJson.isObject()) {
+        throw NotFoundException("Filter for block " + blockId);
+    }
+
+    return BlockFilter(filteredBlock.getId(), filterJson);
+}
+
+CryptoKernel::BlockFilter CryptoKernel::Blockchain::buildBlockFilter(
+    Storage::Transaction* dbTx, const dbBlock& filteredBlock) {
+    // Gather the keys the same way confirmTransaction does
+    const block Block = buildBlock(dbTx, filteredBlock);
+    std::set<transaction> txs = Block.getTransactions();
+    txs.insert(Block.getCoinbaseTx());
+
+    std::set<std::string> elements;
+    for(const transaction& tx : txs) {
+        for(const input& inp : tx.getInputs()) {
+            const auto spentElements = BlockFilter::getElements(getOutput(dbTx,
+                                       inp.getOutputId().toString()).getData());
+            elements.insert(spentElements.begin(), spentElements.end());
+        }
+
+        for(const output& out : tx.getOutputs()) {
+            const auto newElements = BlockFilter::getElements(out.getData());
+            elements.insert(newElements.begin(), newElements.end());
+        }
+    }
+
+    return BlockFilter(filteredBlock.getId(), elements);
+}
+
+CryptoKernel::BlockFilter CryptoKernel::Blockchain::getBlockFilter(const std::string& id) {
+    std::unique_ptr<Storage::Transaction> tx(blockdb->beginReadOnly());
+    return getBlockFilter(tx.get(), id);
+}
+
 CryptoKernel::Blockchain::output CryptoKernel::Blockchain::getOutput(
     const std::string& id) {
     std::unique_ptr<Storage::Transaction> tx(blockdb->beginReadOnly());
@@ -236,7 +632,10 @@ CryptoKernel::Blockchain::input CryptoKernel::Blockchain::getInput(
 }
 
 std::tuple<bool, bool> CryptoKernel::Blockchain::verifyTransaction(Storage::Transaction* dbTransaction,
-        const transaction& tx, const bool coinbaseTx) {
+        const transaction& tx, const bool coinbaseTx, uint64_t* gasUsed) {
+    uint64_t gas = 0;
+    const bool gasRules = gasRulesActive(dbTransaction);
+
     if(transactions->get(dbTransaction, tx.getId().toString()).isObject()) {
         log->printf(LOG_LEVEL_INFO, "blockchain::verifyTransaction(): tx already exists");
         return std::make_tuple(false, false);
@@ -361,8 +760,10 @@ std::tuple<bool, bool> CryptoKernel::Blockchain::verifyTransaction(Storage::Tran
 
 
             if(spendData["spendType"].asString() == "script") {
-                CryptoKernel::ContractRunner lvm(this);
-                if(!lvm.evaluateScriptValid(dbTransaction, tx, inp, spendData["pubKeyOrScript"].asString())) {
+                CryptoKernel::ContractRunner lvm(this, 10485760, 100000000, gasRules);
+                const bool scriptValid = lvm.evaluateScriptValid(dbTransaction, tx, inp, spendData["pubKeyOrScript"].asString());
+                gas += lvm.getGasUsed();
+                if(!scriptValid) {
                     log->printf(LOG_LEVEL_INFO, "blockchain::verifyTransaction(): P2MAST Script returned false");
                 return std::make_tuple(false, true);  
                 }
@@ -495,12 +896,20 @@ std::tuple<bool, bool> CryptoKernel::Blockchain::verifyTransaction(Storage::Tran
         }
     }
 
-    CryptoKernel::ContractRunner lvm(this);
-    if(!lvm.evaluateValid(dbTransaction, tx)) {
+    CryptoKernel::ContractRunner lvm(this, 10485760, 100000000, gasRules);
+    const bool contractsValid = lvm.evaluateValid(dbTransaction, tx);
+    gas += lvm.getGasUsed();
+    if(!contractsValid) {
         log->printf(LOG_LEVEL_INFO, "blockchain::verifyTransaction(): Script returned false");
         return std::make_tuple(false, true);
     }
 
+    if(gasRules && gas > maxBlockGas) {
+        log->printf(LOG_LEVEL_INFO,
+                    "blockchain::verifyTransaction(): tx uses more gas than fits in a block");
+        return std::make_tuple(false, true);
+    }
+
     if(!consensus->verifyTransaction(dbTransaction, tx)) {
         log->printf(LOG_LEVEL_INFO,
                     "blockchain::verifyTransaction(): Could not verify custom rules");
@@ -508,6 +917,10 @@ std::tuple<bool, bool> CryptoKernel::Blockchain::verifyTransaction(Storage::Tran
     }
 
     log->printf(LOG_LEVEL_INFO, "blockchain::verifyTransaction(): Verified successfully");
+
+    if(gasUsed != nullptr) {
+        *gasUsed = gas;
+    }
        
     return std::make_tuple(true, false);
 }
@@ -516,7 +929,9 @@ std::tuple<bool, bool> CryptoKernel::Blockchain::submitTransaction(const transac
     std::unique_ptr<Storage::Transaction> dbTx(blockdb->begin());
     const auto result = submitTransaction(dbTx.get(), tx);
     if(std::get<0>(result)) {
-        dbTx->commit();
+        commitAndNotify(dbTx.get());
+    } else {
+        pendingEvents.clear();
     }
     return result;
 }
@@ -525,20 +940,141 @@ std::tuple<bool, bool> CryptoKernel::Blockchain::submitBlock(const block& newBlo
     std::unique_ptr<Storage::Transaction> dbTx(blockdb->begin());
     const auto result = submitBlock(dbTx.get(), newBlock, genesisBlock);
     if(std::get<0>(result)) {
-        dbTx->commit();
+        commitAndNotify(dbTx.get());
+    } else {
+        pendingEvents.clear();
     }
     return result;
 }
 
+void CryptoKernel::Blockchain::addListener(Listener* listener) {
+    std::lock_guard<std::mutex> lock(listenersMutex);
+    listeners.insert(listener);
+}
+
+void CryptoKernel::Blockchain::removeListener(Listener* listener) {
+    std::lock_guard<std::mutex> lock(listenersMutex);
+    listeners.erase(listener);
+}
+
+void CryptoKernel::Blockchain::commitAndNotify(Storage::Transaction* dbTx) {
+    std::vector<std::function<void(Listener*)>> events;
+    events.swap(pendingEvents);
+
+    // Take the listener lock before the commit releases the write lock so
+    // notifications from consecutive writes are delivered in commit order
+    std::lock_guard<std::mutex> lock(listenersMutex);
+    dbTx->commit();
+
+    for(const auto& event : events) {
+        for(Listener* listener : listeners) {
+            try {
+                event(listener);
+            } catch(const std::exception& e) {
+                log->printf(LOG_LEVEL_WARN,
+                            "blockchain::commitAndNotify(): Listener threw: " + std::string(e.what()));
+            }
+        }
+    }
+}
+
+void CryptoKernel::Blockchain::notifyRemoved(const std::set<transaction>& removed) {
+    for(const transaction& tx : removed) {
+        pendingEvents.push_back([tx](Listener* listener) {
+            listener->transactionRemoved(tx);
+        });
+    }
+}
+
+bool CryptoKernel::Blockchain::preValidateBlock(const block& Block) {
+    // The block id doesn't commit to the consensus data so key on both
+    const std::string key = Block.getId().toString() +
+                            CryptoKernel::Storage::toString(Block.getConsensusData());
+
+    {
+        std::lock_guard<std::mutex> lock(preValidatedMutex);
+        const auto it = preValidated.find(key);
+        if(it != preValidated.end()) {
+            return it->second;
+        }
+    }
+
+    bool valid = true;
+
+    if(!consensus->checkConsensusRulesStateless(Block)) {
+        log->printf(LOG_LEVEL_INFO,
+                    "blockchain::preValidateBlock(): Block fails context-free consensus rules");
+        valid = false;
+    }
+
+    if(valid) {
+        for(const transaction& tx : Block.getTransactions()) {
+            if(!checkSignatureSyntax(tx)) {
+                valid = false;
+                break;
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(preValidatedMutex);
+    if(preValidated.insert(std::make_pair(key, valid)).second) {
+        preValidatedOrder.push_back(key);
+        if(preValidatedOrder.size() > 5000) {
+            preValidated.erase(preValidatedOrder.front());
+            preValidatedOrder.pop_front();
+        }
+    }
+
+    return valid;
+}
+
+bool CryptoKernel::Blockchain::checkSignatureSyntax(const transaction& tx) {
+    // Only rules verifyTransaction enforces whatever the spent outputs are
+    for(const input& inp : tx.getInputs()) {
+        const Json::Value spendData = inp.getData();
+        if(spendData["aggregateSignature"].isObject()) {
+            if(!spendData["aggregateSignature"]["signs"].isArray() ||
+               !spendData["aggregateSignature"]["signature"].isString()) {
+                log->printf(LOG_LEVEL_INFO,
+                            "blockchain::preValidateBlock(): Aggregate signature malformed. Signs isn't an array or signature isn't a string");
+                return false;
+            }
+
+            for(const auto& v : spendData["aggregateSignature"]["signs"]) {
+                if(!v.isUInt64()) {
+                    log->printf(LOG_LEVEL_INFO,
+                                "blockchain::preValidateBlock(): Aggregate signature malformed. Signs array element isn't an integer");
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
 std::tuple<bool, bool> CryptoKernel::Blockchain::submitTransaction(Storage::Transaction* dbTx,
         const transaction& tx) {
-	const auto verifyResult = verifyTransaction(dbTx, tx);
+    uint64_t gas = 0;
+	const auto verifyResult = verifyTransaction(dbTx, tx, false, &gas);
     if(std::get<0>(verifyResult)) {
+        // Relay policy rather than a consensus rule, contracts pay for the
+        // gas they use on top of the size based fee
+        if(calculateTransactionFee(dbTx, tx) < getTransactionFee(tx) * 0.5 + gas / gasPerFeeUnit) {
+            log->printf(LOG_LEVEL_INFO,
+                        "blockchain::submitTransaction(): " + tx.getId().toString() +
+                        " doesn't pay for the " + std::to_string(gas) + " gas it uses");
+            return std::make_tuple(false, false);
+        }
+
         if(consensus->submitTransaction(dbTx, tx)) {
             std::lock_guard<std::mutex> lock(mempoolMutex);
-			if(unconfirmedTransactions.insert(tx)) {
+			if(unconfirmedTransactions.insert(tx, gas)) {
 				log->printf(LOG_LEVEL_INFO,
 							"blockchain::submitTransaction(): Received transaction " + tx.getId().toString());
+				pendingEvents.push_back([tx](Listener* listener) {
+					listener->transactionAdded(tx);
+				});
 				return std::make_tuple(true, false);
 			} else {
 				log->printf(LOG_LEVEL_INFO,
@@ -568,6 +1104,11 @@ std::tuple<bool, bool> CryptoKernel::Blockchain::submitBlock(Storage::Transactio
         return std::make_tuple(true, false);
     }
 
+    if(!genesisBlock && !preValidateBlock(newBlock)) {
+        log->printf(LOG_LEVEL_INFO, "blockchain::submitBlock(): Block failed context-free validation");
+        return std::make_tuple(false, true);
+    }
+
     Json::Value previousBlockJson = blocks->get(dbTx,
                                     newBlock.getPreviousBlockId().toString());
     uint64_t blockHeight = 1;
@@ -627,31 +1168,47 @@ std::tuple<bool, bool> CryptoKernel::Blockchain::submitBlock(Storage::Transactio
     if(!onlySave) {
         uint64_t fees = 0;
 
-        const unsigned int threads = std::thread::hardware_concurrency();
+        const unsigned int threads = txPool->size();
         const auto& txs = newBlock.getTransactions();
-        bool failure = false;
+        const bool gasRules = gasRulesActive(dbTx);
+        uint64_t blockGas = 0;
         unsigned int nTx = 0;
-        std::vector<std::thread> threadsVec;
+        std::vector<std::future<std::pair<bool, uint64_t>>> verifying;
 
         for(const auto& tx : txs) {
-            threadsVec.push_back(std::thread([&]{
-                if(!std::get<0>(verifyTransaction(dbTx, tx))) {
-                    failure = true;
-                }
+            verifying.push_back(txPool->enqueue([&]() {
+                uint64_t gas = 0;
+                const bool valid = std::get<0>(verifyTransaction(dbTx, tx, false, &gas));
+                return std::make_pair(valid, gas);
             }));
             nTx++;
 
             if(nTx % threads == 0 || nTx >= txs.size()) {
-                for(auto& thread : threadsVec) {
-                    thread.join();
+                // The tasks refer to dbTx and tx so let them all finish first
+                for(auto& result : verifying) {
+                    result.wait();
+                }
+
+                bool failure = false;
+                for(auto& result : verifying) {
+                    const std::pair<bool, uint64_t> verified = result.get();
+                    failure = failure || !verified.first;
+                    blockGas += verified.second;
                 }
-                threadsVec.clear();
+                verifying.clear();
 
                 if(failure) {
                     log->printf(LOG_LEVEL_INFO,
                             "blockchain::submitBlock(): Transaction could not be verified");
                     return std::make_tuple(false, true);
                 }
+
+                if(gasRules && blockGas > maxBlockGas) {
+                    log->printf(LOG_LEVEL_INFO,
+                            "blockchain::submitBlock(): Block uses more than " +
+                            std::to_string(maxBlockGas) + " gas");
+                    return std::make_tuple(false, true);
+                }
             }
         }
 
@@ -684,12 +1241,17 @@ std::tuple<bool, bool> CryptoKernel::Blockchain::submitBlock(Storage::Transactio
             return std::make_tuple(false, true);
         }
 
-        confirmTransaction(dbTx, newBlock.getCoinbaseTx(), newBlock.getId(), true);
+        std::set<std::string> filterElements;
+
+        confirmTransaction(dbTx, newBlock.getCoinbaseTx(), newBlock.getId(), blockHeight,
+                           filterElements, true);
 
         //Move transactions from unconfirmed to confirmed and add transaction utxos to db
         for(const transaction& tx : newBlock.getTransactions()) {
-            confirmTransaction(dbTx, tx, newBlock.getId());
+            confirmTransaction(dbTx, tx, newBlock.getId(), blockHeight, filterElements);
         }
+
+        filters->put(dbTx, idAsString, BlockFilter(newBlock.getId(), filterElements).toJson());
     }
 
     if(onlySave) {
@@ -703,8 +1265,13 @@ std::tuple<bool, bool> CryptoKernel::Blockchain::submitBlock(Storage::Transactio
         blocks->put(dbTx, "tip", blockAsJson);
         blocks->put(dbTx, std::to_string(blockHeight), Json::Value(idAsString), 0);
         blocks->put(dbTx, idAsString, blockAsJson);
+        pendingEvents.push_back([newBlock](Listener* listener) {
+            listener->blockConnected(newBlock);
+        });
+        // confirmTransaction already took this block's transactions out of
+        // the mempool, so the rescan only reports ones it invalidated
         std::lock_guard<std::mutex> lock(mempoolMutex);
-		unconfirmedTransactions.rescanMempool(dbTx, this);
+		notifyRemoved(unconfirmedTransactions.rescanMempool(dbTx, this));
     }
 
     if(genesisBlock) {
@@ -719,25 +1286,51 @@ std::tuple<bool, bool> CryptoKernel::Blockchain::submitBlock(Storage::Transactio
 }
 
 void CryptoKernel::Blockchain::confirmTransaction(Storage::Transaction* dbTransaction,
-        const transaction& tx, const BigNum& confirmingBlock, const bool coinbaseTx) {
+        const transaction& tx, const BigNum& confirmingBlock, const uint64_t height,
+        std::set<std::string>& filterElements, const bool coinbaseTx) {
     //Execute custom transaction rules callback
     if(!consensus->confirmTransaction(dbTransaction, tx)) {
         log->printf(LOG_LEVEL_ERR, "Consensus rules failed to confirm transaction");
     }
 
+    const std::string txId = tx.getId().toString();
+    std::map<std::string, addressDelta> deltas;
+
     //"Spend" UTXOs
     for(const input& inp : tx.getInputs()) {
         const std::string outputId = inp.getOutputId().toString();
         const Json::Value utxo = utxos->get(dbTransaction, outputId);
-        const auto txoData = dbOutput(utxo).getData();
+        const dbOutput txo = dbOutput(utxo);
+        const auto txoData = txo.getData();
+
+        const auto spentElements = BlockFilter::getElements(txoData);
+        filterElements.insert(spentElements.begin(), spentElements.end());
 
         stxos->put(dbTransaction, outputId, utxo);
 
+        if(txIndex) {
+            Json::Value spentEntry;
+            spentEntry["tx"] = txId;
+            spentEntry["height"] = static_cast<Json::UInt64>(height);
+            spentBy->put(dbTransaction, outputId, spentEntry);
+        }
+
         if(!txoData["publicKey"].isNull()) {
-            const auto txoStr = txoData["publicKey"].asString() + outputId;
+            const std::string publicKey = txoData["publicKey"].asString();
+            const auto txoStr = publicKey + outputId;
 
-            stxos->put(dbTransaction, txoStr, Json::nullValue, 0);
+            Json::Value indexEntry = utxos->get(dbTransaction, txoStr, 0);
+            if(indexEntry.isObject()) {
+                indexEntry["spentBy"] = txId;
+                indexEntry["spentHeight"] = static_cast<Json::UInt64>(height);
+            }
+
+            stxos->put(dbTransaction, txoStr, indexEntry, 0);
             utxos->erase(dbTransaction, txoStr, 0);
+
+            addressDelta& delta = deltas[publicKey];
+            delta.balance -= txo.getValue();
+            delta.spent++;
         }
 
         utxos->erase(dbTransaction, outputId);
@@ -749,13 +1342,34 @@ void CryptoKernel::Blockchain::confirmTransaction(Storage::Transaction* dbTransa
     for(const output& out : tx.getOutputs()) {
         const auto txoData = out.getData();
         if(!txoData["publicKey"].isNull()) {
-            const auto txoStr = txoData["publicKey"].asString() + out.getId().toString();
-            utxos->put(dbTransaction, txoStr, Json::nullValue, 0);
+            const std::string publicKey = txoData["publicKey"].asString();
+            const auto txoStr = publicKey + out.getId().toString();
+
+            // Covering entry so address queries don't need to load the output
+            Json::Value indexEntry;
+            indexEntry["value"] = static_cast<Json::UInt64>(out.getValue());
+            indexEntry["height"] = static_cast<Json::UInt64>(height);
+            indexEntry["tx"] = txId;
+            utxos->put(dbTransaction, txoStr, indexEntry, 0);
+
+            addressDelta& delta = deltas[publicKey];
+            delta.balance += out.getValue();
+            delta.received += out.getValue();
+            delta.outputs++;
         }
 
+        const auto newElements = BlockFilter::getElements(txoData);
+        filterElements.insert(newElements.begin(), newElements.end());
+
         utxos->put(dbTransaction, out.getId().toString(), dbOutput(out, tx.getId()).toJson());
     }
 
+    applyAddressDeltas(dbTransaction, deltas, 1);
+
+    if(txIndex) {
+        indexAddressTxs(dbTransaction, deltas, height, txId, false);
+    }
+
     //Commit transaction
     transactions->put(dbTransaction, tx.getId().toString(), Blockchain::dbTransaction(tx,
                       confirmingBlock, coinbaseTx).toJson());
@@ -910,9 +1524,235 @@ std::set<CryptoKernel::Blockchain::dbOutput> CryptoKernel::Blockchain::getSpentO
     return returning;
 }
 
+std::vector<CryptoKernel::Blockchain::addressOutput>
+CryptoKernel::Blockchain::getAddressOutputs(const std::string& publicKey, const bool spent,
+                                            const uint64_t limit, const std::string& after) {
+    std::unique_ptr<Storage::Transaction> dbTx(blockdb->beginReadOnly());
+    return getAddressOutputs(dbTx.get(), publicKey, spent, limit, after);
+}
+
+std::vector<CryptoKernel::Blockchain::addressOutput>
+CryptoKernel::Blockchain::getAddressOutputs(Storage::Transaction* dbTx,
+                                            const std::string& publicKey, const bool spent,
+                                            const uint64_t limit, const std::string& after) {
+    std::vector<addressOutput> returning;
+
+    Storage::Table* table = spent ? stxos.get() : utxos.get();
+    std::unique_ptr<Storage::Table::Iterator> it(new Storage::Table::Iterator(table, blockdb.get(), dbTx->snapshot, publicKey, 0));
+
+    if(after.empty()) {
+        it->SeekToFirst();
+    } else {
+        it->Seek(after);
+        if(it->Valid() && it->key() == after) {
+            it->Next();
+        }
+    }
+
+    for(; it->Valid() && returning.size() < limit; it->Next()) {
+        addressOutput out;
+        out.id = it->key();
+        out.spent = spent;
+
+        const Json::Value entry = it->value();
+        if(entry.isObject()) {
+            out.value = entry["value"].asUInt64();
+            out.height = entry["height"].asUInt64();
+            out.txId = entry["tx"].asString();
+        } else {
+            // Entry written before the index covered the output
+            const Json::Value outputJson = table->get(dbTx, out.id);
+            const dbOutput txo = dbOutput(outputJson);
+            out.value = txo.getValue();
+            out.txId = outputJson["creationTx"].asString();
+            out.height = getBlockDB(dbTx,
+                                    transactions->get(dbTx, out.txId)["confirmingBlock"].asString()).getHeight();
+        }
+
+        returning.push_back(out);
+    }
+
+    return returning;
+}
+
+CryptoKernel::Blockchain::addressSummary CryptoKernel::Blockchain::getAddressSummary(
+    const std::string& publicKey) {
+    std::unique_ptr<Storage::Transaction> dbTx(blockdb->beginReadOnly());
+
+    const Json::Value summaryJson = addresses->get(dbTx.get(), publicKey);
+
+    addressSummary returning;
+    returning.balance = summaryJson["balance"].asUInt64();
+    returning.received = summaryJson["received"].asUInt64();
+    returning.outputs = summaryJson["outputs"].asUInt64();
+    returning.spent = summaryJson["spent"].asUInt64();
+    returning.txs = summaryJson["txs"].asUInt64();
+
+    return returning;
+}
+
+void CryptoKernel::Blockchain::applyAddressDeltas(Storage::Transaction* dbTx,
+        const std::map<std::string, addressDelta>& deltas, const int64_t txDelta) {
+    for(const auto& delta : deltas) {
+        Json::Value summaryJson = addresses->get(dbTx, delta.first);
+
+        auto add = [&](const std::string& field, const int64_t change) {
+            summaryJson[field] = static_cast<Json::UInt64>(summaryJson[field].asUInt64() + change);
+        };
+
+        add("balance", delta.second.balance);
+        add("received", delta.second.received);
+        add("outputs", delta.second.outputs);
+        add("spent", delta.second.spent);
+        add("txs", txDelta);
+
+        addresses->put(dbTx, delta.first, summaryJson);
+    }
+}
+
+void CryptoKernel::Blockchain::reindexAddresses() {
+    log->printf(LOG_LEVEL_INFO, "Blockchain::reindexAddresses(): building address index");
+
+    std::unique_ptr<Storage::Transaction> dbTx(blockdb->begin());
+
+    const uint64_t tipHeight = getBlockDB(dbTx.get(), "tip").getHeight();
+
+    std::map<std::string, addressSummary> summaries;
+
+    for(uint64_t height = 1; height <= tipHeight; height++) {
+        const dbBlock indexedBlock = getBlockByHeightDB(dbTx.get(), height);
+
+        std::set<BigNum> txIds = indexedBlock.getTransactions();
+        txIds.insert(indexedBlock.getCoinbaseTx());
+
+        for(const BigNum& txId : txIds) {
+            const dbTransaction tx = getTransactionDB(dbTx.get(), txId.toString());
+            std::set<std::string> touched;
+
+            for(const BigNum& outputId : tx.getOutputs()) {
+                const std::string id = outputId.toString();
+                const bool spent = !utxos->get(dbTx.get(), id).isObject();
+                Storage::Table* table = spent ? stxos.get() : utxos.get();
+
+                const dbOutput out = dbOutput(table->get(dbTx.get(), id));
+                const auto txoData = out.getData();
+                if(txoData["publicKey"].isNull()) {
+                    continue;
+                }
+
+                const std::string publicKey = txoData["publicKey"].asString();
+                const auto txoStr = publicKey + id;
+
+                Json::Value indexEntry = table->get(dbTx.get(), txoStr, 0);
+                if(!indexEntry.isObject()) {
+                    indexEntry = Json::Value(Json::objectValue);
+                }
+                indexEntry["value"] = static_cast<Json::UInt64>(out.getValue());
+                indexEntry["height"] = static_cast<Json::UInt64>(height);
+                indexEntry["tx"] = txId.toString();
+                table->put(dbTx.get(), txoStr, indexEntry, 0);
+
+                addressSummary& summary = summaries[publicKey];
+                if(!spent) {
+                    summary.balance += out.getValue();
+                }
+                summary.received += out.getValue();
+                summary.outputs++;
+                touched.insert(publicKey);
+            }
+
+            for(const BigNum& inputId : tx.getInputs()) {
+                const input inp = getInput(dbTx.get(), inputId.toString());
+                const std::string outputId = inp.getOutputId().toString();
+                const dbOutput out = dbOutput(stxos->get(dbTx.get(), outputId));
+                const auto txoData = out.getData();
+                if(txoData["publicKey"].isNull()) {
+                    continue;
+                }
+
+                const std::string publicKey = txoData["publicKey"].asString();
+                const auto txoStr = publicKey + outputId;
+
+                // The spent output is always confirmed at a lower height so
+                // its entry has already been filled in
+                Json::Value indexEntry = stxos->get(dbTx.get(), txoStr, 0);
+                indexEntry["spentBy"] = txId.toString();
+                indexEntry["spentHeight"] = static_cast<Json::UInt64>(height);
+                stxos->put(dbTx.get(), txoStr, indexEntry, 0);
+
+                summaries[publicKey].spent++;
+                touched.insert(publicKey);
+            }
+
+            for(const std::string& publicKey : touched) {
+                summaries[publicKey].txs++;
+            }
+        }
+
+        // Commit periodically so the write batch doesn't grow with the chain
+        if(height % 1000 == 0) {
+            dbTx->commit();
+            dbTx.reset(blockdb->begin());
+            log->printf(LOG_LEVEL_INFO, "Blockchain::reindexAddresses(): indexed "
+                        + std::to_string(height) + "/" + std::to_string(tipHeight) + " blocks");
+        }
+    }
+
+    for(const auto& summary : summaries) {
+        Json::Value summaryJson;
+        summaryJson["balance"] = static_cast<Json::UInt64>(summary.second.balance);
+        summaryJson["received"] = static_cast<Json::UInt64>(summary.second.received);
+        summaryJson["outputs"] = static_cast<Json::UInt64>(summary.second.outputs);
+        summaryJson["spent"] = static_cast<Json::UInt64>(summary.second.spent);
+        summaryJson["txs"] = static_cast<Json::UInt64>(summary.second.txs);
+        addresses->put(dbTx.get(), summary.first, summaryJson);
+    }
+
+    // Only mark the index as built once the summaries are written, so an
+    // interrupted reindex starts again from scratch
+    addresses->put(dbTx.get(), "version", addressIndexVersion, 0);
+    dbTx->commit();
+
+    log->printf(LOG_LEVEL_INFO, "Blockchain::reindexAddresses(): address index built");
+}
+
+void CryptoKernel::Blockchain::backfillFilters() {
+    log->printf(LOG_LEVEL_INFO, "Blockchain::backfillFilters(): building block filters");
+
+    std::unique_ptr<Storage::Transaction> dbTx(blockdb->begin());
+
+    const uint64_t tipHeight = getBlockDB(dbTx.get(), "tip").getHeight();
+
+    for(uint64_t height = 1; height <= tipHeight; height++) {
+        const dbBlock filteredBlock = getBlockByHeightDB(dbTx.get(), height);
+        const std::string id = filteredBlock.getId().toString();
+
+        // Blocks connected since filters were added already have one
+        if(!filters->get(dbTx.get(), id).isObject()) {
+            filters->put(dbTx.get(), id, buildBlockFilter(dbTx.get(), filteredBlock).toJson());
+        }
+
+        // Commit periodically so the write batch doesn't grow with the chain
+        if(height % 1000 == 0) {
+            dbTx->commit();
+            dbTx.reset(blockdb->begin());
+            log->printf(LOG_LEVEL_INFO, "Blockchain::backfillFilters(): built "
+                        + std::to_string(height) + "/" + std::to_string(tipHeight) + " filters");
+        }
+    }
+
+    // An interrupted backfill starts again but skips the filters it stored
+    filters->put(dbTx.get(), "version", filtersVersion, 0);
+    dbTx->commit();
+
+    log->printf(LOG_LEVEL_INFO, "Blockchain::backfillFilters(): block filters built");
+}
+
 void CryptoKernel::Blockchain::reverseBlock(Storage::Transaction* dbTransaction) {
     const block tip = getBlock(dbTransaction, "tip");
 
+    std::map<std::string, addressDelta> deltas;
+
     auto eraseUtxo = [&](const auto& out, auto& db) {
         db->erase(dbTransaction, out.getId().toString());
 
@@ -923,8 +1763,27 @@ void CryptoKernel::Blockchain::reverseBlock(Storage::Transaction* dbTransaction)
         }
     };
 
-    for(const output& out : tip.getCoinbaseTx().getOutputs()) {
+    auto unconfirmOutput = [&](const output& out) {
         eraseUtxo(out, utxos);
+
+        const auto txoData = out.getData();
+        if(!txoData["publicKey"].isNull()) {
+            addressDelta& delta = deltas[txoData["publicKey"].asString()];
+            delta.balance -= out.getValue();
+            delta.received -= out.getValue();
+            delta.outputs--;
+        }
+    };
+
+    for(const output& out : tip.getCoinbaseTx().getOutputs()) {
+        unconfirmOutput(out);
+    }
+
+    applyAddressDeltas(dbTransaction, deltas, -1);
+
+    if(txIndex) {
+        indexAddressTxs(dbTransaction, deltas, tip.getHeight(),
+                        tip.getCoinbaseTx().getId().toString(), true);
     }
 
     transactions->erase(dbTransaction, tip.getCoinbaseTx().getId().toString());
@@ -932,26 +1791,52 @@ void CryptoKernel::Blockchain::reverseBlock(Storage::Transaction* dbTransaction)
 	std::set<transaction> replayTxs;
 
     for(const transaction& tx : tip.getTransactions()) {
+        deltas.clear();
+
         for(const output& out : tx.getOutputs()) {
-            eraseUtxo(out, utxos);
+            unconfirmOutput(out);
         }
 
         for(const input& inp : tx.getInputs()) {
             inputs->erase(dbTransaction, inp.getId().toString());
 
             const std::string oldOutputId = inp.getOutputId().toString();
+            if(txIndex) {
+                spentBy->erase(dbTransaction, oldOutputId);
+            }
             const dbOutput oldOutput = dbOutput(stxos->get(dbTransaction, oldOutputId));
+            const auto txoData = oldOutput.getData();
+
+            Json::Value indexEntry;
+            if(!txoData["publicKey"].isNull()) {
+                indexEntry = stxos->get(dbTransaction,
+                                        txoData["publicKey"].asString() + oldOutputId, 0);
+                if(indexEntry.isObject()) {
+                    indexEntry.removeMember("spentBy");
+                    indexEntry.removeMember("spentHeight");
+                }
+            }
 
             eraseUtxo(oldOutput, stxos);
 
             utxos->put(dbTransaction, oldOutputId, oldOutput.toJson());
-            const auto txoData = oldOutput.getData();
             if(!txoData["publicKey"].isNull()) {
-                const auto txoStr = txoData["publicKey"].asString() + oldOutputId;
-                utxos->put(dbTransaction, txoStr, Json::nullValue, 0);
+                const std::string publicKey = txoData["publicKey"].asString();
+                const auto txoStr = publicKey + oldOutputId;
+                utxos->put(dbTransaction, txoStr, indexEntry, 0);
+
+                addressDelta& delta = deltas[publicKey];
+                delta.balance += oldOutput.getValue();
+                delta.spent--;
             }
         }
 
+        applyAddressDeltas(dbTransaction, deltas, -1);
+
+        if(txIndex) {
+            indexAddressTxs(dbTransaction, deltas, tip.getHeight(), tx.getId().toString(), true);
+        }
+
         transactions->erase(dbTransaction, tx.getId().toString());
 
 		replayTxs.insert(tx);
@@ -965,9 +1850,14 @@ void CryptoKernel::Blockchain::reverseBlock(Storage::Transaction* dbTransaction)
                 tip.getPreviousBlockId().toString()).toJson());
 
     candidates->put(dbTransaction, tip.getId().toString(), tip.toJson());
+    filters->erase(dbTransaction, tip.getId().toString());
+
+    pendingEvents.push_back([tip](Listener* listener) {
+        listener->blockDisconnected(tip);
+    });
 
     mempoolMutex.lock();
-	unconfirmedTransactions.rescanMempool(dbTransaction, this);
+	notifyRemoved(unconfirmedTransactions.rescanMempool(dbTransaction, this));
     mempoolMutex.unlock();
 
 	for(const auto& tx : replayTxs) {
@@ -1010,6 +1900,43 @@ CryptoKernel::Blockchain::transaction CryptoKernel::Blockchain::getTransaction(
             tx.isCoinbaseTx());
 }
 
+Json::Value CryptoKernel::Blockchain::getTransactionJson(Storage::Transaction* transaction,
+        const std::string& id) {
+    const Json::Value jsonTx = transactions->get(transaction, id);
+    if(!jsonTx.isObject()) {
+        throw NotFoundException("Transaction " + id);
+    }
+
+    // The stored ids are in the same order as the sets of a transaction, so
+    // the JSON matches transaction::toJson
+    Json::Value returning;
+    returning["timestamp"] = jsonTx["timestamp"];
+
+    for(const Json::Value& inpId : jsonTx["inputs"]) {
+        const Json::Value inp = inputs->get(transaction, inpId.asString());
+        if(!inp.isObject()) {
+            throw NotFoundException("Input " + inpId.asString());
+        }
+        returning["inputs"].append(inp);
+    }
+
+    for(const Json::Value& outId : jsonTx["outputs"]) {
+        Json::Value out = utxos->get(transaction, outId.asString());
+        if(!out.isObject()) {
+            out = stxos->get(transaction, outId.asString());
+            if(!out.isObject()) {
+                throw NotFoundException("Output " + outId.asString());
+            }
+        }
+
+        out.removeMember("creationTx");
+        out.removeMember("id");
+        returning["outputs"].append(out);
+    }
+
+    return returning;
+}
+
 void CryptoKernel::Blockchain::emptyDB() {
     blockdb.reset();
     CryptoKernel::Storage::destroy(dbDir);
@@ -1025,7 +1952,7 @@ CryptoKernel::Blockchain::Mempool::Mempool() {
 	bytes = 0;
 }
 
-bool CryptoKernel::Blockchain::Mempool::insert(const transaction& tx) {
+bool CryptoKernel::Blockchain::Mempool::insert(const transaction& tx, const uint64_t gasUsed) {
 	// Check if any inputs or outputs conflict
 	if(txs.find(tx.getId()) != txs.end()) {
 		return false;
@@ -1048,6 +1975,7 @@ bool CryptoKernel::Blockchain::Mempool::insert(const transaction& tx) {
 	}
 
 	txs.insert(std::pair<BigNum, transaction>(tx.getId(), tx));
+    gas[tx.getId()] = gasUsed;
 
     bytes += tx.size();
 
@@ -1066,6 +1994,7 @@ bool CryptoKernel::Blockchain::Mempool::insert(const transaction& tx) {
 void CryptoKernel::Blockchain::Mempool::remove(const transaction& tx) {
 	if(txs.find(tx.getId()) != txs.end()) {
 		txs.erase(tx.getId());
+        gas.erase(tx.getId());
 
         bytes -= tx.size();
 
@@ -1080,7 +2009,7 @@ void CryptoKernel::Blockchain::Mempool::remove(const transaction& tx) {
 	}
 }
 
-void CryptoKernel::Blockchain::Mempool::rescanMempool(Storage::Transaction* dbTx, Blockchain* blockchain) {
+std::set<CryptoKernel::Blockchain::transaction> CryptoKernel::Blockchain::Mempool::rescanMempool(Storage::Transaction* dbTx, Blockchain* blockchain) {
 	std::set<transaction> removals;
 
 	for(const auto& tx : txs) {
@@ -1092,16 +2021,22 @@ void CryptoKernel::Blockchain::Mempool::rescanMempool(Storage::Transaction* dbTx
 	for(const auto& tx : removals) {
 		remove(tx);
 	}
+
+	return removals;
 }
 
 std::set<CryptoKernel::Blockchain::transaction> CryptoKernel::Blockchain::Mempool::getTransactions() const {
 	uint64_t totalSize = 0;
+	uint64_t totalGas = 0;
 	std::set<transaction> returning;
 
 	for(const auto& it : txs) {
-		if(totalSize + it.second.size() < 3.9 * 1024 * 1024) {
+		const uint64_t txGas = gas.at(it.first);
+		if(totalSize + it.second.size() < 3.9 * 1024 * 1024 &&
+		   totalGas + txGas <= maxBlockGas) {
 			returning.insert(it.second);
 			totalSize += it.second.size();
+			totalGas += txGas;
 			continue;
 		}
 
@@ -22,13 +22,20 @@
 #include <set>
 #include <memory>
 #include <map>
+#include <deque>
+#include <mutex>
+#include <functional>
+#include <atomic>
+#include <thread>
 
 #include "storage.h"
 #include "log.h"
 #include "ckmath.h"
+#include "blockfilter.h"
 
 namespace CryptoKernel {
 class Consensus;
+class ThreadPool;
 class Blockchain {
 public:
     Blockchain(CryptoKernel::Log* GlobalLog,
@@ -252,6 +259,7 @@ public:
         Json::Value toJson() const;
 
         BigNum getId() const;
+        BigNum getConfirmingBlock() const;
         bool isCoinbaseTx() const;
         uint64_t getTimestamp() const;
         std::set<BigNum> getInputs() const;
@@ -271,9 +279,81 @@ public:
         BigNum id;
     };
 
+    /**
+    * Receives notifications about changes to the main chain and the mempool.
+    * Callbacks are made in order, after the change has been committed, on the
+    * thread that made the change. They should return quickly and must not call
+    * submitBlock, submitTransaction, addListener or removeListener.
+    */
+    class Listener {
+    public:
+        virtual ~Listener() {}
+
+        /**
+        * Called when a block is added to the tip of the main chain
+        *
+        * @param block the new tip
+        */
+        virtual void blockConnected(const block& block) {}
+
+        /**
+        * Called when the tip of the main chain is removed during a reorg
+        *
+        * @param block the block that was removed
+        */
+        virtual void blockDisconnected(const block& block) {}
+
+        /**
+        * Called when a transaction is accepted into the mempool
+        *
+        * @param tx the new transaction
+        */
+        virtual void transactionAdded(const transaction& tx) {}
+
+        /**
+        * Called when a transaction is evicted from the mempool because it is
+        * no longer valid against the new chain state. Transactions confirmed
+        * by a connected block leave the mempool before it is rescanned, so
+        * they are only reported through blockConnected. During a reorg a
+        * transaction that depends on a disconnected block is reported here
+        * and may later be confirmed by a block on the new chain.
+        *
+        * @param tx the evicted transaction
+        */
+        virtual void transactionRemoved(const transaction& tx) {}
+    };
+
+    /**
+    * Subscribes a listener to chain and mempool notifications
+    *
+    * @param listener the listener to add, must outlive its subscription
+    */
+    void addListener(Listener* listener);
+
+    /**
+    * Unsubscribes a listener. Once this returns the listener will receive
+    * no more callbacks.
+    *
+    * @param listener the listener to remove
+    */
+    void removeListener(Listener* listener);
+
     std::tuple<bool, bool> submitTransaction(const transaction& tx);
     std::tuple<bool, bool> submitBlock(const block& newBlock, bool genesisBlock = false);
 
+    /**
+    * Checks the parts of a block's validity that don't depend on the state of
+    * the chain: the context-free consensus rules (e.g. Proof of Work against the
+    * block's own target) and signature syntax. Structure, size limits and the
+    * merkle root are already enforced when the block is deserialized. Safe to
+    * call concurrently on many blocks. Results are cached so submitBlock doesn't
+    * repeat the work.
+    *
+    * @param block the block to check
+    * @return true iff the block passed the context-free checks
+    */
+    bool preValidateBlock(const block& block);
+
     block generateVerifyingBlock(const std::string& publicKey);
 
     block getBlock(Storage::Transaction* transaction, const std::string& id);
@@ -288,6 +368,21 @@ public:
 
     block buildBlock(Storage::Transaction* transaction, const dbBlock& dbblock);
 
+    /**
+    * Reads the main chain block at the given height as JSON, straight from the
+    * stored block, transactions, inputs and outputs. Nothing is rebuilt or
+    * re-hashed, the stored ids are used as they are.
+    *
+    * @param transaction the database transaction this query will be performed on
+    * @param height the height of the block to read
+    * @param full true for the block as block::toJson writes it, false for the
+    *        stored block with its transactions as ids
+    * @return the block's JSON, with its id added
+    * @throw NotFoundException if there is no block at that height
+    */
+    Json::Value getBlockJsonByHeight(Storage::Transaction* transaction, const uint64_t height,
+                                     const bool full);
+
     block getBlock(const std::string& id);
 
     /**
@@ -320,6 +415,39 @@ public:
 
     dbTransaction getTransactionDB(Storage::Transaction* transaction, const std::string& id);
 
+    /**
+    * Reads a confirmed transaction as transaction::toJson writes it, straight from
+    * the stored transaction, inputs and outputs
+    *
+    * @param transaction the database transaction this query will be performed on
+    * @param id the id of the transaction to read
+    * @return the transaction's JSON
+    * @throw NotFoundException if the transaction is not found
+    */
+    Json::Value getTransactionJson(Storage::Transaction* transaction, const std::string& id);
+
+    /**
+    * Retrieves the compact filter of the keys paid to and spent from in a
+    * main chain block. Filters are stored as blocks are connected, and for
+    * chains stored before that they are backfilled when the chain loads.
+    *
+    * @param dbTx the database transaction this query will be performed on
+    * @param id the id of the block
+    * @return the block's filter
+    * @throw NotFoundException if the block is not in the main chain
+    */
+    BlockFilter getBlockFilter(Storage::Transaction* dbTx, const std::string& id);
+
+    /**
+    * Retrieves the compact filter of the keys paid to and spent from in a
+    * main chain block
+    *
+    * @param id the id of the block
+    * @return the block's filter
+    * @throw NotFoundException if the block is not in the main chain
+    */
+    BlockFilter getBlockFilter(const std::string& id);
+
     /**
     * Retrieves the output, spent or unspent, that is associated
     * with the given id
@@ -340,6 +468,137 @@ public:
 
     std::set<dbOutput> getSpentOutputs(const std::string& publicKey);
 
+    /**
+    * An output paying a public key, as stored in the address index
+    */
+    struct addressOutput {
+        std::string id;
+        uint64_t value;
+        uint64_t height;
+        std::string txId;
+        bool spent;
+    };
+
+    /**
+    * Running totals for a public key, kept up to date as blocks are
+    * connected and disconnected
+    */
+    struct addressSummary {
+        // Value of the outputs paying the key that are still unspent
+        uint64_t balance;
+        // Value of every output ever paid to the key
+        uint64_t received;
+        // Number of outputs paid to the key
+        uint64_t outputs;
+        // Number of those outputs that have been spent
+        uint64_t spent;
+        // Number of transactions paying or spending from the key
+        uint64_t txs;
+    };
+
+    /**
+    * Reads a page of the outputs paying a public key straight from the
+    * address index, without looking up each output. Outputs are ordered by id.
+    *
+    * @param publicKey the key to list the outputs of
+    * @param spent true to list spent outputs, false for unspent ones
+    * @param limit the maximum number of outputs to return
+    * @param after the id of the last output of the previous page, empty for
+    *        the first page
+    * @return the outputs found
+    */
+    std::vector<addressOutput> getAddressOutputs(const std::string& publicKey,
+                                                 const bool spent, const uint64_t limit,
+                                                 const std::string& after = "");
+
+    /**
+    * Reads a page of the address index from an existing transaction, so
+    * that consecutive pages and the outputs they name come from the same
+    * snapshot
+    *
+    * @param dbTx the read only transaction to read from
+    */
+    std::vector<addressOutput> getAddressOutputs(Storage::Transaction* dbTx,
+                                                 const std::string& publicKey,
+                                                 const bool spent, const uint64_t limit,
+                                                 const std::string& after = "");
+
+    /**
+    * Returns the totals for a public key. Keys never seen on chain have all
+    * totals zero.
+    *
+    * @param publicKey the key to summarise
+    * @return the key's totals
+    */
+    addressSummary getAddressSummary(const std::string& publicKey);
+
+    /**
+    * A confirmed transaction found through the transaction index
+    */
+    struct indexedTx {
+        std::string txId;
+        uint64_t height;
+        // Pass as after to getAddressTransactions to continue from this one
+        std::string cursor;
+    };
+
+    /**
+    * Turns on the optional transaction index, which records the transaction
+    * spending each output and every transaction touching each address. Must
+    * be called before loadChain. If the chain was stored without the index it
+    * is built in the background, and queries only cover the chain up to
+    * getTxIndexHeight until it finishes.
+    */
+    void enableTxIndex();
+
+    /**
+    * Returns whether the transaction index is turned on
+    */
+    bool txIndexEnabled() const;
+
+    /**
+    * Sets the height from which the gas rules apply. From that block on, host
+    * calls made by contracts count towards the per-script gas limit, and
+    * neither a transaction nor a block may use more than the block gas cap. Blocks
+    * below it are checked with the instruction limit alone, as before the
+    * rules existed. Must be called before loadChain. Without a call the rules
+    * never apply.
+    *
+    * @param height the first height the gas rules apply to
+    */
+    void setGasActivationHeight(const uint64_t height);
+
+    /**
+    * Returns the height up to which the transaction index has been built, or
+    * the tip height once the index has caught up
+    */
+    uint64_t getTxIndexHeight();
+
+    /**
+    * Finds the transaction that spent an output. Requires the transaction
+    * index.
+    *
+    * @param outputId the id of the output
+    * @return the spending transaction
+    * @throw NotFoundException if the output is unspent, unknown or the
+    *        transaction index is off
+    */
+    indexedTx getSpendingTx(const std::string& outputId);
+
+    /**
+    * Reads a page of the confirmed transactions paying or spending from a
+    * public key, oldest first. Requires the transaction index.
+    *
+    * @param publicKey the key to list the transactions of
+    * @param limit the maximum number of transactions to return
+    * @param after the cursor of the last transaction of the previous page,
+    *        empty for the first page
+    * @return the transactions found, empty if the index is off
+    */
+    std::vector<indexedTx> getAddressTransactions(const std::string& publicKey,
+                                                  const uint64_t limit,
+                                                  const std::string& after = "");
+
     std::set<transaction> getUnconfirmedTransactions();
 
     /**
@@ -363,25 +622,56 @@ private:
     std::unique_ptr<Storage::Table> utxos;
     std::unique_ptr<Storage::Table> stxos;
     std::unique_ptr<Storage::Table> inputs;
+    std::unique_ptr<Storage::Table> filters;
+    std::unique_ptr<Storage::Table> addresses;
+    std::unique_ptr<Storage::Table> spentBy;
+    std::unique_ptr<Storage::Table> addressTxs;
+
+    bool txIndex;
+    std::atomic<bool> stopTxIndex;
+
+    uint64_t gasActivationHeight;
+
+    /**
+    * Returns whether the gas rules apply to the block after the tip in dbTx,
+    * which is the one being connected or mined on
+    */
+    bool gasRulesActive(Storage::Transaction* dbTx);
+    std::unique_ptr<std::thread> txIndexThread;
+
+    /**
+    * Indexes the blocks stored before the transaction index was enabled,
+    * reading them in parallel. Runs on txIndexThread.
+    */
+    void buildTxIndex();
 
     std::unique_ptr<Storage> blockdb;
     BigNum genesisBlockId;
+
+    // Runs the contract inputs of a transaction in parallel
+    std::unique_ptr<ThreadPool> scriptPool;
+    // Verifies the transactions of a block in parallel. Separate from
+    // scriptPool as its tasks wait on scriptPool tasks, and long lived so
+    // each worker keeps its pooled contract VMs between blocks.
+    std::unique_ptr<ThreadPool> txPool;
     Log *log;
 
 	class Mempool {
 		public:
 			Mempool();
 
-			bool insert(const transaction& tx);
+			bool insert(const transaction& tx, const uint64_t gasUsed = 0);
 			void remove(const transaction& tx);
 			std::set<transaction> getTransactions() const;
-			void rescanMempool(Storage::Transaction* dbTx, Blockchain* blockchain);
+			std::set<transaction> rescanMempool(Storage::Transaction* dbTx, Blockchain* blockchain);
 
             unsigned int count() const;
             unsigned int size() const;
 
 		private:
 			std::map<BigNum, transaction> txs;
+			// Gas each transaction's contracts used when it was accepted
+			std::map<BigNum, uint64_t> gas;
 			std::map<BigNum, BigNum> outputs;
 			std::map<BigNum, BigNum> inputs;
 
@@ -391,12 +681,71 @@ private:
     Mempool unconfirmedTransactions;
     std::mutex mempoolMutex;
 
+    std::set<Listener*> listeners;
+    std::mutex listenersMutex;
+    // Notifications for the open write transaction, only touched while holding it
+    std::vector<std::function<void(Listener*)>> pendingEvents;
+    void commitAndNotify(Storage::Transaction* dbTx);
+    void notifyRemoved(const std::set<transaction>& removed);
+
+    std::map<std::string, bool> preValidated;
+    std::deque<std::string> preValidatedOrder;
+    std::mutex preValidatedMutex;
+    bool checkSignatureSyntax(const transaction& tx);
+
     std::string dbDir;
 
+    /**
+    * Checks a transaction against the chain state in dbTransaction. If gasUsed is given
+    * it is set to the gas the transaction's contracts used when the transaction is valid.
+    */
     std::tuple<bool, bool> verifyTransaction(Storage::Transaction* dbTransaction, const transaction& tx,
-                           const bool coinbaseTx = false);
+                           const bool coinbaseTx = false, uint64_t* gasUsed = nullptr);
     void confirmTransaction(Storage::Transaction* dbTransaction, const transaction& tx,
-                            const BigNum& confirmingBlock, const bool coinbaseTx = false);
+                            const BigNum& confirmingBlock, const uint64_t height,
+                            std::set<std::string>& filterElements,
+                            const bool coinbaseTx = false);
+
+    struct addressDelta {
+        int64_t balance;
+        int64_t received;
+        int64_t outputs;
+        int64_t spent;
+    };
+
+    /**
+    * Adds the changes made by one transaction to the summaries of the
+    * addresses it touched, counting the transaction itself as txDelta
+    */
+    void applyAddressDeltas(Storage::Transaction* dbTx,
+                            const std::map<std::string, addressDelta>& deltas,
+                            const int64_t txDelta);
+
+    /**
+    * Builds the address index entries and summaries for a chain stored
+    * before the index existed
+    */
+    void reindexAddresses();
+
+    /**
+    * Stores the filters of main chain blocks connected before filters
+    * were stored, so they never have to be computed on request
+    */
+    void backfillFilters();
+
+    /**
+    * Computes the filter of a main chain block from its transactions
+    */
+    BlockFilter buildBlockFilter(Storage::Transaction* dbTx, const dbBlock& filteredBlock);
+
+    /**
+    * Adds or, if erase is set, removes the transaction index entries for a
+    * transaction touching the given addresses
+    */
+    void indexAddressTxs(Storage::Transaction* dbTx,
+                         const std::map<std::string, addressDelta>& touched,
+                         const uint64_t height, const std::string& txId,
+                         const bool erase);
     uint64_t getTransactionFee(const transaction& tx);
     uint64_t calculateTransactionFee(Storage::Transaction* dbTx, const transaction& tx);
     bool status;
@@ -453,6 +802,20 @@ public:
                                      CryptoKernel::Blockchain::block& block,
                                      const CryptoKernel::Blockchain::dbBlock& previousBlock) = 0;
 
+    /**
+    * Checks the consensus rules of the given block that don't depend on the
+    * state of the blockchain, for example that a Proof of Work is below the
+    * target claimed in the block's consensusData. May be called concurrently
+    * on many blocks before they are submitted. checkConsensusRules is still
+    * called on every block. The default implementation accepts every block.
+    *
+    * @param block the block to check
+    * @return true iff the block passes the context-free consensus rules
+    */
+    virtual bool checkConsensusRulesStateless(const CryptoKernel::Blockchain::block& block) {
+        return true;
+    }
+
     /**
     * Pure virtual function that generates the consensus data
     * for a block owned by the given public key. In a Proof of
@@ -437,6 +437,10 @@ uint64_t CryptoKernel::Blockchain::dbTransaction::getTimestamp() const {
     return timestamp;
 }
 
+CryptoKernel::BigNum CryptoKernel::Blockchain::dbTransaction::getConfirmingBlock() const {
+    return confirmingBlock;
+}
+
 bool CryptoKernel::Blockchain::dbTransaction::isCoinbaseTx() const {
     return coinbaseTx;
 }
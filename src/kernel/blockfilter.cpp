@@ -0,0 +1,223 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "blockfilter.h"
+#include "base64.h"
+#include "crypto.h"
+
+// Golomb-Rice parameter and false positive rate, as in BIP 158
+static const unsigned int filterP = 19;
+static const uint64_t filterM = 784931;
+
+namespace {
+// High 64 bits of a 128 bit product, without relying on a 128 bit type
+uint64_t mulHigh(const uint64_t a, const uint64_t b) {
+    const uint64_t aLo = a & 0xffffffff;
+    const uint64_t aHi = a >> 32;
+    const uint64_t bLo = b & 0xffffffff;
+    const uint64_t bHi = b >> 32;
+
+    const uint64_t lolo = aLo * bLo;
+    const uint64_t hilo = aHi * bLo;
+    const uint64_t lohi = aLo * bHi;
+    const uint64_t hihi = aHi * bHi;
+
+    const uint64_t cross = (lolo >> 32) + (hilo & 0xffffffff) + lohi;
+
+    return hihi + (hilo >> 32) + (cross >> 32);
+}
+
+class BitWriter {
+public:
+    BitWriter() {
+        nBits = 0;
+    }
+
+    void write(const uint64_t value, const unsigned int bits) {
+        for(unsigned int i = bits; i > 0; i--) {
+            writeBit((value >> (i - 1)) & 1);
+        }
+    }
+
+    void writeBit(const bool bit) {
+        if(nBits % 8 == 0) {
+            out.push_back(0);
+        }
+
+        if(bit) {
+            out.back() |= static_cast<char>(0x80 >> (nBits % 8));
+        }
+
+        nBits++;
+    }
+
+    std::string out;
+
+private:
+    uint64_t nBits;
+};
+
+class BitReader {
+public:
+    BitReader(const std::string& in) : in(in) {
+        pos = 0;
+    }
+
+    bool readBit() {
+        if(pos >= in.size() * 8) {
+            throw std::runtime_error("Block filter is truncated");
+        }
+
+        const bool bit = (static_cast<unsigned char>(in[pos / 8]) >> (7 - pos % 8)) & 1;
+        pos++;
+        return bit;
+    }
+
+    uint64_t read(const unsigned int bits) {
+        uint64_t value = 0;
+        for(unsigned int i = 0; i < bits; i++) {
+            value = (value << 1) | readBit();
+        }
+        return value;
+    }
+
+private:
+    const std::string& in;
+    uint64_t pos;
+};
+}
+
+CryptoKernel::BlockFilter::BlockFilter(const BigNum& blockId,
+                                       const std::set<std::string>& elements) {
+    setKey(blockId);
+    n = elements.size();
+
+    std::vector<uint64_t> hashes;
+    hashes.reserve(n);
+    for(const std::string& element : elements) {
+        hashes.push_back(hashToRange(element));
+    }
+    std::sort(hashes.begin(), hashes.end());
+
+    BitWriter writer;
+    uint64_t last = 0;
+    for(const uint64_t hash : hashes) {
+        const uint64_t delta = hash - last;
+        last = hash;
+
+        for(uint64_t q = delta >> filterP; q > 0; q--) {
+            writer.writeBit(true);
+        }
+        writer.writeBit(false);
+        writer.write(delta, filterP);
+    }
+
+    data = writer.out;
+}
+
+CryptoKernel::BlockFilter::BlockFilter(const BigNum& blockId, const Json::Value& filterJson) {
+    setKey(blockId);
+
+    if(!filterJson["n"].isUInt64() || !filterJson["filter"].isString()) {
+        throw std::runtime_error("Block filter JSON is malformed");
+    }
+
+    n = filterJson["n"].asUInt64();
+    data = base64_decode(filterJson["filter"].asString());
+
+    // Every element takes at least P + 1 bits
+    if(n > data.size() * 8 / (filterP + 1)) {
+        throw std::runtime_error("Block filter is too short for its element count");
+    }
+}
+
+void CryptoKernel::BlockFilter::setKey(const BigNum& blockId) {
+    std::string idHex = blockId.toString();
+    if(idHex.size() < 32) {
+        idHex = std::string(32 - idHex.size(), '0') + idHex;
+    }
+
+    k0 = std::stoull(idHex.substr(0, 16), nullptr, 16);
+    k1 = std::stoull(idHex.substr(16, 16), nullptr, 16);
+}
+
+uint64_t CryptoKernel::BlockFilter::hashToRange(const std::string& element) const {
+    return mulHigh(CryptoKernel::Crypto::sipHash(k0, k1, element), n * filterM);
+}
+
+std::vector<uint64_t> CryptoKernel::BlockFilter::decode() const {
+    std::vector<uint64_t> returning;
+    returning.reserve(n);
+
+    BitReader reader(data);
+    uint64_t last = 0;
+    for(uint64_t i = 0; i < n; i++) {
+        uint64_t q = 0;
+        while(reader.readBit()) {
+            q++;
+        }
+
+        last += (q << filterP) + reader.read(filterP);
+        returning.push_back(last);
+    }
+
+    return returning;
+}
+
+bool CryptoKernel::BlockFilter::match(const std::string& element) const {
+    return matchAny(std::set<std::string>{element});
+}
+
+bool CryptoKernel::BlockFilter::matchAny(const std::set<std::string>& elements) const {
+    if(n == 0 || elements.empty()) {
+        return false;
+    }
+
+    std::vector<uint64_t> queries;
+    queries.reserve(elements.size());
+    for(const std::string& element : elements) {
+        queries.push_back(hashToRange(element));
+    }
+    std::sort(queries.begin(), queries.end());
+
+    const std::vector<uint64_t> hashes = decode();
+
+    // Both lists are sorted so walk them together
+    auto query = queries.begin();
+    auto hash = hashes.begin();
+    while(query != queries.end() && hash != hashes.end()) {
+        if(*query == *hash) {
+            return true;
+        } else if(*query < *hash) {
+            query++;
+        } else {
+            hash++;
+        }
+    }
+
+    return false;
+}
+
+Json::Value CryptoKernel::BlockFilter::toJson() const {
+    Json::Value returning;
+    returning["n"] = static_cast<Json::UInt64>(n);
+    returning["filter"] = base64_encode(reinterpret_cast<const unsigned char*>(data.data()),
+                                        data.size());
+    return returning;
+}
+
+uint64_t CryptoKernel::BlockFilter::getN() const {
+    return n;
+}
+
+std::set<std::string> CryptoKernel::BlockFilter::getElements(const Json::Value& outputData) {
+    std::set<std::string> returning;
+
+    for(const char* field : {"publicKey", "schnorrKey", "merkleRoot"}) {
+        if(outputData.isObject() && outputData[field].isString()) {
+            returning.insert(outputData[field].asString());
+        }
+    }
+
+    return returning;
+}
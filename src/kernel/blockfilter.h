@@ -0,0 +1,101 @@
+/*  CryptoKernel - A library for creating blockchain based digital currency
+    Copyright (C) 2016  James Lovejoy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BLOCKFILTER_H_INCLUDED
+#define BLOCKFILTER_H_INCLUDED
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include <json/value.h>
+
+#include "ckmath.h"
+
+namespace CryptoKernel {
+/**
+* A compact probabilistic set of the keys a block's transactions pay to or
+* spend from, encoded as a Golomb-coded set. Light wallets test their keys
+* against each block's filter and only download the blocks that match.
+* False positives happen at a rate of about one in 784931 per key tested,
+* false negatives never happen.
+*/
+class BlockFilter {
+public:
+    /**
+    * Builds the filter for a block
+    *
+    * @param blockId the id of the block, used to key the element hashes
+    * @param elements the keys to put in the filter
+    */
+    BlockFilter(const BigNum& blockId, const std::set<std::string>& elements);
+
+    /**
+    * Loads a filter previously serialized with toJson
+    *
+    * @param blockId the id of the block the filter belongs to
+    * @param filterJson the serialized filter
+    * @throw std::runtime_error if the filter is malformed
+    */
+    BlockFilter(const BigNum& blockId, const Json::Value& filterJson);
+
+    /**
+    * Tests whether an element might be in the filter
+    *
+    * @param element the element to test
+    * @return false if the element is definitely not in the filter
+    */
+    bool match(const std::string& element) const;
+
+    /**
+    * Tests whether any of the given elements might be in the filter. Cheaper
+    * than calling match on each element as the filter is only decoded once.
+    *
+    * @param elements the elements to test
+    * @return false if none of the elements are in the filter
+    */
+    bool matchAny(const std::set<std::string>& elements) const;
+
+    Json::Value toJson() const;
+
+    /**
+    * Returns the number of elements in the filter
+    */
+    uint64_t getN() const;
+
+    /**
+    * Picks the filterable keys out of an output's data: its publicKey,
+    * schnorrKey and merkleRoot, where present
+    *
+    * @param outputData the data field of an output
+    * @return the keys found
+    */
+    static std::set<std::string> getElements(const Json::Value& outputData);
+
+private:
+    uint64_t n;
+    std::string data;
+    uint64_t k0;
+    uint64_t k1;
+
+    void setKey(const BigNum& blockId);
+    uint64_t hashToRange(const std::string& element) const;
+    std::vector<uint64_t> decode() const;
+};
+}
+
+#endif // BLOCKFILTER_H_INCLUDED
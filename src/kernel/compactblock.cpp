@@ -0,0 +1,144 @@
+#include <iomanip>
+#include <sstream>
+
+#include "compactblock.h"
+#include "crypto.h"
+
+CryptoKernel::CompactBlock::CompactBlock(const Blockchain::block& block, const uint64_t nonce) {
+    id = block.getId().toString();
+    this->nonce = nonce;
+
+    header = block.toJson();
+    header.removeMember("transactions");
+
+    setKey();
+
+    for(const Blockchain::transaction& tx : block.getTransactions()) {
+        const std::string txShortId = shortId(tx.getId());
+        shortIds.push_back(txShortId);
+        transactions[txShortId] = tx.toJson();
+    }
+}
+
+CryptoKernel::CompactBlock::CompactBlock(const Json::Value& compactJson) {
+    try {
+        id = compactJson["id"].asString();
+        header = compactJson["header"];
+        nonce = compactJson["nonce"].asUInt64();
+
+        if(!header.isObject() || !compactJson["txids"].isArray()) {
+            throw Blockchain::InvalidElementException("Compact block JSON is malformed");
+        }
+
+        for(const Json::Value& txShortId : compactJson["txids"]) {
+            shortIds.push_back(txShortId.asString());
+        }
+    } catch(const Json::Exception& e) {
+        throw Blockchain::InvalidElementException("Compact block JSON is malformed");
+    }
+
+    setKey();
+}
+
+void CryptoKernel::CompactBlock::setKey() {
+    // The first 128 bits of sha256(id || nonce)
+    const std::string key = Crypto::sha256(id + std::to_string(nonce));
+    k0 = std::stoull(key.substr(0, 16), nullptr, 16);
+    k1 = std::stoull(key.substr(16, 16), nullptr, 16);
+}
+
+Json::Value CryptoKernel::CompactBlock::toJson() const {
+    Json::Value returning;
+    returning["id"] = id;
+    returning["header"] = header;
+    returning["nonce"] = static_cast<Json::UInt64>(nonce);
+    returning["txids"] = Json::Value(Json::arrayValue);
+    for(const std::string& txShortId : shortIds) {
+        returning["txids"].append(txShortId);
+    }
+
+    return returning;
+}
+
+std::string CryptoKernel::CompactBlock::getId() const {
+    return id;
+}
+
+uint64_t CryptoKernel::CompactBlock::getNonce() const {
+    return nonce;
+}
+
+size_t CryptoKernel::CompactBlock::size() const {
+    return shortIds.size();
+}
+
+std::string CryptoKernel::CompactBlock::shortId(const BigNum& txId) const {
+    std::stringstream buffer;
+    buffer << std::hex << std::setw(16) << std::setfill('0')
+           << Crypto::sipHash(k0, k1, txId.toString());
+    return buffer.str();
+}
+
+void CryptoKernel::CompactBlock::fill(const std::set<Blockchain::transaction>& transactions) {
+    const std::set<std::string> missing = getMissing();
+
+    std::map<std::string, Json::Value> found;
+    std::set<std::string> ambiguous;
+    for(const Blockchain::transaction& tx : transactions) {
+        const std::string txShortId = shortId(tx.getId());
+        if(missing.find(txShortId) == missing.end()) {
+            continue;
+        }
+
+        if(!found.insert(std::make_pair(txShortId, tx.toJson())).second) {
+            ambiguous.insert(txShortId);
+        }
+    }
+
+    for(const auto& tx : found) {
+        if(ambiguous.find(tx.first) == ambiguous.end()) {
+            this->transactions[tx.first] = tx.second;
+        }
+    }
+}
+
+void CryptoKernel::CompactBlock::addTransactions(
+    const std::vector<Blockchain::transaction>& transactions) {
+    for(const Blockchain::transaction& tx : transactions) {
+        this->transactions[shortId(tx.getId())] = tx.toJson();
+    }
+}
+
+std::set<std::string> CryptoKernel::CompactBlock::getMissing() const {
+    std::set<std::string> returning;
+    for(const std::string& txShortId : shortIds) {
+        if(transactions.find(txShortId) == transactions.end()) {
+            returning.insert(txShortId);
+        }
+    }
+
+    return returning;
+}
+
+CryptoKernel::Blockchain::block CryptoKernel::CompactBlock::getBlock() const {
+    Json::Value blockJson = header;
+    blockJson["transactions"] = Json::Value(Json::arrayValue);
+    for(const std::string& txShortId : shortIds) {
+        const auto it = transactions.find(txShortId);
+        if(it == transactions.end()) {
+            throw Blockchain::InvalidElementException("Compact block is missing transactions");
+        }
+        blockJson["transactions"].append(it->second);
+    }
+
+    if(blockJson["transactions"].empty()) {
+        blockJson.removeMember("transactions");
+    }
+
+    const Blockchain::block block(blockJson);
+    if(block.getId().toString() != id) {
+        throw Blockchain::InvalidElementException("Compact block transactions don't match its id");
+    }
+
+    return block;
+}
@@ -0,0 +1,124 @@
+/*  CryptoKernel - A library for creating blockchain based digital currency
+    Copyright (C) 2016  James Lovejoy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef COMPACTBLOCK_H_INCLUDED
+#define COMPACTBLOCK_H_INCLUDED
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "blockchain.h"
+
+namespace CryptoKernel {
+/**
+* A block announced by its header and short ids of its transactions, which
+* the receiver fills in from its mempool, asking the announcer for the rest.
+* Short ids are SipHash keyed by the block id and a nonce the announcer picks
+* for each announcement, so transactions can't be ground ahead of time to
+* collide with the ones in a block.
+*/
+class CompactBlock {
+public:
+    /**
+    * Builds the announcement of a block
+    *
+    * @param block the block to announce
+    * @param nonce the nonce keying the short ids, should be random
+    */
+    CompactBlock(const Blockchain::block& block, const uint64_t nonce);
+
+    /**
+    * Loads an announcement received from a peer
+    *
+    * @param compactJson the announcement as serialized with toJson
+    * @throw Blockchain::InvalidElementException if the announcement is malformed
+    */
+    CompactBlock(const Json::Value& compactJson);
+
+    Json::Value toJson() const;
+
+    /**
+    * Returns the id of the announced block
+    */
+    std::string getId() const;
+
+    /**
+    * Returns the nonce keying the short ids
+    */
+    uint64_t getNonce() const;
+
+    /**
+    * Returns the number of transactions in the announced block
+    */
+    size_t size() const;
+
+    /**
+    * Returns the short id of a transaction in this announcement
+    *
+    * @param txId the id of the transaction
+    * @return the short id, 16 hex characters
+    */
+    std::string shortId(const BigNum& txId) const;
+
+    /**
+    * Fills in the announced transactions found among the given ones. A short
+    * id matching more than one of them is left missing so the announcer is
+    * asked for the right one.
+    *
+    * @param transactions the transactions to look in, usually the mempool
+    */
+    void fill(const std::set<Blockchain::transaction>& transactions);
+
+    /**
+    * Fills in transactions the announcer sent for missing short ids,
+    * replacing whatever was filled in for the same short ids
+    *
+    * @param transactions the transactions sent
+    */
+    void addTransactions(const std::vector<Blockchain::transaction>& transactions);
+
+    /**
+    * Returns the short ids no transaction has been filled in for yet
+    */
+    std::set<std::string> getMissing() const;
+
+    /**
+    * Rebuilds the announced block from the filled in transactions
+    *
+    * @return the block
+    * @throw Blockchain::InvalidElementException if transactions are missing or
+    *        the rebuilt block doesn't have the announced id, e.g. after a
+    *        short id collision
+    */
+    Blockchain::block getBlock() const;
+
+private:
+    std::string id;
+    Json::Value header;
+    uint64_t nonce;
+    std::vector<std::string> shortIds;
+    std::map<std::string, Json::Value> transactions;
+    uint64_t k0;
+    uint64_t k1;
+
+    void setKey();
+};
+}
+
+#endif // COMPACTBLOCK_H_INCLUDED
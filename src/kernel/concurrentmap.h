@@ -9,111 +9,234 @@
 #define CONCMAP_H_
 
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include <mutex>
+#include <shared_mutex>
+#include <functional>
+#include <memory>
+
+/**
+* A hash map split into independently locked shards. Readers of a shard share
+* its lock and writers take it exclusively, so lookups of different keys rarely
+* contend. Values are only reachable through accessor handles that hold the
+* shard lock for as long as they live, or by copy. Iteration works on snapshots.
+*/
+template <class KEY, class VAL, class HASH = std::hash<KEY>> class ConcurrentMap {
+private:
+	struct shard {
+		std::unordered_map<KEY, VAL, HASH> map;
+		mutable std::shared_timed_mutex mutex;
+	};
 
-template <class KEY, class VAL> class ConcurrentMap {
 public:
-	ConcurrentMap() {};
+	/**
+	* Read-only handle to a value. Holds the shard's shared lock until destroyed,
+	* so keep it short lived.
+	*/
+	class ConstAccessor {
+	public:
+		ConstAccessor(std::shared_lock<std::shared_timed_mutex>&& lock, const VAL* value)
+			: lock(std::move(lock)), value(value) {}
+
+		explicit operator bool() const {
+			return value != nullptr;
+		}
+
+		const VAL& operator*() const {
+			return *value;
+		}
+
+		const VAL* operator->() const {
+			return value;
+		}
+
+	private:
+		std::shared_lock<std::shared_timed_mutex> lock;
+		const VAL* value;
+	};
+
+	/**
+	* Read-write handle to a value. Holds the shard's exclusive lock until
+	* destroyed, so keep it short lived.
+	*/
+	class Accessor {
+	public:
+		Accessor(std::unique_lock<std::shared_timed_mutex>&& lock, VAL* value)
+			: lock(std::move(lock)), value(value) {}
+
+		explicit operator bool() const {
+			return value != nullptr;
+		}
+
+		VAL& operator*() const {
+			return *value;
+		}
 
-	std::size_t size() {
-		mapMutex.lock();
-		size_t size = map.size();
-		mapMutex.unlock();
+		VAL* operator->() const {
+			return value;
+		}
+
+	private:
+		std::unique_lock<std::shared_timed_mutex> lock;
+		VAL* value;
+	};
+
+	ConcurrentMap(const std::size_t nShards = 16) : shards(nShards > 0 ? nShards : 1) {
+		for(auto& s : shards) {
+			s.reset(new shard);
+		}
+	};
+
+	std::size_t size() const {
+		std::size_t size = 0;
+		for(const auto& s : shards) {
+			std::shared_lock<std::shared_timed_mutex> lock(s->mutex);
+			size += s->map.size();
+		}
 		return size;
 	}
 
-	typename std::map<KEY, VAL>::iterator find(KEY key) {
-		mapMutex.lock();
-		auto res = map.find(key);
-		mapMutex.unlock();
-		return res;
+	/**
+	* Returns a read-only handle to the value for the given key, which
+	* evaluates to false if the key isn't present
+	*/
+	ConstAccessor find(const KEY& key) const {
+		const shard& s = shardFor(key);
+		std::shared_lock<std::shared_timed_mutex> lock(s.mutex);
+		const auto it = s.map.find(key);
+		return ConstAccessor(std::move(lock), it != s.map.end() ? &it->second : nullptr);
 	}
 
-	VAL& at(KEY key) {
-		mapMutex.lock();
-		VAL& res = map[key];
-		mapMutex.unlock();
-		return res;
+	/**
+	* Returns a read-write handle to the value for the given key, which
+	* evaluates to false if the key isn't present
+	*/
+	Accessor findMutable(const KEY& key) {
+		shard& s = shardFor(key);
+		std::unique_lock<std::shared_timed_mutex> lock(s.mutex);
+		const auto it = s.map.find(key);
+		return Accessor(std::move(lock), it != s.map.end() ? &it->second : nullptr);
 	}
 
-	bool contains(KEY key) {
-		bool found = false;
-		mapMutex.lock();
-		if(map.find(key) != map.end()) {
-			found = true;
-		}
-		mapMutex.unlock();
-		return found;
+	/**
+	* Returns a read-write handle to the value for the given key, default
+	* constructing it first if it isn't present
+	*/
+	Accessor at(const KEY& key) {
+		shard& s = shardFor(key);
+		std::unique_lock<std::shared_timed_mutex> lock(s.mutex);
+		VAL* value = &s.map[key];
+		return Accessor(std::move(lock), value);
 	}
 
-	typename std::map<KEY, VAL>::iterator begin() {
-		mapMutex.lock();
-		auto res = map.begin();
-		mapMutex.unlock();
-		return res;
+	/**
+	* Copies the value for the given key into out
+	*
+	* @return true iff the key was present
+	*/
+	bool get(const KEY& key, VAL& out) const {
+		const shard& s = shardFor(key);
+		std::shared_lock<std::shared_timed_mutex> lock(s.mutex);
+		const auto it = s.map.find(key);
+		if(it == s.map.end()) {
+			return false;
+		}
+		out = it->second;
+		return true;
 	}
 
-	typename std::map<KEY, VAL>::iterator end() {
-		mapMutex.lock();
-		auto res = map.end();
-		mapMutex.unlock();
-		return res;
+	bool contains(const KEY& key) const {
+		const shard& s = shardFor(key);
+		std::shared_lock<std::shared_timed_mutex> lock(s.mutex);
+		return s.map.find(key) != s.map.end();
 	}
 
-	typename std::vector<KEY> keys() {
-		mapMutex.lock();
+	/**
+	* Returns a snapshot of the keys. Each shard is copied under its own lock
+	* so the snapshot is not atomic across shards.
+	*/
+	std::vector<KEY> keys() const {
 		std::vector<KEY> keys;
-		for(auto it = map.begin(); it != map.end(); it++) {
-			keys.push_back(it->first);
+		for(const auto& s : shards) {
+			std::shared_lock<std::shared_timed_mutex> lock(s->mutex);
+			for(const auto& entry : s->map) {
+				keys.push_back(entry.first);
+			}
 		}
-		mapMutex.unlock();
 		return keys;
 	}
 
-	void erase(KEY key) {
-		map.erase(key);
+	/**
+	* Erases the given key
+	*
+	* @return true iff the key was present
+	*/
+	bool erase(const KEY& key) {
+		shard& s = shardFor(key);
+		std::unique_lock<std::shared_timed_mutex> lock(s.mutex);
+		return s.map.erase(key) > 0;
 	}
 
-	void erase(typename std::map<KEY, VAL>::iterator it) {
-		mapMutex.lock();
-		map.erase(it);
-		mapMutex.unlock();
+	void clear() {
+		for(auto& s : shards) {
+			// Destroy the values outside the lock in case they take a while
+			std::unordered_map<KEY, VAL, HASH> removed;
+			{
+				std::unique_lock<std::shared_timed_mutex> lock(s->mutex);
+				removed.swap(s->map);
+			}
+		}
 	}
 
-	void clear() {
-		mapMutex.lock();
-		map.clear();
-		mapMutex.unlock();
+	void insert(const KEY& key, const VAL& val) {
+		shard& s = shardFor(key);
+		std::unique_lock<std::shared_timed_mutex> lock(s.mutex);
+		s.map[key] = val;
 	}
 
-	void insert(KEY key, VAL val) {
-		mapMutex.lock();
-		map[key] = val;
-		mapMutex.unlock();
+	void insert(const std::pair<KEY, VAL>& pair) {
+		insert(pair.first, pair.second);
 	}
 
-	void insert(std::pair<KEY, VAL> pair) {
-		mapMutex.lock();
-		map[pair.first] = pair.second;
-		mapMutex.unlock();
+	/**
+	* Calls f on every entry while holding each shard's shared lock in turn.
+	* f must not call back into the map.
+	*/
+	void forEach(const std::function<void(const KEY&, const VAL&)>& f) const {
+		for(const auto& s : shards) {
+			std::shared_lock<std::shared_timed_mutex> lock(s->mutex);
+			for(const auto& entry : s->map) {
+				f(entry.first, entry.second);
+			}
+		}
 	}
 
-	std::map<KEY, VAL> copyMap() {
+	/**
+	* Returns an ordered snapshot of the map. Each shard is copied under its
+	* own lock so the snapshot is not atomic across shards.
+	*/
+	std::map<KEY, VAL> copyMap() const {
 		std::map<KEY, VAL> mapCopy;
-		mapMutex.lock();
-		for(auto it = map.begin(); it != map.end(); it++) {
-			mapCopy[it->first] = it->second;
-		}
-		mapMutex.unlock();
+		forEach([&](const KEY& key, const VAL& val) {
+			mapCopy[key] = val;
+		});
 		return mapCopy;
 	}
 
 	virtual ~ConcurrentMap() {};
 
 private:
-	std::map<KEY, VAL> map;
-	std::mutex mapMutex; // someday, this should be a shared mutex
+	shard& shardFor(const KEY& key) {
+		return *shards[hasher(key) % shards.size()];
+	}
+
+	const shard& shardFor(const KEY& key) const {
+		return *shards[hasher(key) % shards.size()];
+	}
+
+	std::vector<std::unique_ptr<shard>> shards;
+	HASH hasher;
 };
 
 #endif /* CONCMAP_H_ */
@@ -147,7 +147,7 @@ bool CryptoKernel::Consensus::PoW::checkConsensusRules(Storage::Transaction* tra
         blockData.target = calculateTarget(transaction, block.getPreviousBlockId());
 
         //Check proof of work
-        if(blockData.target <= calculatePoW(block, blockData.nonce)) {
+        if(blockData.target <= getPoW(block, blockData.nonce)) {
             return false;
         }
 
@@ -166,6 +166,48 @@ bool CryptoKernel::Consensus::PoW::checkConsensusRules(Storage::Transaction* tra
     }
 }
 
+bool CryptoKernel::Consensus::PoW::checkConsensusRulesStateless(
+    const CryptoKernel::Blockchain::block& block) {
+    try {
+        // The target is checked against the chain in checkConsensusRules,
+        // here the work only has to meet the target the block claims
+        const consensusData blockData = getConsensusData(block);
+        if(blockData.target <= getPoW(block, blockData.nonce)) {
+            return false;
+        }
+
+        return true;
+    } catch(const CryptoKernel::Blockchain::InvalidElementException& e) {
+        return false;
+    }
+}
+
+CryptoKernel::BigNum CryptoKernel::Consensus::PoW::getPoW(
+    const CryptoKernel::Blockchain::block& block, const uint64_t nonce) {
+    const std::string key = block.getId().toString() + std::to_string(nonce);
+
+    {
+        std::lock_guard<std::mutex> lock(powCacheMutex);
+        const auto it = powCache.find(key);
+        if(it != powCache.end()) {
+            return it->second;
+        }
+    }
+
+    const CryptoKernel::BigNum pow = calculatePoW(block, nonce);
+
+    std::lock_guard<std::mutex> lock(powCacheMutex);
+    if(powCache.insert(std::make_pair(key, pow)).second) {
+        powCacheOrder.push_back(key);
+        if(powCacheOrder.size() > 5000) {
+            powCache.erase(powCacheOrder.front());
+            powCacheOrder.pop_front();
+        }
+    }
+
+    return pow;
+}
+
 CryptoKernel::BigNum CryptoKernel::Consensus::PoW::calculatePoW(
     const CryptoKernel::Blockchain::block& block, const uint64_t nonce) {
     std::stringstream buffer;
@@ -51,6 +51,13 @@ public:
                              CryptoKernel::Blockchain::block& block,
                              const CryptoKernel::Blockchain::dbBlock& previousBlock);
 
+    /**
+    * Checks the block's consensusData is well formed and that its Proof of
+    * Work is below the target it claims, ahead of checkConsensusRules. The
+    * target itself depends on the previous blocks so it is only checked there.
+    */
+    bool checkConsensusRulesStateless(const CryptoKernel::Blockchain::block& block);
+
     Json::Value generateConsensusData(Storage::Transaction* transaction,
                                       const CryptoKernel::BigNum& previousBlockId, const std::string& publicKey);
 
@@ -112,6 +119,12 @@ protected:
 private:
     bool running;
     void miner();
+
+    CryptoKernel::BigNum getPoW(const CryptoKernel::Blockchain::block& block,
+                                const uint64_t nonce);
+    std::map<std::string, CryptoKernel::BigNum> powCache;
+    std::deque<std::string> powCacheOrder;
+    std::mutex powCacheMutex;
     std::string pubKey;
     std::unique_ptr<std::thread> minerThread;
 };
@@ -1,39 +1,432 @@
+#include <algorithm>
+#include <limits>
+
 #include "crypto.h"
 #include "base64.h"
 
 #include "contract.h"
+#include "threadpool.h"
 
-CryptoKernel::ContractRunner::ContractRunner(CryptoKernel::Blockchain* blockchain,
-        const uint64_t memoryLimit, const uint64_t instructionLimit) {
-    this->memoryLimit = memoryLimit;
-    this->pcLimit = instructionLimit;
-    this->blockchain = blockchain;
+// Warmed states kept per thread once their runner is done with them
+static const size_t maxPooledVMs = 4;
+
+// Bytes of decompressed bytecode kept in the shared cache
+static const uint64_t bytecodeCacheCapacity = 64 * 1024 * 1024;
+
+// Scripts with summed profiles, the least time consuming goes when it's full
+static const size_t maxProfiledScripts = 1000;
+
+CryptoKernel::ContractRunner::BytecodeCache
+CryptoKernel::ContractRunner::bytecodeCache(bytecodeCacheCapacity);
+
+std::atomic<bool> CryptoKernel::ContractRunner::profileAll(false);
+std::map<std::string, CryptoKernel::ContractRunner::scriptProfile>
+CryptoKernel::ContractRunner::profileTotals;
+std::mutex CryptoKernel::ContractRunner::profileTotalsMutex;
+
+namespace {
+// Gas charged for calls into the host on top of the instructions a script
+// runs, roughly what each costs measured in Lua instructions
+const lua_Integer lookupGas = 5000;
+const lua_Integer signatureGas = 25000;
+const lua_Integer hashGas = 500;
+
+// The state running a script on this thread, bound functions that aren't
+// handed it charge their gas here. Host calls are recorded in the profile
+// if the script is being profiled.
+thread_local lua_State* meteredState = nullptr;
+thread_local CryptoKernel::ContractRunner::scriptProfile* activeProfile = nullptr;
+thread_local bool hostCallsCharged = true;
+
+struct MeteredScope {
+    MeteredScope(lua_State* luaState, CryptoKernel::ContractRunner::scriptProfile* profile,
+                 const bool charged) {
+        previousState = meteredState;
+        previousProfile = activeProfile;
+        previousCharged = hostCallsCharged;
+        meteredState = luaState;
+        activeProfile = profile;
+        hostCallsCharged = charged;
+    }
+
+    ~MeteredScope() {
+        meteredState = previousState;
+        activeProfile = previousProfile;
+        hostCallsCharged = previousCharged;
+    }
+
+    lua_State* previousState;
+    CryptoKernel::ContractRunner::scriptProfile* previousProfile;
+    bool previousCharged;
+};
+
+// Adds gas to what the running script has used, throwing once it goes over
+// the limit the same way the instruction hook errors
+void chargeGas(lua_State* luaState, const lua_Integer gas) {
+    if(luaState == nullptr) {
+        return;
+    }
+
+    lua_getglobal(luaState, "pc");
+    const lua_Integer used = lua_tointeger(luaState, -1) + gas;
+    lua_pop(luaState, 1);
+    lua_pushinteger(luaState, used);
+    lua_setglobal(luaState, "pc");
+
+    lua_getglobal(luaState, "pcLimit");
+    const lua_Integer limit = lua_tointeger(luaState, -1);
+    lua_pop(luaState, 1);
+
+    if(used > limit) {
+        throw std::runtime_error("Gas limit reached");
+    }
+}
+
+// Charges for a host call and, when profiling, times it until the end of
+// the scope
+class HostCall {
+public:
+    HostCall(lua_State* luaState, const char* name, const lua_Integer gas) {
+        // Before the gas rules activate only instructions count
+        this->gas = hostCallsCharged ? gas : 0;
+        chargeGas(luaState, this->gas);
+
+        this->name = name;
+        if(activeProfile != nullptr) {
+            start = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~HostCall() {
+        if(activeProfile != nullptr) {
+            CryptoKernel::ContractRunner::hostCallStats& stats = activeProfile->hostCalls[name];
+            stats.calls++;
+            stats.gas += gas;
+            stats.microseconds += std::chrono::duration_cast<std::chrono::microseconds>(
+                                      std::chrono::steady_clock::now() - start).count();
+        }
+    }
+
+private:
+    const char* name;
+    lua_Integer gas;
+    std::chrono::steady_clock::time_point start;
+};
+
+// Crypto as contracts see it, signing, verifying and hashing cost gas
+class ContractCrypto {
+public:
+    ContractCrypto(const bool fGenerate) : crypto(fGenerate) {}
+
+    bool getStatus() {
+        return crypto.getStatus();
+    }
+
+    std::string sign(std::string message) {
+        HostCall call(meteredState, "sign", signatureGas);
+        return crypto.sign(message);
+    }
+
+    bool verify(std::string message, std::string signature) {
+        HostCall call(meteredState, "verify", signatureGas);
+        return crypto.verify(message, signature);
+    }
+
+    std::string getPublicKey() {
+        return crypto.getPublicKey();
+    }
+
+    std::string getPrivateKey() {
+        return crypto.getPrivateKey();
+    }
+
+    bool setPublicKey(std::string publicKey) {
+        return crypto.setPublicKey(publicKey);
+    }
+
+    bool setPrivateKey(std::string privateKey) {
+        return crypto.setPrivateKey(privateKey);
+    }
+
+    static std::string sha256(std::string message) {
+        HostCall call(meteredState, "sha256", hashGas + message.size());
+        return CryptoKernel::Crypto::sha256(message);
+    }
+
+private:
+    CryptoKernel::Crypto crypto;
+};
+}
+
+void CryptoKernel::ContractRunner::pushJson(lua_State* luaState, const Json::Value& value) {
+    if(!lua_checkstack(luaState, 3)) {
+        throw std::runtime_error("JSON nested too deeply for the Lua stack");
+    }
+
+    switch(value.type()) {
+        case Json::nullValue:
+            lua_pushnil(luaState);
+            break;
+        case Json::intValue:
+            lua_pushinteger(luaState, value.asInt64());
+            break;
+        case Json::uintValue:
+            if(value.asUInt64() <= static_cast<uint64_t>(std::numeric_limits<lua_Integer>::max())) {
+                lua_pushinteger(luaState, value.asInt64());
+            } else {
+                lua_pushnumber(luaState, value.asDouble());
+            }
+            break;
+        case Json::realValue:
+            lua_pushnumber(luaState, value.asDouble());
+            break;
+        case Json::stringValue: {
+            const char* begin;
+            const char* end;
+            value.getString(&begin, &end);
+            lua_pushlstring(luaState, begin, end - begin);
+            break;
+        }
+        case Json::booleanValue:
+            lua_pushboolean(luaState, value.asBool());
+            break;
+        case Json::arrayValue:
+            lua_createtable(luaState, value.size(), 0);
+            for(Json::ArrayIndex i = 0; i < value.size(); i++) {
+                pushJson(luaState, value[i]);
+                lua_rawseti(luaState, -2, i + 1);
+            }
+            break;
+        case Json::objectValue:
+            lua_createtable(luaState, 0, value.size());
+            for(auto it = value.begin(); it != value.end(); it++) {
+                if(it->isNull()) {
+                    continue;
+                }
+                const std::string key = it.name();
+                lua_pushlstring(luaState, key.data(), key.size());
+                pushJson(luaState, *it);
+                lua_rawset(luaState, -3);
+            }
+            break;
+    }
+}
+
+template<Json::Value (CryptoKernel::ContractRunner::BlockchainInterface::*lookup)(const std::string&)>
+int CryptoKernel::ContractRunner::luaBlockchainLookup(lua_State* luaState) {
+    size_t idLength;
+    const char* id = luaL_checklstring(luaState, 1, &idLength);
+    BlockchainInterface* blockchainInterface = (BlockchainInterface*)lua_touserdata(luaState,
+                                               lua_upvalueindex(1));
+    const char* name = (const char*)lua_touserdata(luaState, lua_upvalueindex(2));
+    const bool native = lua_toboolean(luaState, lua_upvalueindex(3));
+
+    // lua_error longjmps so nothing with a destructor can be alive when it's called
+    bool failed = false;
+    try {
+        HostCall call(luaState, name, lookupGas);
+        const Json::Value result = (blockchainInterface->*lookup)(std::string(id, idLength));
+        if(native) {
+            pushJson(luaState, result);
+        } else {
+            const std::string text = result.isNull() ? "" : CryptoKernel::Storage::toString(result);
+            lua_pushlstring(luaState, text.data(), text.size());
+        }
+    } catch(const std::exception& e) {
+        lua_pushstring(luaState, e.what());
+        failed = true;
+    }
+
+    if(failed) {
+        return lua_error(luaState);
+    }
+
+    return 1;
+}
+
+CryptoKernel::ContractRunner::BytecodeCache::BytecodeCache(const uint64_t capacity) {
+    this->capacity = capacity;
+    bytes = 0;
+    hits = 0;
+    misses = 0;
+}
+
+std::shared_ptr<const std::string> CryptoKernel::ContractRunner::BytecodeCache::get(
+    const std::string& key) {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+
+    const auto it = index.find(key);
+    if(it == index.end()) {
+        misses++;
+        return nullptr;
+    }
+
+    hits++;
+    entries.splice(entries.begin(), entries, it->second);
+    return it->second->second;
+}
+
+void CryptoKernel::ContractRunner::BytecodeCache::put(const std::string& key,
+        const std::shared_ptr<const std::string>& bytecode) {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+
+    if(index.find(key) != index.end() || bytecode->size() > capacity) {
+        return;
+    }
+
+    entries.emplace_front(key, bytecode);
+    index[key] = entries.begin();
+    bytes += bytecode->size();
+
+    while(bytes > capacity) {
+        bytes -= entries.back().second->size();
+        index.erase(entries.back().first);
+        entries.pop_back();
+    }
+}
+
+CryptoKernel::ContractRunner::cacheStats
+CryptoKernel::ContractRunner::BytecodeCache::getStats() {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+
+    cacheStats returning;
+    returning.hits = hits;
+    returning.misses = misses;
+    returning.entries = entries.size();
+    returning.bytes = bytes;
+
+    return returning;
+}
+
+CryptoKernel::ContractRunner::cacheStats CryptoKernel::ContractRunner::getCacheStats() {
+    return bytecodeCache.getStats();
+}
+
+CryptoKernel::ContractRunner::VM::VM() {
+    used = 0;
+    memoryLimit = 0;
+    baseline = 0;
+    peak = 0;
+    limitFromBaseline = true;
+    broken = false;
 
-    ud.reset(new int);
-    *ud.get() = 0;
     luaState = lua_newstate(&CryptoKernel::ContractRunner::allocWrapper, this);
     luaL_openlibs(luaState);
     state.reset(new sel::State(luaState));
+    blockchainInterface.reset(new BlockchainInterface());
 
-    blockchainInterface = new BlockchainInterface(blockchain);
-}
+    (*state.get())["Crypto"].SetClass<ContractCrypto, bool>("getPublicKey",
+            &ContractCrypto::getPublicKey,
+            "getPrivateKey", &ContractCrypto::getPrivateKey,
+            "setPublicKey", &ContractCrypto::setPublicKey,
+            "setPrivateKey", &ContractCrypto::setPrivateKey,
+            "sign", &ContractCrypto::sign,
+            "verify", &ContractCrypto::verify,
+            "getStatus", &ContractCrypto::getStatus
+                                                           );
+    (*state.get())["sha256"] = &ContractCrypto::sha256;
 
-void* CryptoKernel::ContractRunner::allocWrapper(void* thisPointer, void* ptr,
-        size_t osize, size_t nsize) {
-    CryptoKernel::ContractRunner* contractRunner = (CryptoKernel::ContractRunner*)
-            thisPointer;
-    return contractRunner->l_alloc_restricted(contractRunner->ud.get(), ptr, osize, nsize);
+    // Under the gas rules lookups hand back tables built straight from the
+    // stored JSON. Before, they return the JSON as text and sandbox.lua
+    // decodes it inside the script, where decoding costs instructions.
+    const std::vector<std::pair<const char*, lua_CFunction>> lookups = {
+        {"getBlock", &luaBlockchainLookup<&BlockchainInterface::getBlock>},
+        {"getTransaction", &luaBlockchainLookup<&BlockchainInterface::getTransaction>},
+        {"getOutput", &luaBlockchainLookup<&BlockchainInterface::getOutput>},
+        {"getInput", &luaBlockchainLookup<&BlockchainInterface::getInput>},
+    };
+    for(const bool native : {true, false}) {
+        lua_createtable(luaState, 0, lookups.size());
+        for(const auto& lookup : lookups) {
+            lua_pushlightuserdata(luaState, blockchainInterface.get());
+            lua_pushlightuserdata(luaState, (void*)lookup.first);
+            lua_pushboolean(luaState, native);
+            lua_pushcclosure(luaState, lookup.second, 3);
+            lua_setfield(luaState, -2, lookup.first);
+        }
+        lua_setglobal(luaState, native ? "Blockchain" : "BlockchainJson");
+    }
+
+    // The per-transaction globals are filled in by setupEnvironment
+    (*state.get())["pcLimit"] = 0;
+    (*state.get())["outputSetId"] = "";
+    (*state.get())["gasRules"] = true;
+
+    if(!state->Load("./sandbox.lua")) {
+        state.reset();
+        lua_close(luaState);
+        throw std::runtime_error("Failed to load sandbox.lua");
+    }
 }
 
-CryptoKernel::ContractRunner::~ContractRunner() {
-    delete blockchainInterface;
+CryptoKernel::ContractRunner::VM::~VM() {
+    state.reset();
     lua_close(luaState);
 }
 
-void* CryptoKernel::ContractRunner::l_alloc_restricted(void* ud, void* ptr, size_t osize,
-        size_t nsize) {
-    /* set limit here */
-    int* used = (int*)ud;
+void CryptoKernel::ContractRunner::VM::reset() {
+    // The globals sandbox.lua and the runner set for a script
+    const char* scriptGlobals[] = {"f", "sandbox_env", "thisTransaction", "thisInput",
+                                   "pcall_rc", "result_or_err_msg"};
+    for(const char* global : scriptGlobals) {
+        lua_pushnil(luaState);
+        lua_setglobal(luaState, global);
+    }
+
+    lua_gc(luaState, LUA_GCCOLLECT, 0);
+    baseline = used;
+    peak = used;
+}
+
+thread_local std::vector<std::unique_ptr<CryptoKernel::ContractRunner::VM>>
+CryptoKernel::ContractRunner::vmPool;
+
+std::unique_ptr<CryptoKernel::ContractRunner::VM> CryptoKernel::ContractRunner::acquireVM() {
+    if(!vmPool.empty()) {
+        std::unique_ptr<VM> returning = std::move(vmPool.back());
+        vmPool.pop_back();
+        return returning;
+    }
+
+    return std::unique_ptr<VM>(new VM());
+}
+
+void CryptoKernel::ContractRunner::releaseVM(std::unique_ptr<VM> vm) {
+    if(vm->broken || vmPool.size() >= maxPooledVMs) {
+        return;
+    }
+
+    // Free whatever the last script left behind while the state sits in the
+    // pool, it is reset again before every run
+    vm->blockchainInterface->setTransaction(nullptr);
+    vm->blockchainInterface->setBlockchain(nullptr);
+    vm->memoryLimit = 0;
+    vm->reset();
+
+    vmPool.push_back(std::move(vm));
+}
+
+CryptoKernel::ContractRunner::ContractRunner(CryptoKernel::Blockchain* blockchain,
+        const uint64_t memoryLimit, const uint64_t instructionLimit,
+        const bool gasRules) {
+    this->memoryLimit = memoryLimit;
+    this->pcLimit = instructionLimit;
+    this->gasRules = gasRules;
+    this->blockchain = blockchain;
+    gasUsed = 0;
+    profiling = false;
+
+    vm = acquireVM();
+    vm->memoryLimit = memoryLimit;
+    // Below the gas activation height the limit covers the whole state, as it
+    // did when every runner loaded its own
+    vm->limitFromBaseline = gasRules;
+    vm->blockchainInterface->setBlockchain(blockchain);
+}
+
+void* CryptoKernel::ContractRunner::allocWrapper(void* vmPointer, void* ptr,
+        size_t osize, size_t nsize) {
+    VM* vm = (VM*)vmPointer;
 
     if(ptr == NULL) {
         /*
@@ -48,20 +441,27 @@ void* CryptoKernel::ContractRunner::l_alloc_restricted(void* ud, void* ptr, size
 
     if (nsize == 0) {
         free(ptr);
-        *used -= osize; /* substract old size from used memory */
+        vm->used -= osize; /* substract old size from used memory */
         return NULL;
     } else {
-        if (*used + (nsize - osize) > memoryLimit) {/* too much memory in use */
+        /* too much memory in use, no limit while the state is being set up */
+        const uint64_t allowed = vm->memoryLimit + (vm->limitFromBaseline ? vm->baseline : 0);
+        if (vm->memoryLimit > 0 && vm->used + (nsize - osize) > allowed) {
             throw std::runtime_error("Memory limit reached");
         }
         ptr = realloc(ptr, nsize);
         if (ptr) {/* reallocation successful? */
-            *used += (nsize - osize);
+            vm->used += (nsize - osize);
+            vm->peak = std::max(vm->peak, vm->used);
         }
         return ptr;
     }
 }
 
+CryptoKernel::ContractRunner::~ContractRunner() {
+    releaseVM(std::move(vm));
+}
+
 std::string CryptoKernel::ContractRunner::compile(const std::string contractScript) {
     sel::State compilerState(true);
 
@@ -78,68 +478,279 @@ std::string CryptoKernel::ContractRunner::compile(const std::string contractScri
 void CryptoKernel::ContractRunner::setupEnvironment(Storage::Transaction* dbTx,
         const CryptoKernel::Blockchain::transaction& tx,
         const CryptoKernel::Blockchain::input& input) {
+    sel::State& state = *vm->state.get();
+
     const int lim = this->pcLimit;
-    (*state.get())["pcLimit"] = lim;
-
-    (*state.get())["Crypto"].SetClass<CryptoKernel::Crypto, bool>("getPublicKey",
-            &CryptoKernel::Crypto::getPublicKey,
-            "getPrivateKey", &CryptoKernel::Crypto::getPrivateKey,
-            "setPublicKey", &CryptoKernel::Crypto::setPublicKey,
-            "setPrivateKey", &CryptoKernel::Crypto::setPrivateKey,
-            "sign", &CryptoKernel::Crypto::sign,
-            "verify", &CryptoKernel::Crypto::verify,
-            "getStatus", &CryptoKernel::Crypto::getStatus
-                                                                 );
-    (*state.get())["txJson"] = CryptoKernel::Storage::toString(tx.toJson());
-    (*state.get())["sha256"] = &CryptoKernel::Crypto::sha256;
-    (*state.get())["thisInputJson"] = CryptoKernel::Storage::toString(input.toJson());
-    (*state.get())["outputSetId"] = tx.getOutputSetId().toString();
-    blockchainInterface->setTransaction(dbTx);
-    (*state.get())["Blockchain"].SetObj((*blockchainInterface), "getBlock",
-                                        &BlockchainInterface::getBlock, "getTransaction", &BlockchainInterface::getTransaction,
-                                        "getOutput", &BlockchainInterface::getOutput, "getInput", &BlockchainInterface::getInput);
+    state["pcLimit"] = lim;
+    state["outputSetId"] = tx.getOutputSetId().toString();
+    state["gasRules"] = gasRules;
+
+    pushJson(vm->luaState, tx.toJson());
+    lua_setglobal(vm->luaState, "thisTransaction");
+    pushJson(vm->luaState, input.toJson());
+    lua_setglobal(vm->luaState, "thisInput");
+    vm->blockchainInterface->setTransaction(dbTx);
 }
 
 bool CryptoKernel::ContractRunner::evaluateValid(Storage::Transaction* dbTx,
         const CryptoKernel::Blockchain::transaction& tx) {
+    std::vector<std::pair<CryptoKernel::Blockchain::input, std::string>> contracts;
     for(const CryptoKernel::Blockchain::input& inp : tx.getInputs()) {
         const CryptoKernel::Blockchain::output out = CryptoKernel::Blockchain::dbOutput(
                     blockchain->utxos->get(dbTx, inp.getOutputId().toString()));
         const Json::Value data = out.getData();
         if(!data["contract"].empty()) {
-            if(!this->evaluateScriptValid(dbTx, tx, inp, data["contract"].asString())) {
+            contracts.push_back(std::make_pair(inp, data["contract"].asString()));
+        }
+    }
+
+    if(contracts.size() < 2) {
+        for(const auto& contract : contracts) {
+            if(!this->evaluateScriptValid(dbTx, tx, contract.first, contract.second)) {
                 return false;
             }
         }
+
+        return true;
+    }
+
+    // Scripts only read the chain so they can share dbTx, nothing writes to
+    // it while the transaction is being verified. Everything else is copied
+    // into each task so none of them depend on this loop's state.
+    std::vector<std::future<scriptResult>> results;
+    for(const auto& contract : contracts) {
+        results.push_back(blockchain->scriptPool->enqueue([blockchain = blockchain,
+                                                           memoryLimit = memoryLimit,
+                                                           pcLimit = pcLimit,
+                                                           gasRules = gasRules,
+                                                           profiling = profiling,
+                                                           dbTx, &tx,
+                                                           input = contract.first,
+                                                           script = contract.second]() {
+            ContractRunner runner(blockchain, memoryLimit, pcLimit, gasRules);
+            if(profiling) {
+                runner.enableProfiling();
+            }
+
+            scriptResult evaluated;
+            evaluated.valid = runner.evaluateScriptValid(dbTx, tx, input, script);
+            evaluated.gas = runner.getGasUsed();
+            evaluated.profiles = runner.getProfiles();
+            return evaluated;
+        }));
+    }
+
+    // The tasks refer to dbTx and tx so let them all finish before returning
+    for(auto& result : results) {
+        result.wait();
+    }
+
+    // Report what running the inputs in order would have, the first false
+    // or exception wins
+    for(auto& result : results) {
+        const scriptResult evaluated = result.get();
+        gasUsed += evaluated.gas;
+        profiles.insert(profiles.end(), evaluated.profiles.begin(), evaluated.profiles.end());
+        if(!evaluated.valid) {
+            return false;
+        }
     }
 
     return true;
 }
 
+uint64_t CryptoKernel::ContractRunner::getGasUsed() const {
+    return gasUsed;
+}
+
+void CryptoKernel::ContractRunner::enableProfiling() {
+    profiling = true;
+}
+
+const std::vector<CryptoKernel::ContractRunner::scriptProfile>&
+CryptoKernel::ContractRunner::getProfiles() const {
+    return profiles;
+}
+
+void CryptoKernel::ContractRunner::setProfiling(const bool enabled) {
+    profileAll = enabled;
+}
+
+bool CryptoKernel::ContractRunner::getProfiling() {
+    return profileAll;
+}
+
+std::vector<CryptoKernel::ContractRunner::scriptProfile>
+CryptoKernel::ContractRunner::getProfileTotals(const size_t limit) {
+    std::vector<scriptProfile> returning;
+
+    {
+        std::lock_guard<std::mutex> lock(profileTotalsMutex);
+        for(const auto& totals : profileTotals) {
+            returning.push_back(totals.second);
+        }
+    }
+
+    std::sort(returning.begin(), returning.end(), [](const scriptProfile& a,
+              const scriptProfile& b) {
+        return a.microseconds > b.microseconds;
+    });
+
+    if(limit > 0 && returning.size() > limit) {
+        returning.resize(limit);
+    }
+
+    return returning;
+}
+
+void CryptoKernel::ContractRunner::recordProfile(scriptProfile& profile,
+        const std::string& script, const bool valid, const uint64_t gas,
+        const std::chrono::steady_clock::time_point& start) {
+    profile.scriptHash = CryptoKernel::Crypto::sha256(script);
+    profile.runs = 1;
+    profile.failures = valid ? 0 : 1;
+    profile.gas = gas;
+    profile.peakMemory = vm->peak - vm->baseline;
+    profile.microseconds = std::chrono::duration_cast<std::chrono::microseconds>(
+                               std::chrono::steady_clock::now() - start).count();
+
+    uint64_t hostGas = 0;
+    for(const auto& call : profile.hostCalls) {
+        hostGas += call.second.gas;
+    }
+    profile.instructions = gas > hostGas ? gas - hostGas : 0;
+
+    profiles.push_back(profile);
+
+    if(!profileAll) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(profileTotalsMutex);
+
+    auto it = profileTotals.find(profile.scriptHash);
+    if(it == profileTotals.end()) {
+        if(profileTotals.size() >= maxProfiledScripts) {
+            const auto cheapest = std::min_element(profileTotals.begin(), profileTotals.end(),
+                                                   [](const std::pair<const std::string, scriptProfile>& a,
+                                                      const std::pair<const std::string, scriptProfile>& b) {
+                return a.second.microseconds < b.second.microseconds;
+            });
+            profileTotals.erase(cheapest);
+        }
+
+        profileTotals[profile.scriptHash] = profile;
+        return;
+    }
+
+    scriptProfile& totals = it->second;
+    totals.runs += profile.runs;
+    totals.failures += profile.failures;
+    totals.gas += profile.gas;
+    totals.instructions += profile.instructions;
+    totals.peakMemory = std::max(totals.peakMemory, profile.peakMemory);
+    totals.microseconds += profile.microseconds;
+    for(const auto& call : profile.hostCalls) {
+        hostCallStats& stats = totals.hostCalls[call.first];
+        stats.calls += call.second.calls;
+        stats.gas += call.second.gas;
+        stats.microseconds += call.second.microseconds;
+    }
+}
+
+std::shared_ptr<const std::string> CryptoKernel::ContractRunner::getBytecode(
+    const std::string& script) {
+    const std::string key = CryptoKernel::Crypto::sha256(script);
+
+    std::shared_ptr<const std::string> bytecode = bytecodeCache.get(key);
+    if(bytecode) {
+        return bytecode;
+    }
+
+    std::string decompressed;
+    std::string errorMessage = "";
+
+    vm->state->HandleExceptionsWith([&](int, std::string msg, std::exception_ptr) {
+                                        errorMessage = msg;
+                                    });
+
+    vm->broken = true;
+    sel::tie(decompressed, errorMessage) = (*vm->state.get())["decompressContract"](
+                                               base64_decode(script));
+
+    if(errorMessage != "") {
+        throw std::runtime_error(errorMessage);
+    }
+
+    // The decompression garbage is collected when the state is reset before
+    // the script runs, so a hit and a miss start it from the same memory
+    vm->broken = false;
+
+    bytecode = std::make_shared<const std::string>(std::move(decompressed));
+
+    // Bytecode too big to load within the limit is never worth keeping
+    if(bytecode->size() <= vm->memoryLimit) {
+        bytecodeCache.put(key, bytecode);
+    }
+
+    return bytecode;
+}
+
 bool CryptoKernel::ContractRunner::evaluateScriptValid(Storage::Transaction* dbTx,
         const CryptoKernel::Blockchain::transaction& tx,
         const CryptoKernel::Blockchain::input& inp, 
         std::string script) {
             
+    const bool profiled = profiling || profileAll;
+    scriptProfile profile = scriptProfile();
+    const auto start = std::chrono::steady_clock::now();
+
+    // Stays set if anything throws, e.g. on hitting the memory limit, so the
+    // state is thrown away rather than pooled
+    vm->broken = true;
+
+    // Decompressing on a cache miss is limited from the same baseline as the
+    // script, and its garbage is gone before the script's environment is set up
+    vm->reset();
+    const std::shared_ptr<const std::string> bytecode = getBytecode(script);
+    vm->broken = true;
+    vm->reset();
+
     setupEnvironment(dbTx, tx, inp);
-    if(!(*state.get()).Load("./sandbox.lua")) {
-        throw std::runtime_error("Failed to load sandbox.lua");
-    }
 
     bool result = false;
     std::string errorMessage = "";
 
-    state->HandleExceptionsWith([&](int, std::string msg, std::exception_ptr) {
+    vm->state->HandleExceptionsWith([&](int, std::string msg, std::exception_ptr) {
                                         errorMessage = msg; 
                                         result = false;
                                     });
 
-    sel::tie(result, errorMessage) = (*state.get())["verifyTransaction"](base64_decode(
-                                            script));
+    vm->broken = true;
+    {
+        MeteredScope metered(vm->luaState, profiled ? &profile : nullptr, gasRules);
+        sel::tie(result, errorMessage) = (*vm->state.get())["runContract"](*bytecode);
+    }
 
     if(errorMessage != "") {
+        // Scripts running out of memory are what profiling is for, so they
+        // are recorded even though the state can't be trusted for their gas
+        if(profiled) {
+            recordProfile(profile, script, false, 0, start);
+        }
         throw std::runtime_error(errorMessage);
     }
 
+    lua_getglobal(vm->luaState, "pc");
+    const uint64_t gas = lua_tointeger(vm->luaState, -1);
+    lua_pop(vm->luaState, 1);
+    gasUsed += gas;
+
+    if(profiled) {
+        recordProfile(profile, script, result, gas, start);
+    }
+
+    vm->broken = false;
+
     return result;
 }
@@ -1,6 +1,14 @@
 #ifndef CONTRACT_H_INCLUDED
 #define CONTRACT_H_INCLUDED
 
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
 #include <selene.h>
 
 #include "blockchain.h"
@@ -9,7 +17,9 @@ namespace CryptoKernel {
 /**
 * This class runs Lua smart contracts inside transaction inputs to verify validity.
 * Provides methods to evaluate a transactions validity, compile contracts to bytecode
-* and limit execution resources
+* and limit execution resources. Lua states are expensive to set up so each thread
+* keeps a small pool of them with the sandbox already loaded. A runner borrows one
+* for its lifetime and the sandbox environment is rebuilt before every script.
 */
 class ContractRunner {
 public:
@@ -19,10 +29,15 @@ public:
     *
     * @param blockchain a pointer to the blockchain object to be used for reference
     * @param memoryLimit specify the memory limit in bytes of the virtual machine, defaults to 10MB
-    * @param instructionLimit specify the maximum number of instructions a contract can execute, defaults to 35000
+    * @param instructionLimit specify the most gas a single contract can use, one per instruction
+    *                         plus a fixed cost for each call into the host, defaults to 100000000
+    * @param gasRules whether the gas rules are active. If false, as for blocks below the gas
+    *                 activation height, calls into the host cost no gas and blockchain lookups
+    *                 are decoded from JSON text inside the script, counting instructions.
     */
     ContractRunner(CryptoKernel::Blockchain* blockchain,
-                   const uint64_t memoryLimit = 10485760, const uint64_t instructionLimit = 100000000);
+                   const uint64_t memoryLimit = 10485760, const uint64_t instructionLimit = 100000000,
+                   const bool gasRules = true);
 
     /**
     * Default destructor
@@ -41,7 +56,9 @@ public:
 
     /**
     * Evaluate all of the input scripts in the given transaction to determine if the transaction
-    * is valid according to the contract rules
+    * is valid according to the contract rules. When there is more than one contract input
+    * they are run in parallel, each with its own Lua state, and the result is the same as
+    * running them in order.
     *
     * @param dbTx the transaction representing the current blockchain state
     * @param tx the transaction to be verified
@@ -63,62 +80,259 @@ public:
         const CryptoKernel::Blockchain::transaction& tx,
         const CryptoKernel::Blockchain::input& inp, 
         std::string script);
+
+    /**
+    * Returns the gas used by every script this runner has evaluated so far. Gas is one per
+    * Lua instruction plus a fixed cost for each blockchain lookup, signature and hash the
+    * script asks for, so it is the same on every node.
+    */
+    uint64_t getGasUsed() const;
+
+    /**
+    * Calls a script made to one host function, the gas they were charged and the
+    * time spent in them
+    */
+    struct hostCallStats {
+        uint64_t calls;
+        uint64_t gas;
+        uint64_t microseconds;
+    };
+
+    /**
+    * What running a script cost, either for a single run or summed over every run of
+    * the script
+    */
+    struct scriptProfile {
+        // sha256 of the script as it appears in the output
+        std::string scriptHash;
+        uint64_t runs;
+        // Runs that returned false or errored
+        uint64_t failures;
+        uint64_t gas;
+        // Gas spent on Lua instructions rather than host calls
+        uint64_t instructions;
+        // Most memory the script had allocated on top of the clean state, the
+        // largest of any run for totals
+        uint64_t peakMemory;
+        // Wall time including loading the bytecode
+        uint64_t microseconds;
+        std::map<std::string, hostCallStats> hostCalls;
+    };
+
+    /**
+    * Record a profile of every script this runner evaluates from now on
+    */
+    void enableProfiling();
+
+    /**
+    * Returns the profiles of the scripts this runner has evaluated with profiling
+    * enabled, in the order they were run
+    */
+    const std::vector<scriptProfile>& getProfiles() const;
+
+    /**
+    * Turns profiling on or off for every runner. Profiles are then summed per script and
+    * can be read with getProfileTotals.
+    *
+    * @param enabled true to profile every script run from now on
+    */
+    static void setProfiling(const bool enabled);
+
+    /**
+    * Returns true if every runner is profiling the scripts it runs
+    */
+    static bool getProfiling();
+
+    /**
+    * Returns the summed profiles of the scripts run while profiling was on for every
+    * runner, the most time consuming first
+    *
+    * @param limit the most scripts to return, 0 for all of them
+    */
+    static std::vector<scriptProfile> getProfileTotals(const size_t limit = 0);
+
+    /**
+    * Counters for the bytecode cache shared by every runner
+    */
+    struct cacheStats {
+        uint64_t hits;
+        uint64_t misses;
+        // Number of scripts and bytes of bytecode currently cached
+        uint64_t entries;
+        uint64_t bytes;
+    };
+
+    /**
+    * Returns the bytecode cache's counters
+    */
+    static cacheStats getCacheStats();
+
+    /**
+    * Pushes a JSON value onto a Lua stack as the same Lua value Json:decode
+    * would turn its text into, without going through the text. Nulls become
+    * nil, leaving holes in arrays and no key in objects.
+    *
+    * @param luaState the state to push onto
+    * @param value the value to push
+    * @throw std::runtime_error if the value is nested too deeply for the stack
+    */
+    static void pushJson(lua_State* luaState, const Json::Value& value);
+
 private:
+    /**
+    * Decompressed contract bytecode keyed by the hash of the script as it
+    * appears in the output, least recently used first out. Compiled Lua
+    * functions belong to a single state, so it is the decompressed bytecode
+    * that is shared between states and loaded into each one.
+    */
+    class BytecodeCache {
+    public:
+        BytecodeCache(const uint64_t capacity);
+
+        std::shared_ptr<const std::string> get(const std::string& key);
+        void put(const std::string& key, const std::shared_ptr<const std::string>& bytecode);
+
+        cacheStats getStats();
+
+    private:
+        typedef std::pair<std::string, std::shared_ptr<const std::string>> entry;
+
+        std::list<entry> entries;
+        std::unordered_map<std::string, std::list<entry>::iterator> index;
+        uint64_t bytes;
+        uint64_t capacity;
+        std::atomic<uint64_t> hits;
+        std::atomic<uint64_t> misses;
+        std::mutex cacheMutex;
+    };
+
+    static BytecodeCache bytecodeCache;
+
+    static std::atomic<bool> profileAll;
+    static std::map<std::string, scriptProfile> profileTotals;
+    static std::mutex profileTotalsMutex;
+
+    void recordProfile(scriptProfile& profile, const std::string& script, const bool valid,
+                       const uint64_t gas, const std::chrono::steady_clock::time_point& start);
+
+    /**
+    * What a contract input run on the script pool hands back to evaluateValid
+    */
+    struct scriptResult {
+        bool valid;
+        uint64_t gas;
+        std::vector<scriptProfile> profiles;
+    };
+
+    /**
+    * Returns the decompressed bytecode of a contract script, from the cache
+    * if possible
+    */
+    std::shared_ptr<const std::string> getBytecode(const std::string& script);
+
     void setupEnvironment(Storage::Transaction* dbTx,
                           const CryptoKernel::Blockchain::transaction& tx,
                           const CryptoKernel::Blockchain::input& input);
-  
 
-    std::unique_ptr<sel::State> state;
-    std::unique_ptr<int> ud;
-    lua_State* luaState;
-    static void* allocWrapper(void* thisPointer, void* ptr, size_t osize, size_t nsize);
-    void* l_alloc_restricted(void* ud, void* ptr, size_t osize, size_t nsize);
+    class BlockchainInterface;
+
+    /**
+    * A Lua state with the libraries, bindings and sandbox loaded
+    */
+    struct VM {
+        VM();
+        ~VM();
+
+        /**
+        * Drops everything a previous script left reachable, collects it and
+        * makes the memory now in use the baseline the limit is measured from
+        * under the gas rules. What a script may allocate doesn't then depend
+        * on what the state ran before.
+        */
+        void reset();
+
+        lua_State* luaState;
+        std::unique_ptr<sel::State> state;
+        std::unique_ptr<BlockchainInterface> blockchainInterface;
+        // Bytes currently allocated by the state and the most it may allocate
+        uint64_t used;
+        uint64_t memoryLimit;
+        // Bytes in use after the last reset
+        uint64_t baseline;
+        // Most bytes allocated at once since the last reset
+        uint64_t peak;
+        // Whether the limit is on top of the baseline rather than on the
+        // whole state, set under the gas rules
+        bool limitFromBaseline;
+        // Set if a script threw part way through, the state can't be reused
+        bool broken;
+    };
+
+    static thread_local std::vector<std::unique_ptr<VM>> vmPool;
+    static std::unique_ptr<VM> acquireVM();
+    static void releaseVM(std::unique_ptr<VM> vm);
+
+    static void* allocWrapper(void* vmPointer, void* ptr, size_t osize, size_t nsize);
+
+    std::unique_ptr<VM> vm;
     uint64_t memoryLimit;
     uint64_t pcLimit;
+    bool gasRules;
+    uint64_t gasUsed;
+    bool profiling;
+    std::vector<scriptProfile> profiles;
     CryptoKernel::Blockchain* blockchain;
     class BlockchainInterface {
     public:
-        BlockchainInterface(CryptoKernel::Blockchain* blockchain) {this->blockchain = blockchain;}
-        std::string getBlock(std::string id) {
+        BlockchainInterface() {this->blockchain = nullptr;}
+        Json::Value getBlock(const std::string& id) {
             try {
                 const Blockchain::dbBlock block = blockchain->getBlockDB(dbTx, id, true);
-                return CryptoKernel::Storage::toString(block.toJson());
+                return block.toJson();
             } catch(const Blockchain::NotFoundException& e) {
-                return "";
+                return Json::Value();
             }
         }
-        std::string getTransaction(std::string id) {
+        Json::Value getTransaction(const std::string& id) {
             try {
                 const Blockchain::dbTransaction tx = blockchain->getTransactionDB(dbTx, id);
-                return CryptoKernel::Storage::toString(tx.toJson());
+                return tx.toJson();
             } catch(const Blockchain::NotFoundException& e) {
-                return "";
+                return Json::Value();
             }
         }
-        std::string getOutput(std::string id) {
+        Json::Value getOutput(const std::string& id) {
             try {
                 const Blockchain::dbOutput out = blockchain->getOutputDB(dbTx, id);
-                return CryptoKernel::Storage::toString(out.toJson());
+                return out.toJson();
             } catch(const Blockchain::NotFoundException& e) {
-                return "";
+                return Json::Value();
             }
         }
-        std::string getInput(std::string id) {
+        Json::Value getInput(const std::string& id) {
             try {
                 const Blockchain::input inp = blockchain->getInput(dbTx, id);
-                return CryptoKernel::Storage::toString(inp.toJson());
+                return inp.toJson();
             } catch(const Blockchain::NotFoundException& e) {
-                return "";
+                return Json::Value();
             }
         }
         void setTransaction(Storage::Transaction* dbTx) {this->dbTx = dbTx;};
+        void setBlockchain(CryptoKernel::Blockchain* blockchain) {this->blockchain = blockchain;};
 
     private:
         CryptoKernel::Blockchain* blockchain;
         Storage::Transaction* dbTx;
     };
-    BlockchainInterface* blockchainInterface;
+
+    /**
+    * Lua C function calling one of the BlockchainInterface lookups, which is
+    * bound as its first upvalue with the lookup's name as the second. If the
+    * third upvalue is true it returns the result as a table, or nil if nothing
+    * was found, otherwise as JSON text, or an empty string if nothing was found.
+    */
+    template<Json::Value (BlockchainInterface::*lookup)(const std::string&)>
+    static int luaBlockchainLookup(lua_State* luaState);
 };
 }
 
@@ -20,6 +20,13 @@
 #include <iomanip>
 #include <cstring>
 
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
 #include <openssl/sha.h>
 #include <openssl/evp.h>
 #include <openssl/rand.h>
@@ -187,6 +194,60 @@ std::string CryptoKernel::Crypto::sha256(std::string message) {
     return base16_encode(hash, SHA256_DIGEST_LENGTH);
 }
 
+namespace {
+inline uint64_t rotl(const uint64_t x, const int b) {
+    return (x << b) | (x >> (64 - b));
+}
+
+inline void sipRound(uint64_t& v0, uint64_t& v1, uint64_t& v2, uint64_t& v3) {
+    v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+    v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+    v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+    v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+}
+}
+
+uint64_t CryptoKernel::Crypto::sipHash(const uint64_t k0, const uint64_t k1,
+                                       const std::string& message) {
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+
+    const size_t len = message.size();
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(message.data());
+
+    size_t i = 0;
+    for(; i + 8 <= len; i += 8) {
+        uint64_t m = 0;
+        for(int j = 7; j >= 0; j--) {
+            m = (m << 8) | bytes[i + j];
+        }
+
+        v3 ^= m;
+        sipRound(v0, v1, v2, v3);
+        sipRound(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+
+    uint64_t last = static_cast<uint64_t>(len) << 56;
+    for(size_t j = 0; i + j < len; j++) {
+        last |= static_cast<uint64_t>(bytes[i + j]) << (8 * j);
+    }
+
+    v3 ^= last;
+    sipRound(v0, v1, v2, v3);
+    sipRound(v0, v1, v2, v3);
+    v0 ^= last;
+
+    v2 ^= 0xff;
+    for(int j = 0; j < 4; j++) {
+        sipRound(v0, v1, v2, v3);
+    }
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
 bool CryptoKernel::Crypto::getStatus() {
     return true;
 }
@@ -209,7 +270,28 @@ CryptoKernel::AES256::AES256(const Json::Value& objJson) {
     memcpy(&salt, decodedSalt.c_str(), decodedSalt.size());
 }
 
-CryptoKernel::AES256::AES256(const std::string& password, const std::string& plainText) {
+void CryptoKernel::lockMemory(void* p, const std::size_t len) {
+    #ifdef _WIN32
+    VirtualLock(p, len);
+    #else
+    mlock(p, len);
+    #endif
+}
+
+void CryptoKernel::unlockMemory(void* p, const std::size_t len) {
+    #ifdef _WIN32
+    VirtualUnlock(p, len);
+    #else
+    munlock(p, len);
+    #endif
+}
+
+CryptoKernel::AES256::AES256(const std::string& password,
+                             const std::string& plainText) : AES256(SecureString(password.begin(),
+                                         password.end()), plainText) {
+}
+
+CryptoKernel::AES256::AES256(const SecureString& password, const std::string& plainText) {
     // Generate salt
     if(!RAND_bytes(salt, sizeof(salt))) {
         throw std::runtime_error("Could not generate random salt");
@@ -264,7 +346,11 @@ Json::Value CryptoKernel::AES256::toJson() const {
     return returning;
 }
 
-std::string CryptoKernel::AES256::decrypt(const std::string& password) const {  
+std::string CryptoKernel::AES256::decrypt(const std::string& password) const {
+    return decrypt(SecureString(password.begin(), password.end()));
+}
+
+std::string CryptoKernel::AES256::decrypt(const SecureString& password) const {
     const auto key = genKey(password);
                       
     // Encrypt plaintext
@@ -301,7 +387,7 @@ std::string CryptoKernel::AES256::decrypt(const std::string& password) const {
     return std::string((char*)&plainText, totalLen);
 }
 
-std::shared_ptr<unsigned char> CryptoKernel::AES256::genKey(const std::string& password) const {
+std::shared_ptr<unsigned char> CryptoKernel::AES256::genKey(const SecureString& password) const {
     std::shared_ptr<unsigned char> key(new unsigned char[32]);
     
     // Derive key from password
@@ -20,14 +20,73 @@
 
 #include <string>
 #include <memory>
+#include <limits>
+#include <new>
 
 #include <openssl/ec.h>
 #include <openssl/ecdsa.h>
 #include <openssl/obj_mac.h>
+#include <openssl/crypto.h>
 #include <json/value.h>
 
 namespace CryptoKernel {
 
+/**
+* Locks memory into RAM so it is never swapped to disk. Best effort, failures
+* are ignored.
+*/
+void lockMemory(void* p, const std::size_t len);
+
+/**
+* Unlocks memory locked by lockMemory
+*/
+void unlockMemory(void* p, const std::size_t len);
+
+/**
+* Allocator for secrets. Memory it hands out is locked so it is never
+* swapped to disk, and is wiped before being freed. Locking is best effort,
+* if the process is over its locked memory limit the memory is still wiped.
+*/
+template <class T> class LockedAllocator {
+public:
+    typedef T value_type;
+
+    LockedAllocator() noexcept {}
+
+    template <class U> LockedAllocator(const LockedAllocator<U>&) noexcept {}
+
+    T* allocate(const std::size_t n) {
+        if(n > (std::numeric_limits<std::size_t>::max)() / sizeof(T)) {
+            throw std::bad_alloc();
+        }
+
+        T* p = static_cast<T*>(::operator new(n * sizeof(T)));
+        lockMemory(p, n * sizeof(T));
+        return p;
+    }
+
+    void deallocate(T* p, const std::size_t n) noexcept {
+        OPENSSL_cleanse(p, n * sizeof(T));
+        unlockMemory(p, n * sizeof(T));
+        ::operator delete(p);
+    }
+
+    template <class U> bool operator==(const LockedAllocator<U>&) const noexcept {
+        return true;
+    }
+
+    template <class U> bool operator!=(const LockedAllocator<U>&) const noexcept {
+        return false;
+    }
+};
+
+/**
+* A string kept in locked memory and wiped when freed. Short strings may be
+* stored inline so reserve enough space to force a heap allocation before
+* putting a secret in one.
+*/
+typedef std::basic_string<char, std::char_traits<char>, LockedAllocator<char>> SecureString;
+
 /**
 * A mutable class which performs cryptography operations on ECDSA (secp256k1) keypairs. It provides funtions to
 * generate keys, signing and verifying. It also provides a static function for generating SHA256 hashes.
@@ -109,6 +168,17 @@ public:
     */
     static std::string sha256(std::string message);
 
+    /**
+    * Static function which computes the SipHash-2-4 of the given message under a 128 bit key.
+    * Much cheaper than SHA256 for hashing many short messages under a secret or per-use key.
+    *
+    * @param k0 the first 64 bits of the key
+    * @param k1 the last 64 bits of the key
+    * @param message the message to hash
+    * @return the 64 bit hash
+    */
+    static uint64_t sipHash(const uint64_t k0, const uint64_t k1, const std::string& message);
+
 private:
     EC_KEY *eckey;
     EC_GROUP *ecgroup;
@@ -119,17 +189,19 @@ class AES256 {
     public:
         AES256(const Json::Value& objJson);
         AES256(const std::string& password, const std::string& plainText);
+        AES256(const SecureString& password, const std::string& plainText);
 
         Json::Value toJson() const;
 
         std::string decrypt(const std::string& password) const;
+        std::string decrypt(const SecureString& password) const;
 
     private:
         unsigned char salt[32];
         unsigned char iv[16];
         std::string cipherText;
 
-        std::shared_ptr<unsigned char> genKey(const std::string& password) const;
+        std::shared_ptr<unsigned char> genKey(const SecureString& password) const;
 };
 
 }
@@ -1,10 +1,13 @@
 #include "network.h"
 #include "networkpeer.h"
+#include "networkvalidation.h"
+#include "networkaddrman.h"
 #include "version.h"
 
 #include <list>
 #include <algorithm>
 #include <cstdlib>
+#include <cstdio>
 #include <ctime>
 #include <openssl/rand.h>
 
@@ -33,6 +36,11 @@ void CryptoKernel::Network::Connection::sendBlock(const CryptoKernel::Blockchain
 	peer->sendBlock(block);
 }
 
+void CryptoKernel::Network::Connection::sendCompactBlock(const CryptoKernel::Blockchain::block& block) {
+	std::lock_guard<std::mutex> mm(modMutex);
+	peer->sendCompactBlock(block);
+}
+
 std::vector<CryptoKernel::Blockchain::transaction> CryptoKernel::Network::Connection::getUnconfirmedTransactions() {
 	std::lock_guard<std::mutex> mm(modMutex);
 	return peer->getUnconfirmedTransactions();
@@ -120,8 +128,7 @@ CryptoKernel::Network::Network(CryptoKernel::Log* log,
 
     networkdb.reset(new CryptoKernel::Storage(dbDir, false, 8, false));
     peers.reset(new Storage::Table("peers"));
-
-    std::unique_ptr<Storage::Transaction> dbTx(networkdb->begin());
+    addressManager.reset(new AddressManager(networkdb.get(), peers.get()));
 
     std::ifstream infile("peers.txt");
     if(!infile.is_open()) {
@@ -130,18 +137,12 @@ CryptoKernel::Network::Network(CryptoKernel::Log* log,
 
     std::string line;
     while(std::getline(infile, line)) {
-        if(!peers->get(dbTx.get(), line).isObject()) {
-            Json::Value newSeed;
-            newSeed["lastseen"] = 0;
-            newSeed["height"] = 1;
-            newSeed["score"] = 0;
-            peers->put(dbTx.get(), line, newSeed);
-        }
+        addressManager->add(line);
     }
 
     infile.close();
 
-    dbTx->commit();
+    addressManager->flush(true);
 
     if(listener.listen(port) != sf::Socket::Done) {
         log->printf(LOG_LEVEL_ERR, "Network(): Could not bind to port " + std::to_string(port));
@@ -149,6 +150,14 @@ CryptoKernel::Network::Network(CryptoKernel::Log* log,
 
     running = true;
 
+    validationQueue.reset(new ValidationQueue(blockchain, log,
+        [this](const CryptoKernel::Blockchain::block& block) {
+            broadcastBlock(block);
+        },
+        [this](const std::string& peer, const uint64_t score) {
+            changeScore(peer, score);
+        }));
+
 	unsigned char seedBuf[64];
 	if(!RAND_bytes(seedBuf, sizeof(seedBuf))) {
 		throw std::runtime_error("Could not randomize connections");
@@ -177,6 +186,13 @@ CryptoKernel::Network::~Network() {
     makeOutgoingConnectionsThread->join();
     infoOutgoingConnectionsThread->join();
     listener.close();
+
+    // Peers submit to the validation queue, so stop them before it
+    connected.clear();
+    disconnected.clear();
+    validationQueue.reset();
+
+    addressManager->flush(true);
 }
 
 void CryptoKernel::Network::makeOutgoingConnectionsWrapper() {
@@ -200,62 +216,45 @@ void CryptoKernel::Network::infoOutgoingConnectionsWrapper() {
 }
 
 void CryptoKernel::Network::makeOutgoingConnections(bool& wait) {
-	std::map<std::string, Json::Value> peersToTry;
-	std::vector<std::string> peerIps;
-
-	std::unique_ptr<Storage::Transaction> dbTx(networkdb->beginReadOnly());
-
-	std::unique_ptr<Storage::Table::Iterator> it(new Storage::Table::Iterator(peers.get(), networkdb.get(), dbTx->snapshot));
-
-	for(it->SeekToFirst(); it->Valid(); it->Next()) {
-		if(connected.size() >= 8) { // honestly, this is enough
-			wait = true;
-			it.reset();
-			return;
-		}
-
-		Json::Value peerInfo = it->value();
-
-		if(connected.contains(it->key())) {
-			continue;
-		}
-
-		std::time_t result = std::time(nullptr);
+	if(connected.size() >= 8) { // honestly, this is enough
+		wait = true;
+		return;
+	}
 
-		const auto banIt = banned.find(it->key());
-		if(banIt != banned.end()) {
-			if(banIt->second > static_cast<uint64_t>(result)) {
-				continue;
-			}
+	const std::vector<std::string> peerIps = addressManager->select(8 - connected.size(),
+		[&](const std::string& url) {
+		if(connected.contains(url)) {
+			return false;
 		}
 
-		if(peerInfo["lastattempt"].asUInt64() + 5 * 60 > static_cast<unsigned long long int>
-				(result) && peerInfo["lastattempt"].asUInt64() != peerInfo["lastseen"].asUInt64()) {
-			continue;
+		uint64_t banExpiry;
+		if(banned.get(url, banExpiry) && banExpiry > static_cast<uint64_t>(std::time(nullptr))) {
+			return false;
 		}
 
-		sf::IpAddress addr(it->key());
+		sf::IpAddress addr(url);
 
 		if(addr == sf::IpAddress::getLocalAddress()
 				|| addr == myAddress
 				|| addr == sf::IpAddress::LocalHost
 				|| addr == sf::IpAddress::None) {
-			continue;
+			return false;
 		}
 
-		//log->printf(LOG_LEVEL_INFO, "Network(): Attempting to connect to " + it->key());
-		peersToTry.insert(std::pair<std::string, Json::Value>(it->key(), peerInfo));
-		peerIps.push_back(it->key());
+		return true;
+	});
+
+	// Nobody worth trying right now
+	if(peerIps.empty()) {
+		wait = true;
+		return;
 	}
-	it.reset();
 
-	std::random_shuffle(peerIps.begin(), peerIps.end());
 	for(std::string peerIp : peerIps) {
 		if(!running) {
 			break;
 		}
-		auto entry = peersToTry.find(peerIp);
-		Json::Value peerData = entry->second;
+		addressManager->markAttempt(peerIp);
 
 		sf::TcpSocket* socket = new sf::TcpSocket();
 		log->printf(LOG_LEVEL_INFO, "Network(): Attempting to connect to " + peerIp);
@@ -264,12 +263,11 @@ void CryptoKernel::Network::makeOutgoingConnections(bool& wait) {
 			Connection* connection = new Connection;
 			connection->setPeer(new Peer(socket, blockchain, this, false));
 
-			peerData["lastseen"] = static_cast<uint64_t>(std::time(nullptr));
-			peerData["score"] = 0;
+			addressManager->markConnected(peerIp);
 
-			connection->setInfo(peerData);
+			connection->setInfo(addressManager->getInfo(peerIp));
 
-			connected.at(peerIp).reset(connection);
+			connected.insert(peerIp, std::shared_ptr<Connection>(connection));
 		}
 		else {
 			log->printf(LOG_LEVEL_WARN, "Network(): Failed to connect to " + peerIp);
@@ -279,81 +277,85 @@ void CryptoKernel::Network::makeOutgoingConnections(bool& wait) {
 }
 
 void CryptoKernel::Network::infoOutgoingConnections() {
-	std::unique_ptr<Storage::Transaction> dbTx(networkdb->begin());
-
-	std::set<std::string> removals;
-
 	std::vector<std::string> keys = connected.keys();
 	std::random_shuffle(keys.begin(), keys.end());
 	for(auto key: keys) {
-		auto it = connected.find(key);
-		if(it != connected.end() && it->second->acquire()) {
+		std::shared_ptr<Connection> connection;
+		if(connected.get(key, connection) && connection->acquire()) {
 			try {
-				const Json::Value info = it->second->getInfo();
+				const Json::Value info = connection->getInfo();
 				try {
 					const std::string peerVersion = info["version"].asString();
 					if(peerVersion.substr(0, peerVersion.find(".")) != version.substr(0, version.find("."))) {
 						log->printf(LOG_LEVEL_WARN,
-									"Network(): " + it->first + " has a different major version than us");
+									"Network(): " + key + " has a different major version than us");
 						throw Peer::NetworkError("peer has an incompatible major version");
 					}
 
-					const auto banIt = banned.find(it->first);
-					if(banIt != banned.end()) {
-						if(banIt->second > static_cast<uint64_t>(std::time(nullptr))) {
-							log->printf(LOG_LEVEL_WARN,
-										"Network(): Disconnecting " + it->first + " for being banned");
-							throw Peer::NetworkError("peer is banned");
-						}
+					uint64_t banExpiry;
+					if(banned.get(key, banExpiry) && banExpiry > static_cast<uint64_t>(std::time(nullptr))) {
+						log->printf(LOG_LEVEL_WARN,
+									"Network(): Disconnecting " + key + " for being banned");
+						throw Peer::NetworkError("peer is banned");
 					}
 
-                    it->second->setInfo("version", info["version"].asString());
-					it->second->setInfo("height", info["tipHeight"].asUInt64());
+                    connection->setInfo("version", info["version"].asString());
+					connection->setInfo("height", info["tipHeight"].asUInt64());
 
 					// update connected stats
-					peerStats stats = it->second->getPeerStats();
-					stats.version = it->second->getInfo("version").asString();
-					stats.blockHeight = it->second->getInfo("height").asUInt64();
-					connectedStats.insert(std::make_pair(it->first, stats));
+					peerStats stats = connection->getPeerStats();
+					stats.version = connection->getInfo("version").asString();
+					stats.blockHeight = connection->getInfo("height").asUInt64();
+					connectedStats.insert(key, stats);
 
 					for(const Json::Value& peer : info["peers"]) {
 						sf::IpAddress addr(peer.asString());
 						if(addr != sf::IpAddress::None) {
-							if(!peers->get(dbTx.get(), addr.toString()).isObject()) {
+							if(addressManager->add(addr.toString())) {
 								log->printf(LOG_LEVEL_INFO, "Network(): Discovered new peer: " + addr.toString());
-								Json::Value newSeed;
-								newSeed["lastseen"] = 0;
-								newSeed["height"] = 1;
-								newSeed["score"] = 0;
-								peers->put(dbTx.get(), addr.toString(), newSeed);
 							}
 						} else {
-							changeScore(it->first, 10);
+							changeScore(key, 10);
 							throw Peer::NetworkError("peer sent a malformed peer IP address: \"" + addr.toString() + "\"");
 						}
 					}
 				} catch(const Json::Exception& e) {
-					changeScore(it->first, 50);
+					changeScore(key, 50);
 					throw Peer::NetworkError("peer sent a malformed info message");
 				}
 
 				const std::time_t result = std::time(nullptr);
-				it->second->setInfo("lastseen", static_cast<uint64_t>(result));
+				connection->setInfo("lastseen", static_cast<uint64_t>(result));
 			} catch(const Peer::NetworkError& e) {
 				log->printf(LOG_LEVEL_WARN,
-							"Network(): Failed to contact " + it->first + ", disconnecting it for: " + e.what());
+							"Network(): Failed to contact " + key + ", disconnecting it for: " + e.what());
 
-				peers->put(dbTx.get(), it->first, it->second->getCachedInfo());
-				connectedStats.erase(it->first);
-				it->second->release();
-				connected.erase(it);
+				addressManager->update(key, connection->getCachedInfo());
+				connectedStats.erase(key);
+				connection->release();
+				disconnected.push_back(connection);
+				connected.erase(key);
 				continue;
 			}
-			it->second->release();
+			connection->release();
 		}
 	}
 
-	dbTx->commit();
+	reapConnections();
+
+	addressManager->flush();
+}
+
+void CryptoKernel::Network::reapConnections() {
+	// Nothing can take a new reference to a connection once it is out of
+	// connected, so one held only here stays that way
+	for(auto it = disconnected.begin(); it != disconnected.end();) {
+		if(it->use_count() == 1) {
+			it = disconnected.erase(it);
+		} else {
+			it++;
+		}
+	}
 }
 
 void CryptoKernel::Network::networkFunc() {
@@ -370,11 +372,11 @@ void CryptoKernel::Network::networkFunc() {
         std::vector<std::string> keys = connected.keys();
         std::random_shuffle(keys.begin(), keys.end());
         for(auto key : keys) {
-        	auto it = connected.find(key);
-        	if(it != connected.end() && it->second->acquire()) {
-                defer d([&]{it->second->release();});
-        		if(it->second->getInfo("height").asUInt64() > bestHeight) {
-					bestHeight = it->second->getInfo("height").asUInt64();
+        	std::shared_ptr<Connection> connection;
+        	if(connected.get(key, connection) && connection->acquire()) {
+                defer d([&]{connection->release();});
+        		if(connection->getInfo("height").asUInt64() > bestHeight) {
+					bestHeight = connection->getInfo("height").asUInt64();
 				}
         	}
         }
@@ -395,13 +397,13 @@ void CryptoKernel::Network::networkFunc() {
             keys = connected.keys();
             std::random_shuffle(keys.begin(), keys.end());
 			for(auto key : keys) {
-				auto it = connected.find(key);
-				if(it != connected.end() && it->second->acquire()) {
-                    defer d([&]{it->second->release();});
-					if(it->second->getInfo("height").asUInt64() > currentHeight) {
+				std::shared_ptr<Connection> connection;
+				if(connected.get(key, connection) && connection->acquire()) {
+                    defer d([&]{connection->release();});
+					if(connection->getInfo("height").asUInt64() > currentHeight) {
 						std::list<CryptoKernel::Blockchain::block> blocks;
 
-						const std::string peerUrl = it->first;
+						const std::string peerUrl = key;
 
 						if(currentHeight == startHeight) {
 							auto nBlocks = 0;
@@ -410,7 +412,7 @@ void CryptoKernel::Network::networkFunc() {
 											"Network(): Downloading blocks " + std::to_string(currentHeight + 1) + " to " +
 											std::to_string(currentHeight + 6));
 								try {
-									const auto newBlocks = it->second->getBlocks(currentHeight + 1, currentHeight + 6);
+									const auto newBlocks = connection->getBlocks(currentHeight + 1, currentHeight + 6);
 									nBlocks = newBlocks.size();
 									blocks.insert(blocks.end(), newBlocks.rbegin(), newBlocks.rend());
 									if(nBlocks > 0) {
@@ -420,7 +422,7 @@ void CryptoKernel::Network::networkFunc() {
 									}
 								} catch(const Peer::NetworkError& e) {
 									log->printf(LOG_LEVEL_WARN,
-												"Network(): Failed to contact " + it->first + " " + e.what() +
+												"Network(): Failed to contact " + key + " " + e.what() +
 												" while downloading blocks");
 									break;
 								}
@@ -432,7 +434,7 @@ void CryptoKernel::Network::networkFunc() {
 								} catch(const CryptoKernel::Blockchain::NotFoundException& e) {
 									if(currentHeight == 1) {
 										// This peer has a different genesis block to us
-										changeScore(it->first, 250);
+										changeScore(key, 250);
 										break;
 									} else {
 										log->printf(LOG_LEVEL_INFO, "Network(): got block h: " + std::to_string(blocks.rbegin()->getHeight()) + " with prevBlock: " + blocks.rbegin()->getPreviousBlockId().toString() + " prev not found");
@@ -458,7 +460,7 @@ void CryptoKernel::Network::networkFunc() {
 
 							auto nBlocks = 0;
 							try {
-								const auto newBlocks = it->second->getBlocks(currentHeight + 1, currentHeight + 6);
+								const auto newBlocks = connection->getBlocks(currentHeight + 1, currentHeight + 6);
 								nBlocks = newBlocks.size();
 								blocks.insert(blocks.begin(), newBlocks.rbegin(), newBlocks.rend());
 								if(nBlocks > 0) {
@@ -469,7 +471,7 @@ void CryptoKernel::Network::networkFunc() {
 								}
 							} catch(const Peer::NetworkError& e) {
 								log->printf(LOG_LEVEL_WARN,
-											"Network(): Failed to contact " + it->first + " " + e.what() +
+											"Network(): Failed to contact " + key + " " + e.what() +
 											" while downloading blocks");
 								break;
 							}
@@ -497,6 +499,10 @@ void CryptoKernel::Network::networkFunc() {
 						blockProcessor.reset(new std::thread([&, blocks](const std::string& peer){
 							failure = false;
 
+							// Check PoW and signature syntax on the whole batch in parallel,
+							// submitBlock picks the cached results up
+							validationQueue->preValidate(blocks);
+
 							log->printf(LOG_LEVEL_INFO, "Network(): Submitting " + std::to_string(blocks.size()) + " blocks to blockchain");
 
 							for(auto rit = blocks.rbegin(); rit != blocks.rend() && running; ++rit) {
@@ -552,15 +558,14 @@ void CryptoKernel::Network::connectionFunc() {
                 continue;
             }
 
-            const auto it = banned.find(client->getRemoteAddress().toString());
-            if(it != banned.end()) {
-                if(it->second > static_cast<uint64_t>(std::time(nullptr))) {
-                    log->printf(LOG_LEVEL_INFO,
-                                "Network(): Incoming connection " + client->getRemoteAddress().toString() + " is banned");
-                    client->disconnect();
-                    delete client;
-                    continue;
-                }
+            uint64_t banExpiry;
+            if(banned.get(client->getRemoteAddress().toString(), banExpiry)
+                    && banExpiry > static_cast<uint64_t>(std::time(nullptr))) {
+                log->printf(LOG_LEVEL_INFO,
+                            "Network(): Incoming connection " + client->getRemoteAddress().toString() + " is banned");
+                client->disconnect();
+                delete client;
+                continue;
             }
 
             sf::IpAddress addr(client->getRemoteAddress());
@@ -610,11 +615,10 @@ void CryptoKernel::Network::connectionFunc() {
             connection->setInfo("lastseen", static_cast<uint64_t>(result));
             connection->setInfo("score", 0);
 
-            connected.at(client->getRemoteAddress().toString()).reset(connection);
+            connected.insert(client->getRemoteAddress().toString(), std::shared_ptr<Connection>(connection));
 
-            std::unique_ptr<Storage::Transaction> dbTx(networkdb->begin());
-            peers->put(dbTx.get(), client->getRemoteAddress().toString(), connection->getCachedInfo());
-            dbTx->commit();
+            addressManager->markConnected(client->getRemoteAddress().toString());
+            addressManager->update(client->getRemoteAddress().toString(), connection->getCachedInfo());
         } else {
             delete client;
         }
@@ -630,11 +634,11 @@ void CryptoKernel::Network::broadcastTransactions(const
 	std::vector<std::string> keys = connected.keys();
 	std::random_shuffle(keys.begin(), keys.end());
 	for(std::string key : keys) {
-		auto it = connected.find(key);
-		if(it != connected.end() && it->second->acquire()) {
-            defer d([&]{it->second->release();});
+		std::shared_ptr<Connection> connection;
+		if(connected.get(key, connection) && connection->acquire()) {
+            defer d([&]{connection->release();});
 			try {
-				it->second->sendTransactions(transactions);
+				connection->sendTransactions(transactions);
 			} catch(const Peer::NetworkError& err) {
 				log->printf(LOG_LEVEL_WARN, "Network::broadcastTransactions(): Failed to contact peer: " + std::string(err.what()));
 			}
@@ -646,11 +650,16 @@ void CryptoKernel::Network::broadcastBlock(const CryptoKernel::Blockchain::block
 	std::vector<std::string> keys = connected.keys();
 	std::random_shuffle(keys.begin(), keys.end());
     for(std::string key : keys) {
-    	auto it = connected.find(key);
-    	if(it != connected.end() && it->second->acquire()) {
-            defer d([&]{it->second->release();});
+    	std::shared_ptr<Connection> connection;
+    	if(connected.get(key, connection) && connection->acquire()) {
+            defer d([&]{connection->release();});
     		try {
-				it->second->sendBlock(block);
+				// Peers that know our mempool only need the header and short transaction ids
+				if(supportsCompactBlocks(connection->getCachedInfo()["version"].asString())) {
+					connection->sendCompactBlock(block);
+				} else {
+					connection->sendBlock(block);
+				}
 			} catch(const Peer::NetworkError& err) {
 				log->printf(LOG_LEVEL_WARN, "Network::broadcastBlock(): Failed to contact peer: " + std::string(err.what()));
 			}
@@ -658,23 +667,36 @@ void CryptoKernel::Network::broadcastBlock(const CryptoKernel::Blockchain::block
     }
 }
 
+bool CryptoKernel::Network::supportsCompactBlocks(const std::string& peerVersion) {
+    unsigned int major = 0;
+    unsigned int minor = 0;
+    unsigned int patch = 0;
+    if(std::sscanf(peerVersion.c_str(), "%u.%u.%u", &major, &minor, &patch) != 3) {
+        return false;
+    }
+
+    return major > 0 || minor > 2 || (minor == 2 && patch >= 1);
+}
+
 double CryptoKernel::Network::syncProgress() {
     return (double)(currentHeight)/(double)(bestHeight);
 }
 
 void CryptoKernel::Network::changeScore(const std::string& url, const uint64_t score) {
-    if(connected.contains(url)) { // this check isn't necessary
-        connected.at(url)->setInfo("score", connected.at(url)->getInfo("score").asUInt64() + score);
+    std::shared_ptr<Connection> connection;
+    if(connected.get(url, connection)) {
+        const uint64_t newScore = connection->getCachedInfo()["score"].asUInt64() + score;
+        connection->setInfo("score", newScore);
         log->printf(LOG_LEVEL_WARN,
                     "Network(): " + url + " misbehaving, increasing ban score by " + std::to_string(
-                        score) + " to " + connected.at(url)->getInfo("score").asString());
-        if(connected.at(url)->getInfo("score").asUInt64() > 200) {
+                        score) + " to " + std::to_string(newScore));
+        if(newScore > 200) {
             log->printf(LOG_LEVEL_WARN,
                         "Network(): Banning " + url + " for being above the ban score threshold");
             // Ban for 24 hours
             banned.insert(url, static_cast<uint64_t>(std::time(nullptr)) + 24 * 60 * 60);
         }
-        connected.at(url)->setInfo("disconnect", true);
+        connection->setInfo("disconnect", true);
     }
 }
 
@@ -4,6 +4,7 @@
 #include <memory>
 #include <thread>
 #include <functional>
+#include <list>
 
 #include <SFML/Network.hpp>
 
@@ -11,6 +12,8 @@
 #include "concurrentmap.h"
 
 namespace CryptoKernel {
+class ValidationQueue;
+
 /**
 * This class provides a peer-to-peer network between multiple blockchains
 */
@@ -97,9 +100,19 @@ public:
 
 private:
     class Peer;
+    class AddressManager;
 
     void changeScore(const std::string& url, const uint64_t score);
 
+    /**
+    * Returns true iff a peer running the given version understands
+    * compact block announcements
+    *
+    * @param peerVersion the version string reported by the peer
+    * @return true iff compact blocks can be sent to the peer
+    */
+    static bool supportsCompactBlocks(const std::string& peerVersion);
+
     class Connection {
     public:
     	Connection();
@@ -107,6 +120,7 @@ private:
     	Json::Value getInfo();
 		void sendTransactions(const std::vector<CryptoKernel::Blockchain::transaction>& transactions);
 		void sendBlock(const CryptoKernel::Blockchain::block& block);
+		void sendCompactBlock(const CryptoKernel::Blockchain::block& block);
 		std::vector<CryptoKernel::Blockchain::transaction> getUnconfirmedTransactions();
 		CryptoKernel::Blockchain::block getBlock(const uint64_t height, const std::string& id);
 		std::vector<CryptoKernel::Blockchain::block> getBlocks(const uint64_t start, const uint64_t end);
@@ -135,16 +149,19 @@ private:
 		std::mutex infoMutex;
 	};
 
-    ConcurrentMap<std::string, std::unique_ptr<Connection>> connected;
+    ConcurrentMap<std::string, std::shared_ptr<Connection>> connected;
     std::recursive_mutex connectedMutex;
 
     ConcurrentMap<std::string, peerStats> connectedStats;
 
+    std::unique_ptr<ValidationQueue> validationQueue;
+
     CryptoKernel::Log* log;
     CryptoKernel::Blockchain* blockchain;
 
     std::unique_ptr<CryptoKernel::Storage> networkdb;
     std::unique_ptr<Storage::Table> peers;
+    std::unique_ptr<AddressManager> addressManager;
 
     bool running;
 
@@ -162,6 +179,16 @@ private:
     void infoOutgoingConnectionsWrapper();
     std::unique_ptr<std::thread> infoOutgoingConnectionsThread;
 
+    // Connections removed from connected that a peer thread may still hold.
+    // They are only destroyed by the info thread once nothing else holds
+    // them, so a peer's own request thread never runs ~Peer and joins itself.
+    std::list<std::shared_ptr<Connection>> disconnected;
+
+    /**
+    * Destroys the disconnected connections no other thread still holds
+    */
+    void reapConnections();
+
     sf::TcpListener listener;
 
     ConcurrentMap<std::string, uint64_t> banned;
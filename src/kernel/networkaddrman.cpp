@@ -0,0 +1,244 @@
+#include <ctime>
+
+#include "networkaddrman.h"
+
+// Limits on the work and memory the address manager will spend
+static const size_t maxNewAddresses = 20000;
+static const size_t maxDirty = 100;
+static const uint64_t flushInterval = 60;
+static const unsigned int maxProbes = 64;
+
+CryptoKernel::Network::AddressManager::AddressManager(CryptoKernel::Storage* db,
+        CryptoKernel::Storage::Table* peers) {
+    this->db = db;
+    this->peers = peers;
+    lastFlush = static_cast<uint64_t>(std::time(nullptr));
+
+    std::random_device r;
+    generator.seed(r());
+
+    // The only full scan of the peers table, on startup
+    std::unique_ptr<Storage::Transaction> dbTx(db->beginReadOnly());
+    std::unique_ptr<Storage::Table::Iterator> it(new Storage::Table::Iterator(peers, db, dbTx->snapshot));
+    for(it->SeekToFirst(); it->Valid(); it->Next()) {
+        const Json::Value peerInfo = it->value();
+
+        address addr;
+        addr.lastSeen = peerInfo["lastseen"].asUInt64();
+        addr.lastAttempt = peerInfo["lastattempt"].asUInt64();
+        addr.height = peerInfo["height"].asUInt64();
+        addr.score = peerInfo["score"].asUInt64();
+        addr.location = addr.lastSeen > 0 ? TRIED : NEW;
+
+        insert(it->key(), addr);
+    }
+    it.reset();
+}
+
+void CryptoKernel::Network::AddressManager::insert(const std::string& url,
+        const address& addr) {
+    address newAddr = addr;
+    newAddr.position = buckets[newAddr.location].size();
+    buckets[newAddr.location].push_back(url);
+    addresses[url] = newAddr;
+}
+
+void CryptoKernel::Network::AddressManager::remove(const std::string& url) {
+    const auto it = addresses.find(url);
+    std::vector<std::string>& from = buckets[it->second.location];
+
+    // Swap with the last element so removal is constant time
+    const size_t position = it->second.position;
+    from[position] = from.back();
+    addresses[from[position]].position = position;
+    from.pop_back();
+
+    addresses.erase(it);
+}
+
+void CryptoKernel::Network::AddressManager::moveTo(const std::string& url,
+        const bucket location) {
+    address addr = addresses[url];
+    if(addr.location != location) {
+        remove(url);
+        addr.location = location;
+        insert(url, addr);
+    }
+}
+
+bool CryptoKernel::Network::AddressManager::add(const std::string& url) {
+    std::lock_guard<std::mutex> lock(addrMutex);
+    if(addresses.find(url) != addresses.end()) {
+        return false;
+    }
+
+    // Make room by forgetting a random address we have never connected to
+    if(buckets[NEW].size() >= maxNewAddresses) {
+        std::uniform_int_distribution<size_t> distribution(0, buckets[NEW].size() - 1);
+        const std::string evicted = buckets[NEW][distribution(generator)];
+        remove(evicted);
+        dirty.erase(evicted);
+        removed.insert(evicted);
+    }
+
+    address addr;
+    addr.lastSeen = 0;
+    addr.lastAttempt = 0;
+    addr.height = 1;
+    addr.score = 0;
+    addr.location = NEW;
+    insert(url, addr);
+
+    removed.erase(url);
+    dirty.insert(url);
+
+    return true;
+}
+
+void CryptoKernel::Network::AddressManager::markAttempt(const std::string& url) {
+    std::lock_guard<std::mutex> lock(addrMutex);
+    const auto it = addresses.find(url);
+    if(it != addresses.end()) {
+        it->second.lastAttempt = static_cast<uint64_t>(std::time(nullptr));
+        dirty.insert(url);
+    }
+}
+
+void CryptoKernel::Network::AddressManager::markConnected(const std::string& url) {
+    std::lock_guard<std::mutex> lock(addrMutex);
+    if(addresses.find(url) == addresses.end()) {
+        address addr;
+        addr.lastAttempt = 0;
+        addr.height = 1;
+        addr.location = TRIED;
+        insert(url, addr);
+        removed.erase(url);
+    } else {
+        moveTo(url, TRIED);
+    }
+
+    address& addr = addresses[url];
+    const uint64_t now = static_cast<uint64_t>(std::time(nullptr));
+    addr.lastSeen = now;
+    addr.lastAttempt = now;
+    addr.score = 0;
+
+    dirty.insert(url);
+}
+
+void CryptoKernel::Network::AddressManager::update(const std::string& url,
+        const Json::Value& info) {
+    std::lock_guard<std::mutex> lock(addrMutex);
+    const auto it = addresses.find(url);
+    if(it != addresses.end()) {
+        try {
+            it->second.lastSeen = info["lastseen"].asUInt64();
+            it->second.height = info["height"].asUInt64();
+            it->second.score = info["score"].asUInt64();
+        } catch(const Json::Exception& e) {
+            return;
+        }
+        dirty.insert(url);
+    }
+}
+
+Json::Value CryptoKernel::Network::AddressManager::getInfo(const std::string& url) {
+    std::lock_guard<std::mutex> lock(addrMutex);
+    const auto it = addresses.find(url);
+    if(it == addresses.end()) {
+        return Json::Value();
+    }
+
+    return toJson(it->second);
+}
+
+Json::Value CryptoKernel::Network::AddressManager::toJson(const address& addr) const {
+    Json::Value returning;
+    returning["lastseen"] = addr.lastSeen;
+    returning["lastattempt"] = addr.lastAttempt;
+    returning["height"] = addr.height;
+    returning["score"] = addr.score;
+    return returning;
+}
+
+std::vector<std::string> CryptoKernel::Network::AddressManager::select(const unsigned int count,
+        const std::function<bool(const std::string&)>& filter) {
+    std::vector<std::string> candidates;
+    std::set<std::string> probed;
+
+    // The filter can resolve hostnames, so only sample under the lock and
+    // filter the samples once it's released
+    std::unique_lock<std::mutex> lock(addrMutex);
+    const uint64_t now = static_cast<uint64_t>(std::time(nullptr));
+    std::uniform_int_distribution<int> coin(0, 1);
+
+    for(unsigned int i = 0; i < maxProbes; i++) {
+        // Prefer addresses that have worked before, half the time
+        bucket location = coin(generator) == 1 ? TRIED : NEW;
+        if(buckets[location].empty()) {
+            location = location == TRIED ? NEW : TRIED;
+            if(buckets[location].empty()) {
+                break;
+            }
+        }
+
+        std::uniform_int_distribution<size_t> distribution(0, buckets[location].size() - 1);
+        const std::string& url = buckets[location][distribution(generator)];
+        if(!probed.insert(url).second) {
+            continue;
+        }
+
+        const address& addr = addresses[url];
+        if(addr.lastAttempt + 5 * 60 > now && addr.lastAttempt != addr.lastSeen) {
+            continue;
+        }
+
+        candidates.push_back(url);
+    }
+
+    lock.unlock();
+
+    std::vector<std::string> returning;
+    for(const std::string& url : candidates) {
+        if(returning.size() >= count) {
+            break;
+        }
+
+        if(filter(url)) {
+            returning.push_back(url);
+        }
+    }
+
+    return returning;
+}
+
+void CryptoKernel::Network::AddressManager::flush(const bool force) {
+    std::lock_guard<std::mutex> lock(addrMutex);
+    const uint64_t now = static_cast<uint64_t>(std::time(nullptr));
+    if(dirty.empty() && removed.empty()) {
+        lastFlush = now;
+        return;
+    }
+
+    if(!force && dirty.size() + removed.size() < maxDirty && lastFlush + flushInterval > now) {
+        return;
+    }
+
+    std::unique_ptr<Storage::Transaction> dbTx(db->begin());
+    for(const std::string& url : dirty) {
+        peers->put(dbTx.get(), url, toJson(addresses[url]));
+    }
+    for(const std::string& url : removed) {
+        peers->erase(dbTx.get(), url);
+    }
+    dbTx->commit();
+
+    dirty.clear();
+    removed.clear();
+    lastFlush = now;
+}
+
+unsigned int CryptoKernel::Network::AddressManager::size() {
+    std::lock_guard<std::mutex> lock(addrMutex);
+    return addresses.size();
+}
@@ -0,0 +1,129 @@
+#ifndef NETWORKADDRMAN_H_INCLUDED
+#define NETWORKADDRMAN_H_INCLUDED
+
+#include <unordered_map>
+#include <vector>
+#include <set>
+#include <random>
+
+#include "network.h"
+
+/**
+* Keeps every known peer address in memory, split into a bucket of
+* addresses we have connected to before and a bucket of addresses we have
+* only heard about. Candidates are sampled at random from the buckets rather
+* than by scanning the peers table, and changes are written back to it in
+* batches.
+*/
+class CryptoKernel::Network::AddressManager {
+public:
+    /**
+    * Loads the known addresses from the given table
+    *
+    * @param db the database holding the peers table
+    * @param peers the table to load from and persist to
+    */
+    AddressManager(CryptoKernel::Storage* db, CryptoKernel::Storage::Table* peers);
+
+    /**
+    * Adds an address we have heard about if it is not already known
+    *
+    * @param url the address of the peer
+    * @return true iff the address was new
+    */
+    bool add(const std::string& url);
+
+    /**
+    * Records that we are about to try connecting to the given address
+    *
+    * @param url the address of the peer
+    */
+    void markAttempt(const std::string& url);
+
+    /**
+    * Records a successful connection to the given address and moves it
+    * into the tried bucket
+    *
+    * @param url the address of the peer
+    */
+    void markConnected(const std::string& url);
+
+    /**
+    * Updates the stored state of an address from a connection's info
+    *
+    * @param url the address of the peer
+    * @param info the connection info containing lastseen, height and score
+    */
+    void update(const std::string& url, const Json::Value& info);
+
+    /**
+    * Returns the stored state of an address in the format of the peers table
+    *
+    * @param url the address of the peer
+    * @return the address' lastseen, lastattempt, height and score
+    */
+    Json::Value getInfo(const std::string& url);
+
+    /**
+    * Samples up to the given number of addresses that are not backing off
+    * from a failed attempt and that the filter accepts. Does a bounded number
+    * of random probes rather than scanning all known addresses.
+    *
+    * @param count the maximum number of addresses to return
+    * @param filter returns false for addresses that shouldn't be tried, run
+    *        without the address lock held so it may block
+    * @return the sampled addresses
+    */
+    std::vector<std::string> select(const unsigned int count,
+                                    const std::function<bool(const std::string&)>& filter);
+
+    /**
+    * Writes changed addresses to disk if enough have built up or enough
+    * time has passed since the last write
+    *
+    * @param force write any changes regardless
+    */
+    void flush(const bool force = false);
+
+    /**
+    * Returns the number of known addresses
+    *
+    * @return the number of addresses in both buckets
+    */
+    unsigned int size();
+
+private:
+    enum bucket {
+        NEW = 0,
+        TRIED = 1
+    };
+
+    struct address {
+        uint64_t lastSeen;
+        uint64_t lastAttempt;
+        uint64_t height;
+        uint64_t score;
+        bucket location;
+        size_t position;
+    };
+
+    void insert(const std::string& url, const address& addr);
+    void remove(const std::string& url);
+    void moveTo(const std::string& url, const bucket location);
+    Json::Value toJson(const address& addr) const;
+
+    CryptoKernel::Storage* db;
+    CryptoKernel::Storage::Table* peers;
+
+    std::unordered_map<std::string, address> addresses;
+    std::vector<std::string> buckets[2];
+
+    std::set<std::string> dirty;
+    std::set<std::string> removed;
+    uint64_t lastFlush;
+
+    std::default_random_engine generator;
+    std::mutex addrMutex;
+};
+
+#endif // NETWORKADDRMAN_H_INCLUDED
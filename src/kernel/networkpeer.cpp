@@ -1,7 +1,10 @@
 #include <chrono>
 
+#include <openssl/rand.h>
+
 #include "version.h"
 #include "networkpeer.h"
+#include "networkvalidation.h"
 
 CryptoKernel::Network::Peer::Peer(sf::TcpSocket* client, CryptoKernel::Blockchain* blockchain,
                                   CryptoKernel::Network* network, const bool incoming) {
@@ -157,24 +160,97 @@ void CryptoKernel::Network::Peer::requestFunc() {
                                 network->broadcastTransactions(txs);
                             }
                         } else if(request["command"] == "block") {
-                            const CryptoKernel::Blockchain::block block = CryptoKernel::Blockchain::block(
-                                        request["data"]);
-
-                            // Don't accept blocks that are more than two hours away from the current time
-                            const int64_t now = std::time(nullptr);
-                            if(std::abs((int)(now - block.getTimestamp())) > 2 * 60 * 60) {
+                            network->validationQueue->submit(request["data"],
+                                                             client->getRemoteAddress().toString());
+                        } else if(request["command"] == "compactblock") {
+                            if(request["data"]["txids"].size() > 100000) {
                                 network->changeScore(client->getRemoteAddress().toString(), 50);
                             } else {
                                 try {
-                                    blockchain->getBlockDB(block.getId().toString());
-                                } catch(const CryptoKernel::Blockchain::NotFoundException& e) {
-                                    const auto blockResult = blockchain->submitBlock(block, false);
-                                    if(std::get<0>(blockResult)) {
-                                        network->broadcastBlock(block);
-                                    } else if(std::get<1>(blockResult)) {
-                                        network->changeScore(client->getRemoteAddress().toString(), 50);
+                                    CryptoKernel::CompactBlock compact(request["data"]);
+                                    try {
+                                        blockchain->getBlockDB(compact.getId());
+                                    } catch(const CryptoKernel::Blockchain::NotFoundException& e) {
+                                        // Fill in as much of the block as we can from our own mempool
+                                        compact.fill(blockchain->getUnconfirmedTransactions());
+
+                                        const std::set<std::string> missing = compact.getMissing();
+                                        if(missing.empty()) {
+                                            completeBlock(compact);
+                                        } else {
+                                            const uint64_t now = static_cast<uint64_t>(std::time(nullptr));
+
+                                            // Forget about blocks the peer never filled in
+                                            for(auto it = partialBlocks.begin(); it != partialBlocks.end();) {
+                                                if(it->second.received + 60 < now) {
+                                                    it = partialBlocks.erase(it);
+                                                } else {
+                                                    ++it;
+                                                }
+                                            }
+
+                                            if(partialBlocks.size() < 16) {
+                                                partialBlocks.erase(compact.getId());
+                                                partialBlocks.insert(std::make_pair(compact.getId(),
+                                                                     partialBlock{compact, now}));
+
+                                                Json::Value response;
+                                                response["command"] = "getblocktxn";
+                                                response["data"]["id"] = compact.getId();
+                                                response["data"]["nonce"] = static_cast<Json::UInt64>(compact.getNonce());
+                                                response["data"]["txids"] = Json::Value(Json::arrayValue);
+                                                for(const std::string& shortId : missing) {
+                                                    response["data"]["txids"].append(shortId);
+                                                }
+                                                send(response);
+                                            }
+                                        }
+                                    }
+                                } catch(const CryptoKernel::Blockchain::InvalidElementException& e) {
+                                    network->changeScore(client->getRemoteAddress().toString(), 50);
+                                }
+                            }
+                        } else if(request["command"] == "getblocktxn") {
+                            try {
+                                const CryptoKernel::Blockchain::block block = blockchain->getBlock(
+                                            request["data"]["id"].asString());
+
+                                // Short ids are keyed by the nonce of the announcement being filled in
+                                const CryptoKernel::CompactBlock compact(block,
+                                        request["data"]["nonce"].asUInt64());
+
+                                std::set<std::string> wanted;
+                                for(const Json::Value& shortId : request["data"]["txids"]) {
+                                    wanted.insert(shortId.asString());
+                                }
+
+                                Json::Value response;
+                                response["command"] = "blocktxn";
+                                response["data"]["id"] = request["data"]["id"].asString();
+                                response["data"]["transactions"] = Json::Value(Json::arrayValue);
+                                for(const CryptoKernel::Blockchain::transaction& tx : block.getTransactions()) {
+                                    if(wanted.find(compact.shortId(tx.getId())) != wanted.end()) {
+                                        response["data"]["transactions"].append(tx.toJson());
                                     }
                                 }
+
+                                send(response);
+                            } catch(const CryptoKernel::Blockchain::NotFoundException& e) {
+                                // The block was reorganised away, the peer will sync it normally
+                            }
+                        } else if(request["command"] == "blocktxn") {
+                            const auto it = partialBlocks.find(request["data"]["id"].asString());
+                            if(it != partialBlocks.end()) {
+                                CryptoKernel::CompactBlock compact = it->second.compact;
+                                partialBlocks.erase(it);
+
+                                std::vector<CryptoKernel::Blockchain::transaction> txs;
+                                for(const Json::Value& txJson : request["data"]["transactions"]) {
+                                    txs.push_back(CryptoKernel::Blockchain::transaction(txJson));
+                                }
+                                compact.addTransactions(txs);
+
+                                completeBlock(compact);
                             }
                         } else if(request["command"] == "getunconfirmed") {
                             const std::set<CryptoKernel::Blockchain::transaction> unconfirmedTransactions =
@@ -208,6 +284,27 @@ void CryptoKernel::Network::Peer::requestFunc() {
                                 response["nonce"] = request["nonce"].asUInt64();
                                 send(response);
                             }
+                        } else if(request["command"] == "getfilters") {
+                            const uint64_t start = request["data"]["start"].asUInt64();
+                            const uint64_t end = request["data"]["end"].asUInt64();
+                            Json::Value returning;
+                            if(end > start && (end - start) <= 1000) {
+                                std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(blockchain->getTxHandle());
+                                for(uint64_t i = start; i < end; i++) {
+                                    try {
+                                        const std::string id = blockchain->getBlockByHeightDB(dbTx.get(), i).getId().toString();
+                                        Json::Value filter;
+                                        filter["id"] = id;
+                                        filter["filter"] = blockchain->getBlockFilter(dbTx.get(), id).toJson();
+                                        returning["data"].append(filter);
+                                    } catch(const CryptoKernel::Blockchain::NotFoundException& e) {
+                                        break;
+                                    }
+                                }
+                            }
+
+                            returning["nonce"] = request["nonce"].asUInt64();
+                            send(returning);
                         } else if(request["command"] == "getblock") {
                             if(request["data"]["id"].empty()) {
                                 Json::Value response;
@@ -293,6 +390,45 @@ void CryptoKernel::Network::Peer::sendBlock(const CryptoKernel::Blockchain::bloc
     send(request);
 }
 
+void CryptoKernel::Network::Peer::sendCompactBlock(const CryptoKernel::Blockchain::block&
+        block) {
+    // A fresh nonce for every announcement keeps short ids unpredictable
+    uint64_t nonce;
+    if(!RAND_bytes(reinterpret_cast<unsigned char*>(&nonce), sizeof(nonce))) {
+        throw NetworkError("Could not pick a compact block nonce");
+    }
+
+    Json::Value request;
+    request["command"] = "compactblock";
+    request["data"] = CryptoKernel::CompactBlock(block, nonce).toJson();
+
+    send(request);
+}
+
+void CryptoKernel::Network::Peer::completeBlock(const CryptoKernel::CompactBlock& compact) {
+    if(!compact.getMissing().empty()) {
+        network->log->printf(LOG_LEVEL_WARN, "Network(): Peer " +
+                             client->getRemoteAddress().toString() +
+                             " did not provide all transactions for compact block " + compact.getId());
+        return;
+    }
+
+    // A short id collision or a lying peer leaves us with a different block.
+    // Regular sync will pick it up by height instead.
+    try {
+        const CryptoKernel::Blockchain::block block = compact.getBlock();
+
+        network->log->printf(LOG_LEVEL_INFO, "Network(): Reconstructed block " + compact.getId() +
+                             " with " + std::to_string(compact.size()) +
+                             " transactions from compact announcement");
+
+        network->validationQueue->submit(block, client->getRemoteAddress().toString());
+    } catch(const CryptoKernel::Blockchain::InvalidElementException& e) {
+        network->log->printf(LOG_LEVEL_WARN, "Network(): Failed to reconstruct compact block " +
+                             compact.getId() + " from " + client->getRemoteAddress().toString());
+    }
+}
+
 std::vector<CryptoKernel::Blockchain::transaction>
 CryptoKernel::Network::Peer::getUnconfirmedTransactions() {
     Json::Value request;
@@ -7,6 +7,7 @@
 #include <condition_variable>
 
 #include "network.h"
+#include "compactblock.h"
 
 class CryptoKernel::Network::Peer {
 public:
@@ -18,10 +19,12 @@ public:
     void sendTransactions(const std::vector<CryptoKernel::Blockchain::transaction>& 
                           transactions);
     void sendBlock(const CryptoKernel::Blockchain::block& block);
+    void sendCompactBlock(const CryptoKernel::Blockchain::block& block);
     std::vector<CryptoKernel::Blockchain::transaction> getUnconfirmedTransactions();
     CryptoKernel::Blockchain::block getBlock(const uint64_t height, const std::string& id);
     std::vector<CryptoKernel::Blockchain::block> getBlocks(const uint64_t start,
                                                            const uint64_t end);
+
     
     Network::peerStats getPeerStats() const;
 
@@ -57,6 +60,17 @@ private:
     std::default_random_engine generator;
     
     Network::peerStats stats;
+
+    struct partialBlock {
+        CryptoKernel::CompactBlock compact;
+        uint64_t received;
+    };
+
+    // Compact blocks waiting on transactions we requested from the peer,
+    // only touched from the request thread
+    std::map<std::string, partialBlock> partialBlocks;
+
+    void completeBlock(const CryptoKernel::CompactBlock& compact);
 };
 
 #endif // NETWORKPEER_H_INCLUDED
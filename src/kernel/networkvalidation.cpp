@@ -0,0 +1,187 @@
+#include "networkvalidation.h"
+
+CryptoKernel::ValidationQueue::ValidationQueue(CryptoKernel::Blockchain* blockchain,
+        CryptoKernel::Log* log,
+        const std::function<void(const CryptoKernel::Blockchain::block&)>& blockConnected,
+        const std::function<void(const std::string&, const uint64_t)>& peerMisbehaving) {
+    this->blockchain = blockchain;
+    this->log = log;
+    this->blockConnected = blockConnected;
+    this->peerMisbehaving = peerMisbehaving;
+    nextSequence = 0;
+    nextConnect = 0;
+    running = true;
+
+    connectThread.reset(new std::thread(&CryptoKernel::ValidationQueue::connectFunc, this));
+}
+
+CryptoKernel::ValidationQueue::~ValidationQueue() {
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        running = false;
+    }
+    jobReady.notify_all();
+    connectThread->join();
+}
+
+void CryptoKernel::ValidationQueue::submit(const Json::Value& blockJson,
+        const std::string& peer) {
+    std::shared_ptr<job> newJob(new job);
+    newJob->peer = peer;
+    newJob->blockJson = blockJson;
+    enqueue(newJob);
+}
+
+void CryptoKernel::ValidationQueue::submit(const CryptoKernel::Blockchain::block& block,
+        const std::string& peer) {
+    std::shared_ptr<job> newJob(new job);
+    newJob->peer = peer;
+    newJob->block.reset(new CryptoKernel::Blockchain::block(block));
+    enqueue(newJob);
+}
+
+unsigned int CryptoKernel::ValidationQueue::size() {
+    std::lock_guard<std::mutex> lock(queueMutex);
+    return jobs.size();
+}
+
+void CryptoKernel::ValidationQueue::enqueue(const std::shared_ptr<job>& newJob) {
+    newJob->checked = false;
+    newJob->valid = false;
+    newJob->misbehaving = false;
+
+    uint64_t sequence;
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        // Peers resend blocks and regular sync catches up, so shed load
+        // rather than queueing without bound
+        if(jobs.size() >= 256) {
+            log->printf(LOG_LEVEL_WARN, "Network(): Validation queue full, dropping block from " +
+                                 newJob->peer);
+            return;
+        }
+
+        sequence = nextSequence++;
+        jobs[sequence] = newJob;
+    }
+
+    pool.enqueue([this, newJob]() {
+        try {
+            check(*newJob);
+        } catch(const std::exception& e) {
+            // The connect stage waits on every sequence number, never leave one unchecked
+            newJob->valid = false;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            newJob->checked = true;
+        }
+        jobReady.notify_all();
+    });
+}
+
+void CryptoKernel::ValidationQueue::check(job& blockJob) {
+    try {
+        if(!blockJob.block) {
+            blockJob.block.reset(new CryptoKernel::Blockchain::block(blockJob.blockJson));
+            blockJob.blockJson = Json::Value();
+        }
+    } catch(const CryptoKernel::Blockchain::InvalidElementException& e) {
+        blockJob.misbehaving = true;
+        return;
+    } catch(const Json::Exception& e) {
+        blockJob.misbehaving = true;
+        return;
+    }
+
+    // Don't accept blocks that are more than two hours away from the current time
+    const int64_t now = std::time(nullptr);
+    if(std::abs((int)(now - blockJob.block->getTimestamp())) > 2 * 60 * 60) {
+        blockJob.misbehaving = true;
+        return;
+    }
+
+    try {
+        blockchain->getBlockDB(blockJob.block->getId().toString());
+        return;
+    } catch(const CryptoKernel::Blockchain::NotFoundException& e) {
+    }
+
+    if(!blockchain->preValidateBlock(*blockJob.block)) {
+        blockJob.misbehaving = true;
+        return;
+    }
+
+    blockJob.valid = true;
+}
+
+void CryptoKernel::ValidationQueue::preValidate(const
+        std::list<CryptoKernel::Blockchain::block>& blocks) {
+    std::vector<std::future<bool>> results;
+    for(const CryptoKernel::Blockchain::block& block : blocks) {
+        results.push_back(pool.enqueue([this, &block]() {
+            return blockchain->preValidateBlock(block);
+        }));
+    }
+
+    for(auto& result : results) {
+        result.wait();
+    }
+}
+
+void CryptoKernel::ValidationQueue::connect(job& blockJob) {
+    if(!blockJob.valid) {
+        if(blockJob.misbehaving) {
+            peerMisbehaving(blockJob.peer, 50);
+        }
+        return;
+    }
+
+    // Runs on the connect thread, so nothing a peer's block throws may escape
+    // it. Penalise the peer as its request thread did before.
+    try {
+        const auto blockResult = blockchain->submitBlock(*blockJob.block, false);
+        if(std::get<0>(blockResult)) {
+            blockConnected(*blockJob.block);
+        } else if(std::get<1>(blockResult)) {
+            peerMisbehaving(blockJob.peer, 50);
+        }
+    } catch(const CryptoKernel::Blockchain::InvalidElementException& e) {
+        peerMisbehaving(blockJob.peer, 50);
+    } catch(const Json::Exception& e) {
+        peerMisbehaving(blockJob.peer, 250);
+    } catch(const std::exception& e) {
+        log->printf(LOG_LEVEL_WARN, "Network(): Failed to connect block from " +
+                             blockJob.peer + ": " + e.what());
+        peerMisbehaving(blockJob.peer, 50);
+    }
+}
+
+void CryptoKernel::ValidationQueue::connectFunc() {
+    while(true) {
+        std::shared_ptr<job> nextJob;
+
+        {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            jobReady.wait(lock, [this] {
+                if(!running) {
+                    return true;
+                }
+                const auto it = jobs.find(nextConnect);
+                return it != jobs.end() && it->second->checked;
+            });
+
+            if(!running) {
+                return;
+            }
+
+            const auto it = jobs.find(nextConnect);
+            nextJob = it->second;
+            jobs.erase(it);
+            nextConnect++;
+        }
+
+        connect(*nextJob);
+    }
+}
@@ -0,0 +1,106 @@
+#ifndef NETWORKVALIDATION_H_INCLUDED
+#define NETWORKVALIDATION_H_INCLUDED
+
+#include <map>
+#include <list>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+#include "blockchain.h"
+#include "log.h"
+#include "threadpool.h"
+
+namespace CryptoKernel {
+/**
+* Validates blocks received from peers off the peer I/O threads. Blocks are
+* deserialized and checked for context-free validity in parallel, then
+* connected to the blockchain one at a time in the order they arrived.
+* The submitting peer is scored once the result is known.
+*/
+class ValidationQueue {
+public:
+    /**
+    * Constructs a validation queue that connects blocks to the given
+    * blockchain and starts its connect thread
+    *
+    * @param blockchain the blockchain to connect blocks to
+    * @param log the log to report dropped and failed blocks to
+    * @param blockConnected called on the connect thread with each block that
+    *        became part of the chain
+    * @param peerMisbehaving called on the connect thread with the peer that sent
+    *        an invalid block and the ban score to add to it
+    */
+    ValidationQueue(CryptoKernel::Blockchain* blockchain, CryptoKernel::Log* log,
+                    const std::function<void(const CryptoKernel::Blockchain::block&)>& blockConnected,
+                    const std::function<void(const std::string&, const uint64_t)>& peerMisbehaving);
+    ~ValidationQueue();
+
+    /**
+    * Queues a serialized block received from the given peer. Returns
+    * without waiting for the block to be validated.
+    *
+    * @param blockJson the block as sent by the peer
+    * @param peer the address of the peer that sent the block
+    */
+    void submit(const Json::Value& blockJson, const std::string& peer);
+
+    /**
+    * Queues an already deserialized block received from the given peer
+    *
+    * @param block the block to validate
+    * @param peer the address of the peer that sent the block
+    */
+    void submit(const CryptoKernel::Blockchain::block& block, const std::string& peer);
+
+    /**
+    * Runs the context-free checks on a batch of downloaded blocks in
+    * parallel and waits for them to finish. The results are cached by the
+    * blockchain for when the blocks are submitted in order.
+    *
+    * @param blocks the blocks to check
+    */
+    void preValidate(const std::list<CryptoKernel::Blockchain::block>& blocks);
+
+    /**
+    * Returns the number of blocks waiting to be connected
+    *
+    * @return the number of queued blocks
+    */
+    unsigned int size();
+
+private:
+    struct job {
+        std::string peer;
+        Json::Value blockJson;
+        std::unique_ptr<CryptoKernel::Blockchain::block> block;
+        bool checked;
+        bool valid;
+        bool misbehaving;
+    };
+
+    void enqueue(const std::shared_ptr<job>& newJob);
+    void check(job& blockJob);
+    void connect(job& blockJob);
+    void connectFunc();
+
+    CryptoKernel::Blockchain* blockchain;
+    CryptoKernel::Log* log;
+    std::function<void(const CryptoKernel::Blockchain::block&)> blockConnected;
+    std::function<void(const std::string&, const uint64_t)> peerMisbehaving;
+
+    std::map<uint64_t, std::shared_ptr<job>> jobs;
+    uint64_t nextSequence;
+    uint64_t nextConnect;
+    bool running;
+
+    std::mutex queueMutex;
+    std::condition_variable jobReady;
+
+    std::unique_ptr<std::thread> connectThread;
+
+    CryptoKernel::ThreadPool pool;
+};
+}
+
+#endif // NETWORKVALIDATION_H_INCLUDED
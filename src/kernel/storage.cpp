@@ -278,6 +278,10 @@ void CryptoKernel::Storage::Table::Iterator::SeekToFirst() {
     it->Seek(prefix);
 }
 
+void CryptoKernel::Storage::Table::Iterator::Seek(const std::string& key) {
+    it->Seek(prefix + key);
+}
+
 bool CryptoKernel::Storage::Table::Iterator::Valid() {
     if(it->Valid()) {
         return it->key().ToString().compare(0, prefix.size(), prefix) == 0;
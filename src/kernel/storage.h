@@ -109,6 +109,13 @@ public:
             */
             void SeekToFirst();
 
+            /**
+            * Sets the iterator to the first key at or after the given key
+            *
+            * @param key the key to seek to, relative to the table and prefix
+            */
+            void Seek(const std::string& key);
+
             /**
             * Determines whether there are additional keys still in the database
             *
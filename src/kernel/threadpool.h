@@ -0,0 +1,131 @@
+/*  CryptoKernel - A library for creating blockchain based digital currency
+    Copyright (C) 2016  James Lovejoy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef THREADPOOL_H_INCLUDED
+#define THREADPOOL_H_INCLUDED
+
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <memory>
+#include <type_traits>
+
+namespace CryptoKernel {
+/**
+* A fixed size pool of worker threads that run queued tasks in FIFO order.
+* Tasks must not block waiting on other tasks queued on the same pool.
+*/
+class ThreadPool {
+public:
+    /**
+    * Starts a pool with the given number of worker threads
+    *
+    * @param nThreads the number of workers to start, at least one
+    *        worker is always started
+    */
+    ThreadPool(const unsigned int nThreads = std::thread::hardware_concurrency()) {
+        stopping = false;
+        const unsigned int nWorkers = nThreads > 0 ? nThreads : 1;
+        for(unsigned int i = 0; i < nWorkers; i++) {
+            workers.emplace_back(&ThreadPool::workerFunc, this);
+        }
+    }
+
+    /**
+    * Finishes all queued tasks then joins the workers
+    */
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            stopping = true;
+        }
+        queueReady.notify_all();
+
+        for(std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    /**
+    * Queues a task to be run on one of the workers
+    *
+    * @param f the task to run
+    * @return a future holding the result of the task, or any exception it threw
+    */
+    template<class F>
+    std::future<typename std::result_of<F()>::type> enqueue(F&& f) {
+        typedef typename std::result_of<F()>::type result;
+
+        auto task = std::make_shared<std::packaged_task<result()>>(std::forward<F>(f));
+        std::future<result> returning = task->get_future();
+
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            tasks.push([task]() {
+                (*task)();
+            });
+        }
+        queueReady.notify_one();
+
+        return returning;
+    }
+
+    /**
+    * Returns the number of workers in the pool
+    *
+    * @return the number of worker threads
+    */
+    unsigned int size() const {
+        return workers.size();
+    }
+
+private:
+    void workerFunc() {
+        while(true) {
+            std::function<void()> task;
+
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queueReady.wait(lock, [this] {
+                    return stopping || !tasks.empty();
+                });
+
+                if(tasks.empty()) {
+                    return;
+                }
+
+                task = std::move(tasks.front());
+                tasks.pop();
+            }
+
+            task();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex queueMutex;
+    std::condition_variable queueReady;
+    bool stopping;
+};
+}
+
+#endif // THREADPOOL_H_INCLUDED
@@ -0,0 +1,158 @@
+#include "BlockFilterTests.h"
+
+#include <chrono>
+#include <stdexcept>
+
+CPPUNIT_TEST_SUITE_REGISTRATION(BlockFilterTest);
+
+static const CryptoKernel::BigNum blockId("a3f1c0de5e1f00d2b4c6a8e0f2d4b6a8c0e2f4d6b8a0c2e4f6d8b0a2c4e6f8a0");
+
+BlockFilterTest::BlockFilterTest() {
+    log.reset(new CryptoKernel::Log("tests.log"));
+}
+
+BlockFilterTest::~BlockFilterTest() {
+}
+
+void BlockFilterTest::setUp() {
+}
+
+void BlockFilterTest::tearDown() {
+}
+
+void BlockFilterTest::testMatch() {
+    std::set<std::string> elements;
+    for(unsigned int i = 0; i < 500; i++) {
+        elements.insert("key" + std::to_string(i));
+    }
+
+    const CryptoKernel::BlockFilter filter(blockId, elements);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(500), filter.getN());
+
+    for(const std::string& element : elements) {
+        CPPUNIT_ASSERT(filter.match(element));
+    }
+
+    // With a false positive rate of 1/784931 none of these should match
+    unsigned int falsePositives = 0;
+    for(unsigned int i = 0; i < 1000; i++) {
+        if(filter.match("other" + std::to_string(i))) {
+            falsePositives++;
+        }
+    }
+    CPPUNIT_ASSERT(falsePositives <= 1);
+
+    CPPUNIT_ASSERT(filter.matchAny({"other1", "other2", "key42"}));
+    CPPUNIT_ASSERT(!filter.matchAny({}));
+}
+
+void BlockFilterTest::testEmpty() {
+    const CryptoKernel::BlockFilter filter(blockId, std::set<std::string>());
+    CPPUNIT_ASSERT_EQUAL(uint64_t(0), filter.getN());
+    CPPUNIT_ASSERT(!filter.match("key"));
+
+    const CryptoKernel::BlockFilter decoded(blockId, filter.toJson());
+    CPPUNIT_ASSERT(!decoded.match("key"));
+}
+
+void BlockFilterTest::testSerialization() {
+    const std::set<std::string> elements = {"a", "b", "c", "d"};
+    const CryptoKernel::BlockFilter filter(blockId, elements);
+
+    const Json::Value filterJson = filter.toJson();
+    CPPUNIT_ASSERT_EQUAL(uint64_t(4), filterJson["n"].asUInt64());
+    CPPUNIT_ASSERT(filterJson["filter"].isString());
+
+    const CryptoKernel::BlockFilter decoded(blockId, filterJson);
+    for(const std::string& element : elements) {
+        CPPUNIT_ASSERT(decoded.match(element));
+    }
+
+    // The hashes are keyed by block so another block's filter is different
+    const CryptoKernel::BlockFilter other(CryptoKernel::BigNum("1234"), elements);
+    CPPUNIT_ASSERT(other.toJson()["filter"] != filterJson["filter"]);
+}
+
+void BlockFilterTest::testMalformed() {
+    Json::Value filterJson;
+    filterJson["n"] = "four";
+    filterJson["filter"] = "";
+    CPPUNIT_ASSERT_THROW(CryptoKernel::BlockFilter(blockId, filterJson), std::runtime_error);
+
+    // Far more elements than the encoding has room for
+    filterJson["n"] = 1000;
+    filterJson["filter"] = "AAAA";
+    CPPUNIT_ASSERT_THROW(CryptoKernel::BlockFilter(blockId, filterJson), std::runtime_error);
+}
+
+void BlockFilterTest::testGetElements() {
+    Json::Value data;
+    data["publicKey"] = "pub";
+    data["schnorrKey"] = "schnorr";
+    data["merkleRoot"] = "root";
+    data["contract"] = "ignored";
+
+    const std::set<std::string> elements = CryptoKernel::BlockFilter::getElements(data);
+    CPPUNIT_ASSERT_EQUAL(size_t(3), elements.size());
+    CPPUNIT_ASSERT(elements.count("pub") == 1);
+    CPPUNIT_ASSERT(elements.count("schnorr") == 1);
+    CPPUNIT_ASSERT(elements.count("root") == 1);
+
+    CPPUNIT_ASSERT(CryptoKernel::BlockFilter::getElements(Json::nullValue).empty());
+}
+
+void BlockFilterTest::testRescan() {
+    // A 1000 block chain with 20 keys per block and a wallet of 100 keys,
+    // 10 of which are paid in every 100th block
+    const unsigned int nBlocks = 1000;
+
+    std::vector<std::pair<CryptoKernel::BigNum, Json::Value>> chain;
+    for(unsigned int height = 0; height < nBlocks; height++) {
+        const CryptoKernel::BigNum id(std::to_string(height + 1) + "f00dfeedfacecafebeef0123456789ab");
+
+        std::set<std::string> elements;
+        for(unsigned int i = 0; i < 20; i++) {
+            elements.insert(std::to_string(height) + "/" + std::to_string(i));
+        }
+
+        if(height % 100 == 0) {
+            elements.insert("wallet" + std::to_string(height / 100));
+        }
+
+        chain.push_back(std::make_pair(id, CryptoKernel::BlockFilter(id, elements).toJson()));
+    }
+
+    std::set<std::string> walletKeys;
+    for(unsigned int i = 0; i < 100; i++) {
+        walletKeys.insert("wallet" + std::to_string(i));
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+
+    unsigned int matches = 0;
+    for(unsigned int height = 0; height < nBlocks; height++) {
+        const bool matched = CryptoKernel::BlockFilter(chain[height].first,
+                             chain[height].second).matchAny(walletKeys);
+
+        // Filters never miss a block that pays the wallet
+        if(height % 100 == 0) {
+            CPPUNIT_ASSERT(matched);
+        }
+
+        if(matched) {
+            matches++;
+        }
+    }
+
+    // Logged rather than asserted, timings depend on the machine
+    const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                             std::chrono::steady_clock::now() - start).count();
+    log->printf(LOG_LEVEL_INFO, "BlockFilterTest::testRescan(): Matched " + std::to_string(nBlocks)
+                + " filters in " + std::to_string(elapsed) + "us, "
+                + std::to_string(matches) + " blocks to fetch");
+
+    // Every wallet block plus well under one expected false positive
+    // (1000 * 100 / 784931)
+    CPPUNIT_ASSERT(matches >= 10);
+    CPPUNIT_ASSERT(matches <= 12);
+}
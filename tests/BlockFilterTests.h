@@ -0,0 +1,38 @@
+#ifndef BLOCKFILTERTEST_H
+#define BLOCKFILTERTEST_H
+
+#include <cppunit/extensions/HelperMacros.h>
+
+#include "blockfilter.h"
+#include "log.h"
+
+class BlockFilterTest : public CPPUNIT_NS::TestFixture {
+    CPPUNIT_TEST_SUITE(BlockFilterTest);
+
+    CPPUNIT_TEST(testMatch);
+    CPPUNIT_TEST(testEmpty);
+    CPPUNIT_TEST(testSerialization);
+    CPPUNIT_TEST(testMalformed);
+    CPPUNIT_TEST(testGetElements);
+    CPPUNIT_TEST(testRescan);
+
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    BlockFilterTest();
+    virtual ~BlockFilterTest();
+    void setUp();
+    void tearDown();
+
+private:
+    void testMatch();
+    void testEmpty();
+    void testSerialization();
+    void testMalformed();
+    void testGetElements();
+    void testRescan();
+
+    std::unique_ptr<CryptoKernel::Log> log;
+};
+
+#endif
@@ -5,8 +5,10 @@
 #include "crypto.h"
 #include "schnorr.h"
 #include "consensus/regtest.h"
+#include "consensus/PoW.h"
 #include "contract.h"
 #include "merkletree.h"
+#include "networkvalidation.h"
 
 CPPUNIT_TEST_SUITE_REGISTRATION(BlockchainTest);
 
@@ -30,7 +32,7 @@ void BlockchainTest::tearDown() {
     CryptoKernel::Storage::destroy("./testblockdb");
 }
 
-BlockchainTest::testChain::testChain(CryptoKernel::Log* GlobalLog) : CryptoKernel::Blockchain(GlobalLog, "./testblockdb") {}
+BlockchainTest::testChain::testChain(CryptoKernel::Log* GlobalLog, const std::string& dbDir) : CryptoKernel::Blockchain(GlobalLog, dbDir) {}
 
 BlockchainTest::testChain::~testChain() {}
 
@@ -936,4 +938,403 @@ void BlockchainTest::testPayToMerkleRootMalformed() {
     const auto res6 = blockchain->submitTransaction(CryptoKernel::Blockchain::transaction({CryptoKernel::Blockchain::input(p2mrout.getId(), invalidSpendData)}, {p2pkout}, 1530888581));
     CPPUNIT_ASSERT_MESSAGE("Invalid merkleProof[1] did not fail the transaction", !std::get<0>(res6));
 
-}
\ No newline at end of file
+}
+
+void BlockchainTest::testPreValidateBlock() {
+    const std::string pubKey = "BL2AcSzFw2+rGgQwJ25r7v/misIvr3t4JzkH3U1CCknchfkncSneKLBo6tjnKDhDxZUSPXEKMDtTU/YsvkwxJR8=";
+
+    consensus->mineBlock(true, pubKey);
+
+    const auto block = blockchain->getBlockByHeight(2);
+    CPPUNIT_ASSERT(blockchain->preValidateBlock(block));
+
+    const auto output = *block.getCoinbaseTx().getOutputs().begin();
+    CryptoKernel::Blockchain::output outp(output.getValue() - 20000, 0, Json::nullValue);
+
+    // Signs must be an array whatever output is being spent
+    Json::Value spendData;
+    spendData["aggregateSignature"]["signs"] = "not an array";
+    spendData["aggregateSignature"]["signature"] = "abc";
+
+    CryptoKernel::Blockchain::input inp(output.getId(), spendData);
+    CryptoKernel::Blockchain::transaction tx({inp}, {outp}, 1530888581);
+
+    const CryptoKernel::Blockchain::block badBlock({tx}, block.getCoinbaseTx(),
+                                                   block.getPreviousBlockId(), block.getTimestamp(),
+                                                   block.getConsensusData(), block.getHeight());
+
+    CPPUNIT_ASSERT(!blockchain->preValidateBlock(badBlock));
+
+    // The cached result is returned the second time
+    CPPUNIT_ASSERT(!blockchain->preValidateBlock(badBlock));
+
+    // Proof of Work has to be below the target in the block's own
+    // consensusData. The block id doesn't cover consensusData so the work
+    // for a nonce is the same whatever target is claimed.
+    CryptoKernel::Consensus::PoW::KGW_SHA256 pow(150, blockchain.get(), false, "", log.get());
+    pow.start();
+
+    const CryptoKernel::BigNum work = pow.calculatePoW(block, 0);
+
+    Json::Value consensusData;
+    consensusData["totalWork"] = "1";
+    consensusData["nonce"] = 0;
+    consensusData["target"] = (work + CryptoKernel::BigNum("1")).toString();
+    const CryptoKernel::Blockchain::block metTarget(block.getTransactions(), block.getCoinbaseTx(),
+                                                    block.getPreviousBlockId(), block.getTimestamp(),
+                                                    consensusData, block.getHeight());
+    CPPUNIT_ASSERT(pow.checkConsensusRulesStateless(metTarget));
+
+    consensusData["target"] = work.toString();
+    const CryptoKernel::Blockchain::block missedTarget(block.getTransactions(),
+                                                       block.getCoinbaseTx(),
+                                                       block.getPreviousBlockId(), block.getTimestamp(),
+                                                       consensusData, block.getHeight());
+    CPPUNIT_ASSERT(!pow.checkConsensusRulesStateless(missedTarget));
+
+    // Regtest blocks have no target at all
+    CPPUNIT_ASSERT(!pow.checkConsensusRulesStateless(block));
+}
+
+void BlockchainTest::testListenerNotifications() {
+    class recordingListener : public CryptoKernel::Blockchain::Listener {
+    public:
+        void blockConnected(const CryptoKernel::Blockchain::block& block) {
+            connected.push_back(block.getHeight());
+        }
+
+        void transactionAdded(const CryptoKernel::Blockchain::transaction& tx) {
+            added.push_back(tx.getId().toString());
+        }
+
+        void transactionRemoved(const CryptoKernel::Blockchain::transaction& tx) {
+            removed.push_back(tx.getId().toString());
+        }
+
+        std::vector<uint64_t> connected;
+        std::vector<std::string> added;
+        std::vector<std::string> removed;
+    };
+
+    recordingListener listener;
+    blockchain->addListener(&listener);
+
+    CryptoKernel::Crypto crypto(true);
+    const auto pubKey = crypto.getPublicKey();
+
+    consensus->mineBlock(true, pubKey);
+
+    CPPUNIT_ASSERT_EQUAL(size_t(1), listener.connected.size());
+    CPPUNIT_ASSERT_EQUAL(uint64_t(2), listener.connected[0]);
+
+    const auto outs = blockchain->getUnspentOutputs(pubKey);
+    const auto& out = *outs.begin();
+
+    Json::Value outData;
+    outData["publicKey"] = pubKey;
+    CryptoKernel::Blockchain::output out2(out.getValue() - 20000, 0, outData);
+
+    const std::string outputSetId = CryptoKernel::Blockchain::transaction::getOutputSetId({out2}).toString();
+
+    Json::Value spendData;
+    spendData["signature"] = crypto.sign(out.getId().toString() + outputSetId);
+
+    CryptoKernel::Blockchain::input inp(out.getId(), spendData);
+    CryptoKernel::Blockchain::transaction tx({inp}, {out2}, 1530888581);
+
+    CPPUNIT_ASSERT(std::get<0>(blockchain->submitTransaction(tx)));
+    CPPUNIT_ASSERT_EQUAL(size_t(1), listener.added.size());
+    CPPUNIT_ASSERT_EQUAL(tx.getId().toString(), listener.added[0]);
+
+    // A rejected transaction doesn't notify
+    blockchain->submitTransaction(tx);
+    CPPUNIT_ASSERT_EQUAL(size_t(1), listener.added.size());
+
+    // Confirming the transaction isn't an eviction
+    consensus->mineBlock(true, pubKey);
+    CPPUNIT_ASSERT_EQUAL(size_t(2), listener.connected.size());
+    CPPUNIT_ASSERT(listener.removed.empty());
+
+    blockchain->removeListener(&listener);
+
+    consensus->mineBlock(true, pubKey);
+    CPPUNIT_ASSERT_EQUAL(size_t(2), listener.connected.size());
+}
+
+void BlockchainTest::testBlockFilter() {
+    CryptoKernel::Crypto crypto(true);
+    const auto pubKey = crypto.getPublicKey();
+
+    consensus->mineBlock(true, pubKey);
+
+    const auto block = blockchain->getBlockByHeight(2);
+    const auto filter = blockchain->getBlockFilter(block.getId().toString());
+    CPPUNIT_ASSERT(filter.match(pubKey));
+    CPPUNIT_ASSERT(!filter.match("BL2AcSzFw2+rGgQwJ25r7v/misIvr3t4JzkH3U1CCknchfkncSneKLBo6tjnKDhDxZUSPXEKMDtTU/YsvkwxJR8="));
+
+    // The block that spends the coinbase output matches its key too
+    const auto out = *block.getCoinbaseTx().getOutputs().begin();
+
+    Json::Value outData;
+    outData["publicKey"] = "BL2AcSzFw2+rGgQwJ25r7v/misIvr3t4JzkH3U1CCknchfkncSneKLBo6tjnKDhDxZUSPXEKMDtTU/YsvkwxJR8=";
+    CryptoKernel::Blockchain::output out2(out.getValue() - 20000, 0, outData);
+
+    const std::string outputSetId = CryptoKernel::Blockchain::transaction::getOutputSetId({out2}).toString();
+
+    Json::Value spendData;
+    spendData["signature"] = crypto.sign(out.getId().toString() + outputSetId);
+
+    CryptoKernel::Blockchain::input inp(out.getId(), spendData);
+    CryptoKernel::Blockchain::transaction tx({inp}, {out2}, 1530888581);
+
+    CPPUNIT_ASSERT(std::get<0>(blockchain->submitTransaction(tx)));
+
+    consensus->mineBlock(true, "BL2AcSzFw2+rGgQwJ25r7v/misIvr3t4JzkH3U1CCknchfkncSneKLBo6tjnKDhDxZUSPXEKMDtTU/YsvkwxJR8=");
+
+    const auto spendingBlock = blockchain->getBlockByHeight(3);
+    CPPUNIT_ASSERT(blockchain->getBlockFilter(spendingBlock.getId().toString()).match(pubKey));
+
+    CPPUNIT_ASSERT_THROW(blockchain->getBlockFilter("1234"), CryptoKernel::Blockchain::NotFoundException);
+}
+
+void BlockchainTest::testAddressIndex() {
+    CryptoKernel::Crypto crypto(true);
+    const auto pubKey = crypto.getPublicKey();
+
+    consensus->mineBlock(true, pubKey);
+    consensus->mineBlock(true, pubKey);
+
+    auto summary = blockchain->getAddressSummary(pubKey);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(2), summary.outputs);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(2), summary.txs);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(0), summary.spent);
+    CPPUNIT_ASSERT_EQUAL(summary.received, summary.balance);
+
+    // Page through the unspent outputs one at a time
+    const auto first = blockchain->getAddressOutputs(pubKey, false, 1);
+    CPPUNIT_ASSERT_EQUAL(size_t(1), first.size());
+    const auto second = blockchain->getAddressOutputs(pubKey, false, 1, first[0].id);
+    CPPUNIT_ASSERT_EQUAL(size_t(1), second.size());
+    CPPUNIT_ASSERT(first[0].id < second[0].id);
+    CPPUNIT_ASSERT(blockchain->getAddressOutputs(pubKey, false, 1, second[0].id).empty());
+
+    const auto out = blockchain->getOutput(first[0].id);
+    CPPUNIT_ASSERT_EQUAL(out.getValue(), first[0].value);
+
+    // Spend one of them
+    Json::Value outData;
+    outData["publicKey"] = "BL2AcSzFw2+rGgQwJ25r7v/misIvr3t4JzkH3U1CCknchfkncSneKLBo6tjnKDhDxZUSPXEKMDtTU/YsvkwxJR8=";
+    CryptoKernel::Blockchain::output out2(out.getValue() - 20000, 0, outData);
+
+    const std::string outputSetId = CryptoKernel::Blockchain::transaction::getOutputSetId({out2}).toString();
+
+    Json::Value spendData;
+    spendData["signature"] = crypto.sign(out.getId().toString() + outputSetId);
+
+    CryptoKernel::Blockchain::input inp(out.getId(), spendData);
+    CryptoKernel::Blockchain::transaction tx({inp}, {out2}, 1530888581);
+
+    CPPUNIT_ASSERT(std::get<0>(blockchain->submitTransaction(tx)));
+
+    consensus->mineBlock(true, "BL2AcSzFw2+rGgQwJ25r7v/misIvr3t4JzkH3U1CCknchfkncSneKLBo6tjnKDhDxZUSPXEKMDtTU/YsvkwxJR8=");
+
+    summary = blockchain->getAddressSummary(pubKey);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(1), summary.spent);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(3), summary.txs);
+    CPPUNIT_ASSERT_EQUAL(summary.received - out.getValue(), summary.balance);
+
+    const auto spent = blockchain->getAddressOutputs(pubKey, true, 10);
+    CPPUNIT_ASSERT_EQUAL(size_t(1), spent.size());
+    CPPUNIT_ASSERT_EQUAL(first[0].id, spent[0].id);
+    CPPUNIT_ASSERT(spent[0].spent);
+    CPPUNIT_ASSERT_EQUAL(first[0].height, spent[0].height);
+    CPPUNIT_ASSERT_EQUAL(size_t(1), blockchain->getAddressOutputs(pubKey, false, 10).size());
+
+    CPPUNIT_ASSERT_EQUAL(uint64_t(0), blockchain->getAddressSummary("nobody").txs);
+}
+
+void BlockchainTest::testTxIndex() {
+    CryptoKernel::Crypto crypto(true);
+    const auto pubKey = crypto.getPublicKey();
+
+    CPPUNIT_ASSERT(!blockchain->txIndexEnabled());
+
+    consensus->mineBlock(true, pubKey);
+
+    const auto out = *blockchain->getBlockByHeight(2).getCoinbaseTx().getOutputs().begin();
+
+    Json::Value outData;
+    outData["publicKey"] = "BL2AcSzFw2+rGgQwJ25r7v/misIvr3t4JzkH3U1CCknchfkncSneKLBo6tjnKDhDxZUSPXEKMDtTU/YsvkwxJR8=";
+    CryptoKernel::Blockchain::output out2(out.getValue() - 20000, 0, outData);
+
+    const std::string outputSetId = CryptoKernel::Blockchain::transaction::getOutputSetId({out2}).toString();
+
+    Json::Value spendData;
+    spendData["signature"] = crypto.sign(out.getId().toString() + outputSetId);
+
+    CryptoKernel::Blockchain::input inp(out.getId(), spendData);
+    CryptoKernel::Blockchain::transaction tx({inp}, {out2}, 1530888581);
+
+    CPPUNIT_ASSERT(std::get<0>(blockchain->submitTransaction(tx)));
+
+    consensus->mineBlock(true, "BL2AcSzFw2+rGgQwJ25r7v/misIvr3t4JzkH3U1CCknchfkncSneKLBo6tjnKDhDxZUSPXEKMDtTU/YsvkwxJR8=");
+
+    // Reopen the chain with the index on so it gets built in the background
+    blockchain.reset();
+    consensus.reset();
+    blockchain.reset(new testChain(log.get()));
+    blockchain->enableTxIndex();
+    consensus.reset(new CryptoKernel::Consensus::Regtest(blockchain.get()));
+    blockchain->loadChain(consensus.get(), "genesistest.json");
+    consensus->start();
+
+    for(unsigned int i = 0; i < 100 && blockchain->getTxIndexHeight() < 3; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    CPPUNIT_ASSERT_EQUAL(uint64_t(3), blockchain->getTxIndexHeight());
+
+    const auto spending = blockchain->getSpendingTx(out.getId().toString());
+    CPPUNIT_ASSERT_EQUAL(tx.getId().toString(), spending.txId);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(3), spending.height);
+
+    // New blocks are indexed as they are connected
+    consensus->mineBlock(true, pubKey);
+
+    const auto txs = blockchain->getAddressTransactions(pubKey, 10);
+    CPPUNIT_ASSERT_EQUAL(size_t(3), txs.size());
+    CPPUNIT_ASSERT_EQUAL(uint64_t(2), txs[0].height);
+    CPPUNIT_ASSERT_EQUAL(tx.getId().toString(), txs[1].txId);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(4), txs[2].height);
+
+    const auto page = blockchain->getAddressTransactions(pubKey, 10, txs[1].cursor);
+    CPPUNIT_ASSERT_EQUAL(size_t(1), page.size());
+    CPPUNIT_ASSERT_EQUAL(txs[2].txId, page[0].txId);
+
+    // A key extending this one shares its prefix in the index
+    consensus->mineBlock(true, pubKey + "/");
+    CPPUNIT_ASSERT_EQUAL(size_t(3), blockchain->getAddressTransactions(pubKey, 10).size());
+    CPPUNIT_ASSERT_EQUAL(size_t(1), blockchain->getAddressTransactions(pubKey + "/", 10).size());
+
+    CPPUNIT_ASSERT_THROW(blockchain->getSpendingTx(out2.getId().toString()),
+                         CryptoKernel::Blockchain::NotFoundException);
+}
+
+void BlockchainTest::testBlockJsonByHeight() {
+    CryptoKernel::Crypto crypto(true);
+    const auto pubKey = crypto.getPublicKey();
+
+    consensus->mineBlock(true, pubKey);
+
+    const auto out = *blockchain->getBlockByHeight(2).getCoinbaseTx().getOutputs().begin();
+
+    Json::Value outData;
+    outData["publicKey"] = "BL2AcSzFw2+rGgQwJ25r7v/misIvr3t4JzkH3U1CCknchfkncSneKLBo6tjnKDhDxZUSPXEKMDtTU/YsvkwxJR8=";
+    CryptoKernel::Blockchain::output out2(out.getValue() - 20000, 0, outData);
+
+    const std::string outputSetId = CryptoKernel::Blockchain::transaction::getOutputSetId({out2}).toString();
+
+    Json::Value spendData;
+    spendData["signature"] = crypto.sign(out.getId().toString() + outputSetId);
+
+    CryptoKernel::Blockchain::input inp(out.getId(), spendData);
+    CryptoKernel::Blockchain::transaction tx({inp}, {out2}, 1530888581);
+
+    CPPUNIT_ASSERT(std::get<0>(blockchain->submitTransaction(tx)));
+
+    consensus->mineBlock(true, pubKey);
+
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(blockchain->getTxHandle());
+
+    // The stored JSON matches the rebuilt block, including the spent output
+    for(uint64_t height = 2; height <= 3; height++) {
+        const auto block = blockchain->getBlockByHeight(height);
+        Json::Value expected = block.toJson();
+        expected["id"] = block.getId().toString();
+
+        CPPUNIT_ASSERT_EQUAL(CryptoKernel::Storage::toString(expected),
+                             CryptoKernel::Storage::toString(
+                                 blockchain->getBlockJsonByHeight(dbTx.get(), height, true)));
+    }
+
+    const Json::Value stored = blockchain->getBlockJsonByHeight(dbTx.get(), 3, false);
+    CPPUNIT_ASSERT_EQUAL(Json::ArrayIndex(1), stored["transactions"].size());
+    CPPUNIT_ASSERT_EQUAL(tx.getId().toString(), stored["transactions"][0].asString());
+
+    CPPUNIT_ASSERT_THROW(blockchain->getBlockJsonByHeight(dbTx.get(), 4, true),
+                         CryptoKernel::Blockchain::NotFoundException);
+}
+
+void BlockchainTest::testValidationQueue() {
+    const std::string pubKey = "BL2AcSzFw2+rGgQwJ25r7v/misIvr3t4JzkH3U1CCknchfkncSneKLBo6tjnKDhDxZUSPXEKMDtTU/YsvkwxJR8=";
+
+    // Mine a branch on a second chain sharing the genesis block so the
+    // queue has blocks it hasn't seen yet
+    std::vector<CryptoKernel::Blockchain::block> branch;
+    CryptoKernel::Storage::destroy("./testblockdb2");
+    {
+        testChain otherChain(log.get(), "./testblockdb2");
+        CryptoKernel::Consensus::Regtest otherConsensus(&otherChain);
+        otherChain.loadChain(&otherConsensus, "genesistest.json");
+        otherConsensus.start();
+
+        for(uint64_t height = 2; height <= 4; height++) {
+            otherConsensus.mineBlock(true, pubKey);
+            branch.push_back(otherChain.getBlockByHeight(height));
+        }
+    }
+    CryptoKernel::Storage::destroy("./testblockdb2");
+
+    std::mutex resultsMutex;
+    std::condition_variable resultReady;
+    std::vector<uint64_t> connected;
+    std::vector<std::pair<std::string, uint64_t>> penalties;
+
+    {
+        CryptoKernel::ValidationQueue queue(blockchain.get(), log.get(),
+            [&](const CryptoKernel::Blockchain::block& block) {
+                std::lock_guard<std::mutex> lock(resultsMutex);
+                connected.push_back(block.getHeight());
+                resultReady.notify_all();
+            },
+            [&](const std::string& peer, const uint64_t score) {
+                std::lock_guard<std::mutex> lock(resultsMutex);
+                penalties.push_back(std::make_pair(peer, score));
+                resultReady.notify_all();
+            });
+
+        Json::Value malformed;
+        malformed["this is"] = "not a block";
+        queue.submit(malformed, "malformed");
+
+        // Far outside the two hour window
+        Json::Value stale = branch[0].toJson();
+        stale["timestamp"] = 1000;
+        queue.submit(stale, "stale");
+
+        // Each block builds on the one before, so they only connect if the
+        // queue keeps the order they were submitted in
+        queue.submit(branch[0].toJson(), "honest");
+        queue.submit(branch[1], "honest");
+        queue.submit(branch[2].toJson(), "honest");
+
+        std::unique_lock<std::mutex> lock(resultsMutex);
+        CPPUNIT_ASSERT(resultReady.wait_for(lock, std::chrono::seconds(30), [&]() {
+            return connected.size() + penalties.size() == 5;
+        }));
+    }
+
+    CPPUNIT_ASSERT_EQUAL(size_t(3), connected.size());
+    for(unsigned int i = 0; i < connected.size(); i++) {
+        CPPUNIT_ASSERT_EQUAL(uint64_t(i + 2), connected[i]);
+    }
+
+    // Invalid blocks are scored against the peer that sent them and never
+    // reach the chain
+    CPPUNIT_ASSERT_EQUAL(size_t(2), penalties.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("malformed"), penalties[0].first);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(50), penalties[0].second);
+    CPPUNIT_ASSERT_EQUAL(std::string("stale"), penalties[1].first);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(50), penalties[1].second);
+
+    CPPUNIT_ASSERT_EQUAL(branch[2].getId().toString(), blockchain->getBlock("tip").getId().toString());
+}
@@ -18,6 +18,13 @@ class BlockchainTest : public CPPUNIT_NS::TestFixture {
     CPPUNIT_TEST(testPayToMerkleRoot);
     CPPUNIT_TEST(testPayToMerkleRootScript);
     CPPUNIT_TEST(testPayToMerkleRootMalformed);
+    CPPUNIT_TEST(testPreValidateBlock);
+    CPPUNIT_TEST(testListenerNotifications);
+    CPPUNIT_TEST(testBlockFilter);
+    CPPUNIT_TEST(testAddressIndex);
+    CPPUNIT_TEST(testTxIndex);
+    CPPUNIT_TEST(testBlockJsonByHeight);
+    CPPUNIT_TEST(testValidationQueue);
     CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -29,7 +36,7 @@ public:
 private:
     class testChain : public CryptoKernel::Blockchain {
         public:
-            testChain(CryptoKernel::Log* GlobalLog);
+            testChain(CryptoKernel::Log* GlobalLog, const std::string& dbDir = "./testblockdb");
             virtual ~testChain();
         private:
             virtual std::string getCoinbaseOwner(const std::string& publicKey);
@@ -47,6 +54,13 @@ private:
     void testPayToMerkleRoot();
     void testPayToMerkleRootScript();
     void testPayToMerkleRootMalformed();
+    void testPreValidateBlock();
+    void testListenerNotifications();
+    void testBlockFilter();
+    void testAddressIndex();
+    void testTxIndex();
+    void testBlockJsonByHeight();
+    void testValidationQueue();
 
     
     std::unique_ptr<CryptoKernel::Blockchain> blockchain;
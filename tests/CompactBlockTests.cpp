@@ -0,0 +1,164 @@
+#include "CompactBlockTests.h"
+
+#include "crypto.h"
+
+CPPUNIT_TEST_SUITE_REGISTRATION(CompactBlockTest);
+
+// A transaction spending a made up output, distinct for each n
+static CryptoKernel::Blockchain::transaction makeTransaction(const unsigned int n) {
+    Json::Value outData;
+    outData["message"] = "output " + std::to_string(n);
+    const CryptoKernel::Blockchain::output out(1000 + n, n, outData);
+
+    const CryptoKernel::Blockchain::input inp(
+        CryptoKernel::BigNum(CryptoKernel::Crypto::sha256("spent " + std::to_string(n))),
+        Json::nullValue);
+
+    return CryptoKernel::Blockchain::transaction({inp}, {out}, 1530888581);
+}
+
+// A block confirming transactions 0 to nTransactions - 1
+static CryptoKernel::Blockchain::block makeBlock(const unsigned int nTransactions) {
+    std::set<CryptoKernel::Blockchain::transaction> transactions;
+    for(unsigned int i = 0; i < nTransactions; i++) {
+        transactions.insert(makeTransaction(i));
+    }
+
+    Json::Value coinbaseData;
+    coinbaseData["message"] = "coinbase";
+    const CryptoKernel::Blockchain::transaction coinbaseTx({},
+        {CryptoKernel::Blockchain::output(100000000, 0, coinbaseData)}, 1530888581, true);
+
+    return CryptoKernel::Blockchain::block(transactions, coinbaseTx,
+                                           CryptoKernel::BigNum("1"), 1530888581,
+                                           Json::nullValue, 2);
+}
+
+CompactBlockTest::CompactBlockTest() {
+}
+
+CompactBlockTest::~CompactBlockTest() {
+}
+
+void CompactBlockTest::setUp() {
+}
+
+void CompactBlockTest::tearDown() {
+}
+
+void CompactBlockTest::testReconstruct() {
+    const CryptoKernel::Blockchain::block block = makeBlock(10);
+
+    // As the receiver sees it, filled in from a mempool with other transactions in it
+    CryptoKernel::CompactBlock compact(CryptoKernel::CompactBlock(block, 42).toJson());
+    CPPUNIT_ASSERT_EQUAL(block.getId().toString(), compact.getId());
+    CPPUNIT_ASSERT_EQUAL(size_t(10), compact.size());
+    CPPUNIT_ASSERT_EQUAL(size_t(10), compact.getMissing().size());
+
+    std::set<CryptoKernel::Blockchain::transaction> mempool;
+    for(unsigned int i = 0; i < 20; i++) {
+        mempool.insert(makeTransaction(i));
+    }
+    compact.fill(mempool);
+
+    CPPUNIT_ASSERT(compact.getMissing().empty());
+    CPPUNIT_ASSERT_EQUAL(block.getId().toString(), compact.getBlock().getId().toString());
+
+    // A block without transactions needs nothing filled in
+    const CryptoKernel::Blockchain::block empty = makeBlock(0);
+    const CryptoKernel::CompactBlock emptyCompact(CryptoKernel::CompactBlock(empty, 42).toJson());
+    CPPUNIT_ASSERT(emptyCompact.getMissing().empty());
+    CPPUNIT_ASSERT_EQUAL(empty.getId().toString(), emptyCompact.getBlock().getId().toString());
+}
+
+void CompactBlockTest::testSaltedShortIds() {
+    const CryptoKernel::Blockchain::block block = makeBlock(10);
+    const CryptoKernel::CompactBlock first(block, 1);
+    const CryptoKernel::CompactBlock second(block, 2);
+
+    // The same transaction gets unrelated short ids in different announcements
+    for(const CryptoKernel::Blockchain::transaction& tx : block.getTransactions()) {
+        CPPUNIT_ASSERT_EQUAL(size_t(16), first.shortId(tx.getId()).size());
+        CPPUNIT_ASSERT(first.shortId(tx.getId()) != second.shortId(tx.getId()));
+        CPPUNIT_ASSERT(first.shortId(tx.getId()) != tx.getId().toString().substr(0, 16));
+    }
+
+    // The announcer's short ids can be recomputed from the nonce alone
+    const CryptoKernel::CompactBlock received(first.toJson());
+    for(const CryptoKernel::Blockchain::transaction& tx : block.getTransactions()) {
+        CPPUNIT_ASSERT_EQUAL(first.shortId(tx.getId()), received.shortId(tx.getId()));
+    }
+}
+
+void CompactBlockTest::testMissingTransactions() {
+    const CryptoKernel::Blockchain::block block = makeBlock(10);
+    const CryptoKernel::CompactBlock announced(block, 7);
+    CryptoKernel::CompactBlock compact(announced.toJson());
+
+    std::set<CryptoKernel::Blockchain::transaction> mempool;
+    for(unsigned int i = 2; i < 10; i++) {
+        mempool.insert(makeTransaction(i));
+    }
+    compact.fill(mempool);
+
+    const std::set<std::string> missing = compact.getMissing();
+    CPPUNIT_ASSERT_EQUAL(size_t(2), missing.size());
+    CPPUNIT_ASSERT(missing.count(announced.shortId(makeTransaction(0).getId())) == 1);
+    CPPUNIT_ASSERT(missing.count(announced.shortId(makeTransaction(1).getId())) == 1);
+    CPPUNIT_ASSERT_THROW(compact.getBlock(), CryptoKernel::Blockchain::InvalidElementException);
+
+    // The announcer only sending some of them still isn't enough
+    compact.addTransactions({makeTransaction(0)});
+    CPPUNIT_ASSERT_EQUAL(size_t(1), compact.getMissing().size());
+    CPPUNIT_ASSERT_THROW(compact.getBlock(), CryptoKernel::Blockchain::InvalidElementException);
+
+    compact.addTransactions({makeTransaction(1)});
+    CPPUNIT_ASSERT(compact.getMissing().empty());
+    CPPUNIT_ASSERT_EQUAL(block.getId().toString(), compact.getBlock().getId().toString());
+}
+
+void CompactBlockTest::testCollision() {
+    const CryptoKernel::Blockchain::block block = makeBlock(10);
+    const CryptoKernel::CompactBlock announced(block, 7);
+
+    // Announce the short id of a transaction outside the block in place of
+    // one inside it, as if the two collided
+    Json::Value compactJson = announced.toJson();
+    const std::string inBlock = announced.shortId(makeTransaction(0).getId());
+    for(Json::Value& shortId : compactJson["txids"]) {
+        if(shortId.asString() == inBlock) {
+            shortId = announced.shortId(makeTransaction(10).getId());
+        }
+    }
+
+    CryptoKernel::CompactBlock compact(compactJson);
+    std::set<CryptoKernel::Blockchain::transaction> mempool;
+    for(unsigned int i = 0; i < 11; i++) {
+        mempool.insert(makeTransaction(i));
+    }
+    compact.fill(mempool);
+
+    // Everything is filled in but with the wrong transaction, so the block is
+    // rejected and left to regular sync
+    CPPUNIT_ASSERT(compact.getMissing().empty());
+    CPPUNIT_ASSERT_THROW(compact.getBlock(), CryptoKernel::Blockchain::InvalidElementException);
+}
+
+void CompactBlockTest::testMalformed() {
+    Json::Value compactJson = CryptoKernel::CompactBlock(makeBlock(2), 7).toJson();
+
+    Json::Value noTxids = compactJson;
+    noTxids["txids"] = "not an array";
+    CPPUNIT_ASSERT_THROW(CryptoKernel::CompactBlock compact(noTxids),
+                         CryptoKernel::Blockchain::InvalidElementException);
+
+    Json::Value badNonce = compactJson;
+    badNonce["nonce"] = "not a number";
+    CPPUNIT_ASSERT_THROW(CryptoKernel::CompactBlock compact(badNonce),
+                         CryptoKernel::Blockchain::InvalidElementException);
+
+    Json::Value noHeader = compactJson;
+    noHeader.removeMember("header");
+    CPPUNIT_ASSERT_THROW(CryptoKernel::CompactBlock compact(noHeader),
+                         CryptoKernel::Blockchain::InvalidElementException);
+}
@@ -0,0 +1,33 @@
+#ifndef COMPACTBLOCKTEST_H
+#define COMPACTBLOCKTEST_H
+
+#include <cppunit/extensions/HelperMacros.h>
+
+#include "compactblock.h"
+
+class CompactBlockTest : public CPPUNIT_NS::TestFixture {
+    CPPUNIT_TEST_SUITE(CompactBlockTest);
+
+    CPPUNIT_TEST(testReconstruct);
+    CPPUNIT_TEST(testSaltedShortIds);
+    CPPUNIT_TEST(testMissingTransactions);
+    CPPUNIT_TEST(testCollision);
+    CPPUNIT_TEST(testMalformed);
+
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    CompactBlockTest();
+    virtual ~CompactBlockTest();
+    void setUp();
+    void tearDown();
+
+private:
+    void testReconstruct();
+    void testSaltedShortIds();
+    void testMissingTransactions();
+    void testCollision();
+    void testMalformed();
+};
+
+#endif
@@ -0,0 +1,204 @@
+#include "ConcurrentMapTests.h"
+
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+CPPUNIT_TEST_SUITE_REGISTRATION(ConcurrentMapTest);
+
+ConcurrentMapTest::ConcurrentMapTest() {
+    log.reset(new CryptoKernel::Log("tests.log"));
+}
+
+ConcurrentMapTest::~ConcurrentMapTest() {
+}
+
+void ConcurrentMapTest::setUp() {
+}
+
+void ConcurrentMapTest::tearDown() {
+}
+
+void ConcurrentMapTest::testInsertGet() {
+    ConcurrentMap<std::string, uint64_t> map;
+    map.insert("a", 1);
+    map.insert(std::make_pair(std::string("b"), uint64_t(2)));
+
+    uint64_t value = 0;
+    CPPUNIT_ASSERT(map.get("a", value));
+    CPPUNIT_ASSERT_EQUAL(uint64_t(1), value);
+    CPPUNIT_ASSERT(map.get("b", value));
+    CPPUNIT_ASSERT_EQUAL(uint64_t(2), value);
+    CPPUNIT_ASSERT(!map.get("c", value));
+
+    CPPUNIT_ASSERT(map.contains("a"));
+    CPPUNIT_ASSERT(!map.contains("c"));
+    CPPUNIT_ASSERT_EQUAL(size_t(2), map.size());
+}
+
+void ConcurrentMapTest::testAccessors() {
+    ConcurrentMap<std::string, uint64_t> map;
+
+    CPPUNIT_ASSERT(!map.find("a"));
+    CPPUNIT_ASSERT(!map.findMutable("a"));
+
+    // at() default constructs missing values
+    {
+        auto value = map.at("a");
+        CPPUNIT_ASSERT(value);
+        *value += 5;
+    }
+
+    {
+        auto value = map.findMutable("a");
+        CPPUNIT_ASSERT(value);
+        *value += 5;
+    }
+
+    const auto value = map.find("a");
+    CPPUNIT_ASSERT(value);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(10), *value);
+}
+
+void ConcurrentMapTest::testErase() {
+    ConcurrentMap<std::string, uint64_t> map;
+    map.insert("a", 1);
+    map.insert("b", 2);
+
+    CPPUNIT_ASSERT(map.erase("a"));
+    CPPUNIT_ASSERT(!map.erase("a"));
+    CPPUNIT_ASSERT(!map.contains("a"));
+    CPPUNIT_ASSERT_EQUAL(size_t(1), map.size());
+
+    map.clear();
+    CPPUNIT_ASSERT_EQUAL(size_t(0), map.size());
+}
+
+void ConcurrentMapTest::testSnapshots() {
+    ConcurrentMap<std::string, uint64_t> map;
+    for(uint64_t i = 0; i < 100; i++) {
+        map.insert(std::to_string(i), i);
+    }
+
+    const std::map<std::string, uint64_t> copy = map.copyMap();
+    CPPUNIT_ASSERT_EQUAL(size_t(100), copy.size());
+
+    // Changing the map doesn't affect an earlier snapshot
+    const std::vector<std::string> keys = map.keys();
+    map.clear();
+    CPPUNIT_ASSERT_EQUAL(size_t(100), keys.size());
+
+    for(const auto& entry : copy) {
+        CPPUNIT_ASSERT_EQUAL(std::to_string(entry.second), entry.first);
+    }
+}
+
+void ConcurrentMapTest::testContention() {
+    // Mostly reads with some writes from many threads, like the peer maps
+    const unsigned int nThreads = 8;
+    const unsigned int nOps = 10000;
+    const unsigned int nKeys = 64;
+
+    ConcurrentMap<std::string, uint64_t> map;
+    for(unsigned int i = 0; i < nKeys; i++) {
+        map.insert(std::to_string(i), 0);
+    }
+
+    std::atomic<uint64_t> increments(0);
+
+    const auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for(unsigned int t = 0; t < nThreads; t++) {
+        threads.push_back(std::thread([&, t]() {
+            uint64_t value;
+            for(unsigned int i = 0; i < nOps; i++) {
+                const std::string key = std::to_string((i * 7 + t) % nKeys);
+                if(i % 10 == 0) {
+                    auto accessor = map.findMutable(key);
+                    (*accessor)++;
+                    increments++;
+                } else {
+                    map.get(key, value);
+                }
+            }
+        }));
+    }
+
+    for(auto& thread : threads) {
+        thread.join();
+    }
+
+    // Logged rather than asserted, timings depend on the machine
+    const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                             std::chrono::steady_clock::now() - start).count();
+    log->printf(LOG_LEVEL_INFO, "ConcurrentMapTest::testContention(): "
+                + std::to_string(nThreads * nOps) + " operations on "
+                + std::to_string(nThreads) + " threads in " + std::to_string(elapsed) + "us");
+
+    uint64_t total = 0;
+    for(const auto& entry : map.copyMap()) {
+        total += entry.second;
+    }
+
+    // Every tenth operation is a write and none of them are lost
+    CPPUNIT_ASSERT_EQUAL(uint64_t(nThreads * nOps / 10), increments.load());
+    CPPUNIT_ASSERT_EQUAL(increments.load(), total);
+}
+
+void ConcurrentMapTest::testIterateWhileWriting() {
+    // Peers come and go while other threads walk the connection maps
+    const unsigned int nWriters = 4;
+    const unsigned int nReaders = 4;
+    const unsigned int nOps = 5000;
+
+    ConcurrentMap<std::string, uint64_t> map;
+    std::atomic<bool> inconsistent(false);
+    std::atomic<unsigned int> writersDone(0);
+
+    std::vector<std::thread> threads;
+    for(unsigned int t = 0; t < nWriters; t++) {
+        threads.push_back(std::thread([&, t]() {
+            for(unsigned int i = 0; i < nOps; i++) {
+                const uint64_t value = t * nOps + i;
+                map.insert(std::to_string(value), value);
+                if(i % 2 == 0) {
+                    map.erase(std::to_string(value));
+                }
+            }
+            writersDone++;
+        }));
+    }
+
+    for(unsigned int t = 0; t < nReaders; t++) {
+        threads.push_back(std::thread([&]() {
+            while(writersDone < nWriters) {
+                // Every entry seen by a snapshot is whole
+                map.forEach([&](const std::string& key, const uint64_t& value) {
+                    if(std::to_string(value) != key) {
+                        inconsistent = true;
+                    }
+                });
+
+                for(const auto& key : map.keys()) {
+                    uint64_t value;
+                    if(map.get(key, value) && std::to_string(value) != key) {
+                        inconsistent = true;
+                    }
+                }
+            }
+        }));
+    }
+
+    for(auto& thread : threads) {
+        thread.join();
+    }
+
+    CPPUNIT_ASSERT(!inconsistent);
+
+    // Only the odd insertions survive
+    CPPUNIT_ASSERT_EQUAL(size_t(nWriters * nOps / 2), map.size());
+    for(const auto& entry : map.copyMap()) {
+        CPPUNIT_ASSERT_EQUAL(uint64_t(1), entry.second % 2);
+    }
+}
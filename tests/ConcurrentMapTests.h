@@ -0,0 +1,38 @@
+#ifndef CONCURRENTMAPTEST_H
+#define CONCURRENTMAPTEST_H
+
+#include <cppunit/extensions/HelperMacros.h>
+
+#include "concurrentmap.h"
+#include "log.h"
+
+class ConcurrentMapTest : public CPPUNIT_NS::TestFixture {
+    CPPUNIT_TEST_SUITE(ConcurrentMapTest);
+
+    CPPUNIT_TEST(testInsertGet);
+    CPPUNIT_TEST(testAccessors);
+    CPPUNIT_TEST(testErase);
+    CPPUNIT_TEST(testSnapshots);
+    CPPUNIT_TEST(testContention);
+    CPPUNIT_TEST(testIterateWhileWriting);
+
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    ConcurrentMapTest();
+    virtual ~ConcurrentMapTest();
+    void setUp();
+    void tearDown();
+
+private:
+    void testInsertGet();
+    void testAccessors();
+    void testErase();
+    void testSnapshots();
+    void testContention();
+    void testIterateWhileWriting();
+
+    std::unique_ptr<CryptoKernel::Log> log;
+};
+
+#endif
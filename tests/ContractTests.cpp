@@ -7,8 +7,49 @@
 #include "consensus/regtest.h"
 #include "merkletree.h"
 
+#include <limits>
+
 CPPUNIT_TEST_SUITE_REGISTRATION(ContractTest);
 
+// "sha256(preimage) = sha(hello world)"
+static const std::string helloWorldContract = "BCJNGGBAggEBAAD2BRtMdWFTABmTDQoaCgQIBAgIeFYAAQD1aCh3QAFzcmV0dXJuIHNoYTI1Nih0aGlzSW5wdXRbImRhdGEiXVsicHJlaW1hZ2UiXSkgPT0gIjAzNjc1YWM1M2ZmOWNkMTUzNWNjYzdkZmNkZmEyYzQ1OGM1MjE4MzcxZjQxOGRjMTM2ZjJkMTlhYzFmYmU4YTUigADyKQICCwAAAAYAQABGQEAAR4DAAEfAwAAkgAABXwBBAB4AAIADQAAAAwCAACYAAAEmAIAABQAAAAQHrAAlBAqtACAEBa0AJAQJqwAvFEGlAC1RAQAAAAGlABMLCgAPBAAVAAEAkAEAAAAFX0VOVgAAAAA=";
+
+// Pushes value with pushJson and checks it is the same Lua value, down to
+// integer or float, as json.lua decodes its text to
+static bool pushesAsDecoded(const Json::Value& value) {
+    lua_State* luaState = luaL_newstate();
+    luaL_openlibs(luaState);
+
+    bool same = false;
+    if(luaL_dofile(luaState, "./json.lua") == LUA_OK) {
+        lua_setglobal(luaState, "Json");
+
+        CryptoKernel::ContractRunner::pushJson(luaState, value);
+        lua_setglobal(luaState, "pushed");
+
+        const std::string text = CryptoKernel::Storage::toString(value);
+        lua_pushlstring(luaState, text.data(), text.size());
+        lua_setglobal(luaState, "text");
+
+        const char* compare =
+            "local function same(a, b)\n"
+            "    if type(a) ~= type(b) then return false end\n"
+            "    if type(a) == 'number' then return math.type(a) == math.type(b) and a == b end\n"
+            "    if type(a) ~= 'table' then return a == b end\n"
+            "    for k, v in pairs(a) do if not same(v, b[k]) then return false end end\n"
+            "    for k in pairs(b) do if a[k] == nil then return false end end\n"
+            "    return true\n"
+            "end\n"
+            "return same(pushed, Json:decode(text))\n";
+        if(luaL_dostring(luaState, compare) == LUA_OK) {
+            same = lua_toboolean(luaState, -1);
+        }
+    }
+
+    lua_close(luaState);
+    return same;
+}
+
 ContractTest::contractTestChain::contractTestChain(CryptoKernel::Log* GlobalLog) : CryptoKernel::Blockchain(GlobalLog, "./testblockdb") {}
 
 ContractTest::contractTestChain::~contractTestChain() {}
@@ -188,4 +229,257 @@ void ContractTest::testTwoContractInputs() {
 
     const auto res2 = blockchain->submitTransaction(contractspendtx);
     CPPUNIT_ASSERT_MESSAGE("Spending contract output succeeded. Shouldn't have.", !std::get<0>(res2));
-}
\ No newline at end of file
+}
+
+void ContractTest::testPushJson() {
+    // Nulls leave holes in arrays and no key in objects
+    Json::Value array(Json::arrayValue);
+    array.append(1);
+    array.append(Json::Value());
+    array.append("three");
+    array.append(Json::Value());
+    CPPUNIT_ASSERT(pushesAsDecoded(array));
+
+    Json::Value object;
+    object["present"] = true;
+    object["missing"] = Json::Value();
+    CPPUNIT_ASSERT(pushesAsDecoded(object));
+
+    // Unsigned values that don't fit a lua_Integer become floats, the rest
+    // stay integers
+    const uint64_t maxInteger = std::numeric_limits<lua_Integer>::max();
+    CPPUNIT_ASSERT(pushesAsDecoded(Json::Value(Json::UInt64(maxInteger))));
+    CPPUNIT_ASSERT(pushesAsDecoded(Json::Value(Json::UInt64(maxInteger + 1))));
+    CPPUNIT_ASSERT(pushesAsDecoded(Json::Value(std::numeric_limits<Json::UInt64>::max())));
+    CPPUNIT_ASSERT(pushesAsDecoded(Json::Value(Json::Int64(-5))));
+
+    CPPUNIT_ASSERT(pushesAsDecoded(Json::Value(1.5)));
+    CPPUNIT_ASSERT(pushesAsDecoded(Json::Value(0.1)));
+    CPPUNIT_ASSERT(pushesAsDecoded(Json::Value(3.0)));
+    CPPUNIT_ASSERT(pushesAsDecoded(Json::Value(-2.5e-7)));
+
+    Json::Value nested;
+    nested["outer"]["inner"]["values"].append(Json::UInt64(42));
+    nested["outer"]["inner"]["values"].append(Json::Value());
+    nested["outer"]["inner"]["values"].append(object);
+    nested["outer"]["name"] = "nested";
+    nested["outer"]["real"] = 0.25;
+    nested["list"].append(array);
+    CPPUNIT_ASSERT(pushesAsDecoded(nested));
+
+    // Elements after a null keep their position
+    lua_State* luaState = luaL_newstate();
+    CryptoKernel::ContractRunner::pushJson(luaState, array);
+    CPPUNIT_ASSERT_EQUAL(LUA_TNIL, lua_rawgeti(luaState, -1, 2));
+    lua_pop(luaState, 1);
+    CPPUNIT_ASSERT_EQUAL(LUA_TSTRING, lua_rawgeti(luaState, -1, 3));
+    CPPUNIT_ASSERT_EQUAL(std::string("three"), std::string(lua_tostring(luaState, -1)));
+    lua_close(luaState);
+}
+
+std::set<CryptoKernel::Blockchain::output> ContractTest::fundContracts(
+    const unsigned int nContracts) {
+    CryptoKernel::Crypto crypto(true);
+    const auto ECDSAPubKey = crypto.getPublicKey();
+
+    consensus->mineBlock(true, ECDSAPubKey);
+
+    const auto outs = blockchain->getUnspentOutputs(ECDSAPubKey);
+    const auto& out = *outs.begin();
+
+    Json::Value outData;
+    outData["contract"] = helloWorldContract;
+
+    const uint64_t contractValue = (out.getValue() - 20000000) / nContracts;
+
+    std::set<CryptoKernel::Blockchain::output> contractOutputs;
+    for(unsigned int i = 0; i < nContracts; i++) {
+        contractOutputs.insert(CryptoKernel::Blockchain::output(contractValue, i, outData));
+    }
+
+    const std::string outputSetId = CryptoKernel::Blockchain::transaction::getOutputSetId(contractOutputs).toString();
+
+    Json::Value spendData;
+    spendData["signature"] = crypto.sign(out.getId().toString() + outputSetId);
+
+    CryptoKernel::Blockchain::input inp(out.getId(), spendData);
+    CryptoKernel::Blockchain::transaction tx({inp}, contractOutputs, 1530888581);
+
+    const auto res = blockchain->submitTransaction(tx);
+    CPPUNIT_ASSERT_MESSAGE("Initial contract transaction failed", std::get<0>(res));
+
+    consensus->mineBlock(true, ECDSAPubKey);
+
+    return contractOutputs;
+}
+
+CryptoKernel::Blockchain::transaction ContractTest::spendContracts(
+    const std::set<CryptoKernel::Blockchain::output>& contracts, const std::string& preimage) {
+    CryptoKernel::Crypto crypto(true);
+
+    uint64_t total = 0;
+    for(const auto& contractOutput : contracts) {
+        total += contractOutput.getValue();
+    }
+
+    Json::Value p2pkOutData;
+    p2pkOutData["publicKey"] = crypto.getPublicKey();
+    CryptoKernel::Blockchain::output p2pkout(total - 20000000, 0, p2pkOutData);
+
+    Json::Value spendData;
+    spendData["preimage"] = preimage;
+
+    std::set<CryptoKernel::Blockchain::input> contractInputs;
+    for(const auto& contractOutput : contracts) {
+        contractInputs.insert(CryptoKernel::Blockchain::input(contractOutput.getId(), spendData));
+    }
+
+    return CryptoKernel::Blockchain::transaction(contractInputs, {p2pkout}, 1530888581);
+}
+
+void ContractTest::testVMPooling() {
+    const auto contracts = fundContracts(20);
+    const auto valid = spendContracts(contracts, "Hello, World");
+    const auto invalid = spendContracts(contracts, "Hello world FAIL");
+
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(blockchain->getTxHandle());
+
+    // Runners borrow pooled states, so alternate passing and failing runs
+    // to check that nothing carries over from one script to the next
+    uint64_t gasUsed = 0;
+    for(unsigned int run = 0; run < 4; run++) {
+        CryptoKernel::ContractRunner lvm(blockchain.get());
+        if(run % 2 == 1) {
+            CPPUNIT_ASSERT(!lvm.evaluateValid(dbTx.get(), invalid));
+            continue;
+        }
+
+        CPPUNIT_ASSERT(lvm.evaluateValid(dbTx.get(), valid));
+        if(run == 0) {
+            gasUsed = lvm.getGasUsed();
+        } else {
+            CPPUNIT_ASSERT_EQUAL(gasUsed, lvm.getGasUsed());
+        }
+    }
+
+    // Every input spends the same script so at least every run after the
+    // first hits the cache
+    const auto cacheStats = CryptoKernel::ContractRunner::getCacheStats();
+    CPPUNIT_ASSERT(cacheStats.hits >= 3 * contracts.size());
+    CPPUNIT_ASSERT(cacheStats.entries >= 1);
+}
+
+void ContractTest::testGasLimit() {
+    const auto contracts = fundContracts(20);
+    const auto spendTx = spendContracts(contracts, "Hello, World");
+
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(blockchain->getTxHandle());
+
+    // Gas doesn't depend on the order the inputs ran in, and each input
+    // pays at least for its sha256 call
+    CryptoKernel::ContractRunner metered(blockchain.get());
+    CPPUNIT_ASSERT(metered.evaluateValid(dbTx.get(), spendTx));
+    const uint64_t gasUsed = metered.getGasUsed();
+    CPPUNIT_ASSERT(gasUsed >= contracts.size() * 500);
+
+    CryptoKernel::ContractRunner again(blockchain.get());
+    CPPUNIT_ASSERT(again.evaluateValid(dbTx.get(), spendTx));
+    CPPUNIT_ASSERT_EQUAL(gasUsed, again.getGasUsed());
+
+    // Below the gas activation height only instructions are counted
+    CryptoKernel::ContractRunner unmetered(blockchain.get(), 10485760, 100000000, false);
+    CPPUNIT_ASSERT(unmetered.evaluateValid(dbTx.get(), spendTx));
+    CPPUNIT_ASSERT(unmetered.getGasUsed() > 0);
+    CPPUNIT_ASSERT(unmetered.getGasUsed() < gasUsed);
+
+    // A limit below the cost of hashing makes the script fail
+    CryptoKernel::ContractRunner limited(blockchain.get(), 10485760, 100);
+    CPPUNIT_ASSERT(!limited.evaluateScriptValid(dbTx.get(), spendTx,
+                                                *spendTx.getInputs().begin(),
+                                                helloWorldContract));
+}
+
+void ContractTest::testMemoryRules() {
+    // Under the gas rules the memory limit is on top of what the loaded
+    // sandbox uses, below the activation height the sandbox counts against it
+    const auto contracts = fundContracts(1);
+    const auto spendTx = spendContracts(contracts, "Hello, World");
+    const auto& inp = *spendTx.getInputs().begin();
+
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(blockchain->getTxHandle());
+
+    CryptoKernel::ContractRunner fromBaseline(blockchain.get(), 65536);
+    CPPUNIT_ASSERT(fromBaseline.evaluateScriptValid(dbTx.get(), spendTx, inp,
+                                                    helloWorldContract));
+
+    bool fits = true;
+    try {
+        CryptoKernel::ContractRunner wholeState(blockchain.get(), 65536, 100000000, false);
+        fits = wholeState.evaluateScriptValid(dbTx.get(), spendTx, inp,
+                                              helloWorldContract);
+    } catch(const std::exception& e) {
+        fits = false;
+    }
+    CPPUNIT_ASSERT(!fits);
+}
+
+void ContractTest::testLookupRules() {
+    const auto contracts = fundContracts(1);
+    const auto spendTx = spendContracts(contracts, "Hello, World");
+    const auto& inp = *spendTx.getInputs().begin();
+
+    const std::string found = CryptoKernel::ContractRunner::compile(
+        "return Blockchain.getOutput(thisInput[\"outputId\"])[\"data\"][\"contract\"] ~= nil");
+    const std::string missing = CryptoKernel::ContractRunner::compile(
+        "return Blockchain.getOutput(\"missing\") == nil");
+
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(blockchain->getTxHandle());
+
+    // Under the gas rules a lookup costs the same whatever it returns
+    CryptoKernel::ContractRunner metered(blockchain.get());
+    CPPUNIT_ASSERT(metered.evaluateScriptValid(dbTx.get(), spendTx, inp, found));
+    const uint64_t foundGas = metered.getGasUsed();
+    CryptoKernel::ContractRunner meteredMissing(blockchain.get());
+    CPPUNIT_ASSERT(meteredMissing.evaluateScriptValid(dbTx.get(), spendTx, inp, missing));
+    CPPUNIT_ASSERT(foundGas >= 5000);
+    CPPUNIT_ASSERT(foundGas < meteredMissing.getGasUsed() + 100);
+
+    // Below the activation height the script pays for decoding what it finds
+    CryptoKernel::ContractRunner unmetered(blockchain.get(), 10485760, 100000000, false);
+    CPPUNIT_ASSERT(unmetered.evaluateScriptValid(dbTx.get(), spendTx, inp, found));
+    CryptoKernel::ContractRunner unmeteredMissing(blockchain.get(), 10485760, 100000000, false);
+    CPPUNIT_ASSERT(unmeteredMissing.evaluateScriptValid(dbTx.get(), spendTx, inp, missing));
+    CPPUNIT_ASSERT(unmetered.getGasUsed() >= unmeteredMissing.getGasUsed() + 200);
+}
+
+void ContractTest::testProfiling() {
+    const auto contracts = fundContracts(20);
+    const auto spendTx = spendContracts(contracts, "Hello, World");
+
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(blockchain->getTxHandle());
+
+    // Profiles come back in input order whether or not the inputs ran in
+    // parallel, and add up to the runner's gas
+    CryptoKernel::ContractRunner::setProfiling(true);
+    CryptoKernel::ContractRunner profiled(blockchain.get());
+    profiled.enableProfiling();
+    CPPUNIT_ASSERT(profiled.evaluateValid(dbTx.get(), spendTx));
+    CryptoKernel::ContractRunner::setProfiling(false);
+
+    const auto& profiles = profiled.getProfiles();
+    CPPUNIT_ASSERT_EQUAL(contracts.size(), profiles.size());
+
+    uint64_t profiledGas = 0;
+    for(const auto& profile : profiles) {
+        CPPUNIT_ASSERT_EQUAL(uint64_t(1), profile.hostCalls.at("sha256").calls);
+        CPPUNIT_ASSERT(profile.instructions > 0);
+        CPPUNIT_ASSERT(profile.peakMemory > 0);
+        profiledGas += profile.gas;
+    }
+    CPPUNIT_ASSERT_EQUAL(profiled.getGasUsed(), profiledGas);
+
+    const auto totals = CryptoKernel::ContractRunner::getProfileTotals(1);
+    CPPUNIT_ASSERT_EQUAL(size_t(1), totals.size());
+    CPPUNIT_ASSERT_EQUAL(CryptoKernel::Crypto::sha256(helloWorldContract), totals[0].scriptHash);
+    CPPUNIT_ASSERT(totals[0].runs >= contracts.size());
+}
@@ -12,6 +12,12 @@ class ContractTest : public CPPUNIT_NS::TestFixture {
     CPPUNIT_TEST(testSimpleFail);
     CPPUNIT_TEST(testHelloWorld);
     CPPUNIT_TEST(testTwoContractInputs);
+    CPPUNIT_TEST(testPushJson);
+    CPPUNIT_TEST(testVMPooling);
+    CPPUNIT_TEST(testGasLimit);
+    CPPUNIT_TEST(testMemoryRules);
+    CPPUNIT_TEST(testLookupRules);
+    CPPUNIT_TEST(testProfiling);
     CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -33,6 +39,25 @@ private:
     void testSimpleFail();
     void testHelloWorld();
     void testTwoContractInputs();
+    void testPushJson();
+    void testVMPooling();
+    void testGasLimit();
+    void testMemoryRules();
+    void testLookupRules();
+    void testProfiling();
+
+    /**
+    * Mines a block and pays its coinbase to nContracts outputs locked by
+    * the hello world contract, confirming them in the next block
+    */
+    std::set<CryptoKernel::Blockchain::output> fundContracts(const unsigned int nContracts);
+
+    /**
+    * Builds a transaction spending every contract output with the given
+    * preimage
+    */
+    CryptoKernel::Blockchain::transaction spendContracts(
+        const std::set<CryptoKernel::Blockchain::output>& contracts, const std::string& preimage);
 
     std::unique_ptr<CryptoKernel::Blockchain> blockchain;
     std::unique_ptr<CryptoKernel::Log> log;
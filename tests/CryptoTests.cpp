@@ -88,3 +88,25 @@ void CryptoTest::testSHA256Hash() {
         "b6dc933311bc2357cc5fc636a4dbe41a01b7a33b583d043a7f870f3440697e27";
     CPPUNIT_ASSERT_EQUAL(hash, CryptoKernel::Crypto::sha256("wow"));
 }
+
+/**
+* Tests strings and containers using locked memory
+*/
+void CryptoTest::testSecureString() {
+    CryptoKernel::SecureString secret;
+    secret.reserve(64);
+    secret.append(plainText.begin(), plainText.end());
+    CPPUNIT_ASSERT_EQUAL(plainText, std::string(secret.begin(), secret.end()));
+
+    // Growing the string moves it to a fresh locked allocation
+    for(unsigned int i = 0; i < 100; i++) {
+        secret += plainText.c_str();
+    }
+    CPPUNIT_ASSERT_EQUAL(static_cast<std::size_t>(plainText.size() * 101), secret.size());
+
+    std::vector<int, CryptoKernel::LockedAllocator<int>> values;
+    for(int i = 0; i < 1000; i++) {
+        values.push_back(i);
+    }
+    CPPUNIT_ASSERT_EQUAL(999, values.back());
+}
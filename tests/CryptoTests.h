@@ -14,6 +14,7 @@ class CryptoTest : public CPPUNIT_NS::TestFixture {
     CPPUNIT_TEST(testPassingKeys);
     CPPUNIT_TEST(testSHA256Hash);
     CPPUNIT_TEST(testSignVerifyInvalid);
+    CPPUNIT_TEST(testSecureString);
     CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -29,6 +30,7 @@ private:
     void testPassingKeys();
     void testSHA256Hash();
     void testSignVerifyInvalid();
+    void testSecureString();
     CryptoKernel::Crypto *crypto;
     const std::string plainText = "This is a test.";
 
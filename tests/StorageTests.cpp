@@ -147,3 +147,40 @@ void StorageTest::testIterator() {
 
     CPPUNIT_ASSERT(!it->Valid());
 }
+
+void StorageTest::testIteratorSeek() {
+    CryptoKernel::Storage database("./testdb", false, 10, true);
+
+    CryptoKernel::Storage::Table myTable("seekTable");
+
+    std::unique_ptr<CryptoKernel::Storage::Transaction> transaction(database.begin());
+
+    for(const char* key : {"a", "c", "e"}) {
+        Json::Value dataToStore;
+        dataToStore["myval"] = key;
+        myTable.put(transaction.get(), key, dataToStore);
+    }
+
+    transaction->commit();
+
+    std::unique_ptr<CryptoKernel::Storage::Table::Iterator> it(new
+            CryptoKernel::Storage::Table::Iterator(&myTable, &database));
+
+    // Exact match
+    it->Seek("c");
+    CPPUNIT_ASSERT(it->Valid());
+    CPPUNIT_ASSERT_EQUAL(std::string("c"), it->key());
+
+    // Between keys lands on the next one
+    it->Seek("b");
+    CPPUNIT_ASSERT(it->Valid());
+    CPPUNIT_ASSERT_EQUAL(std::string("c"), it->key());
+
+    it->Next();
+    CPPUNIT_ASSERT(it->Valid());
+    CPPUNIT_ASSERT_EQUAL(std::string("e"), it->key());
+
+    // Past the end of the table
+    it->Seek("f");
+    CPPUNIT_ASSERT(!it->Valid());
+}
@@ -15,6 +15,7 @@ class StorageTest : public CPPUNIT_NS::TestFixture {
     CPPUNIT_TEST(testToJson);
     CPPUNIT_TEST(testToString);
     CPPUNIT_TEST(testIterator);
+    CPPUNIT_TEST(testIteratorSeek);
 
     CPPUNIT_TEST_SUITE_END();
 
@@ -32,6 +33,7 @@ private:
     void testToJson();
     void testToString();
     void testIterator();
+    void testIteratorSeek();
 };
 
 #endif
@@ -0,0 +1,182 @@
+#include "WalletTests.h"
+
+#include "wallet.h"
+#include "crypto.h"
+
+#include <thread>
+
+CPPUNIT_TEST_SUITE_REGISTRATION(WalletTest);
+
+static const std::string walletPassword = "testpassword";
+
+WalletTest::WalletTest() {
+    log.reset(new CryptoKernel::Log("tests.log"));
+}
+
+WalletTest::~WalletTest() {}
+
+void WalletTest::setUp() {
+    blockchain.reset(new testChain(log.get()));
+    consensus.reset(new CryptoKernel::Consensus::Regtest(blockchain.get()));
+    blockchain->loadChain(consensus.get(), "genesistest.json");
+    consensus->start();
+
+    // A new wallet asks for its passphrase on the terminal, so start from
+    // one that already has it
+    CryptoKernel::Storage walletdb("./testwalletdb", true, 8, false);
+    CryptoKernel::Storage::Table params("params");
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(walletdb.begin());
+    params.put(dbTx.get(), "height", Json::Value(0));
+    params.put(dbTx.get(), "tipId", Json::Value(""));
+    params.put(dbTx.get(), "balance", Json::Value(0));
+    params.put(dbTx.get(), "lockedBalance", Json::Value(0));
+    params.put(dbTx.get(), "unconfirmedBalance", Json::Value(0));
+    params.put(dbTx.get(), "schemaVersion", Json::Value(LATEST_WALLET_SCHEMA));
+    params.put(dbTx.get(), "pwcheck", CryptoKernel::AES256(walletPassword, "CORRECT").toJson());
+    dbTx->commit();
+}
+
+void WalletTest::tearDown() {
+    blockchain.reset();
+    consensus.reset();
+    std::remove("genesistest.json");
+    CryptoKernel::Storage::destroy("./testblockdb");
+    CryptoKernel::Storage::destroy("./testwalletdb");
+}
+
+WalletTest::testChain::testChain(CryptoKernel::Log* GlobalLog) : CryptoKernel::Blockchain(GlobalLog, "./testblockdb") {}
+
+WalletTest::testChain::~testChain() {}
+
+std::string WalletTest::testChain::getCoinbaseOwner(const std::string& publicKey) {
+    return publicKey;
+}
+
+uint64_t WalletTest::testChain::getBlockReward(const uint64_t height) {
+    return 100000000;
+}
+
+void WalletTest::reloadChain() {
+    blockchain.reset();
+    consensus.reset();
+    blockchain.reset(new testChain(log.get()));
+    consensus.reset(new CryptoKernel::Consensus::Regtest(blockchain.get()));
+    blockchain->loadChain(consensus.get(), "genesistest.json");
+    consensus->start();
+}
+
+bool WalletTest::waitFor(const std::function<bool()>& condition) {
+    for(unsigned int i = 0; i < 100; i++) {
+        if(condition()) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+
+    return condition();
+}
+
+void WalletTest::testClearUnconfirmed() {
+    std::unique_ptr<CryptoKernel::Wallet> wallet(new CryptoKernel::Wallet(blockchain.get(),
+                                                 nullptr, log.get(), "./testwalletdb"));
+
+    const auto account = wallet->newAccount("test", walletPassword);
+    consensus->mineBlock(true, account.getKeys().begin()->pubKey);
+    CPPUNIT_ASSERT(waitFor([&]() {
+        return wallet->getTotalBalance() == 100000000;
+    }));
+
+    // The send locks the whole coinbase until it confirms
+    CryptoKernel::Crypto crypto(true);
+    const std::string txId = wallet->sendToAddress(crypto.getPublicKey(), 1000000,
+                                                   walletPassword);
+    CPPUNIT_ASSERT(blockchain->getUnconfirmedTransactions().size() == 1);
+    CPPUNIT_ASSERT_EQUAL(txId,
+                         blockchain->getUnconfirmedTransactions().begin()->getId().toString());
+    CPPUNIT_ASSERT_EQUAL(uint64_t(100000000), wallet->getLockedBalance());
+    CPPUNIT_ASSERT_EQUAL(uint64_t(0), wallet->getTotalBalance());
+    CPPUNIT_ASSERT(waitFor([&]() {
+        return wallet->getUnconfirmedBalance() > 0;
+    }));
+
+    // Restarting loses the mempool, so the send will never confirm and its
+    // input is spendable again
+    wallet.reset();
+    reloadChain();
+    CPPUNIT_ASSERT(blockchain->getUnconfirmedTransactions().empty());
+
+    wallet.reset(new CryptoKernel::Wallet(blockchain.get(), nullptr, log.get(),
+                                          "./testwalletdb"));
+    CPPUNIT_ASSERT(waitFor([&]() {
+        return wallet->getLockedBalance() == 0;
+    }));
+    CPPUNIT_ASSERT_EQUAL(uint64_t(100000000), wallet->getTotalBalance());
+    CPPUNIT_ASSERT_EQUAL(uint64_t(0), wallet->getUnconfirmedBalance());
+
+    wallet->sendToAddress(crypto.getPublicKey(), 1000000, walletPassword);
+    CPPUNIT_ASSERT_EQUAL(size_t(1), blockchain->getUnconfirmedTransactions().size());
+    CPPUNIT_ASSERT_EQUAL(uint64_t(100000000), wallet->getLockedBalance());
+}
+
+void WalletTest::testHistoryUpgrade() {
+    std::unique_ptr<CryptoKernel::Wallet> wallet(new CryptoKernel::Wallet(blockchain.get(),
+                                                 nullptr, log.get(), "./testwalletdb"));
+
+    const auto account = wallet->newAccount("test", walletPassword);
+    consensus->mineBlock(true, account.getKeys().begin()->pubKey);
+    CPPUNIT_ASSERT(waitFor([&]() {
+        return wallet->getTotalBalance() == 100000000;
+    }));
+
+    CryptoKernel::Crypto crypto(true);
+    wallet->sendToAddress(crypto.getPublicKey(), 1000000, walletPassword);
+    consensus->mineBlock(true, crypto.getPublicKey());
+    CPPUNIT_ASSERT(waitFor([&]() {
+        const Json::Value history = wallet->listHistory(10);
+        return history.size() == 2 && !history[0]["unconfirmed"].asBool();
+    }));
+
+    const std::string expected = CryptoKernel::Storage::toString(wallet->listHistory(10));
+    const uint64_t balance = wallet->getTotalBalance();
+    wallet.reset();
+
+    // Put the wallet back to schema 3, before the history index existed
+    {
+        CryptoKernel::Storage walletdb("./testwalletdb", true, 8, false);
+        CryptoKernel::Storage::Table params("params");
+        CryptoKernel::Storage::Table transactions("transactions");
+        CryptoKernel::Storage::Table history("history");
+
+        std::set<std::string> txIds;
+        std::set<std::string> historyKeys;
+        std::unique_ptr<CryptoKernel::Storage::Table::Iterator> it(new
+            CryptoKernel::Storage::Table::Iterator(&transactions, &walletdb));
+        for(it->SeekToFirst(); it->Valid(); it->Next()) {
+            txIds.insert(it->key());
+        }
+        it.reset(new CryptoKernel::Storage::Table::Iterator(&history, &walletdb));
+        for(it->SeekToFirst(); it->Valid(); it->Next()) {
+            historyKeys.insert(it->key());
+        }
+        it.reset();
+
+        std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(walletdb.begin());
+        for(const auto& txId : txIds) {
+            Json::Value tx;
+            tx["unconfirmed"] = false;
+            transactions.put(dbTx.get(), txId, tx);
+        }
+        for(const auto& key : historyKeys) {
+            history.erase(dbTx.get(), key);
+        }
+        params.put(dbTx.get(), "schemaVersion", Json::Value(3));
+        dbTx->commit();
+    }
+
+    // The wallet is already at the tip, so only the upgrade can refill the
+    // history
+    wallet.reset(new CryptoKernel::Wallet(blockchain.get(), nullptr, log.get(),
+                                          "./testwalletdb"));
+    CPPUNIT_ASSERT_EQUAL(expected, CryptoKernel::Storage::toString(wallet->listHistory(10)));
+    CPPUNIT_ASSERT_EQUAL(balance, wallet->getTotalBalance());
+}
@@ -0,0 +1,54 @@
+#ifndef WALLETTEST_H
+#define WALLETTEST_H
+
+#include <functional>
+
+#include <cppunit/extensions/HelperMacros.h>
+
+#include "blockchain.h"
+#include "consensus/regtest.h"
+#include "log.h"
+
+class WalletTest : public CPPUNIT_NS::TestFixture {
+    CPPUNIT_TEST_SUITE(WalletTest);
+
+    CPPUNIT_TEST(testClearUnconfirmed);
+    CPPUNIT_TEST(testHistoryUpgrade);
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    WalletTest();
+    virtual ~WalletTest();
+    void setUp();
+    void tearDown();
+
+private:
+    class testChain : public CryptoKernel::Blockchain {
+        public:
+            testChain(CryptoKernel::Log* GlobalLog);
+            virtual ~testChain();
+        private:
+            virtual std::string getCoinbaseOwner(const std::string& publicKey);
+            virtual uint64_t getBlockReward(const uint64_t height);
+    };
+
+    void testClearUnconfirmed();
+    void testHistoryUpgrade();
+
+    /**
+    * Reopens the chain, dropping its mempool
+    */
+    void reloadChain();
+
+    /**
+    * Waits up to five seconds for the wallet's watch thread to make condition
+    * true, returning whether it did
+    */
+    bool waitFor(const std::function<bool()>& condition);
+
+    std::unique_ptr<CryptoKernel::Blockchain> blockchain;
+    std::unique_ptr<CryptoKernel::Log> log;
+    std::unique_ptr<CryptoKernel::Consensus::Regtest> consensus;
+};
+
+#endif